@@ -8,6 +8,7 @@ sed -i.old \
     -e 's/#* *max_wal_senders *= *[0-9]*/max_wal_senders = 8/' \
     -e 's/#* *wal_keep_segments *= *[0-9]*/wal_keep_segments = 4/' \
     -e 's/#* *max_replication_slots *= *[0-9]*/max_replication_slots = 4/' \
+    -e "s/#* *shared_preload_libraries *= *'[^']*'/shared_preload_libraries = 'bottledwater'/" \
     "${PGDATA}/postgresql.conf"
 
 # TODO authenticate the user
@@ -1,13 +1,19 @@
 #include "connect.h"
 #include "replication.h"
 
+#include <inttypes.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include <internal/pqexpbuffer.h>
 
+/* First line of the snapshot state file, identifying its format */
+#define SNAPSHOT_STATE_HEADER "bottledwater snapshot state 1"
+
 /* Wrap around a function call to bail on error. */
 #define check(err, call) { err = call; if (err) return err; }
 
@@ -23,12 +29,53 @@
 }
 
 void client_error(client_context_t context, char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
-int exec_sql(client_context_t context, char *query);
+int exec_sql(client_context_t context, PGconn *conn, char *query);
 int client_connect(client_context_t context);
+int client_sql_connect(client_context_t context);
 void client_sql_disconnect(client_context_t context);
+int extension_search_path(client_context_t context, PGconn *conn);
 int replication_slot_exists(client_context_t context, bool *exists);
 int snapshot_start(client_context_t context);
-int snapshot_poll(client_context_t context);
+int snapshot_begin(client_context_t context, PGconn *conn);
+int snapshot_resume_begin(client_context_t context);
+int snapshot_plan_chunks(client_context_t context);
+int snapshot_split_table(client_context_t context, PGresult *tables, int row, int *capacity);
+snapshot_chunk *snapshot_add_chunk(client_context_t context, int *capacity);
+int snapshot_chunk_compare(const void *a, const void *b);
+void snapshot_assign_workers(client_context_t context, int workers);
+int snapshot_next_chunk(client_context_t context, int worker);
+int snapshot_export(client_context_t context, PGconn *conn, const char *table_pattern,
+        const char *relids);
+int snapshot_read_state(client_context_t context, bool *resume);
+int snapshot_write_state(client_context_t context);
+int snapshot_checkpoint(client_context_t context);
+int snapshot_clear_state(client_context_t context);
+int watermark_lookup(client_context_t context);
+int client_filter(void *_context, uint64_t wal_pos, Oid relid, int msg_type,
+        const void *key_bin, size_t key_len, avro_value_t *new_val, int *skip);
+int incremental_watermark_seen(client_context_t context, avro_value_t *row);
+int watermark_field(avro_value_t *row, const char *name, avro_value_t *value);
+void incremental_add_changed_key(incremental_snapshot *incr, const void *key_bin, size_t key_len);
+int incremental_key_changed(incremental_snapshot *incr, const void *key_bin, size_t key_len);
+int incremental_key_compare(const void *a, const void *b);
+int incremental_exec(client_context_t context, const char *query, int num_params,
+        const char **params, PGresult **result);
+int incremental_start(client_context_t context);
+int incremental_load_tables(client_context_t context, const char *resume_relid);
+int incremental_poll(client_context_t context);
+int incremental_restart(client_context_t context);
+int resnapshot_request(client_context_t context);
+int incremental_next_chunk(client_context_t context);
+int incremental_chunk_range(client_context_t context, char *spec, size_t spec_len, Oid *relid);
+int incremental_write_watermark(client_context_t context, bool checkpoint, Oid resume_relid,
+        bool resume_has_key, int64_t resume_key, int64_t *watermark);
+int incremental_read_chunk(client_context_t context, const char *spec);
+int incremental_emit(client_context_t context);
+int incremental_finish(client_context_t context);
+void incremental_clear_chunk(incremental_snapshot *incr);
+void incremental_free(incremental_snapshot *incr);
+void snapshot_disconnect_workers(client_context_t context);
+int snapshot_poll(client_context_t context, int worker);
 int snapshot_tuple(client_context_t context, PGresult *res, int row_number);
 
 
@@ -38,18 +85,31 @@ int snapshot_tuple(client_context_t context, PGresult *res, int row_number);
 client_context_t db_client_new() {
     client_context_t context = malloc(sizeof(client_context));
     memset(context, 0, sizeof(client_context));
+    context->snapshot_chunk_bytes = DEFAULT_SNAPSHOT_CHUNK_BYTES;
+    context->incremental_chunk_rows = DEFAULT_INCREMENTAL_CHUNK_ROWS;
+
+    // The frame reader understands FingerprintedSchema messages, so ask for them
+    replication_stream_set_option(&context->repl, "schema_fingerprint",
+            PROTOCOL_SCHEMA_FINGERPRINT_INCLUDE);
     return context;
 }
 
 
 /* Closes any network connections, if applicable, and frees the client_context struct. */
 void db_client_free(client_context_t context) {
+    snapshot_disconnect_workers(context);
+    incremental_free(&context->incr);
     client_sql_disconnect(context);
     if (context->repl.conn) PQfinish(context->repl.conn);
+    replication_stream_free_options(&context->repl);
+    if (context->repl.inflate_buf) free(context->repl.inflate_buf);
     if (context->repl.snapshot_name) free(context->repl.snapshot_name);
     if (context->repl.output_plugin) free(context->repl.output_plugin);
     if (context->repl.slot_name) free(context->repl.slot_name);
     if (context->error_policy) free(context->error_policy);
+    if (context->resnapshot_pattern) free(context->resnapshot_pattern);
+    if (context->extension_schema) free(context->extension_schema);
+    if (context->snapshot_state_file) free(context->snapshot_state_file);
     if (context->app_name) free(context->app_name);
     if (context->conninfo) free(context->conninfo);
     free(context);
@@ -73,14 +133,29 @@ int db_client_start(client_context_t context) {
     check(err, client_connect(context));
     checkRepl(err, context, replication_stream_check(&context->repl));
     check(err, replication_slot_exists(context, &slot_exists));
+    check(err, watermark_lookup(context));
 
     if (slot_exists) {
         context->slot_created = false;
+
+        /* An interrupted incremental snapshot continues once streaming has started */
+        check(err, incremental_start(context));
+        if (context->resnapshot_pattern) check(err, resnapshot_request(context));
+
+        /* If a snapshot was interrupted, resume it before streaming from the slot */
+        bool resume;
+        check(err, snapshot_read_state(context, &resume));
+        if (resume) {
+            context->taking_snapshot = true;
+            check(err, snapshot_start(context));
+            return err;
+        }
     } else {
         checkRepl(err, context, replication_slot_create(&context->repl));
         context->slot_created = true;
+        check(err, incremental_start(context));
 
-        if (!context->skip_snapshot) {
+        if (!context->skip_snapshot && !context->incremental) {
             context->taking_snapshot = true;
             check(err, snapshot_start(context));
 
@@ -88,9 +163,13 @@ int db_client_start(client_context_t context) {
              * snapshot finishes */
             return err;
         }
+
+        /* A state file left behind for an earlier slot doesn't apply to this one */
+        check(err, snapshot_clear_state(context));
     }
 
-    client_sql_disconnect(context);
+    /* An incremental snapshot is taken while streaming, and needs the SQL connection */
+    if (context->incr.state == INCREMENTAL_OFF) client_sql_disconnect(context);
     context->taking_snapshot = false;
 
     checkRepl(err, context, replication_stream_start(&context->repl, context->error_policy));
@@ -107,25 +186,37 @@ int db_client_start(client_context_t context) {
 int db_client_poll(client_context_t context) {
     int err = 0;
 
-    if (context->sql_conn) {
-        /* To make PQgetResult() non-blocking, check PQisBusy() first */
-        if (PQisBusy(context->sql_conn)) {
-            context->status = 0;
+    if (context->snapshot_conns_active > 0) {
+        /* Poll the snapshot workers in turn, starting after the one that was processed
+         * last time, so that a busy worker can't starve the others. To make
+         * PQgetResult() non-blocking, check PQisBusy() first. */
+        for (int n = 0; n < context->snapshot_workers; n++) {
+            int worker = (context->snapshot_next_poll + n) % context->snapshot_workers;
+            PGconn *conn = context->snapshot_conns[worker];
+            if (!conn || PQisBusy(conn)) continue;
+
+            context->snapshot_next_poll = worker + 1;
+            check(err, snapshot_poll(context, worker));
+            context->status = 1;
+
+            /* If the snapshot is finished, switch over to the replication stream */
+            if (context->snapshot_conns_active == 0) {
+                checkRepl(err, context, replication_stream_start(&context->repl, context->error_policy));
+            }
             return err;
         }
 
-        check(err, snapshot_poll(context));
-        context->status = 1;
-
-        /* If the snapshot is finished, switch over to the replication stream */
-        if (!context->sql_conn) {
-            checkRepl(err, context, replication_stream_start(&context->repl, context->error_policy));
-        }
+        context->status = 0;
         return err;
 
     } else {
         checkRepl(err, context, replication_stream_poll(&context->repl));
         context->status = context->repl.status;
+
+        if (context->status >= 0 && (context->incr.restart ||
+                    (context->incr.state != INCREMENTAL_OFF && context->incr.state != INCREMENTAL_DONE))) {
+            check(err, incremental_poll(context));
+        }
         return err;
     }
 }
@@ -141,8 +232,9 @@ int db_client_wait(client_context_t context) {
     int max_fd = rep_fd;
     FD_SET(rep_fd, &input_mask);
 
-    if (context->sql_conn) {
-        int sql_fd = PQsocket(context->sql_conn);
+    for (int i = 0; i < context->snapshot_workers && context->snapshot_conns; i++) {
+        if (!context->snapshot_conns[i]) continue;
+        int sql_fd = PQsocket(context->snapshot_conns[i]);
         if (sql_fd > max_fd) max_fd = sql_fd;
         FD_SET(sql_fd, &input_mask);
     }
@@ -167,10 +259,12 @@ int db_client_wait(client_context_t context) {
                 PQerrorMessage(context->repl.conn));
         return EIO;
     }
-    if (context->sql_conn && !PQconsumeInput(context->sql_conn)) {
-        client_error(context, "Could not receive snapshot data: %s",
-                PQerrorMessage(context->sql_conn));
-        return EIO;
+    for (int i = 0; i < context->snapshot_workers && context->snapshot_conns; i++) {
+        PGconn *conn = context->snapshot_conns[i];
+        if (conn && !PQconsumeInput(conn)) {
+            client_error(context, "Could not receive snapshot data: %s", PQerrorMessage(conn));
+            return EIO;
+        }
     }
     return 0;
 }
@@ -185,14 +279,14 @@ void client_error(client_context_t context, char *fmt, ...) {
 }
 
 
-/* Executes a SQL command that returns no results. */
-int exec_sql(client_context_t context, char *query) {
-    PGresult *res = PQexec(context->sql_conn, query);
+/* Executes a SQL command that returns no results on the given connection. */
+int exec_sql(client_context_t context, PGconn *conn, char *query) {
+    PGresult *res = PQexec(conn, query);
     if (PQresultStatus(res) == PGRES_COMMAND_OK) {
         PQclear(res);
         return 0;
     } else {
-        client_error(context, "Query failed: %s: %s", query, PQerrorMessage(context->sql_conn));
+        client_error(context, "Query failed: %s: %s", query, PQerrorMessage(conn));
         PQclear(res);
         return EIO;
     }
@@ -213,11 +307,8 @@ int client_connect(client_context_t context) {
         return EINVAL;
     }
 
-    context->sql_conn = PQconnectdb(context->conninfo);
-    if (PQstatus(context->sql_conn) != CONNECTION_OK) {
-        client_error(context, "Connection to database failed: %s", PQerrorMessage(context->sql_conn));
-        return EIO;
-    }
+    int err = 0;
+    check(err, client_sql_connect(context));
 
     /* Parse the connection string into key-value pairs */
     char *error = NULL;
@@ -251,7 +342,6 @@ int client_connect(client_context_t context) {
     keys[i] = "fallback_application_name"; values[i] = context->app_name; i++;
     keys[i] = NULL;                        values[i] = NULL;
 
-    int err = 0;
     context->repl.conn = PQconnectdbParams(keys, values, true);
     if (PQstatus(context->repl.conn) != CONNECTION_OK) {
         client_error(context, "Replication connection failed: %s", PQerrorMessage(context->repl.conn));
@@ -265,6 +355,17 @@ int client_connect(client_context_t context) {
 }
 
 
+/* Opens the connection for SQL queries, context->sql_conn. */
+int client_sql_connect(client_context_t context) {
+    context->sql_conn = PQconnectdb(context->conninfo);
+    if (PQstatus(context->sql_conn) != CONNECTION_OK) {
+        client_error(context, "Connection to database failed: %s", PQerrorMessage(context->sql_conn));
+        return EIO;
+    }
+    return extension_search_path(context, context->sql_conn);
+}
+
+
 void client_sql_disconnect(client_context_t context) {
     if (!context->sql_conn) return;
 
@@ -273,6 +374,22 @@ void client_sql_disconnect(client_context_t context) {
 }
 
 
+/* Once the schema of the extension is known, makes it the search path of a connection,
+ * so that the extension's functions and tables are found wherever it is installed,
+ * regardless of the search path of the user. All other names in the client's queries
+ * are qualified. */
+int extension_search_path(client_context_t context, PGconn *conn) {
+    if (!context->extension_schema) return 0;
+
+    int err = 0;
+    PQExpBuffer query = createPQExpBuffer();
+    appendPQExpBuffer(query, "SET search_path TO %s", context->extension_schema);
+    err = exec_sql(context, conn, query->data);
+    destroyPQExpBuffer(query);
+    return err;
+}
+
+
 /* Sets *exists to true if a replication slot with the name context->repl.slot_name
  * already exists, and false if not. In addition, if the slot already exists,
  * context->repl.start_lsn is filled in with the LSN at which the client should
@@ -316,62 +433,388 @@ done:
 }
 
 
-/* Initiates the non-blocking capture of a consistent snapshot of the database,
- * using the exported snapshot context->repl.snapshot_name. */
+/* Initiates the non-blocking capture of a consistent snapshot of the database. If the
+ * replication slot was just created, its exported snapshot context->repl.snapshot_name
+ * is used; if a snapshot is being resumed, a new snapshot is taken. With a single
+ * worker and no state file, all tables are exported by one query. Otherwise the
+ * tables are divided into chunks, which are distributed across snapshot_workers SQL
+ * connections that all use the same snapshot, and each worker exports its chunks one
+ * at a time. The snapshot is complete when all workers have finished. */
 int snapshot_start(client_context_t context) {
-    if (!context->repl.snapshot_name || context->repl.snapshot_name[0] == '\0') {
-        client_error(context, "snapshot_name must be set in client context");
-        return EINVAL;
+    int err = 0;
+    if (context->snapshot_workers < 1) context->snapshot_workers = 1;
+    int workers = context->snapshot_workers;
+
+    context->snapshot_conns = calloc(workers, sizeof(PGconn *));
+    context->snapshot_worker_chunk = calloc(workers, sizeof(int));
+    context->snapshot_conns[0] = context->sql_conn;
+    context->snapshot_conns_active = 0;
+    context->snapshot_next_poll = 0;
+    context->snapshot_checkpointed = time(NULL);
+
+    if (context->slot_created) {
+        if (!context->repl.snapshot_name || context->repl.snapshot_name[0] == '\0') {
+            client_error(context, "snapshot_name must be set in client context");
+            return EINVAL;
+        }
+        check(err, snapshot_begin(context, context->sql_conn));
+    } else {
+        check(err, snapshot_resume_begin(context));
+    }
+
+    if (workers == 1 && !context->snapshot_state_file) {
+        context->snapshot_worker_chunk[0] = -1;
+        check(err, snapshot_export(context, context->sql_conn, "%", NULL));
+        context->snapshot_conns_active++;
+    } else {
+        /* When resuming, the chunks were read from the state file */
+        if (context->slot_created) {
+            check(err, snapshot_plan_chunks(context));
+            check(err, snapshot_write_state(context));
+        }
+        snapshot_assign_workers(context, workers);
+
+        for (int i = 0; i < workers; i++) {
+            context->snapshot_worker_chunk[i] = -1;
+            int chunk = snapshot_next_chunk(context, i);
+
+            /* The first worker uses the SQL connection we already have, and runs even if
+             * it has no chunks, so that the end of the snapshot is still detected. Other
+             * workers only run if they have chunks. */
+            if (i > 0 && chunk < 0) continue;
+
+            if (i > 0) {
+                context->snapshot_conns[i] = PQconnectdb(context->conninfo);
+                if (PQstatus(context->snapshot_conns[i]) != CONNECTION_OK) {
+                    client_error(context, "Connection to database for snapshot worker %d failed: %s",
+                            i, PQerrorMessage(context->snapshot_conns[i]));
+                    return EIO;
+                }
+                check(err, extension_search_path(context, context->snapshot_conns[i]));
+                check(err, snapshot_begin(context, context->snapshot_conns[i]));
+            }
+
+            context->snapshot_worker_chunk[i] = chunk;
+            check(err, snapshot_export(context, context->snapshot_conns[i], "%",
+                        chunk < 0 ? "" : context->snapshot_chunks[chunk].spec));
+            context->snapshot_conns_active++;
+        }
     }
 
+    // Invoke the begin-transaction callback with xid==0 to indicate start of snapshot
+    begin_txn_cb begin_txn = context->repl.frame_reader->on_begin_txn;
+    void *cb_context = context->repl.frame_reader->cb_context;
+    if (begin_txn) {
+        check(err, begin_txn(cb_context, context->repl.start_lsn, 0));
+    }
+    return 0;
+}
+
+/* Starts a transaction on the given SQL connection that uses the exported snapshot. */
+int snapshot_begin(client_context_t context, PGconn *conn) {
     int err = 0;
-    check(err, exec_sql(context, "BEGIN"));
-    check(err, exec_sql(context, "SET TRANSACTION ISOLATION LEVEL REPEATABLE READ"));
+    check(err, exec_sql(context, conn, "BEGIN"));
+    check(err, exec_sql(context, conn, "SET TRANSACTION ISOLATION LEVEL REPEATABLE READ"));
 
     PQExpBuffer query = createPQExpBuffer();
     appendPQExpBuffer(query, "SET TRANSACTION SNAPSHOT '%s'", context->repl.snapshot_name);
-    check(err, exec_sql(context, query->data));
+    err = exec_sql(context, conn, query->data);
     destroyPQExpBuffer(query);
+    return err;
+}
+
+/* When resuming a snapshot, the snapshot that was exported when the replication slot
+ * was created no longer exists. Instead, starts a transaction on context->sql_conn
+ * with a new snapshot, and exports it as context->repl.snapshot_name so that the
+ * other workers can use it. The new snapshot is later than the slot's restart point,
+ * so any changes between the two are both in the snapshot and replayed afterwards. */
+int snapshot_resume_begin(client_context_t context) {
+    int err = 0;
+    check(err, exec_sql(context, context->sql_conn, "BEGIN"));
+    check(err, exec_sql(context, context->sql_conn, "SET TRANSACTION ISOLATION LEVEL REPEATABLE READ"));
+
+    PGresult *res = PQexec(context->sql_conn, "SELECT pg_catalog.pg_export_snapshot()");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1) {
+        client_error(context, "Could not export snapshot for resuming: %s",
+                PQerrorMessage(context->sql_conn));
+        PQclear(res);
+        return EIO;
+    }
+
+    if (context->repl.snapshot_name) free(context->repl.snapshot_name);
+    context->repl.snapshot_name = strdup(PQgetvalue(res, 0, 0));
+    PQclear(res);
+    return err;
+}
+
+/* Divides the tables that may be exported into chunks, and stores them in
+ * context->snapshot_chunks, largest first. Tables larger than snapshot_chunk_bytes are
+ * split into ranges of their key; any other table is one chunk. Each chunk is
+ * formatted for the snapshot_relids option, and the snapshot function then applies
+ * the table filter and other checks as usual. */
+int snapshot_plan_chunks(client_context_t context) {
+    int err = 0, capacity = 0;
+    PGresult *res = PQexec(context->sql_conn,
+            "SELECT c.oid, pg_catalog.pg_total_relation_size(c.oid), "
+            "pg_catalog.quote_ident(n.nspname) || '.' || pg_catalog.quote_ident(c.relname), "
+            "pg_catalog.quote_ident(a.attname) "
+            "FROM pg_catalog.pg_class c "
+            "JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace "
+
+            // The key index, chosen as in get_table_list() in the extension, if it has one column
+            "LEFT JOIN pg_catalog.pg_index i ON i.indrelid = c.oid AND i.indisvalid AND "
+            "i.indisready AND i.indnatts = 1 AND "
+            "((c.relreplident IN ('d', 'f') AND i.indisprimary) OR "
+            "(c.relreplident = 'i' AND i.indisreplident)) "
+
+            // Only integer keys can be split into ranges (20 = int8, 21 = int2, 23 = int4)
+            "LEFT JOIN pg_catalog.pg_attribute a ON a.attrelid = c.oid AND "
+            "a.attnum = i.indkey[0] AND a.atttypid IN (20, 21, 23) "
+
+            "WHERE c.relkind = 'r' AND c.relpersistence = 'p' AND "
+            "n.nspname NOT LIKE 'pg_%' AND n.nspname != 'information_schema'");
+
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        client_error(context, "Could not fetch table sizes for snapshot: %s",
+                PQerrorMessage(context->sql_conn));
+        PQclear(res);
+        return EIO;
+    }
+
+    for (int row = 0; row < PQntuples(res) && !err; row++) {
+        err = snapshot_split_table(context, res, row, &capacity);
+    }
+    PQclear(res);
+
+    qsort(context->snapshot_chunks, context->snapshot_num_chunks, sizeof(snapshot_chunk),
+            snapshot_chunk_compare);
+    return err;
+}
+
+/* Appends the chunks for the table in the given row of the table list to
+ * context->snapshot_chunks. A table larger than snapshot_chunk_bytes whose key
+ * is a single integer column is split into ranges of equal width between its smallest
+ * and largest key; any other table becomes a single chunk. The first and last ranges
+ * are open-ended, so rows outside the expected key range are not missed. */
+int snapshot_split_table(client_context_t context, PGresult *tables, int row, int *capacity) {
+    const char *relid = PQgetvalue(tables, row, 0), *name = PQgetvalue(tables, row, 2);
+    const char *key = PQgetvalue(tables, row, 3);
+    int64_t size = strtoll(PQgetvalue(tables, row, 1), NULL, 10);
+    int64_t min_key = 0, max_key = 0;
+    int num_ranges = 1;
+
+    if (context->snapshot_chunk_bytes > 0 && size > context->snapshot_chunk_bytes &&
+            !PQgetisnull(tables, row, 3)) {
+        PQExpBuffer query = createPQExpBuffer();
+        appendPQExpBuffer(query, "SELECT min(%s), max(%s) FROM %s", key, key, name);
+        PGresult *res = PQexec(context->sql_conn, query->data);
+        destroyPQExpBuffer(query);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            client_error(context, "Could not fetch key range of %s for snapshot: %s",
+                    name, PQerrorMessage(context->sql_conn));
+            PQclear(res);
+            return EIO;
+        }
+
+        // min() and max() of an empty table are null, and then it isn't split
+        if (!PQgetisnull(res, 0, 0) && !PQgetisnull(res, 0, 1)) {
+            min_key = strtoll(PQgetvalue(res, 0, 0), NULL, 10);
+            max_key = strtoll(PQgetvalue(res, 0, 1), NULL, 10);
+            num_ranges = (size + context->snapshot_chunk_bytes - 1) / context->snapshot_chunk_bytes;
 
-    Oid argtypes[] = { 25, 16, 25 }; // 25 == TEXTOID, 16 == BOOLOID
+            // Every range should contain at least one possible key value
+            if ((uint64_t) max_key - (uint64_t) min_key < (uint64_t) num_ranges) {
+                num_ranges = (int) ((uint64_t) max_key - (uint64_t) min_key) + 1;
+            }
+        }
+        PQclear(res);
+    }
+
+    if (num_ranges == 1) {
+        snapshot_chunk *chunk = snapshot_add_chunk(context, capacity);
+        snprintf(chunk->spec, sizeof(chunk->spec), "%s", relid);
+        chunk->size = size;
+        return 0;
+    }
+
+    // Unsigned arithmetic, since the key range may not fit in an int64_t
+    uint64_t width = ((uint64_t) max_key - (uint64_t) min_key) / num_ranges + 1;
+
+    for (int i = 0; i < num_ranges; i++) {
+        snapshot_chunk *chunk = snapshot_add_chunk(context, capacity);
+        char lower[24] = "", upper[24] = "";
+
+        if (i > 0) {
+            snprintf(lower, sizeof(lower), "%" PRId64, (int64_t) ((uint64_t) min_key + i * width));
+        }
+        if (i < num_ranges - 1) {
+            snprintf(upper, sizeof(upper), "%" PRId64, (int64_t) ((uint64_t) min_key + (i + 1) * width));
+        }
+        snprintf(chunk->spec, sizeof(chunk->spec), "%s:%s:%s", relid, lower, upper);
+        chunk->size = size / num_ranges;
+    }
+    return 0;
+}
+
+/* Orders snapshot chunks by decreasing size, for qsort(). */
+int snapshot_chunk_compare(const void *a, const void *b) {
+    int64_t size_a = ((const snapshot_chunk *) a)->size;
+    int64_t size_b = ((const snapshot_chunk *) b)->size;
+    return (size_a < size_b) - (size_a > size_b);
+}
+
+/* Appends an empty chunk to context->snapshot_chunks, whose allocated length is
+ * *capacity, growing the array if necessary. */
+snapshot_chunk *snapshot_add_chunk(client_context_t context, int *capacity) {
+    if (context->snapshot_num_chunks == *capacity) {
+        *capacity = *capacity ? 2 * *capacity : 16;
+        context->snapshot_chunks = realloc(context->snapshot_chunks,
+                *capacity * sizeof(snapshot_chunk));
+    }
+
+    snapshot_chunk *chunk = &context->snapshot_chunks[context->snapshot_num_chunks++];
+    memset(chunk, 0, sizeof(snapshot_chunk));
+    return chunk;
+}
+
+/* Distributes the chunks that remain to be exported across the snapshot workers, so
+ * that each worker has about the same amount of data to read: chunks are taken largest
+ * first, and each is given to the worker with the least data so far. */
+void snapshot_assign_workers(client_context_t context, int workers) {
+    int64_t *assigned_bytes = calloc(workers, sizeof(int64_t));
+
+    for (int i = 0; i < context->snapshot_num_chunks; i++) {
+        snapshot_chunk *chunk = &context->snapshot_chunks[i];
+        if (chunk->done) continue;
+
+        chunk->worker = 0;
+        for (int j = 1; j < workers; j++) {
+            if (assigned_bytes[j] < assigned_bytes[chunk->worker]) chunk->worker = j;
+        }
+        assigned_bytes[chunk->worker] += chunk->size;
+    }
+
+    free(assigned_bytes);
+}
+
+/* Returns the index of the next chunk that the given worker should export, after the
+ * one it is currently exporting, or -1 if it has no more chunks. */
+int snapshot_next_chunk(client_context_t context, int worker) {
+    for (int i = context->snapshot_worker_chunk[worker] + 1; i < context->snapshot_num_chunks; i++) {
+        snapshot_chunk *chunk = &context->snapshot_chunks[i];
+        if (chunk->worker == worker && !chunk->done) return i;
+    }
+    return -1;
+}
+
+/* Sends the query that exports the tables on one snapshot worker's connection, and
+ * switches the connection to single-row mode for reading the results. Only tables
+ * whose names match table_pattern (a LIKE pattern) are exported, and if relids is
+ * not NULL, only those of them with the listed relids (a comma-separated list). */
+int snapshot_export(client_context_t context, PGconn *conn, const char *table_pattern,
+        const char *relids) {
+    // Pass the output plugin options to the snapshot, so that rows are encoded the same way
+    PQExpBuffer options = createPQExpBuffer();
+    replication_stream_options_array(&context->repl, options);
+
+    if (relids) {
+        /* Add the worker's tables to the array literal, before its closing brace */
+        options->data[--options->len] = '\0';
+        if (options->len > 1) appendPQExpBufferChar(options, ',');
+        appendPQExpBuffer(options, "\"snapshot_relids\",\"%s\"}", relids);
+    }
+
+    Oid argtypes[] = { 25, 16, 25, 1009 }; // 25 == TEXTOID, 16 == BOOLOID, 1009 == TEXTARRAYOID
     const char *args[] = {
-        "%",
+        table_pattern,
         context->allow_unkeyed ? "t" : "f",
-        context->error_policy
+        context->error_policy,
+        options->data
     };
 
-    if (!PQsendQueryParams(context->sql_conn,
-                "SELECT bottledwater_export(table_pattern := $1, allow_unkeyed := $2, error_policy := $3)",
-                3, argtypes, args, NULL, NULL, 1)) { // The final 1 requests results in binary format
-        client_error(context, "Could not dispatch snapshot fetch: %s",
-                PQerrorMessage(context->sql_conn));
+    if (!PQsendQueryParams(conn,
+                "SELECT bottledwater_export(table_pattern := $1, allow_unkeyed := $2, "
+                "error_policy := $3, options := $4)",
+                4, argtypes, args, NULL, NULL, 1)) { // The final 1 requests results in binary format
+        client_error(context, "Could not dispatch snapshot fetch: %s", PQerrorMessage(conn));
+        destroyPQExpBuffer(options);
         return EIO;
     }
+    destroyPQExpBuffer(options);
 
-    if (!PQsetSingleRowMode(context->sql_conn)) {
+    if (!PQsetSingleRowMode(conn)) {
         client_error(context, "Could not activate single-row mode");
         return EIO;
     }
+    return 0;
+}
 
-    // Invoke the begin-transaction callback with xid==0 to indicate start of snapshot
-    begin_txn_cb begin_txn = context->repl.frame_reader->on_begin_txn;
-    void *cb_context = context->repl.frame_reader->cb_context;
-    if (begin_txn) {
-        check(err, begin_txn(cb_context, context->repl.start_lsn, 0));
+/* Closes the connections of any snapshot workers other than the first, whose
+ * connection is context->sql_conn, and frees the arrays of connections and chunks. */
+void snapshot_disconnect_workers(client_context_t context) {
+    if (context->snapshot_conns) {
+        for (int i = 1; i < context->snapshot_workers; i++) {
+            if (context->snapshot_conns[i]) PQfinish(context->snapshot_conns[i]);
+        }
+        free(context->snapshot_conns);
+        context->snapshot_conns = NULL;
     }
-    return 0;
+    context->snapshot_conns_active = 0;
+
+    if (context->snapshot_worker_chunk) free(context->snapshot_worker_chunk);
+    if (context->snapshot_chunks) free(context->snapshot_chunks);
+    context->snapshot_worker_chunk = NULL;
+    context->snapshot_chunks = NULL;
+    context->snapshot_num_chunks = 0;
 }
 
-/* Reads the next result row from the snapshot query, parses and processes it.
- * Blocks until a new row is available, if necessary. */
-int snapshot_poll(client_context_t context) {
+/* Reads the next result row from a snapshot worker's query, parses and processes it.
+ * Blocks until a new row is available, if necessary. When a worker's query finishes,
+ * it moves on to its next chunk, if any; progress is recorded in the state file every
+ * SNAPSHOT_CHECKPOINT_INTERVAL seconds. When the last worker finishes, the end of the
+ * snapshot is signalled to the commit callback. */
+int snapshot_poll(client_context_t context, int worker) {
     int err = 0;
-    PGresult *res = PQgetResult(context->sql_conn);
+    PGconn *conn = context->snapshot_conns[worker];
+    PGresult *res = PQgetResult(conn);
 
     /* null result indicates that there are no more rows */
     if (!res) {
-        check(err, exec_sql(context, "COMMIT"));
-        client_sql_disconnect(context);
+        int chunk = context->snapshot_worker_chunk[worker];
+        if (chunk >= 0) {
+            context->snapshot_chunks[chunk].exported = true;
+
+            if (context->snapshot_state_file &&
+                    time(NULL) - context->snapshot_checkpointed >= SNAPSHOT_CHECKPOINT_INTERVAL) {
+                check(err, snapshot_checkpoint(context));
+            }
+
+            chunk = snapshot_next_chunk(context, worker);
+            if (chunk >= 0) {
+                context->snapshot_worker_chunk[worker] = chunk;
+                return snapshot_export(context, conn, "%", context->snapshot_chunks[chunk].spec);
+            }
+        }
+
+        check(err, exec_sql(context, conn, "COMMIT"));
+        if (worker == 0) {
+            client_sql_disconnect(context);
+        } else {
+            PQfinish(conn);
+        }
+        context->snapshot_conns[worker] = NULL;
+        context->snapshot_conns_active--;
+        if (context->snapshot_conns_active > 0) return 0;
+
+        /* Once everything has been written, there is nothing left to resume */
+        if (context->snapshot_state_file) {
+            if (context->on_snapshot_flush) {
+                check(err, context->on_snapshot_flush(context->repl.frame_reader->cb_context));
+            }
+            check(err, snapshot_clear_state(context));
+        }
+        snapshot_disconnect_workers(context);
 
         // Invoke the commit callback with xid==0 to indicate end of snapshot
         commit_txn_cb on_commit = context->repl.frame_reader->on_commit_txn;
@@ -399,6 +842,130 @@ int snapshot_poll(client_context_t context) {
     return err;
 }
 
+/* Reads the progress of an interrupted snapshot from snapshot_state_file, if there is
+ * one, into context->snapshot_chunks, and sets *resume to true if the snapshot should
+ * be resumed. The file records the chunks the snapshot was divided into, and whether
+ * each of them was completely written. */
+int snapshot_read_state(client_context_t context, bool *resume) {
+    *resume = false;
+    if (!context->snapshot_state_file) return 0;
+
+    FILE *file = fopen(context->snapshot_state_file, "r");
+    if (!file) {
+        if (errno == ENOENT) return 0;
+        client_error(context, "Could not read snapshot state from %s: %s",
+                context->snapshot_state_file, strerror(errno));
+        return errno;
+    }
+
+    int err = 0, capacity = 0, done;
+    char line[256], slot_name[64], spec[64];
+    int64_t size;
+
+    if (!fgets(line, sizeof(line), file) || strcmp(line, SNAPSHOT_STATE_HEADER "\n") != 0 ||
+            !fgets(line, sizeof(line), file) || sscanf(line, "slot %63s", slot_name) != 1) {
+        client_error(context, "Snapshot state file %s is not in the expected format",
+                context->snapshot_state_file);
+        err = EINVAL;
+    } else if (strcmp(slot_name, context->repl.slot_name) != 0) {
+        client_error(context, "Snapshot state file %s belongs to replication slot \"%s\"",
+                context->snapshot_state_file, slot_name);
+        err = EINVAL;
+    }
+
+    while (!err && fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "chunk %d %" SCNd64 " %63s", &done, &size, spec) != 3) {
+            client_error(context, "Invalid line in snapshot state file %s: %s",
+                    context->snapshot_state_file, line);
+            err = EINVAL;
+            break;
+        }
+
+        snapshot_chunk *chunk = snapshot_add_chunk(context, &capacity);
+        snprintf(chunk->spec, sizeof(chunk->spec), "%s", spec);
+        chunk->size = size;
+        chunk->exported = chunk->done = (done != 0);
+    }
+
+    fclose(file);
+    if (!err) {
+        *resume = true;
+        context->snapshot_resumable = true;
+    }
+    return err;
+}
+
+/* Writes the chunks of the snapshot, and which of them are complete, to
+ * snapshot_state_file. The new contents are written to a temporary file, which then
+ * replaces the old one, so that after a crash the file is either old or new but never
+ * partially written. */
+int snapshot_write_state(client_context_t context) {
+    if (!context->snapshot_state_file) return 0;
+
+    int err = 0;
+    size_t len = strlen(context->snapshot_state_file) + 5;
+    char *temp_name = malloc(len);
+    snprintf(temp_name, len, "%s.tmp", context->snapshot_state_file);
+
+    FILE *file = fopen(temp_name, "w");
+    if (!file) {
+        err = errno;
+        client_error(context, "Could not write snapshot state to %s: %s", temp_name, strerror(err));
+        free(temp_name);
+        return err;
+    }
+
+    fprintf(file, "%s\n", SNAPSHOT_STATE_HEADER);
+    fprintf(file, "slot %s\n", context->repl.slot_name);
+    for (int i = 0; i < context->snapshot_num_chunks; i++) {
+        snapshot_chunk *chunk = &context->snapshot_chunks[i];
+        fprintf(file, "chunk %d %" PRId64 " %s\n", chunk->done ? 1 : 0, chunk->size, chunk->spec);
+    }
+
+    if (ferror(file) || fflush(file) != 0 || fsync(fileno(file)) != 0) err = errno ? errno : EIO;
+    if (fclose(file) != 0 && !err) err = errno;
+    if (!err && rename(temp_name, context->snapshot_state_file) != 0) err = errno;
+
+    if (err) {
+        client_error(context, "Could not write snapshot state to %s: %s",
+                context->snapshot_state_file, strerror(err));
+    } else {
+        context->snapshot_resumable = true;
+    }
+    free(temp_name);
+    return err;
+}
+
+/* Waits until all the data received so far has been durably written, using the
+ * on_snapshot_flush callback, and then records the chunks that have been exported as
+ * complete in the state file. */
+int snapshot_checkpoint(client_context_t context) {
+    int err = 0;
+    if (context->on_snapshot_flush) {
+        check(err, context->on_snapshot_flush(context->repl.frame_reader->cb_context));
+    }
+
+    for (int i = 0; i < context->snapshot_num_chunks; i++) {
+        if (context->snapshot_chunks[i].exported) context->snapshot_chunks[i].done = true;
+    }
+
+    context->snapshot_checkpointed = time(NULL);
+    return snapshot_write_state(context);
+}
+
+/* Deletes snapshot_state_file, if it exists, since there is no snapshot to resume. */
+int snapshot_clear_state(client_context_t context) {
+    if (!context->snapshot_state_file) return 0;
+
+    if (unlink(context->snapshot_state_file) != 0 && errno != ENOENT) {
+        client_error(context, "Could not delete snapshot state file %s: %s",
+                context->snapshot_state_file, strerror(errno));
+        return errno;
+    }
+    context->snapshot_resumable = false;
+    return 0;
+}
+
 /* Processes one tuple of the snapshot query result set. */
 int snapshot_tuple(client_context_t context, PGresult *res, int row_number) {
     if (PQnfields(res) != 1) {
@@ -422,3 +989,619 @@ int snapshot_tuple(client_context_t context, PGresult *res, int row_number) {
     }
     return err;
 }
+
+/* Looks up the schema of the extension and its bottledwater_watermark table, in which
+ * incremental snapshots keep their watermarks, and installs a filter on the frame
+ * reader, so that changes to that table are not passed on to the callbacks (they are
+ * bookkeeping, not data). */
+int watermark_lookup(client_context_t context) {
+    int err = 0;
+    PGresult *res = PQexec(context->sql_conn,
+            "SELECT pg_catalog.quote_ident(n.nspname), c.oid "
+            "FROM pg_catalog.pg_extension e "
+            "JOIN pg_catalog.pg_namespace n ON n.oid = e.extnamespace "
+            "LEFT JOIN pg_catalog.pg_class c ON c.relnamespace = e.extnamespace AND "
+            "c.relname = 'bottledwater_watermark' "
+            "WHERE e.extname = 'bottledwater'");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        client_error(context, "Could not look up watermark table: %s",
+                PQerrorMessage(context->sql_conn));
+        PQclear(res);
+        return EIO;
+    }
+
+    if (PQntuples(res) == 1) {
+        if (context->extension_schema) free(context->extension_schema);
+        context->extension_schema = strdup(PQgetvalue(res, 0, 0));
+    }
+    context->watermark_relid = PQntuples(res) != 1 || PQgetisnull(res, 0, 1) ? InvalidOid :
+        (Oid) strtoul(PQgetvalue(res, 0, 1), NULL, 10);
+    PQclear(res);
+    check(err, extension_search_path(context, context->sql_conn));
+
+    if (context->repl.frame_reader) {
+        context->repl.frame_reader->on_filter = client_filter;
+        context->repl.frame_reader->filter_context = context;
+    }
+    return 0;
+}
+
+/* Called by the frame reader before each table schema or row-level callback. Hides
+ * changes to the watermark table, and tracks the watermarks and changed keys of the
+ * chunk of an incremental snapshot that is in progress. While the chunk itself is being
+ * sent, suppresses its rows whose keys changed in the stream. */
+int client_filter(void *_context, uint64_t wal_pos, Oid relid, int msg_type,
+        const void *key_bin, size_t key_len, avro_value_t *new_val, int *skip) {
+    client_context_t context = (client_context_t) _context;
+    incremental_snapshot *incr = &context->incr;
+
+    if (relid == context->watermark_relid && relid != InvalidOid) {
+        *skip = 1;
+        // Rows of a snapshot (wal_pos == 0) may predate this slot, so only the stream counts
+        return new_val && wal_pos != 0 ? incremental_watermark_seen(context, new_val) : 0;
+    }
+
+    if (relid != incr->chunk_relid || !key_bin || msg_type == PROTOCOL_MSG_TABLE_SCHEMA) return 0;
+    if (incr->state != INCREMENTAL_WINDOW && incr->state != INCREMENTAL_EMIT) return 0;
+
+    if (incr->emitting) {
+        *skip = incremental_key_changed(incr, key_bin, key_len);
+    } else {
+        incremental_add_changed_key(incr, key_bin, key_len);
+    }
+    return 0;
+}
+
+/* Called when a watermark row appears in the replication stream. If it carries a new
+ * request from bottledwater_resnapshot() for this client's slot, the incremental
+ * snapshot starts again with the request's table pattern. If it is the low watermark
+ * of the chunk in progress, the window in which changed keys are tracked opens; if it
+ * is the high watermark, the chunk is sent after the end of its transaction. The watermarks
+ * come from a sequence, so those of other replication slots never match. */
+int incremental_watermark_seen(client_context_t context, avro_value_t *row) {
+    incremental_snapshot *incr = &context->incr;
+    avro_value_t field;
+    const char *str;
+    size_t size;
+    int64_t watermark, request;
+    int err = 0;
+
+    check(err, watermark_field(row, "slot_name", &field));
+    if (avro_value_get_string(&field, &str, &size)) return EINVAL;
+    if (strcmp(str, context->repl.slot_name) != 0) return 0;
+
+    check(err, watermark_field(row, "request", &field));
+    if (avro_value_get_long(&field, &request)) return EINVAL;
+
+    if (request != incr->request) {
+        check(err, watermark_field(row, "table_pattern", &field));
+        if (avro_value_get_string(&field, &str, &size)) return EINVAL;
+
+        if (incr->table_pattern) free(incr->table_pattern);
+        incr->table_pattern = strdup(str);
+        incr->request = request;
+        incr->restart = true;
+        return 0;
+    }
+
+    if (incr->state != INCREMENTAL_WAIT_LOW && incr->state != INCREMENTAL_WINDOW) return 0;
+
+    check(err, watermark_field(row, "watermark", &field));
+    if (avro_value_get_long(&field, &watermark)) return EINVAL;
+
+    if (incr->state == INCREMENTAL_WAIT_LOW && watermark == incr->low_watermark) {
+        incr->state = INCREMENTAL_WINDOW;
+    } else if (incr->state == INCREMENTAL_WINDOW && watermark == incr->high_watermark) {
+        incr->state = INCREMENTAL_EMIT;
+    }
+    return 0;
+}
+
+/* Looks up a non-null field of a row of the watermark table. */
+int watermark_field(avro_value_t *row, const char *name, avro_value_t *value) {
+    avro_value_t branch;
+    int discriminant;
+
+    if (avro_value_get_by_name(row, name, value, NULL)) return EINVAL;
+    if (avro_value_get_type(value) == AVRO_UNION) {
+        if (avro_value_get_discriminant(value, &discriminant) || discriminant == 0) return EINVAL;
+        if (avro_value_get_current_branch(value, &branch)) return EINVAL;
+        *value = branch;
+    }
+    return 0;
+}
+
+/* Remembers that the row with the given encoded key changed while the chunk was open. */
+void incremental_add_changed_key(incremental_snapshot *incr, const void *key_bin, size_t key_len) {
+    if (incr->num_changed == incr->changed_capacity) {
+        incr->changed_capacity = incr->changed_capacity ? 2 * incr->changed_capacity : 64;
+        incr->changed_keys = realloc(incr->changed_keys,
+                incr->changed_capacity * sizeof(incremental_key));
+    }
+
+    incremental_key *key = &incr->changed_keys[incr->num_changed++];
+    key->bin = malloc(key_len);
+    key->len = key_len;
+    memcpy(key->bin, key_bin, key_len);
+}
+
+/* Returns nonzero if the given encoded key is one of the chunk's changed keys, which
+ * must already be sorted with incremental_key_compare. */
+int incremental_key_changed(incremental_snapshot *incr, const void *key_bin, size_t key_len) {
+    incremental_key key = { (void *) key_bin, key_len };
+    return bsearch(&key, incr->changed_keys, incr->num_changed, sizeof(incremental_key),
+            incremental_key_compare) != NULL;
+}
+
+/* Orders encoded keys by length and then by content, for qsort() and bsearch(). */
+int incremental_key_compare(const void *a, const void *b) {
+    const incremental_key *key_a = a, *key_b = b;
+    if (key_a->len != key_b->len) return (key_a->len > key_b->len) - (key_a->len < key_b->len);
+    return memcmp(key_a->bin, key_b->bin, key_a->len);
+}
+
+/* Executes a query with text parameters on context->sql_conn. If result is not NULL,
+ * the result is returned there, and must be freed with PQclear(). */
+int incremental_exec(client_context_t context, const char *query, int num_params,
+        const char **params, PGresult **result) {
+    PGresult *res = PQexecParams(context->sql_conn, query, num_params, NULL, params, NULL, NULL, 0);
+    ExecStatusType status = PQresultStatus(res);
+
+    if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK) {
+        client_error(context, "Query failed: %s: %s", query, PQerrorMessage(context->sql_conn));
+        PQclear(res);
+        return EIO;
+    }
+
+    if (result) {
+        *result = res;
+    } else {
+        PQclear(res);
+    }
+    return 0;
+}
+
+/* Prepares an incremental snapshot, which incremental_poll() then takes while the
+ * replication stream is consumed. For a new replication slot, the slot's watermark row
+ * is reset, so that an incremental snapshot starts from the first table (and any
+ * re-snapshot requested for an earlier slot with the same name is forgotten). For an
+ * existing slot, an incremental snapshot or re-snapshot continues from the progress
+ * recorded in the row, unless it is complete. */
+int incremental_start(client_context_t context) {
+    incremental_snapshot *incr = &context->incr;
+    const char *resume_relid = "0";
+    PGresult *res = NULL;
+    int err = 0;
+
+    if (context->watermark_relid == InvalidOid) {
+        if (!context->incremental) return 0;
+        client_error(context, "Incremental snapshots require the bottledwater_watermark table. "
+                "Please update the bottledwater extension.");
+        return EINVAL;
+    }
+
+    const char *slot_params[] = { context->repl.slot_name };
+
+    if (context->slot_created) {
+        check(err, exec_sql(context, context->sql_conn, "BEGIN"));
+        check(err, incremental_exec(context,
+                    "DELETE FROM bottledwater_watermark WHERE slot_name = $1", 1, slot_params, NULL));
+        if (context->incremental) {
+            check(err, incremental_exec(context,
+                        "INSERT INTO bottledwater_watermark (slot_name) VALUES ($1)",
+                        1, slot_params, NULL));
+        }
+        check(err, exec_sql(context, context->sql_conn, "COMMIT"));
+        if (!context->incremental) return 0;
+
+        incr->has_lower = false;
+        incr->table_pattern = strdup("%");
+    } else {
+        check(err, incremental_exec(context,
+                    "SELECT resume_relid, resume_key, complete, table_pattern, request "
+                    "FROM bottledwater_watermark WHERE slot_name = $1", 1, slot_params, &res));
+
+        // No row means that this slot isn't taking an incremental snapshot
+        if (PQntuples(res) == 0) {
+            PQclear(res);
+            return 0;
+        }
+
+        // Remember the request, so that it isn't acted upon again if it is streamed again
+        incr->request = strtoll(PQgetvalue(res, 0, 4), NULL, 10);
+        if (strcmp(PQgetvalue(res, 0, 2), "t") == 0) {
+            PQclear(res);
+            return 0;
+        }
+
+        if (!PQgetisnull(res, 0, 0)) resume_relid = PQgetvalue(res, 0, 0);
+        incr->has_lower = !PQgetisnull(res, 0, 1);
+        if (incr->has_lower) incr->lower = strtoll(PQgetvalue(res, 0, 1), NULL, 10);
+        incr->table_pattern = strdup(PQgetvalue(res, 0, 3));
+    }
+
+    err = incremental_load_tables(context, resume_relid);
+    if (res) PQclear(res);
+    return err;
+}
+
+/* Fetches the list of tables that the incremental snapshot reads: those with a key
+ * whose names match incr->table_pattern, in order of relid, starting at resume_relid.
+ * The snapshot then starts at the first of those tables. */
+int incremental_load_tables(client_context_t context, const char *resume_relid) {
+    incremental_snapshot *incr = &context->incr;
+    char watermark_relid[16];
+    int err = 0;
+
+    snprintf(watermark_relid, sizeof(watermark_relid), "%u", context->watermark_relid);
+    const char *table_params[] = { resume_relid, watermark_relid, incr->table_pattern };
+
+    check(err, incremental_exec(context,
+            "SELECT c.oid, "
+            "pg_catalog.quote_ident(n.nspname) || '.' || pg_catalog.quote_ident(c.relname), "
+            "pg_catalog.quote_ident(a.attname) "
+            "FROM pg_catalog.pg_class c "
+            "JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace "
+
+            // Only tables with a key can be reconciled with the stream
+            "JOIN pg_catalog.pg_index i ON i.indrelid = c.oid AND i.indisvalid AND i.indisready AND "
+            "((c.relreplident IN ('d', 'f') AND i.indisprimary) OR "
+            "(c.relreplident = 'i' AND i.indisreplident)) "
+
+            // Tables whose key is one integer column are read in chunks of key ranges
+            "LEFT JOIN pg_catalog.pg_attribute a ON a.attrelid = c.oid AND i.indnatts = 1 AND "
+            "a.attnum = i.indkey[0] AND a.atttypid IN (20, 21, 23) "
+
+            // The same pattern matching as bottledwater_export's table_pattern
+            "WHERE c.relkind = 'r' AND c.relpersistence = 'p' AND c.relname LIKE $3 AND "
+            "n.nspname NOT LIKE 'pg_%' AND n.nspname != 'information_schema' AND "
+            "c.oid >= $1::oid AND c.oid != $2::oid "
+            "ORDER BY c.oid",
+            3, table_params, &incr->tables));
+
+    // The table at which the snapshot stopped may have been dropped in the meantime
+    if (PQntuples(incr->tables) == 0 || strcmp(PQgetvalue(incr->tables, 0, 0), resume_relid) != 0) {
+        incr->has_lower = false;
+    }
+
+    incr->state = INCREMENTAL_IDLE;
+    incr->table = 0;
+    incr->chunk_relid = InvalidOid;
+    incr->checkpointed = time(NULL);
+    return 0;
+}
+
+/* Advances the incremental snapshot: sends the chunk in progress once its high
+ * watermark has been seen in the stream, starts again if a re-snapshot was requested,
+ * and then reads the next chunk. */
+int incremental_poll(client_context_t context) {
+    int err = 0;
+
+    // The SQL connection is closed when a snapshot finishes, and reopened for the next
+    if (!context->sql_conn) check(err, client_sql_connect(context));
+
+    // Not in the middle of a transaction, whose events the chunk's rows must not join
+    if (context->incr.state == INCREMENTAL_EMIT && !context->repl.frame_reader->in_txn) {
+        check(err, incremental_emit(context));
+        context->status = 1;
+    }
+    if (context->incr.restart) {
+        check(err, incremental_restart(context));
+    }
+    if (context->incr.state == INCREMENTAL_IDLE) {
+        check(err, incremental_next_chunk(context));
+    }
+    return err;
+}
+
+/* Acts on a request from bottledwater_resnapshot() that was seen in the stream: any
+ * chunk that is in progress is abandoned, and the incremental snapshot starts again
+ * from the first table matching the request's pattern. Since the request is ordered
+ * with the rest of the stream, the rows it sends are reconciled with streamed changes
+ * in the same way as those of any other incremental snapshot. */
+int incremental_restart(client_context_t context) {
+    incremental_snapshot *incr = &context->incr;
+    char request[24];
+    int err = 0;
+
+    incr->restart = false;
+    incremental_clear_chunk(incr);
+    if (incr->tables) PQclear(incr->tables);
+    incr->tables = NULL;
+    incr->has_lower = false;
+
+    /* Marking an earlier snapshot as complete may have overwritten the request before it
+     * was seen, so record it again, unless it has been superseded by another request */
+    snprintf(request, sizeof(request), "%" PRId64, incr->request);
+    const char *params[] = { context->repl.slot_name, request };
+    check(err, incremental_exec(context,
+                "UPDATE bottledwater_watermark "
+                "SET complete = false, resume_relid = NULL, resume_key = NULL "
+                "WHERE slot_name = $1 AND request = $2::bigint", 2, params, NULL));
+
+    return incremental_load_tables(context, "0");
+}
+
+/* Calls bottledwater_resnapshot() for this client's replication slot, with the pattern
+ * given in context->resnapshot_pattern. The client acts on the request when it sees it
+ * in the replication stream. */
+int resnapshot_request(client_context_t context) {
+    if (context->watermark_relid == InvalidOid) {
+        client_error(context, "Re-snapshots require the bottledwater_watermark table. "
+                "Please update the bottledwater extension.");
+        return EINVAL;
+    }
+
+    const char *params[] = { context->repl.slot_name, context->resnapshot_pattern };
+    return incremental_exec(context, "SELECT bottledwater_resnapshot($1, $2)", 2, params, NULL);
+}
+
+/* Reads the next chunk of the incremental snapshot in a short transaction, between
+ * updates of the low and high watermark, and keeps its frames until the high watermark
+ * is seen in the replication stream. Every SNAPSHOT_CHECKPOINT_INTERVAL seconds, once
+ * everything sent so far has been durably written, the position of the chunk is
+ * recorded with the low watermark, so that after a restart the snapshot continues
+ * from there. */
+int incremental_next_chunk(client_context_t context) {
+    incremental_snapshot *incr = &context->incr;
+    int err = 0;
+    char spec[64];
+    bool checkpoint = (time(NULL) - incr->checkpointed >= SNAPSHOT_CHECKPOINT_INTERVAL);
+
+    // The position before this chunk, which is where a restart would continue
+    Oid resume_relid = InvalidOid;
+    bool resume_has_key = incr->has_lower;
+    int64_t resume_key = incr->lower;
+    if (incr->table < PQntuples(incr->tables)) {
+        resume_relid = (Oid) strtoul(PQgetvalue(incr->tables, incr->table, 0), NULL, 10);
+    }
+
+    check(err, incremental_chunk_range(context, spec, sizeof(spec), &incr->chunk_relid));
+    if (spec[0] == '\0') return incremental_finish(context);
+
+    if (checkpoint) {
+        if (context->on_snapshot_flush) {
+            check(err, context->on_snapshot_flush(context->repl.frame_reader->cb_context));
+        }
+        incr->checkpointed = time(NULL);
+    }
+
+    check(err, incremental_write_watermark(context, checkpoint, resume_relid,
+                resume_has_key, resume_key, &incr->low_watermark));
+    check(err, incremental_read_chunk(context, spec));
+    check(err, incremental_write_watermark(context, false, InvalidOid, false, 0,
+                &incr->high_watermark));
+
+    incr->state = INCREMENTAL_WAIT_LOW;
+    return 0;
+}
+
+/* Determines the next chunk of the incremental snapshot, and formats it for the
+ * snapshot_relids option. A table whose key is a single integer column is read in
+ * ranges of incremental_chunk_rows keys; any other table is read as a single chunk.
+ * Sets spec to the empty string if all tables have been read. */
+int incremental_chunk_range(client_context_t context, char *spec, size_t spec_len, Oid *relid) {
+    incremental_snapshot *incr = &context->incr;
+
+    for (; incr->table < PQntuples(incr->tables); incr->table++, incr->has_lower = false) {
+        const char *relid_str = PQgetvalue(incr->tables, incr->table, 0);
+        const char *name = PQgetvalue(incr->tables, incr->table, 1);
+        const char *key = PQgetvalue(incr->tables, incr->table, 2);
+        *relid = (Oid) strtoul(relid_str, NULL, 10);
+
+        // has_lower marks a table without an integer key as already read
+        if (PQgetisnull(incr->tables, incr->table, 2)) {
+            if (incr->has_lower) continue;
+            snprintf(spec, spec_len, "%s", relid_str);
+            incr->has_lower = true;
+            return 0;
+        }
+
+        PQExpBuffer query = createPQExpBuffer();
+        PGresult *res;
+        char lower[24] = "";
+        int err;
+
+        if (incr->has_lower) snprintf(lower, sizeof(lower), "%" PRId64, incr->lower);
+        appendPQExpBuffer(query, "SELECT max(%s) FROM (SELECT %s FROM %s %s%s%s%s ORDER BY %s LIMIT %d) chunk",
+                key, key, name, incr->has_lower ? "WHERE " : "", incr->has_lower ? key : "",
+                incr->has_lower ? " >= " : "", lower, key, context->incremental_chunk_rows);
+        err = incremental_exec(context, query->data, 0, NULL, &res);
+        destroyPQExpBuffer(query);
+        if (err) return err;
+
+        // A null maximum means that there are no more rows in the table
+        if (PQgetisnull(res, 0, 0)) {
+            PQclear(res);
+            continue;
+        }
+
+        int64_t max_key = strtoll(PQgetvalue(res, 0, 0), NULL, 10);
+        PQclear(res);
+
+        if (max_key == INT64_MAX) {
+            // The chunk reaches the end of the key space, so it is the table's last
+            if (incr->has_lower) {
+                snprintf(spec, spec_len, "%s:%s:", relid_str, lower);
+            } else {
+                snprintf(spec, spec_len, "%s", relid_str);
+            }
+            incr->table++;
+            incr->has_lower = false;
+        } else {
+            snprintf(spec, spec_len, "%s:%s:%" PRId64, relid_str, lower, max_key + 1);
+            incr->has_lower = true;
+            incr->lower = max_key + 1;
+        }
+        return 0;
+    }
+
+    spec[0] = '\0';
+    return 0;
+}
+
+/* Updates the slot's watermark row with a new watermark from the sequence, which is
+ * returned in *watermark. If checkpoint is true, the given position is also recorded
+ * as the place from which to continue the snapshot after a restart. */
+int incremental_write_watermark(client_context_t context, bool checkpoint, Oid resume_relid,
+        bool resume_has_key, int64_t resume_key, int64_t *watermark) {
+    char relid_str[16], key_str[24], request[24];
+    PGresult *res;
+    int err = 0;
+
+    snprintf(relid_str, sizeof(relid_str), "%u", resume_relid);
+    snprintf(key_str, sizeof(key_str), "%" PRId64, resume_key);
+    snprintf(request, sizeof(request), "%" PRId64, context->incr.request);
+    const char *params[] = {
+        context->repl.slot_name,
+        resume_relid != InvalidOid ? relid_str : NULL,
+        resume_relid != InvalidOid && resume_has_key ? key_str : NULL,
+        request
+    };
+
+    if (checkpoint) {
+        // A request that hasn't been seen in the stream yet has reset the position already
+        check(err, incremental_exec(context,
+                    "UPDATE bottledwater_watermark "
+                    "SET watermark = nextval('bottledwater_watermark_seq'), "
+                    "resume_relid = CASE WHEN request = $4::bigint THEN $2::oid ELSE resume_relid END, "
+                    "resume_key = CASE WHEN request = $4::bigint THEN $3::bigint ELSE resume_key END "
+                    "WHERE slot_name = $1 RETURNING watermark", 4, params, &res));
+    } else {
+        check(err, incremental_exec(context,
+                    "UPDATE bottledwater_watermark "
+                    "SET watermark = nextval('bottledwater_watermark_seq') "
+                    "WHERE slot_name = $1 RETURNING watermark", 1, params, &res));
+    }
+
+    if (PQntuples(res) != 1) {
+        client_error(context, "Watermark row for replication slot \"%s\" is missing",
+                context->repl.slot_name);
+        err = EINVAL;
+    } else {
+        *watermark = strtoll(PQgetvalue(res, 0, 0), NULL, 10);
+    }
+    PQclear(res);
+    return err;
+}
+
+/* Exports one chunk of the incremental snapshot on context->sql_conn, outside of any
+ * explicit transaction, and keeps copies of the frames that are returned. */
+int incremental_read_chunk(client_context_t context, const char *spec) {
+    incremental_snapshot *incr = &context->incr;
+    PGresult *res;
+    int err = 0;
+
+    check(err, snapshot_export(context, context->sql_conn, incr->table_pattern, spec));
+
+    while ((res = PQgetResult(context->sql_conn))) {
+        ExecStatusType status = PQresultStatus(res);
+
+        if (status != PGRES_SINGLE_TUPLE && status != PGRES_TUPLES_OK) {
+            client_error(context, "While reading incremental snapshot: %s: %s",
+                    PQresStatus(status), PQresultErrorMessage(res));
+            err = EIO;
+        } else if (status == PGRES_SINGLE_TUPLE && !err) {
+            if (incr->num_frames == incr->frames_capacity) {
+                incr->frames_capacity = incr->frames_capacity ? 2 * incr->frames_capacity : 16;
+                incr->frames = realloc(incr->frames, incr->frames_capacity * sizeof(char *));
+                incr->frame_lens = realloc(incr->frame_lens, incr->frames_capacity * sizeof(int));
+            }
+
+            int len = PQgetlength(res, 0, 0);
+            incr->frames[incr->num_frames] = malloc(len);
+            memcpy(incr->frames[incr->num_frames], PQgetvalue(res, 0, 0), len);
+            incr->frame_lens[incr->num_frames++] = len;
+        }
+        PQclear(res);
+    }
+    return err;
+}
+
+/* Sends the chunk in progress: its frames are parsed as if they were part of the
+ * replication stream, except that rows whose keys changed between the watermarks are
+ * suppressed by client_filter(), since the stream has already sent newer values.
+ *
+ * The rows are bracketed by begin and commit callbacks with INCREMENTAL_CHUNK_XID, as
+ * a transaction of their own. Its commit LSN is the position in the stream at which
+ * the transaction with the high watermark ended, so that commits stay in WAL order and
+ * the slot only advances past the watermark once the chunk has been written. */
+int incremental_emit(client_context_t context) {
+    incremental_snapshot *incr = &context->incr;
+    frame_reader_t reader = context->repl.frame_reader;
+    XLogRecPtr commit_lsn = context->repl.recvd_lsn;
+    int err = 0;
+
+    qsort(incr->changed_keys, incr->num_changed, sizeof(incremental_key), incremental_key_compare);
+
+    if (reader->on_begin_txn) {
+        check(err, reader->on_begin_txn(reader->cb_context, commit_lsn, INCREMENTAL_CHUNK_XID));
+    }
+    incr->emitting = true;
+
+    for (int i = 0; i < incr->num_frames && !err; i++) {
+        /* wal_pos == 0 == InvalidXLogRecPtr, as for the snapshot */
+        err = parse_frame(reader, 0, incr->frames[i], incr->frame_lens[i]);
+        if (err) {
+            client_error(context, "Error parsing frame data: %s", reader->error);
+        }
+    }
+
+    incr->emitting = false;
+    if (!err && reader->on_commit_txn) {
+        err = reader->on_commit_txn(reader->cb_context, commit_lsn, INCREMENTAL_CHUNK_XID);
+    }
+    incremental_clear_chunk(incr);
+    incr->state = INCREMENTAL_IDLE;
+    return err;
+}
+
+/* Records the incremental snapshot as complete, once everything sent so far has been
+ * durably written, and closes the SQL connection, which is no longer needed. */
+int incremental_finish(client_context_t context) {
+    int err = 0;
+    char request[24];
+
+    snprintf(request, sizeof(request), "%" PRId64, context->incr.request);
+    const char *params[] = { context->repl.slot_name, request };
+
+    if (context->on_snapshot_flush) {
+        check(err, context->on_snapshot_flush(context->repl.frame_reader->cb_context));
+    }
+    // Not if a re-snapshot has been requested since, which hasn't been seen in the stream yet
+    check(err, incremental_exec(context,
+                "UPDATE bottledwater_watermark "
+                "SET complete = true, resume_relid = NULL, resume_key = NULL "
+                "WHERE slot_name = $1 AND request = $2::bigint", 2, params, NULL));
+
+    incremental_free(&context->incr);
+    context->incr.state = INCREMENTAL_DONE;
+    client_sql_disconnect(context);
+    return 0;
+}
+
+/* Frees the frames and changed keys of the chunk in progress. */
+void incremental_clear_chunk(incremental_snapshot *incr) {
+    for (int i = 0; i < incr->num_frames; i++) free(incr->frames[i]);
+    for (int i = 0; i < incr->num_changed; i++) free(incr->changed_keys[i].bin);
+    incr->num_frames = 0;
+    incr->num_changed = 0;
+    incr->chunk_relid = InvalidOid;
+}
+
+/* Frees all memory held by the incremental snapshot. */
+void incremental_free(incremental_snapshot *incr) {
+    incremental_clear_chunk(incr);
+    if (incr->frames) free(incr->frames);
+    if (incr->frame_lens) free(incr->frame_lens);
+    if (incr->changed_keys) free(incr->changed_keys);
+    if (incr->tables) PQclear(incr->tables);
+    if (incr->table_pattern) free(incr->table_pattern);
+    incr->frames = NULL;
+    incr->frame_lens = NULL;
+    incr->changed_keys = NULL;
+    incr->tables = NULL;
+    incr->table_pattern = NULL;
+    incr->frames_capacity = 0;
+    incr->changed_capacity = 0;
+}
@@ -3,7 +3,66 @@
 
 #include "replication.h"
 
+#include <time.h>
+
 #define CLIENT_CONTEXT_ERROR_LEN 512
+#define DEFAULT_SNAPSHOT_CHUNK_BYTES (1024LL * 1024 * 1024)
+#define SNAPSHOT_CHECKPOINT_INTERVAL 10 /* Seconds between updates of the snapshot state file */
+#define DEFAULT_INCREMENTAL_CHUNK_ROWS 1000
+#define INCREMENTAL_CHUNK_XID 1 /* BootstrapTransactionId, never the xid of a decoded transaction */
+
+/* Called before the progress of the snapshot is recorded. Should return once all the
+ * data received so far has been durably written. */
+typedef int (*snapshot_flush_cb)(void *);
+
+/* Progress of an incremental snapshot through one chunk of a table */
+typedef enum {
+    INCREMENTAL_OFF = 0,   /* Not taking an incremental snapshot */
+    INCREMENTAL_IDLE,      /* Ready to read the next chunk */
+    INCREMENTAL_WAIT_LOW,  /* Chunk has been read; waiting for the low watermark in the stream */
+    INCREMENTAL_WINDOW,    /* Between the watermarks: changed keys are removed from the chunk */
+    INCREMENTAL_EMIT,      /* High watermark seen; chunk is sent once its transaction is done */
+    INCREMENTAL_DONE       /* All tables have been read */
+} incremental_state;
+
+/* Encoded key of a row that changed while a chunk of an incremental snapshot was open */
+typedef struct {
+    void *bin;
+    size_t len;
+} incremental_key;
+
+/* An incremental snapshot reads each table in chunks of rows, in short transactions,
+ * while the replication stream is being consumed. Each chunk is bracketed by updates of
+ * a watermark row; rows of the chunk whose key changes in the stream between the two
+ * watermarks are dropped from the chunk, and the rest are sent at the high watermark. */
+typedef struct {
+    incremental_state state;
+    PGresult *tables;         /* relid, quoted name and integer key column (if any) of each table */
+    char *table_pattern;      /* LIKE pattern for the names of the tables to read */
+    int64_t request;          /* Last bottledwater_resnapshot() request that was acted upon */
+    bool restart;             /* A new request was seen; start again with its table_pattern */
+    int table;                /* Row of tables that is currently being read */
+    bool has_lower;           /* False if the next chunk starts at the beginning of the table */
+    int64_t lower;            /* Smallest key of the next chunk */
+    Oid chunk_relid;          /* Table of the chunk that is in progress */
+    int64_t low_watermark, high_watermark; /* Watermarks of the chunk that is in progress */
+    char **frames;            /* Frames of the chunk that is in progress, as read from the server */
+    int *frame_lens;
+    int num_frames, frames_capacity;
+    incremental_key *changed_keys; /* Keys of the chunk's table that changed in the window */
+    int num_changed, changed_capacity;
+    bool emitting;            /* True while the chunk's frames are being parsed */
+    time_t checkpointed;      /* When progress was last recorded in the watermark table */
+} incremental_snapshot;
+
+/* A unit of work for a snapshot worker: a whole table, or a range of a table's key. */
+typedef struct {
+    char spec[64];    /* Entry in the snapshot_relids option: "relid" or "relid:min:max" */
+    int64_t size;     /* Estimated number of bytes to read */
+    int worker;       /* Snapshot worker that exports this chunk */
+    bool exported;    /* True once all rows of the chunk have been received */
+    bool done;        /* True once the chunk is recorded as complete in the state file */
+} snapshot_chunk;
 
 typedef struct {
     char *conninfo, *app_name;
@@ -14,6 +73,24 @@ typedef struct {
     bool skip_snapshot;
     bool taking_snapshot;
     bool slot_created;
+    int snapshot_workers;      /* Number of SQL connections that take the snapshot in parallel */
+    PGconn **snapshot_conns;   /* Connection of each snapshot worker (NULL once it has finished) */
+    int snapshot_conns_active; /* Number of snapshot workers that have not yet finished */
+    int snapshot_next_poll;    /* Worker to poll first, so that every worker makes progress */
+    int64_t snapshot_chunk_bytes; /* Split tables larger than this between workers (0 = never) */
+    snapshot_chunk *snapshot_chunks; /* Chunks to export, if not exporting everything in one query */
+    int snapshot_num_chunks;
+    int *snapshot_worker_chunk;  /* Index of the chunk each worker is exporting (-1 = none) */
+    char *snapshot_state_file;   /* File in which snapshot progress is recorded (NULL = none) */
+    bool snapshot_resumable;     /* True once snapshot progress has been written to the file */
+    time_t snapshot_checkpointed; /* When snapshot progress was last written to the file */
+    snapshot_flush_cb on_snapshot_flush; /* Called with the frame reader's cb_context */
+    bool incremental;            /* Take an incremental snapshot while streaming, instead of a snapshot */
+    int incremental_chunk_rows;  /* Number of rows in each chunk of an incremental snapshot */
+    incremental_snapshot incr;   /* State of the incremental snapshot */
+    char *extension_schema;      /* Schema of the bottledwater extension, quoted (NULL = not installed) */
+    Oid watermark_relid;         /* The bottledwater_watermark table, whose changes aren't sent */
+    char *resnapshot_pattern;    /* On startup, request a re-snapshot of these tables (NULL = none) */
     int status; /* 1 = message was processed on last poll; 0 = no data available right now; -1 = stream ended */
     char error[CLIENT_CONTEXT_ERROR_LEN];
 } client_context;
@@ -30,10 +30,15 @@
 int process_frame(avro_value_t *frame_val, frame_reader_t reader, uint64_t wal_pos);
 int process_frame_begin_txn(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
 int process_frame_commit_txn(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
-int process_frame_table_schema(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
+int process_frame_table_schema(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos,
+        int has_fingerprint);
 int process_frame_insert(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
 int process_frame_update(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
 int process_frame_delete(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
+int process_frame_update_delta(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
+int process_frame_key_change(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
+int write_entirely(frame_reader_t reader, schema_list_entry *entry, avro_value_t *value,
+        const void **buf, size_t *len);
 schema_list_entry *schema_list_lookup(frame_reader_t reader, int64_t relid);
 schema_list_entry *schema_list_replace(frame_reader_t reader, int64_t relid);
 schema_list_entry *schema_list_entry_new(frame_reader_t reader);
@@ -41,6 +46,8 @@ void schema_list_entry_decrefs(schema_list_entry *entry);
 int read_entirely(frame_reader_t reader, avro_value_t *value, avro_reader_t avro_reader, const void *buf, size_t len);
 
 int frame_reader_handle(frame_reader_t reader, int err, const char *fmt, ...) __attribute__ ((format (printf, 3, 4)));
+int frame_reader_filter(frame_reader_t reader, uint64_t wal_pos, int64_t relid, int msg_type,
+        const void *key_bin, size_t key_len, avro_value_t *new_val, int *skip);
 
 
 int parse_frame(frame_reader_t reader, uint64_t wal_pos, char *buf, int buflen) {
@@ -72,7 +79,7 @@ int process_frame(avro_value_t *frame_val, frame_reader_t reader, uint64_t wal_p
                 check(err, process_frame_commit_txn(&record_val, reader, wal_pos));
                 break;
             case PROTOCOL_MSG_TABLE_SCHEMA:
-                check(err, process_frame_table_schema(&record_val, reader, wal_pos));
+                check(err, process_frame_table_schema(&record_val, reader, wal_pos, 0));
                 break;
             case PROTOCOL_MSG_INSERT:
                 check(err, process_frame_insert(&record_val, reader, wal_pos));
@@ -83,6 +90,15 @@ int process_frame(avro_value_t *frame_val, frame_reader_t reader, uint64_t wal_p
             case PROTOCOL_MSG_DELETE:
                 check(err, process_frame_delete(&record_val, reader, wal_pos));
                 break;
+            case PROTOCOL_MSG_UPDATE_DELTA:
+                check(err, process_frame_update_delta(&record_val, reader, wal_pos));
+                break;
+            case PROTOCOL_MSG_KEY_CHANGE:
+                check(err, process_frame_key_change(&record_val, reader, wal_pos));
+                break;
+            case PROTOCOL_MSG_FINGERPRINTED_SCHEMA:
+                check(err, process_frame_table_schema(&record_val, reader, wal_pos, 1));
+                break;
             default:
                 return frame_reader_handle(reader, EINVAL,
                         "Unknown message type %d", msg_type);
@@ -98,6 +114,7 @@ int process_frame_begin_txn(avro_value_t *record_val, frame_reader_t reader, uin
 
     check_avro(err, reader, avro_value_get_by_index(record_val, 0, &xid_val, NULL));
     check_avro(err, reader, avro_value_get_long(&xid_val, &xid));
+    reader->in_txn = 1;
 
     if (reader->on_begin_txn) {
         check_handle(err, reader, reader->on_begin_txn(reader->cb_context, wal_pos, (uint32_t) xid),
@@ -113,6 +130,7 @@ int process_frame_commit_txn(avro_value_t *record_val, frame_reader_t reader, ui
 
     check_avro(err, reader, avro_value_get_by_index(record_val, 0, &xid_val, NULL));
     check_avro(err, reader, avro_value_get_long(&xid_val, &xid));
+    reader->in_txn = 0;
 
     if (reader->on_commit_txn) {
         check_handle(err, reader, reader->on_commit_txn(reader->cb_context, wal_pos, (uint32_t) xid),
@@ -121,24 +139,40 @@ int process_frame_commit_txn(avro_value_t *record_val, frame_reader_t reader, ui
     return err;
 }
 
-int process_frame_table_schema(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos) {
-    int err = 0, key_schema_present;
-    avro_value_t relid_val, key_schema_val, row_schema_val, branch_val;
-    int64_t relid;
+/* Handles a TableSchema message, or a FingerprintedSchema message (which has the same
+ * fields followed by a fingerprint) if has_fingerprint is nonzero. */
+int process_frame_table_schema(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos,
+        int has_fingerprint) {
+    int err = 0, key_schema_present, skip;
+    avro_value_t relid_val, key_schema_val, row_schema_val, fingerprint_val, branch_val;
+    int64_t relid, fingerprint = 0;
     const char *key_schema_json = NULL, *row_schema_json;
     size_t key_schema_len = 1, row_schema_len;
     avro_schema_t key_schema = NULL, row_schema;
 
-    check_avro(err, reader, avro_value_get_by_index(record_val, 0, &relid_val,      NULL));
-    check_avro(err, reader, avro_value_get_by_index(record_val, 1, &key_schema_val, NULL));
-    check_avro(err, reader, avro_value_get_by_index(record_val, 2, &row_schema_val, NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 0, &relid_val,       NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 1, &key_schema_val,  NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 2, &row_schema_val,  NULL));
     check_avro(err, reader, avro_value_get_long(&relid_val, &relid));
+
+    if (has_fingerprint) {
+        check_avro(err, reader, avro_value_get_by_index(record_val, 3, &fingerprint_val, NULL));
+        check_avro(err, reader, avro_value_get_long(&fingerprint_val, &fingerprint));
+    }
+
+    /* The server sends a table's schemas again whenever it starts a new schema cache,
+     * e.g. when switching from the snapshot to the replication stream. If they are the
+     * schemas we already have, there is nothing to parse, and nothing has changed. */
+    schema_list_entry *entry = schema_list_lookup(reader, relid);
+    if (entry && fingerprint && entry->fingerprint == (uint64_t) fingerprint) return err;
+
     check_avro(err, reader, avro_value_get_discriminant(&key_schema_val, &key_schema_present));
     check_avro(err, reader, avro_value_get_string(&row_schema_val, &row_schema_json, &row_schema_len));
     check_avro(err, reader, avro_schema_from_json_length(row_schema_json, row_schema_len - 1, &row_schema));
 
-    schema_list_entry *entry = schema_list_replace(reader, relid);
+    entry = schema_list_replace(reader, relid);
     entry->relid = relid;
+    entry->fingerprint = 0; /* set once the callback has accepted the schemas */
     entry->row_schema = row_schema;
     entry->row_iface = avro_generic_class_from_schema(row_schema);
     avro_generic_value_new(entry->row_iface, &entry->row_value);
@@ -156,18 +190,23 @@ int process_frame_table_schema(avro_value_t *record_val, frame_reader_t reader,
         entry->key_schema = NULL;
     }
 
-    if (reader->on_table_schema) {
+    check(err, frame_reader_filter(reader, wal_pos, relid, PROTOCOL_MSG_TABLE_SCHEMA,
+                NULL, 0, NULL, &skip));
+
+    if (reader->on_table_schema && !skip) {
         check_handle(err, reader,
                 reader->on_table_schema(reader->cb_context, wal_pos, relid,
                     key_schema_json, key_schema_len - 1, key_schema,
                     row_schema_json, row_schema_len - 1, row_schema),
                 "error in table_schema callback for relid %" PRIu64, relid);
     }
+
+    entry->fingerprint = (uint64_t) fingerprint;
     return err;
 }
 
 int process_frame_insert(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos) {
-    int err = 0, key_present;
+    int err = 0, key_present, skip;
     avro_value_t relid_val, key_val, new_val, branch_val;
     int64_t relid;
     const void *key_bin = NULL, *new_bin = NULL;
@@ -193,8 +232,10 @@ int process_frame_insert(avro_value_t *record_val, frame_reader_t reader, uint64
     }
 
     check(err, read_entirely(reader, &entry->row_value, entry->avro_reader, new_bin, new_len));
+    check(err, frame_reader_filter(reader, wal_pos, relid, PROTOCOL_MSG_INSERT,
+                key_bin, key_len, &entry->row_value, &skip));
 
-    if (reader->on_insert_row) {
+    if (reader->on_insert_row && !skip) {
         check_handle(err, reader,
                 reader->on_insert_row(reader->cb_context, wal_pos, relid,
                     key_bin, key_len, key_bin ? &entry->key_value : NULL,
@@ -205,7 +246,7 @@ int process_frame_insert(avro_value_t *record_val, frame_reader_t reader, uint64
 }
 
 int process_frame_update(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos) {
-    int err = 0, key_present, old_present;
+    int err = 0, key_present, old_present, skip;
     avro_value_t relid_val, key_val, old_val, new_val, branch_val;
     int64_t relid;
     const void *key_bin = NULL, *old_bin = NULL, *new_bin = NULL;
@@ -239,8 +280,10 @@ int process_frame_update(avro_value_t *record_val, frame_reader_t reader, uint64
     }
 
     check(err, read_entirely(reader, &entry->row_value, entry->avro_reader, new_bin, new_len));
+    check(err, frame_reader_filter(reader, wal_pos, relid, PROTOCOL_MSG_UPDATE,
+                key_bin, key_len, &entry->row_value, &skip));
 
-    if (reader->on_update_row) {
+    if (reader->on_update_row && !skip) {
         check_handle(err, reader,
                 reader->on_update_row(reader->cb_context, wal_pos, relid,
                     key_bin, key_len, key_bin ? &entry->key_value : NULL,
@@ -252,7 +295,7 @@ int process_frame_update(avro_value_t *record_val, frame_reader_t reader, uint64
 }
 
 int process_frame_delete(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos) {
-    int err = 0, key_present, old_present;
+    int err = 0, key_present, old_present, skip;
     avro_value_t relid_val, key_val, old_val, branch_val;
     int64_t relid;
     const void *key_bin = NULL, *old_bin = NULL;
@@ -283,7 +326,10 @@ int process_frame_delete(avro_value_t *record_val, frame_reader_t reader, uint64
         check(err, read_entirely(reader, &entry->old_value, entry->avro_reader, old_bin, old_len));
     }
 
-    if (reader->on_delete_row) {
+    check(err, frame_reader_filter(reader, wal_pos, relid, PROTOCOL_MSG_DELETE,
+                key_bin, key_len, NULL, &skip));
+
+    if (reader->on_delete_row && !skip) {
         check_handle(err, reader,
                 reader->on_delete_row(reader->cb_context, wal_pos, relid,
                     key_bin, key_len, key_bin ? &entry->key_value : NULL,
@@ -293,6 +339,143 @@ int process_frame_delete(avro_value_t *record_val, frame_reader_t reader, uint64
     return err;
 }
 
+/* An UpdateDelta message only contains the values of the columns that the update
+ * changed. If it contains the old row, we reconstruct the full new row from it, and
+ * pass it to the update_row callback, so that the callbacks don't need to know about
+ * deltas. Otherwise the delta is passed to the update_delta callback as it is. */
+int process_frame_update_delta(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos) {
+    int err = 0, key_present, old_present, skip;
+    avro_value_t relid_val, key_val, old_val, changed_val, new_val, branch_val;
+    int64_t relid;
+    const void *key_bin = NULL, *old_bin = NULL, *changed = NULL, *delta_bin = NULL, *new_bin = NULL;
+    size_t key_len = 0, old_len = 0, changed_len = 0, delta_len = 0, new_len = 0;
+
+    check_avro(err, reader, avro_value_get_by_index(record_val, 0, &relid_val,   NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 1, &key_val,     NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 2, &old_val,     NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 3, &changed_val, NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 4, &new_val,     NULL));
+    check_avro(err, reader, avro_value_get_long(&relid_val, &relid));
+    check_avro(err, reader, avro_value_get_discriminant(&key_val, &key_present));
+    check_avro(err, reader, avro_value_get_discriminant(&old_val, &old_present));
+    check_avro(err, reader, avro_value_get_bytes(&changed_val, &changed, &changed_len));
+    check_avro(err, reader, avro_value_get_bytes(&new_val, &delta_bin, &delta_len));
+
+    schema_list_entry *entry = schema_list_lookup(reader, relid);
+    if (!entry) {
+        return frame_reader_handle(reader, EINVAL,
+                "Received update for unknown relid %" PRIu64, relid);
+    }
+
+    if (key_present) {
+        check_avro(err, reader, avro_value_get_current_branch(&key_val, &branch_val));
+        check_avro(err, reader, avro_value_get_bytes(&branch_val, &key_bin, &key_len));
+        check(err, read_entirely(reader, &entry->key_value, entry->avro_reader, key_bin, key_len));
+    }
+
+    check(err, read_entirely(reader, &entry->row_value, entry->avro_reader, delta_bin, delta_len));
+
+    if (!old_present) {
+        if (!reader->on_update_delta) {
+            return frame_reader_handle(reader, EINVAL,
+                    "Received update delta without old row for relid %" PRIu64
+                    ", but there is no update_delta callback", relid);
+        }
+
+        check(err, frame_reader_filter(reader, wal_pos, relid, PROTOCOL_MSG_UPDATE_DELTA,
+                    key_bin, key_len, &entry->row_value, &skip));
+        if (!skip) {
+            check_handle(err, reader,
+                    reader->on_update_delta(reader->cb_context, wal_pos, relid,
+                        key_bin, key_len, key_bin ? &entry->key_value : NULL,
+                        changed, changed_len, delta_bin, delta_len, &entry->row_value),
+                    "error in update_delta callback for relid %" PRIu64, relid);
+        }
+        return err;
+    }
+
+    check_avro(err, reader, avro_value_get_current_branch(&old_val, &branch_val));
+    check_avro(err, reader, avro_value_get_bytes(&branch_val, &old_bin, &old_len));
+    check(err, read_entirely(reader, &entry->old_value, entry->avro_reader, old_bin, old_len));
+    check_avro(err, reader, reconstruct_update_row(&entry->row_value, &entry->old_value,
+                changed, changed_len));
+    check(err, write_entirely(reader, entry, &entry->row_value, &new_bin, &new_len));
+    check(err, frame_reader_filter(reader, wal_pos, relid, PROTOCOL_MSG_UPDATE_DELTA,
+                key_bin, key_len, &entry->row_value, &skip));
+
+    if (reader->on_update_row && !skip) {
+        check_handle(err, reader,
+                reader->on_update_row(reader->cb_context, wal_pos, relid,
+                    key_bin, key_len, key_bin ? &entry->key_value : NULL,
+                    old_bin, old_len, &entry->old_value,
+                    new_bin, new_len, &entry->row_value),
+                "error in update_row callback for relid %" PRIu64, relid);
+    }
+    return err;
+}
+
+int process_frame_key_change(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos) {
+    int err = 0, key_present, op, skip;
+    avro_value_t relid_val, op_val, key_val, branch_val;
+    int64_t relid;
+    const void *key_bin = NULL;
+    size_t key_len = 0;
+
+    check_avro(err, reader, avro_value_get_by_index(record_val, 0, &relid_val, NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 1, &op_val,    NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 2, &key_val,   NULL));
+    check_avro(err, reader, avro_value_get_long(&relid_val, &relid));
+    check_avro(err, reader, avro_value_get_int(&op_val, &op));
+    check_avro(err, reader, avro_value_get_discriminant(&key_val, &key_present));
+
+    schema_list_entry *entry = schema_list_lookup(reader, relid);
+    if (!entry) {
+        return frame_reader_handle(reader, EINVAL,
+                "Received key change for unknown relid %" PRIu64, relid);
+    }
+
+    if (key_present) {
+        check_avro(err, reader, avro_value_get_current_branch(&key_val, &branch_val));
+        check_avro(err, reader, avro_value_get_bytes(&branch_val, &key_bin, &key_len));
+        check(err, read_entirely(reader, &entry->key_value, entry->avro_reader, key_bin, key_len));
+    }
+
+    check(err, frame_reader_filter(reader, wal_pos, relid, PROTOCOL_MSG_KEY_CHANGE,
+                key_bin, key_len, NULL, &skip));
+
+    if (reader->on_key_change && !skip) {
+        check_handle(err, reader,
+                reader->on_key_change(reader->cb_context, wal_pos, relid, op,
+                    key_bin, key_len, key_bin ? &entry->key_value : NULL),
+                "error in key_change callback for relid %" PRIu64, relid);
+    }
+    return err;
+}
+
+/* Turns the new row of an UpdateDelta message, in which the fields that the update
+ * didn't change are null, into the complete new row, by copying those fields from the
+ * old row. Bit i of the changed bitmap (counting from the least significant bit of the
+ * first byte) is set if field i of the row changed. Both values must be records of the
+ * same schema. Returns an Avro error code. */
+int reconstruct_update_row(avro_value_t *new_val, avro_value_t *old_val,
+        const void *changed, size_t changed_len) {
+    int err = 0;
+    size_t num_fields;
+    const uint8_t *bits = changed;
+    avro_value_t new_field, old_field;
+
+    check(err, avro_value_get_size(new_val, &num_fields));
+
+    for (size_t i = 0; i < num_fields; i++) {
+        if (i / 8 < changed_len && (bits[i / 8] & (1 << (i % 8)))) continue;
+
+        check(err, avro_value_get_by_index(new_val, i, &new_field, NULL));
+        check(err, avro_value_get_by_index(old_val, i, &old_field, NULL));
+        check(err, avro_value_copy(&new_field, &old_field));
+    }
+    return err;
+}
+
 frame_reader_t frame_reader_new() {
     frame_reader_t reader = malloc(sizeof(frame_reader));
     check_alloc(reader);
@@ -352,6 +535,9 @@ schema_list_entry *schema_list_entry_new(frame_reader_t reader) {
 /* Decrements the reference counts of a schema list entry. */
 void schema_list_entry_decrefs(schema_list_entry *entry) {
     avro_reader_free(entry->avro_reader);
+    free(entry->delta_buf);
+    entry->delta_buf = NULL;
+    entry->delta_buf_size = 0;
     avro_value_decref(&entry->old_value);
     avro_value_decref(&entry->row_value);
     avro_value_iface_decref(entry->row_iface);
@@ -392,6 +578,22 @@ int frame_reader_handle(frame_reader_t reader, int err, const char *fmt, ...) {
     } else return err;
 }
 
+/* Calls the reader's filter callback, if it has one, before the callback for a table
+ * schema or row-level event. Sets *skip to nonzero if the event should be suppressed. */
+int frame_reader_filter(frame_reader_t reader, uint64_t wal_pos, int64_t relid, int msg_type,
+        const void *key_bin, size_t key_len, avro_value_t *new_val, int *skip) {
+    int err = 0;
+    *skip = 0;
+
+    if (reader->on_filter) {
+        check_handle(err, reader,
+                reader->on_filter(reader->filter_context, wal_pos, relid, msg_type,
+                    key_bin, key_len, new_val, skip),
+                "error in filter callback for relid %" PRIu64, relid);
+    }
+    return err;
+}
+
 /* Parses the contents of a binary-encoded Avro buffer into an Avro value, ensuring
  * that the entire buffer is read. */
 int read_entirely(frame_reader_t reader, avro_value_t *value, avro_reader_t avro_reader, const void *buf, size_t len) {
@@ -423,3 +625,31 @@ int handle_keepalive(frame_reader_t reader, uint64_t wal_pos) {
     }
     return 0;
 }
+
+/* Encodes an Avro value into the entry's delta buffer, which is grown as needed, and
+ * returns a pointer to the encoding (valid until the next call for the same entry). */
+int write_entirely(frame_reader_t reader, schema_list_entry *entry, avro_value_t *value,
+        const void **buf, size_t *len) {
+    int err = 0;
+    size_t size;
+    avro_writer_t writer;
+
+    check_avro(err, reader, avro_value_sizeof(value, &size));
+
+    if (size > entry->delta_buf_size) {
+        entry->delta_buf_size = size < 256 ? 256 : size;
+        entry->delta_buf = realloc(entry->delta_buf, entry->delta_buf_size);
+        check_alloc(entry->delta_buf);
+    }
+
+    writer = avro_writer_memory(entry->delta_buf, entry->delta_buf_size);
+    err = avro_value_write(writer, value);
+    avro_writer_free(writer);
+    if (err) {
+        return frame_reader_handle(reader, err, "Avro error: %s", avro_strerror());
+    }
+
+    *buf = entry->delta_buf;
+    *len = size;
+    return err;
+}
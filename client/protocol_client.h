@@ -40,6 +40,29 @@ typedef int (*delete_row_cb)(void *, uint64_t, Oid,
         const void *, size_t, avro_value_t *,
         const void *, size_t, avro_value_t *);
 
+/* Parameters: context, wal_pos, relid,
+ *             key_bin, key_len, key_val,
+ *             changed, changed_len (bitmap of the fields the update changed),
+ *             delta_bin, delta_len, delta_val (new row in which unchanged fields are null)
+ * Called for an UpdateDelta message that doesn't contain the old row, so the new row
+ * can only be reconstructed from the consumer's own copy of the previous row. */
+typedef int (*update_delta_cb)(void *, uint64_t, Oid,
+        const void *, size_t, avro_value_t *,
+        const void *, size_t,
+        const void *, size_t, avro_value_t *);
+
+/* Parameters: context, wal_pos, relid, op (one of the PROTOCOL_KEY_CHANGE_* values),
+ *             key_bin, key_len, key_val */
+typedef int (*key_change_cb)(void *, uint64_t, Oid, int,
+        const void *, size_t, avro_value_t *);
+
+/* Parameters: context, wal_pos, relid, msg_type (one of the PROTOCOL_MSG_* values),
+ *             key_bin, key_len, new_val (NULL for deletes, key changes and schemas),
+ *             skip (output: set to nonzero to suppress the event)
+ * Called before the callback for each table schema or row-level event. */
+typedef int (*filter_cb)(void *, uint64_t, Oid, int,
+        const void *, size_t, avro_value_t *, int *);
+
 #define FRAME_READER_SYNC_PENDING EBUSY
 
 /* Parameters: context, wal_pos
@@ -61,6 +84,7 @@ typedef int (*error_handler_cb)(void *, int err, const char *);
 
 typedef struct {
     Oid                 relid;       /* Uniquely identifies a table, even when it is renamed */
+    uint64_t            fingerprint; /* Fingerprint of the schemas sent by the server (0 = unknown) */
     avro_schema_t       key_schema;  /* Avro schema for the table's primary key or replica identity */
     avro_schema_t       row_schema;  /* Avro schema for one row of the table */
     avro_value_iface_t *key_iface;   /* Avro generic interface for creating key values */
@@ -69,6 +93,8 @@ typedef struct {
     avro_value_t        row_value;   /* Avro row value, for encoding one row */
     avro_value_t        old_value;   /* Avro row value, for encoding the old value (in updates, deletes) */
     avro_reader_t       avro_reader; /* In-memory buffer reader */
+    char               *delta_buf;   /* Buffer for the encoding of a row reconstructed from an update delta */
+    size_t              delta_buf_size; /* Allocated size of delta_buf */
 } schema_list_entry;
 
 typedef struct {
@@ -78,9 +104,15 @@ typedef struct {
     table_schema_cb on_table_schema; /* Called when there is a new schema for a particular relation */
     insert_row_cb on_insert_row;     /* Called when a row is inserted into a relation */
     update_row_cb on_update_row;     /* Called when a row in a relation is updated */
+    update_delta_cb on_update_delta; /* Called for update deltas without the old row (NULL = always request old rows) */
     delete_row_cb on_delete_row;     /* Called when a row in a relation is deleted */
+    key_change_cb on_key_change;     /* Called when a row in a key-only relation is inserted, updated or deleted */
     keepalive_cb on_keepalive;       /* Called when server sends a keepalive message */
     error_handler_cb on_error;       /* Called when a frame cannot be read or when a callback returns a nonzero error code */
+    filter_cb on_filter;             /* Called before each schema or row-level callback; may suppress it */
+    void *filter_context;            /* Pointer that is passed to on_filter */
+    int omit_old_rows;               /* Nonzero if the callbacks don't use the old row of updates and deletes */
+    int in_txn;                      /* Nonzero between the begin and commit of a transaction */
     int num_schemas;                 /* Number of schemas in use */
     int capacity;                    /* Allocated size of schemas array */
     schema_list_entry **schemas;     /* Array of pointers to schema_list_entry structs */
@@ -98,5 +130,7 @@ frame_reader_t frame_reader_new(void);
 void frame_reader_free(frame_reader_t reader);
 
 int handle_keepalive(frame_reader_t reader, uint64_t wal_pos);
+int reconstruct_update_row(avro_value_t *new_val, avro_value_t *old_val,
+        const void *changed, size_t changed_len);
 
 #endif /* PROTOCOL_CLIENT_H */
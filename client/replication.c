@@ -5,12 +5,14 @@
 #include "replication.h"
 
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
 
 #include <datatype/timestamp.h>
 #include <internal/pqexpbuffer.h>
+#include <zlib.h>
 
 #define CHECKPOINT_INTERVAL_SEC 10
 
@@ -19,6 +21,7 @@
 int replication_stream_finish(replication_stream_t stream);
 int parse_keepalive_message(replication_stream_t stream, char *buf, int buflen);
 int parse_xlogdata_message(replication_stream_t stream, char *buf, int buflen);
+int decompress_frame(replication_stream_t stream, char **buf, int *buflen);
 int send_checkpoint(replication_stream_t stream, int64 now);
 void repl_error(replication_stream_t stream, char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
 int64 current_time(void);
@@ -141,15 +144,107 @@ int replication_stream_check(replication_stream_t stream) {
 }
 
 
+/* Sets an option to be passed to the output plugin when replication is started,
+ * replacing any previous value of the option with the same name. Must be called
+ * before replication_stream_start(). */
+void replication_stream_set_option(replication_stream_t stream, const char *name, const char *value) {
+    for (int i = 0; i < stream->num_options; i++) {
+        if (strcmp(stream->options[i].name, name) == 0) {
+            free(stream->options[i].value);
+            stream->options[i].value = strdup(value);
+            return;
+        }
+    }
+
+    stream->options = realloc(stream->options, (stream->num_options + 1) * sizeof(plugin_option));
+    stream->options[stream->num_options].name = strdup(name);
+    stream->options[stream->num_options].value = strdup(value);
+    stream->num_options++;
+}
+
+/* Returns the value of an output plugin option previously set with
+ * replication_stream_set_option(), or NULL if it has not been set. */
+const char *replication_stream_get_option(replication_stream_t stream, const char *name) {
+    for (int i = 0; i < stream->num_options; i++) {
+        if (strcmp(stream->options[i].name, name) == 0) {
+            return stream->options[i].value;
+        }
+    }
+    return NULL;
+}
+
+/* Appends the options set with replication_stream_set_option() to a buffer, formatted
+ * as a Postgres array literal of alternating names and values, for passing the same
+ * options to the snapshot function. */
+void replication_stream_options_array(replication_stream_t stream, PQExpBuffer buf) {
+    appendPQExpBufferChar(buf, '{');
+
+    for (int i = 0; i < stream->num_options; i++) {
+        const char *strings[] = { stream->options[i].name, stream->options[i].value };
+
+        for (int j = 0; j < 2; j++) {
+            if (i > 0 || j > 0) appendPQExpBufferChar(buf, ',');
+            appendPQExpBufferChar(buf, '"');
+            /* Within a quoted array element, quotes and backslashes need to be escaped */
+            for (const char *c = strings[j]; *c; c++) {
+                if (*c == '"' || *c == '\\') appendPQExpBufferChar(buf, '\\');
+                appendPQExpBufferChar(buf, *c);
+            }
+            appendPQExpBufferChar(buf, '"');
+        }
+    }
+
+    appendPQExpBufferChar(buf, '}');
+}
+
+void replication_stream_free_options(replication_stream_t stream) {
+    for (int i = 0; i < stream->num_options; i++) {
+        free(stream->options[i].name);
+        free(stream->options[i].value);
+    }
+    if (stream->options) free(stream->options);
+    stream->options = NULL;
+    stream->num_options = 0;
+}
+
+
 /* Starts streaming logical changes from replication slot stream->slot_name,
- * starting from position stream->start_lsn. */
+ * starting from position stream->start_lsn. Any options set with
+ * replication_stream_set_option() are passed on to the output plugin. If the frame
+ * reader's callbacks don't need old rows, the output plugin is asked not to send
+ * them, unless the old_row option was set explicitly, or updates are sent as deltas
+ * (which the frame reader reconstructs from the old row) and there is no
+ * update_delta callback that can handle deltas without it. */
 int replication_stream_start(replication_stream_t stream, const char *error_policy) {
     PQExpBuffer query = createPQExpBuffer();
-    appendPQExpBuffer(query, "START_REPLICATION SLOT \"%s\" LOGICAL %X/%X (\"error_policy\" '%s')",
+    appendPQExpBuffer(query, "START_REPLICATION SLOT \"%s\" LOGICAL %X/%X (\"error_policy\" '%s'",
             stream->slot_name,
             (uint32) (stream->start_lsn >> 32), (uint32) stream->start_lsn,
             error_policy);
 
+    const char *compression = replication_stream_get_option(stream, "frame_compression");
+    stream->frame_compression = compression &&
+        strcmp(compression, PROTOCOL_FRAME_COMPRESSION_DEFLATE) == 0;
+
+    const char *update_format = replication_stream_get_option(stream, "update_format");
+    if (stream->frame_reader && stream->frame_reader->omit_old_rows &&
+            !replication_stream_get_option(stream, "old_row") &&
+            (stream->frame_reader->on_update_delta ||
+             !(update_format && strcmp(update_format, PROTOCOL_UPDATE_FORMAT_DELTA) == 0))) {
+        appendPQExpBuffer(query, ", \"old_row\" '%s'", PROTOCOL_OLD_ROW_OMIT);
+    }
+
+    for (int i = 0; i < stream->num_options; i++) {
+        appendPQExpBuffer(query, ", \"%s\" '", stream->options[i].name);
+        /* Option values are string literals, so any quotes need to be doubled */
+        for (const char *c = stream->options[i].value; *c; c++) {
+            if (*c == '\'') appendPQExpBufferChar(query, '\'');
+            appendPQExpBufferChar(query, *c);
+        }
+        appendPQExpBufferChar(query, '\'');
+    }
+    appendPQExpBufferChar(query, ')');
+
     PGresult *res = PQexec(stream->conn, query->data);
 
     if (PQresultStatus(res) != PGRES_COPY_BOTH) {
@@ -321,7 +416,14 @@ int parse_xlogdata_message(replication_stream_t stream, char *buf, int buflen) {
     fprintf(stderr, "XLogData: wal_pos %X/%X\n", (uint32) (wal_pos >> 32), (uint32) wal_pos);
 #endif
 
-    int err = parse_frame(stream->frame_reader, wal_pos, buf + hdrlen, buflen - hdrlen);
+    char *frame = buf + hdrlen;
+    int frame_len = buflen - hdrlen;
+    if (stream->frame_compression) {
+        int err = decompress_frame(stream, &frame, &frame_len);
+        if (err) return err;
+    }
+
+    int err = parse_frame(stream->frame_reader, wal_pos, frame, frame_len);
     if (err) {
         repl_error(stream, "Error parsing frame data: %s", stream->frame_reader->error);
     }
@@ -331,6 +433,51 @@ int parse_xlogdata_message(replication_stream_t stream, char *buf, int buflen) {
 }
 
 
+/* Strips the header byte that precedes frames when frame compression is enabled, and
+ * decompresses the frame if necessary. On return, *buf and *buflen refer either to
+ * the uncompressed frame within the message, or to the stream's inflate buffer. */
+int decompress_frame(replication_stream_t stream, char **buf, int *buflen) {
+    unsigned char *data = (unsigned char *) *buf;
+
+    if (data[0] == PROTOCOL_FRAME_UNCOMPRESSED) {
+        *buf += 1;
+        *buflen -= 1;
+        return 0;
+    }
+
+    if (data[0] != PROTOCOL_FRAME_DEFLATE || *buflen < 1 + 4) {
+        repl_error(stream, "Invalid frame header: %d (%d bytes)", data[0], *buflen);
+        return EIO;
+    }
+
+    uLongf frame_len = ((uLongf) data[1] << 24) | ((uLongf) data[2] << 16) |
+        ((uLongf) data[3] << 8) | (uLongf) data[4];
+
+    if (frame_len > stream->inflate_buf_size) {
+        stream->inflate_buf = realloc(stream->inflate_buf, frame_len);
+        if (!stream->inflate_buf) {
+            repl_error(stream, "Could not allocate %lu bytes to decompress frame",
+                    (unsigned long) frame_len);
+            stream->inflate_buf_size = 0;
+            return ENOMEM;
+        }
+        stream->inflate_buf_size = frame_len;
+    }
+
+    uLongf inflated_len = frame_len;
+    int err = uncompress((Bytef *) stream->inflate_buf, &inflated_len,
+            (Bytef *) data + 1 + 4, *buflen - 1 - 4);
+    if (err != Z_OK || inflated_len != frame_len) {
+        repl_error(stream, "Could not decompress frame (zlib error %d)", err);
+        return EIO;
+    }
+
+    *buf = stream->inflate_buf;
+    *buflen = (int) frame_len;
+    return 0;
+}
+
+
 /* Send a "Standby status update" message to server, indicating the LSN up to which we
  * have received logs. This message is packed binary with the following structure:
  *
@@ -6,17 +6,28 @@
 #include <libpq-fe.h>
 #include <postgres_fe.h>
 #include <access/xlogdefs.h>
+#include <internal/pqexpbuffer.h>
 
 #define REPLICATION_STREAM_ERROR_LEN 512
 
+/* An option that is passed to the output plugin when starting replication. */
+typedef struct {
+    char *name, *value;
+} plugin_option;
+
 typedef struct {
     char *slot_name, *output_plugin, *snapshot_name;
+    plugin_option *options;
+    int num_options;
     PGconn *conn;
     XLogRecPtr start_lsn;
     XLogRecPtr recvd_lsn;
     XLogRecPtr fsync_lsn;
     int64 last_checkpoint;
     frame_reader_t frame_reader;
+    int frame_compression; /* 1 if frames have a header byte and may be compressed (see protocol.h) */
+    char *inflate_buf;     /* Buffer for decompressing frames */
+    size_t inflate_buf_size;
     int status; /* 1 = message was processed on last poll; 0 = no data available right now; -1 = stream ended */
     char error[REPLICATION_STREAM_ERROR_LEN];
 } replication_stream;
@@ -26,6 +37,10 @@ typedef replication_stream *replication_stream_t;
 int replication_slot_create(replication_stream_t stream);
 int replication_slot_drop(replication_stream_t stream);
 int replication_stream_check(replication_stream_t stream);
+void replication_stream_set_option(replication_stream_t stream, const char *name, const char *value);
+const char *replication_stream_get_option(replication_stream_t stream, const char *name);
+void replication_stream_options_array(replication_stream_t stream, PQExpBuffer buf);
+void replication_stream_free_options(replication_stream_t stream);
 int replication_stream_start(replication_stream_t stream, const char *error_policy);
 int replication_stream_poll(replication_stream_t stream);
 int replication_stream_keepalive(replication_stream_t stream);
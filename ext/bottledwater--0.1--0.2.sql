@@ -0,0 +1,82 @@
+-- Complain if script is sourced in psql, rather than via CREATE EXTENSION.
+\echo Use "ALTER EXTENSION bottledwater UPDATE TO '0.2'" to load this file. \quit
+
+-- Statistics of the output plugin, one row per replication slot (with a null relid)
+-- and one row per table decoded through that slot. Requires bottledwater to be listed
+-- in shared_preload_libraries.
+CREATE OR REPLACE FUNCTION bottledwater_stats(
+        OUT slot_name name,
+        OUT relid oid,
+        OUT inserts bigint,
+        OUT updates bigint,
+        OUT deletes bigint,
+        OUT bytes bigint,
+        OUT schema_cache_hits bigint,
+        OUT schema_cache_misses bigint,
+        OUT errors bigint,
+        OUT encode_time double precision -- milliseconds
+    ) RETURNS setof record
+    AS 'bottledwater', 'bottledwater_stats' LANGUAGE C VOLATILE STRICT;
+
+-- Discards the statistics of a replication slot, e.g. one that has been dropped. When
+-- there is no room for new statistics, those of dropped slots are discarded anyway.
+CREATE OR REPLACE FUNCTION bottledwater_stats_reset(slot_name name) RETURNS void
+    AS 'bottledwater', 'bottledwater_stats_reset' LANGUAGE C VOLATILE STRICT;
+
+REVOKE ALL ON FUNCTION bottledwater_stats_reset(name) FROM PUBLIC;
+
+-- bottledwater_export gained the options argument. Replacing it in place would add an
+-- overload instead, making calls with the old arguments ambiguous.
+DROP FUNCTION bottledwater_export(text, boolean, bottledwater_error_policy);
+
+CREATE OR REPLACE FUNCTION bottledwater_export(
+        table_pattern text    DEFAULT '%',
+        allow_unkeyed boolean DEFAULT false,
+        error_policy bottledwater_error_policy DEFAULT 'exit',
+        -- alternating names and values of output plugin options, e.g.
+        -- '{numeric_encoding,decimal}'; options that only apply to the
+        -- replication stream are ignored
+        options text[] DEFAULT '{}'
+    ) RETURNS setof bytea
+    AS 'bottledwater', 'bottledwater_export' LANGUAGE C VOLATILE STRICT;
+
+-- Bookkeeping for incremental snapshots (bottledwater --incremental-snapshot), with
+-- one row per replication slot. The client updates the watermark before and after
+-- reading each chunk of a table, and recognises those updates in the replication
+-- stream. resume_relid and resume_key record the first chunk that has not yet been
+-- durably written, from which the snapshot continues after a restart.
+-- Its objects are qualified with the extension's schema (which is why the extension
+-- is not relocatable), so that they are found whatever the session's search_path.
+CREATE SEQUENCE @extschema@.bottledwater_watermark_seq;
+
+CREATE TABLE @extschema@.bottledwater_watermark (
+    slot_name     name PRIMARY KEY,
+    watermark     bigint NOT NULL DEFAULT nextval('@extschema@.bottledwater_watermark_seq'),
+    resume_relid  oid,     -- null when the snapshot starts from the first table
+    resume_key    bigint,  -- null when the snapshot starts from the beginning of the table
+    complete      boolean NOT NULL DEFAULT false,
+    table_pattern text NOT NULL DEFAULT '%', -- LIKE pattern for the names of tables to read
+    request       bigint NOT NULL DEFAULT 0  -- last request from bottledwater_resnapshot()
+);
+
+SELECT pg_catalog.pg_extension_config_dump('@extschema@.bottledwater_watermark', '');
+
+-- Asks the bottledwater client that is consuming the given replication slot to send
+-- the current contents of the tables whose names match table_pattern again, without
+-- interrupting the replication stream. The request reaches the client through the
+-- stream, and replaces any incremental snapshot that the client is taking. Returns
+-- an identifier for the request.
+CREATE OR REPLACE FUNCTION bottledwater_resnapshot(
+        slot_name name,
+        table_pattern text DEFAULT '%'
+    ) RETURNS bigint AS $$
+    INSERT INTO @extschema@.bottledwater_watermark (slot_name, complete)
+        SELECT $1, true WHERE NOT EXISTS (
+            SELECT 1 FROM @extschema@.bottledwater_watermark w WHERE w.slot_name = $1);
+    UPDATE @extschema@.bottledwater_watermark
+        SET watermark = nextval('@extschema@.bottledwater_watermark_seq'),
+            request = currval('@extschema@.bottledwater_watermark_seq'),
+            table_pattern = $2, resume_relid = NULL, resume_key = NULL, complete = false
+        WHERE bottledwater_watermark.slot_name = $1
+        RETURNING request;
+$$ LANGUAGE sql VOLATILE STRICT;
@@ -1,32 +1,44 @@
 #include "io_util.h"
 
+#include <string.h>
+
 #define INIT_BUFFER_LENGTH 16384
-#define MAX_BUFFER_LENGTH 1048576
+
+/* A zigzag-encoded 64-bit integer takes at most 10 bytes as a varint. The length of a
+ * bytes or string value is less than 2^31, so it takes at most 5 bytes. */
+#define MAX_VARINT_LENGTH 10
+#define MAX_LENGTH_VARINT_LENGTH 5
+
+static int encode_varint(char *buf, int64 value);
 
 
-/* Allocates a fixed-length buffer and tries to write something to it using the Avro writer API.
- * If it doesn't fit, increases the buffer size and tries again. The actual writing operation
- * is given as a callback; the context argument is passed to the callback. On success (return
- * value 0), output is set to a palloc'ed byte array of the right size. The VARSIZE of the
- * output array does not include a terminating null byte, but we guarantee that the following
- * byte is indeed 0, so it's safe to increment VARSIZE if you need the null byte included. */
-int try_writing(bytea **output, try_writing_cb cb, void *context) {
-    int size = INIT_BUFFER_LENGTH, err = ENOSPC;
+/* Tries to write something using the Avro writer API, appending it to the end of the
+ * given buffer. If it doesn't fit in the buffer's free space, the buffer is enlarged
+ * (at least doubling its size) and the write is tried again, so there is no limit on
+ * the size of the output other than Postgres' maximum allocation size. The buffer can
+ * be reused across calls, so its memory only needs to be allocated once. The actual
+ * writing operation is given as a callback; the context argument is passed to the
+ * callback. On success (return value 0), the output has been appended to the buffer,
+ * and as usual for a StringInfo, it is followed by a null byte. */
+int try_writing(StringInfo output, try_writing_cb cb, void *context) {
+    int available, err = ENOSPC;
     avro_writer_t writer;
 
-    while (err == ENOSPC && size <= MAX_BUFFER_LENGTH) {
-        *output = (bytea *) palloc(size);
-        writer = avro_writer_memory(VARDATA(*output), size - VARHDRSZ);
+    if (output->maxlen - output->len - 1 < INIT_BUFFER_LENGTH) {
+        enlargeStringInfo(output, INIT_BUFFER_LENGTH);
+    }
+
+    while (err == ENOSPC) {
+        /* Leave space for the null byte that terminates a StringInfo */
+        available = output->maxlen - output->len - 1;
+        writer = avro_writer_memory(output->data + output->len, available);
         err = (*cb)(writer, context);
 
         if (err == 0) {
-            SET_VARSIZE(*output, avro_writer_tell(writer) + VARHDRSZ);
-            err = avro_write(writer, "\x00", 1);
-        }
-
-        if (err == ENOSPC) {
-            size *= 4;
-            pfree(*output);
+            output->len += avro_writer_tell(writer);
+            output->data[output->len] = '\0';
+        } else if (err == ENOSPC) {
+            enlargeStringInfo(output, 2 * available);
         }
         avro_writer_free(writer);
     }
@@ -34,12 +46,102 @@ int try_writing(bytea **output, try_writing_cb cb, void *context) {
     return err;
 }
 
+/* Turns a buffer whose first VARHDRSZ bytes were reserved (e.g. with
+ * appendStringInfoSpaces) into a byte array, without copying the data. */
+bytea *string_info_to_bytea(StringInfo buf) {
+    SET_VARSIZE(buf->data, buf->len);
+    return (bytea *) buf->data;
+}
+
 /* try_writing_cb function that encodes an Avro schema as a JSON string. */
 int write_schema_json(avro_writer_t writer, void *context) {
     return avro_schema_to_json((avro_schema_t) context, writer);
 }
 
-/* try_writing_cb function that encodes a value using Avro binary encoding. */
-int write_avro_binary(avro_writer_t writer, void *context) {
-    return avro_value_write(writer, (avro_value_t *) context);
+/* Writes value as a zigzag-encoded variable-length integer to buf, which must have
+ * space for MAX_VARINT_LENGTH bytes, and returns the number of bytes written. */
+static int encode_varint(char *buf, int64 value) {
+    uint64 n = ((uint64) value << 1) ^ (uint64) (value >> 63);
+    int len = 0;
+
+    while (n & ~((uint64) 0x7F)) {
+        buf[len++] = (char) ((n & 0x7F) | 0x80);
+        n >>= 7;
+    }
+    buf[len++] = (char) n;
+    return len;
+}
+
+/* Appends an Avro long or int. */
+void write_avro_long(StringInfo out, int64 value) {
+    enlargeStringInfo(out, MAX_VARINT_LENGTH);
+    out->len += encode_varint(out->data + out->len, value);
+    out->data[out->len] = '\0';
+}
+
+/* Appends an Avro boolean. */
+void write_avro_boolean(StringInfo out, bool value) {
+    appendStringInfoCharMacro(out, value ? 1 : 0);
+}
+
+/* Appends an Avro float (IEEE 754 single precision, little-endian). */
+void write_avro_float(StringInfo out, float4 value) {
+    uint32 bits;
+    char buf[4];
+
+    memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 4; i++) {
+        buf[i] = (char) (bits >> (8 * i));
+    }
+    appendBinaryStringInfo(out, buf, 4);
+}
+
+/* Appends an Avro double (IEEE 754 double precision, little-endian). */
+void write_avro_double(StringInfo out, float8 value) {
+    uint64 bits;
+    char buf[8];
+
+    memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 8; i++) {
+        buf[i] = (char) (bits >> (8 * i));
+    }
+    appendBinaryStringInfo(out, buf, 8);
+}
+
+/* Appends an Avro bytes value: the length, followed by the data. */
+void write_avro_bytes(StringInfo out, const char *data, int len) {
+    write_avro_long(out, len);
+    appendBinaryStringInfo(out, data, len);
+}
+
+/* Appends an Avro string value (which has the same encoding as bytes). */
+void write_avro_string(StringInfo out, const char *str) {
+    write_avro_bytes(out, str, strlen(str));
+}
+
+/* Starts an Avro bytes value whose contents are going to be encoded directly into
+ * the buffer, without knowing its length in advance. Reserves space for the length
+ * prefix, and returns the offset at which the contents start. Call end_avro_bytes()
+ * with that offset once the contents have been written. */
+int begin_avro_bytes(StringInfo out) {
+    appendStringInfoSpaces(out, MAX_LENGTH_VARINT_LENGTH);
+    return out->len;
+}
+
+/* Fills in the length prefix of a bytes value started by begin_avro_bytes(). If the
+ * length takes fewer bytes than were reserved, the contents are moved back to close
+ * the gap. */
+void end_avro_bytes(StringInfo out, int start) {
+    char prefix[MAX_VARINT_LENGTH];
+    int contents_len = out->len - start;
+    int prefix_len = encode_varint(prefix, contents_len);
+    int prefix_start = start - MAX_LENGTH_VARINT_LENGTH;
+
+    memcpy(out->data + prefix_start, prefix, prefix_len);
+
+    if (prefix_len < MAX_LENGTH_VARINT_LENGTH) {
+        memmove(out->data + prefix_start + prefix_len, out->data + start, contents_len);
+        out->len -= MAX_LENGTH_VARINT_LENGTH - prefix_len;
+        out->data[out->len] = '\0';
+    }
 }
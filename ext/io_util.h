@@ -3,6 +3,7 @@
 
 #include "avro.h"
 #include "postgres.h"
+#include "lib/stringinfo.h"
 
 #define check(err, call) { err = call; if (err) return err; }
 
@@ -11,8 +12,19 @@
  * other value to indicate any other error (the operation will not be retried). */
 typedef int (*try_writing_cb)(avro_writer_t, void *);
 
-int try_writing(bytea **output, try_writing_cb cb, void *context);
+int try_writing(StringInfo output, try_writing_cb cb, void *context);
+bytea *string_info_to_bytea(StringInfo buf);
 int write_schema_json(avro_writer_t writer, void *context);
-int write_avro_binary(avro_writer_t writer, void *context);
+
+/* Functions that append values in Avro binary encoding to a buffer. Avro's int and long
+ * types have the same encoding, so write_avro_long is used for both. */
+void write_avro_long(StringInfo out, int64 value);
+void write_avro_boolean(StringInfo out, bool value);
+void write_avro_float(StringInfo out, float4 value);
+void write_avro_double(StringInfo out, float8 value);
+void write_avro_bytes(StringInfo out, const char *data, int len);
+void write_avro_string(StringInfo out, const char *str);
+int begin_avro_bytes(StringInfo out);
+void end_avro_bytes(StringInfo out, int start);
 
 #endif /* IO_UTIL_H */
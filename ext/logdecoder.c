@@ -2,11 +2,31 @@
 #include "protocol_server.h"
 #include "oid2avro.h"
 #include "error_policy.h"
+#include "stats.h"
 
 #include "replication/logical.h"
 #include "replication/output_plugin.h"
+#include "replication/slot.h"
+#include "portability/instr_time.h"
 #include "utils/builtins.h"
 #include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+#include <limits.h>
+#include <zlib.h>
+
+/* By default, every frame is written as soon as it has been generated, i.e.
+ * one frame per transaction begin, commit and row change. */
+#define DEFAULT_FRAME_MAX_MESSAGES 1
+#define DEFAULT_FRAME_MAX_BYTES 0
+
+/* Transactions without any changes to replicated tables are not sent, except that if
+ * nothing has been sent for this many milliseconds, an empty transaction is sent to
+ * let the client acknowledge its commit, so that the replication slot advances. */
+#define DEFAULT_PROGRESS_INTERVAL_MS 10000
+
+/* When frame compression is enabled, frames smaller than this are not compressed */
+#define DEFAULT_FRAME_COMPRESSION_MIN_BYTES 1024
 
 /* Entry point when Postgres loads the plugin */
 extern void _PG_init(void);
@@ -20,18 +40,33 @@ static void output_avro_change(LogicalDecodingContext *ctx, ReorderBufferTXN *tx
 
 typedef struct {
     MemoryContext memctx; /* reset after every change event, to prevent leaks */
-    avro_schema_t frame_schema;
-    avro_value_iface_t *frame_iface;
-    avro_value_t frame_value;
+    frame_buffer frame;       /* Messages that have not yet been written, in Avro binary encoding */
     schema_cache_t schema_cache;
+    encoding_options encoding; /* How rows are converted to Avro */
+    table_filter_t table_filter; /* Which tables and columns are replicated */
     error_policy_t error_policy;
+    int frame_max_messages;   /* Write the frame once it contains this many messages */
+    int frame_max_bytes;      /* Write the frame once its encoded size reaches this (0 = no limit) */
+    int progress_interval;    /* Milliseconds after which an empty transaction is sent (0 = never) */
+    bool frame_compression;   /* Whether frames have a header byte and may be compressed */
+    int frame_compression_min_bytes; /* Only frames of at least this size are compressed */
+    bool txn_begun;           /* Whether the begin message of the current transaction has been sent */
+    TimestampTz last_write;   /* When a frame was last written */
+    plugin_stats *stats;      /* Counters not yet added to the shared statistics */
+    int profile_interval;     /* Milliseconds between logging profiling histograms (0 = no profiling) */
 } plugin_state;
 
-void reset_frame(plugin_state *state);
-int write_frame(LogicalDecodingContext *ctx, plugin_state *state);
+char *option_value(DefElem *elem);
+int parse_int_option(DefElem *elem, int min_value);
+void begin_txn_if_needed(plugin_state *state, ReorderBufferTXN *txn);
+void maybe_write_frame(LogicalDecodingContext *ctx, plugin_state *state, bool end_of_txn);
+void write_frame(LogicalDecodingContext *ctx, plugin_state *state);
+void write_compressed_frame(StringInfo out, plugin_state *state);
+bool parse_frame_compression(DefElem *elem);
 
 
 void _PG_init() {
+    plugin_stats_shmem_request();
 }
 
 void _PG_output_plugin_init(OutputPluginCallbacks *cb) {
@@ -47,6 +82,7 @@ static void output_avro_startup(LogicalDecodingContext *ctx, OutputPluginOptions
         bool is_init) {
     ListCell *option;
 
+    MemoryContext oldctx = MemoryContextSwitchTo(ctx->context);
     plugin_state *state = palloc(sizeof(plugin_state));
     ctx->output_plugin_private = state;
     opt->output_type = OUTPUT_PLUGIN_BINARY_OUTPUT;
@@ -54,23 +90,46 @@ static void output_avro_startup(LogicalDecodingContext *ctx, OutputPluginOptions
     state->memctx = AllocSetContextCreate(ctx->context, "Avro decoder context",
             ALLOCSET_DEFAULT_MINSIZE, ALLOCSET_DEFAULT_INITSIZE, ALLOCSET_DEFAULT_MAXSIZE);
 
-    state->frame_schema = schema_for_frame();
-    state->frame_iface = avro_generic_class_from_schema(state->frame_schema);
-    avro_generic_value_new(state->frame_iface, &state->frame_value);
-    state->schema_cache = schema_cache_new(ctx->context);
+    frame_buffer_init(&state->frame);
+    encoding_options_init(&state->encoding);
+    state->table_filter = table_filter_new();
+
+    state->frame_max_messages = DEFAULT_FRAME_MAX_MESSAGES;
+    state->frame_max_bytes = DEFAULT_FRAME_MAX_BYTES;
+    state->progress_interval = DEFAULT_PROGRESS_INTERVAL_MS;
+    state->frame_compression = false;
+    state->frame_compression_min_bytes = DEFAULT_FRAME_COMPRESSION_MIN_BYTES;
+    state->txn_begun = false;
+    state->last_write = GetCurrentTimestamp();
+    state->stats = plugin_stats_new(ctx->context, NameStr(MyReplicationSlot->data.name));
+    state->profile_interval = 0;
 
     foreach(option, ctx->output_plugin_options) {
         DefElem *elem = lfirst(option);
         Assert(elem->arg == NULL || IsA(elem->arg, String));
 
         if (strcmp(elem->defname, "error_policy") == 0) {
-            if (elem->arg == NULL) {
-                ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                        errmsg("No value specified for parameter \"%s\"",
-                            elem->defname)));
-            } else {
-                state->error_policy = parse_error_policy(strVal(elem->arg));
-            }
+            state->error_policy = parse_error_policy(option_value(elem));
+        } else if (strcmp(elem->defname, "frame_max_messages") == 0) {
+            state->frame_max_messages = parse_int_option(elem, 1);
+        } else if (strcmp(elem->defname, "frame_max_bytes") == 0) {
+            state->frame_max_bytes = parse_int_option(elem, 0);
+        } else if (strcmp(elem->defname, "progress_interval") == 0) {
+            state->progress_interval = parse_int_option(elem, 0);
+        } else if (strcmp(elem->defname, "frame_compression") == 0) {
+            state->frame_compression = parse_frame_compression(elem);
+        } else if (strcmp(elem->defname, "frame_compression_min_bytes") == 0) {
+            state->frame_compression_min_bytes = parse_int_option(elem, 0);
+        } else if (strcmp(elem->defname, "profile_interval") == 0) {
+            state->profile_interval = parse_int_option(elem, 0);
+        } else if (strncmp(elem->defname, "snapshot_", strlen("snapshot_")) == 0) {
+            /* option only applies to bottledwater_export, which gets the same options */
+        } else if (encoding_options_parse(&state->encoding, elem->defname,
+                    elem->arg ? strVal(elem->arg) : NULL)) {
+            /* option has been stored in state->encoding */
+        } else if (table_filter_parse(state->table_filter, elem->defname,
+                    elem->arg ? strVal(elem->arg) : NULL)) {
+            /* option has been stored in state->table_filter */
         } else {
             ereport(INFO, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
                     errmsg("Parameter \"%s\" = \"%s\" is unknown",
@@ -78,45 +137,54 @@ static void output_avro_startup(LogicalDecodingContext *ctx, OutputPluginOptions
                         elem->arg ? strVal(elem->arg) : "(null)")));
         }
     }
+
+    state->schema_cache = schema_cache_new(ctx->context, &state->encoding, state->table_filter);
+    if (state->profile_interval > 0) {
+        state->frame.profiler = profiler_new(ctx->context, state->profile_interval);
+    }
+    MemoryContextSwitchTo(oldctx);
 }
 
 static void output_avro_shutdown(LogicalDecodingContext *ctx) {
     plugin_state *state = ctx->output_plugin_private;
+    plugin_stats_flush(state->stats);
     MemoryContextDelete(state->memctx);
 
     schema_cache_free(state->schema_cache);
-    avro_value_decref(&state->frame_value);
-    avro_value_iface_decref(state->frame_iface);
-    avro_schema_decref(state->frame_schema);
+    frame_buffer_free(&state->frame);
 }
 
+/* The begin message is deferred until the transaction's first change is sent (see
+ * begin_txn_if_needed), so that transactions which don't change any replicated
+ * tables don't generate any messages. */
 static void output_avro_begin_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn) {
     plugin_state *state = ctx->output_plugin_private;
-    MemoryContext oldctx = MemoryContextSwitchTo(state->memctx);
-    reset_frame(state);
-
-    if (update_frame_with_begin_txn(&state->frame_value, txn)) {
-        elog(ERROR, "output_avro_begin_txn: Avro conversion failed: %s", avro_strerror());
-    }
-    if (write_frame(ctx, state)) {
-        elog(ERROR, "output_avro_begin_txn: writing Avro binary failed: %s", avro_strerror());
-    }
-
-    MemoryContextSwitchTo(oldctx);
-    MemoryContextReset(state->memctx);
+    state->txn_begun = false;
 }
 
 static void output_avro_commit_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
         XLogRecPtr commit_lsn) {
     plugin_state *state = ctx->output_plugin_private;
-    MemoryContext oldctx = MemoryContextSwitchTo(state->memctx);
-    reset_frame(state);
+    MemoryContext oldctx;
+
+    /* Elide an empty transaction, unless it's time to report progress */
+    if (!state->txn_begun && (state->progress_interval == 0 ||
+                !TimestampDifferenceExceeds(state->last_write, GetCurrentTimestamp(),
+                    state->progress_interval))) {
+        plugin_stats_flush(state->stats);
+        return;
+    }
+
+    oldctx = MemoryContextSwitchTo(state->memctx);
+    begin_txn_if_needed(state, txn);
 
-    if (update_frame_with_commit_txn(&state->frame_value, txn, commit_lsn)) {
+    if (update_frame_with_commit_txn(&state->frame, txn, commit_lsn)) {
         elog(ERROR, "output_avro_commit_txn: Avro conversion failed: %s", avro_strerror());
     }
-    if (write_frame(ctx, state)) {
-        elog(ERROR, "output_avro_commit_txn: writing Avro binary failed: %s", avro_strerror());
+    maybe_write_frame(ctx, state, true);
+    plugin_stats_flush(state->stats);
+    if (state->frame.profiler) {
+        profiler_maybe_report(state->frame.profiler, NameStr(MyReplicationSlot->data.name));
     }
 
     MemoryContextSwitchTo(oldctx);
@@ -129,7 +197,20 @@ static void output_avro_change(LogicalDecodingContext *ctx, ReorderBufferTXN *tx
     HeapTuple oldtuple = NULL, newtuple = NULL;
     plugin_state *state = ctx->output_plugin_private;
     MemoryContext oldctx = MemoryContextSwitchTo(state->memctx);
-    reset_frame(state);
+    int frame_len = state->frame.buf.len, frame_messages = state->frame.num_messages;
+    bool txn_begun = state->txn_begun;
+    uint64 cache_hits = state->schema_cache->hits, cache_misses = state->schema_cache->misses;
+    plugin_stats_counters *counters;
+    instr_time start_time, duration;
+
+    /* Skip changes to tables that are filtered out, before doing any Avro work */
+    if (!schema_cache_table_included(state->schema_cache, rel)) {
+        MemoryContextSwitchTo(oldctx);
+        MemoryContextReset(state->memctx);
+        return;
+    }
+
+    INSTR_TIME_SET_CURRENT(start_time);
 
     switch (change->action) {
         case REORDER_BUFFER_CHANGE_INSERT:
@@ -137,7 +218,9 @@ static void output_avro_change(LogicalDecodingContext *ctx, ReorderBufferTXN *tx
                 elog(ERROR, "output_avro_change: insert action without a tuple");
             }
             newtuple = &change->data.tp.newtuple->tuple;
-            err = update_frame_with_insert(&state->frame_value, state->schema_cache, rel,
+            if (!schema_cache_row_included(state->schema_cache, rel, newtuple, false)) break;
+            begin_txn_if_needed(state, txn);
+            err = update_frame_with_insert(&state->frame, state->schema_cache, rel,
                     RelationGetDescr(rel), newtuple);
             break;
 
@@ -149,52 +232,189 @@ static void output_avro_change(LogicalDecodingContext *ctx, ReorderBufferTXN *tx
                 oldtuple = &change->data.tp.oldtuple->tuple;
             }
             newtuple = &change->data.tp.newtuple->tuple;
-            err = update_frame_with_update(&state->frame_value, state->schema_cache, rel, oldtuple, newtuple);
+            /* Also send updates that make a row stop matching the row filter, if we
+             * can tell from the old row (e.g. with REPLICA IDENTITY FULL) */
+            if (!schema_cache_row_included(state->schema_cache, rel, newtuple, false) &&
+                    !(oldtuple && schema_cache_row_included(state->schema_cache, rel, oldtuple, true))) {
+                break;
+            }
+            begin_txn_if_needed(state, txn);
+            err = update_frame_with_update(&state->frame, state->schema_cache, rel, oldtuple, newtuple);
             break;
 
         case REORDER_BUFFER_CHANGE_DELETE:
             if (change->data.tp.oldtuple) {
                 oldtuple = &change->data.tp.oldtuple->tuple;
             }
-            err = update_frame_with_delete(&state->frame_value, state->schema_cache, rel, oldtuple);
+            /* The old row may only contain the key columns, so if the row filter can't
+             * be evaluated on it, the delete is sent anyway */
+            if (oldtuple && !schema_cache_row_included(state->schema_cache, rel, oldtuple, true)) break;
+            begin_txn_if_needed(state, txn);
+            err = update_frame_with_delete(&state->frame, state->schema_cache, rel, oldtuple);
             break;
 
         default:
             elog(ERROR, "output_avro_change: unknown change action %d", change->action);
     }
 
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, start_time);
+
+    counters = plugin_stats_table(state->stats, RelationGetRelid(rel));
+    counters->encode_time_us += INSTR_TIME_GET_MICROSEC(duration);
+    counters->schema_cache_hits += state->schema_cache->hits - cache_hits;
+    counters->schema_cache_misses += state->schema_cache->misses - cache_misses;
+
+    if (err) {
+        counters->errors++;
+    } else if (state->frame.num_messages != frame_messages) {
+        /* the change wasn't skipped by the row filter */
+        if (change->action == REORDER_BUFFER_CHANGE_INSERT) counters->inserts++;
+        if (change->action == REORDER_BUFFER_CHANGE_UPDATE) counters->updates++;
+        if (change->action == REORDER_BUFFER_CHANGE_DELETE) counters->deletes++;
+        counters->bytes += state->frame.buf.len - frame_len;
+    }
+
     if (err) {
         elog(INFO, "Row conversion failed: %s", schema_debug_info(rel, NULL));
         error_policy_handle(state->error_policy, "output_avro_change: row conversion failed", avro_strerror());
-        /* if handling the error didn't exit early, it should be safe to fall
-         * through, because we'll just write the frame without the message that
-         * failed (so potentially it'll be an empty frame)
-         */
-    }
-    if (write_frame(ctx, state)) {
-        error_policy_handle(state->error_policy, "output_avro_change: writing Avro binary failed", avro_strerror());
+        /* if handling the error didn't exit early, discard whatever was appended
+         * to the frame for the change that failed, and carry on */
+        frame_buffer_truncate(&state->frame, frame_len, frame_messages);
+        state->txn_begun = txn_begun;
     }
+    maybe_write_frame(ctx, state, false);
 
     MemoryContextSwitchTo(oldctx);
     MemoryContextReset(state->memctx);
 }
 
-void reset_frame(plugin_state *state) {
-    if (avro_value_reset(&state->frame_value)) {
-        elog(ERROR, "Avro value reset failed: %s", avro_strerror());
+/* Returns the string value of a plugin option, or raises an error if the option
+ * was given without a value. */
+char *option_value(DefElem *elem) {
+    if (elem->arg == NULL) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("No value specified for parameter \"%s\"",
+                    elem->defname)));
     }
+    return strVal(elem->arg);
 }
 
-int write_frame(LogicalDecodingContext *ctx, plugin_state *state) {
-    int err = 0;
-    bytea *output = NULL;
+/* Parses the value of a plugin option as an integer, and checks that it is no
+ * smaller than min_value. */
+int parse_int_option(DefElem *elem, int min_value) {
+    char *str = option_value(elem), *end;
+    long value;
+
+    errno = 0;
+    value = strtol(str, &end, 10);
+
+    if (errno != 0 || end == str || *end != '\0' || value < min_value || value > INT_MAX) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("Invalid value \"%s\" for parameter \"%s\": expected an integer >= %d",
+                    str, elem->defname, min_value)));
+    }
+    return (int) value;
+}
+
+/* Appends the begin message of the current transaction to the frame, unless it has
+ * already been sent. Called before the first message of a transaction is appended. */
+void begin_txn_if_needed(plugin_state *state, ReorderBufferTXN *txn) {
+    if (state->txn_begun) return;
+
+    if (update_frame_with_begin_txn(&state->frame, txn)) {
+        elog(ERROR, "output_avro_begin_txn: Avro conversion failed: %s", avro_strerror());
+    }
+    state->txn_begun = true;
+}
+
+/* Parses the value of the frame_compression option, returning true if frames should
+ * be compressed. */
+bool parse_frame_compression(DefElem *elem) {
+    char *value = option_value(elem);
+
+    if (strcmp(value, PROTOCOL_FRAME_COMPRESSION_NONE) == 0) {
+        return false;
+    } else if (strcmp(value, PROTOCOL_FRAME_COMPRESSION_DEFLATE) == 0) {
+        return true;
+    } else {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("Invalid value \"%s\" for parameter \"%s\"", value, elem->defname)));
+    }
+}
 
-    check(err, try_writing(&output, &write_avro_binary, &state->frame_value));
+/* Called after messages have been appended to the frame. Frames accumulate messages
+ * across the callbacks of a transaction, and are written out at the end of the
+ * transaction, or earlier if they have reached frame_max_messages messages or
+ * frame_max_bytes bytes. This allows large transactions to be sent in a small
+ * number of large frames, rather than one frame per row. */
+void maybe_write_frame(LogicalDecodingContext *ctx, plugin_state *state, bool end_of_txn) {
+    if (state->frame.num_messages == 0) return;
+
+    if (end_of_txn || state->frame.num_messages >= state->frame_max_messages ||
+            (state->frame_max_bytes > 0 && state->frame.buf.len >= state->frame_max_bytes)) {
+        write_frame(ctx, state);
+    }
+}
+
+/* Sends the frame to the client. The messages are already in Avro binary encoding,
+ * so this just terminates the frame and copies it into the output buffer. We can't
+ * encode directly into ctx->out, because OutputPluginPrepareWrite() resets it and
+ * records the current WAL position, which the client takes as the position of the
+ * frame; for a frame that spans several callbacks, that must be the position at
+ * which the frame is written. */
+void write_frame(LogicalDecodingContext *ctx, plugin_state *state) {
+    instr_time start_time;
+
+    PROFILE_START(state->frame.profiler, start_time);
+    frame_buffer_finish(&state->frame);
 
     OutputPluginPrepareWrite(ctx, true);
-    appendBinaryStringInfo(ctx->out, VARDATA(output), VARSIZE(output) - VARHDRSZ);
+    if (state->frame_compression) {
+        write_compressed_frame(ctx->out, state);
+    } else {
+        appendBinaryStringInfo(ctx->out, state->frame.buf.data, state->frame.buf.len);
+    }
+    plugin_stats_table(state->stats, InvalidOid)->bytes += ctx->out->len;
     OutputPluginWrite(ctx, true);
+    PROFILE_END(state->frame.profiler, InvalidOid, PROFILE_WRITE_FRAME, start_time);
+
+    frame_buffer_reset(&state->frame);
+    state->last_write = GetCurrentTimestamp();
+}
+
+/* Appends the frame to the output buffer in the format of the frame_compression
+ * option (see protocol.h): a header byte, followed either by the frame itself, or by
+ * its size and its zlib compression. Compression uses the fastest level, since it
+ * happens in the walsender and is meant to save bandwidth on large frames. */
+void write_compressed_frame(StringInfo out, plugin_state *state) {
+    StringInfo frame = &state->frame.buf;
+    int start = out->len;
+    uLongf compressed_len;
+    uint32 frame_len = (uint32) frame->len;
+
+    if (frame->len >= state->frame_compression_min_bytes) {
+        compressed_len = compressBound(frame->len);
+        enlargeStringInfo(out, 1 + 4 + compressed_len);
+
+        out->data[out->len++] = PROTOCOL_FRAME_DEFLATE;
+        out->data[out->len++] = (frame_len >> 24) & 0xff;
+        out->data[out->len++] = (frame_len >> 16) & 0xff;
+        out->data[out->len++] = (frame_len >> 8) & 0xff;
+        out->data[out->len++] = frame_len & 0xff;
+
+        if (compress2((Bytef *) out->data + out->len, &compressed_len,
+                    (Bytef *) frame->data, frame->len, Z_BEST_SPEED) == Z_OK &&
+                compressed_len < frame->len) {
+            out->len += compressed_len;
+            out->data[out->len] = '\0';
+            return;
+        }
+
+        /* Compression failed or didn't help; send the frame as it is */
+        out->len = start;
+    }
 
-    pfree(output);
-    return err;
+    appendStringInfoChar(out, PROTOCOL_FRAME_UNCOMPRESSED);
+    appendBinaryStringInfo(out, frame->data, frame->len);
 }
@@ -1,5 +1,6 @@
 #include "io_util.h"
 #include "oid2avro.h"
+#include "protocol.h"
 
 #include "funcapi.h"
 #include "access/htup_details.h"
@@ -12,7 +13,9 @@
 #include "utils/cash.h"
 #include "utils/date.h"
 #include "utils/datetime.h"
+#include "utils/datum.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/numeric.h"
 #include "utils/timestamp.h"
 
@@ -20,6 +23,29 @@
 #error Expecting timestamps to be represented as integers, not as floating-point.
 #endif
 
+/* The internal representation of NUMERIC values is private to numeric.c, but as it is
+ * also the on-disk format, it can't change. A value consists of a header, followed by
+ * digits in base 10000 (most significant first), and equals the sum of
+ * digit[i] * 10000^(weight - i). The header is either two 16-bit words (flags, sign and
+ * display scale, followed by the weight), or one word in which they are packed. */
+#define NUMERIC_DIGIT_BASE          10000
+#define NUMERIC_DIGIT_DEC_DIGITS    4
+#define NUMERIC_HDR_SIGN_MASK       0xC000
+#define NUMERIC_HDR_NEG             0x4000
+#define NUMERIC_HDR_SHORT           0x8000
+#define NUMERIC_HDR_NAN             0xC000
+#define NUMERIC_HDR_SHORT_SIGN_MASK 0x2000
+#define NUMERIC_HDR_SHORT_WEIGHT_SIGN_MASK 0x0040
+#define NUMERIC_HDR_SHORT_WEIGHT_MASK      0x003F
+
+/* Multiplication and division of the unscaled value of a decimal by powers of ten is
+ * done in steps of at most 10^9, so that they fit in a 32-bit limb. */
+#define DECIMAL_MAX_POW10_STEP 9
+
+static const uint32 decimal_pow10[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
 typedef struct {
     avro_schema_t date_schema;         /* Predefined data type for "date" */
     avro_schema_t time_tz_schema;      /* Predefined data type for "time with time zone" */
@@ -27,10 +53,15 @@ typedef struct {
     avro_schema_t datetime_tz_schema;  /* Predefined data type for "timestamp with time zone" */
     avro_schema_t interval_schema;     /* Predefined data type for "interval" */
     avro_schema_t special_time_schema; /* Predefined data type for enum of +infinity, -infinity */
+    avro_schema_t unchanged_toast_schema; /* Predefined data type for unchanged TOASTed values */
 } predef_schema;
 
-avro_schema_t schema_for_oid(predef_schema *predef, Oid typid);
-avro_schema_t schema_for_numeric(predef_schema *predef);
+avro_schema_t schema_for_oid(predef_schema *predef, encoding_options *options, Form_pg_attribute attr);
+avro_schema_t schema_for_numeric(predef_schema *predef, bool as_decimal);
+bool column_is_decimal(Form_pg_attribute attr, encoding_options *options);
+const char *column_logical_type(Form_pg_attribute attr, encoding_options *options,
+        StringInfo attributes);
+bool string_info_ends_with(StringInfo buf, const char *suffix);
 avro_schema_t schema_for_date(predef_schema *predef);
 avro_schema_t schema_for_time_tz(predef_schema *predef);
 avro_schema_t schema_for_timestamp(predef_schema *predef, bool with_tz);
@@ -38,20 +69,141 @@ avro_schema_t schema_for_interval(predef_schema *predef);
 void schema_for_date_fields(avro_schema_t record_schema);
 void schema_for_time_fields(avro_schema_t record_schema);
 avro_schema_t schema_for_special_times(predef_schema *predef, avro_schema_t record_schema);
-
-int update_avro_with_datum(avro_value_t *output_val, Oid typid, Datum pg_datum);
-int update_avro_with_date(avro_value_t *union_val, DateADT date);
-int update_avro_with_time_tz(avro_value_t *record_val, TimeTzADT *time);
-int update_avro_with_timestamp(avro_value_t *union_val, bool with_tz, Timestamp timestamp);
-int update_avro_with_interval(avro_value_t *record_val, Interval *interval);
-int update_avro_with_bytes(avro_value_t *output_val, bytea *bytes);
-int update_avro_with_char(avro_value_t *output_val, char c);
-int update_avro_with_string(avro_value_t *output_val, Oid typid, Datum pg_datum);
+avro_schema_t schema_for_unchanged_toast(predef_schema *predef);
+bool column_has_toast_marker(Form_pg_attribute attr, encoding_options *options);
+
+encoding_plan *encoding_plan_new(TupleDesc tupdesc, int num_columns);
+int natts_excluding_dropped(TupleDesc tupdesc);
+int natts_included(TupleDesc tupdesc, Bitmapset *excluded_columns);
+bool column_is_included(TupleDesc tupdesc, int index, Bitmapset *excluded_columns);
+void column_plan_init(column_plan *column, Form_pg_attribute attr, encoding_options *options);
+void decimal_mul_add(uint32 *limbs, int *len, uint32 mul, uint32 add);
+uint32 decimal_div(uint32 *limbs, int *len, uint32 divisor);
+void write_decimal_bytes(StringInfo out, uint32 *limbs, int len, bool negative);
+int write_special_time(StringInfo out, bool is_nobegin);
+int write_timestamp(StringInfo out, bool with_tz, Timestamp timestamp);
+
+static int encode_boolean(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_float4(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_float8(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_int2(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_int4(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_int8(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_cash(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_oid(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_xid(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_cid(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_numeric(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_decimal(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_date(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_time(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_time_tz(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_timestamp(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_timestamp_tz(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_date_days(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_timestamp_micros(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_interval(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_bytea(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_char(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_name(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_text(StringInfo out, column_plan *column, Datum pg_datum);
+static int encode_with_output_func(StringInfo out, column_plan *column, Datum pg_datum);
 
 
 static char *make_avro_safe(const char *raw, bool is_namespace);
 
 
+/* Sets all encoding options to their defaults. */
+void encoding_options_init(encoding_options *options) {
+    memset(options, 0, sizeof(encoding_options));
+    options->numeric_encoding = NUMERIC_ENCODING_DOUBLE;
+    options->temporal_encoding = TEMPORAL_ENCODING_RECORD;
+    options->unchanged_toast = UNCHANGED_TOAST_FETCH;
+    options->update_format = UPDATE_FORMAT_FULL;
+    options->old_row = OLD_ROW_INCLUDE;
+    options->schema_fingerprint = SCHEMA_FINGERPRINT_OMIT;
+}
+
+/* Sets the encoding option with the given name, if it is one of the encoding options.
+ * Returns true if the option was recognised, and false if it wasn't (it may be an
+ * option for some other part of the extension). Raises an error if the value is
+ * invalid or NULL. */
+bool encoding_options_parse(encoding_options *options, const char *name, const char *value) {
+    if (strcmp(name, "numeric_encoding") == 0) {
+        if (value && strcmp(value, PROTOCOL_NUMERIC_ENCODING_DOUBLE) == 0) {
+            options->numeric_encoding = NUMERIC_ENCODING_DOUBLE;
+        } else if (value && strcmp(value, PROTOCOL_NUMERIC_ENCODING_DECIMAL) == 0) {
+            options->numeric_encoding = NUMERIC_ENCODING_DECIMAL;
+        } else {
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("invalid numeric_encoding: %s", value ? value : "(null)")));
+        }
+        return true;
+    }
+
+    if (strcmp(name, "temporal_encoding") == 0) {
+        if (value && strcmp(value, PROTOCOL_TEMPORAL_ENCODING_RECORD) == 0) {
+            options->temporal_encoding = TEMPORAL_ENCODING_RECORD;
+        } else if (value && strcmp(value, PROTOCOL_TEMPORAL_ENCODING_LOGICAL) == 0) {
+            options->temporal_encoding = TEMPORAL_ENCODING_LOGICAL;
+        } else {
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("invalid temporal_encoding: %s", value ? value : "(null)")));
+        }
+        return true;
+    }
+
+    if (strcmp(name, "unchanged_toast") == 0) {
+        if (value && strcmp(value, PROTOCOL_UNCHANGED_TOAST_FETCH) == 0) {
+            options->unchanged_toast = UNCHANGED_TOAST_FETCH;
+        } else if (value && strcmp(value, PROTOCOL_UNCHANGED_TOAST_MARKER) == 0) {
+            options->unchanged_toast = UNCHANGED_TOAST_MARKER;
+        } else {
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("invalid unchanged_toast: %s", value ? value : "(null)")));
+        }
+        return true;
+    }
+
+    if (strcmp(name, "update_format") == 0) {
+        if (value && strcmp(value, PROTOCOL_UPDATE_FORMAT_FULL) == 0) {
+            options->update_format = UPDATE_FORMAT_FULL;
+        } else if (value && strcmp(value, PROTOCOL_UPDATE_FORMAT_DELTA) == 0) {
+            options->update_format = UPDATE_FORMAT_DELTA;
+        } else {
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("invalid update_format: %s", value ? value : "(null)")));
+        }
+        return true;
+    }
+
+    if (strcmp(name, "old_row") == 0) {
+        if (value && strcmp(value, PROTOCOL_OLD_ROW_INCLUDE) == 0) {
+            options->old_row = OLD_ROW_INCLUDE;
+        } else if (value && strcmp(value, PROTOCOL_OLD_ROW_OMIT) == 0) {
+            options->old_row = OLD_ROW_OMIT;
+        } else {
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("invalid old_row: %s", value ? value : "(null)")));
+        }
+        return true;
+    }
+
+    if (strcmp(name, "schema_fingerprint") == 0) {
+        if (value && strcmp(value, PROTOCOL_SCHEMA_FINGERPRINT_OMIT) == 0) {
+            options->schema_fingerprint = SCHEMA_FINGERPRINT_OMIT;
+        } else if (value && strcmp(value, PROTOCOL_SCHEMA_FINGERPRINT_INCLUDE) == 0) {
+            options->schema_fingerprint = SCHEMA_FINGERPRINT_INCLUDE;
+        } else {
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("invalid schema_fingerprint: %s", value ? value : "(null)")));
+        }
+        return true;
+    }
+    return false;
+}
+
+
 /* Returns the relation object for the index that we're going to use as key for a
  * particular table. (Indexes are relations too!) Returns null if the table is unkeyed.
  * The return value is opened with a shared lock; call relation_close() when finished. */
@@ -97,8 +249,9 @@ Relation table_key_index(Relation rel) {
  *
  * Returns 0 if successful, nonzero if an error occurred generating the schema.
  * If the table is unkeyed, sets *schema_out to NULL and returns 0. */
-int schema_for_table_key(Relation rel, avro_schema_t *schema_out) {
+int schema_for_table_key(Relation rel, encoding_options *options, avro_schema_t *schema_out) {
     Relation index_rel;
+    encoding_options key_options = *options;
     int err;
 
     index_rel = table_key_index(rel);
@@ -107,7 +260,9 @@ int schema_for_table_key(Relation rel, avro_schema_t *schema_out) {
         return 0;
     }
 
-    err = schema_for_table_row(index_rel, schema_out);
+    /* Key values are always encoded in full (see encoding_plan_for_key) */
+    key_options.unchanged_toast = UNCHANGED_TOAST_FETCH;
+    err = schema_for_table_row(index_rel, &key_options, NULL, schema_out);
 
     relation_close(index_rel, AccessShareLock);
     return err;
@@ -115,11 +270,13 @@ int schema_for_table_key(Relation rel, avro_schema_t *schema_out) {
 
 
 /* Generates an Avro schema corresponding to a given table (relation) and sets
- * *schema_out to point to it.
+ * *schema_out to point to it. Columns whose index in the tuple descriptor is in
+ * excluded_columns (which may be NULL) are omitted from the schema.
  *
  * Returns 0 if successful, nonzero if an error occurred generating the schema.
  * If the table is unkeyed, sets *schema_out to NULL and returns 0. */
-int schema_for_table_row(Relation rel, avro_schema_t *schema_out) {
+int schema_for_table_row(Relation rel, encoding_options *options, Bitmapset *excluded_columns,
+        avro_schema_t *schema_out) {
     char *rel_namespace, *relname, *relname_avro_safe, *rel_namespace_avro_safe;
     char *attname_avro_safe;
     StringInfoData namespace;
@@ -150,10 +307,11 @@ int schema_for_table_row(Relation rel, avro_schema_t *schema_out) {
 
     tupdesc = RelationGetDescr(rel);
 
-    if (tupdesc->natts == 0) {
+    if (natts_included(tupdesc, excluded_columns) == 0) {
         /* Special case for table schemas with no columns.  (You can create
          * such a table via `CREATE TABLE no_columns ()`, but more likely you'd
-         * get there by dropping all the columns from an existing table.)
+         * get there by dropping all the columns from an existing table, or by
+         * excluding all of them with a column filter.)
          *
          * We need to special-case this because avro-c doesn't seem to like
          * record schemas with no fields. */
@@ -164,10 +322,10 @@ int schema_for_table_row(Relation rel, avro_schema_t *schema_out) {
 
     for (int i = 0; i < tupdesc->natts; i++) {
         Form_pg_attribute attr = tupdesc->attrs[i];
-        if (attr->attisdropped) continue; /* skip dropped columns */
+        if (!column_is_included(tupdesc, i, excluded_columns)) continue;
 
         attname_avro_safe = make_avro_safe(NameStr(attr->attname), false);
-        column_schema = schema_for_oid(&predef, attr->atttypid);
+        column_schema = schema_for_oid(&predef, options, attr);
 
         err = avro_schema_record_field_append(record_schema, attname_avro_safe, column_schema);
 
@@ -182,90 +340,308 @@ int schema_for_table_row(Relation rel, avro_schema_t *schema_out) {
 }
 
 
-/* Translates a Postgres heap tuple (one row of a table) into the Avro schema generated
- * by schema_for_table_row(). */
-int tuple_to_avro_row(avro_value_t *output_val, TupleDesc tupdesc, HeapTuple tuple) {
-    int err = 0, field = 0;
-    check(err, avro_value_reset(output_val));
+/* Builds the plan for encoding rows of a table, given the table's tuple descriptor,
+ * into the Avro schema generated by schema_for_table_row() with the same excluded
+ * columns. The plan is allocated in the current memory context, and should be rebuilt
+ * whenever the table schema changes. */
+encoding_plan *encoding_plan_for_row(TupleDesc tupdesc, encoding_options *options,
+        Bitmapset *excluded_columns) {
+    int field = 0, tuple_index = 0;
+    encoding_plan *plan = encoding_plan_new(tupdesc, natts_included(tupdesc, excluded_columns));
 
     for (int i = 0; i < tupdesc->natts; i++) {
-        avro_value_t field_val;
-        bool isnull;
-        Datum datum;
-
+        column_plan *column;
         Form_pg_attribute attr = tupdesc->attrs[i];
         if (attr->attisdropped) continue; /* skip dropped columns */
 
-        check(err, avro_value_get_by_index(output_val, field, &field_val, NULL));
+        /* Excluded columns are still present in tuples with dropped columns omitted */
+        if (!bms_is_member(i, excluded_columns)) {
+            column = &plan->columns[field];
+            column->rel_index = i;
+            column->tuple_index = tuple_index;
+            column_plan_init(column, attr, options);
+            field++;
+        }
+        tuple_index++;
+    }
+
+    return plan;
+}
 
-        datum = heap_getattr(tuple, i + 1, tupdesc, &isnull);
 
-        if (isnull) {
-            check(err, avro_value_set_branch(&field_val, 0, NULL));
-        } else {
-            check(err, update_avro_with_datum(&field_val, attr->atttypid, datum));
+/* Builds the plan for extracting the fields that constitute the primary key/replica
+ * identity from a row of a table, and encoding them into the Avro schema generated by
+ * schema_for_table_key(). tupdesc is the descriptor of the table, and index_rel is its
+ * key index. The plan is allocated in the current memory context. */
+encoding_plan *encoding_plan_for_key(TupleDesc tupdesc, Relation index_rel,
+        encoding_options *options) {
+    int2vector *indkey = &index_rel->rd_index->indkey;
+    encoding_plan *plan = encoding_plan_new(tupdesc, indkey->dim1);
+    encoding_options key_options = *options;
+
+    /* Key values are always encoded in full, since they identify the row */
+    key_options.unchanged_toast = UNCHANGED_TOAST_FETCH;
+
+    for (int field = 0; field < indkey->dim1; field++) {
+        column_plan *column = &plan->columns[field];
+        int attnum = indkey->values[field];
+        int tuple_index = 0;
+
+        if (attnum < 1 || attnum > tupdesc->natts || tupdesc->attrs[attnum - 1]->attisdropped) {
+            elog(ERROR, "index refers to non-existent attribute number %d", attnum - 1);
         }
 
-        field++;
+        for (int i = 0; i < attnum - 1; i++) {
+            if (!tupdesc->attrs[i]->attisdropped) tuple_index++;
+        }
+
+        column->rel_index = attnum - 1;
+        column->tuple_index = tuple_index;
+        column_plan_init(column, tupdesc->attrs[attnum - 1], &key_options);
     }
 
-    return err;
+    return plan;
 }
 
 
-/* Extracts the fields that constitute the primary key/replica identity from a tuple,
- * and translates them into an Avro value in the schema generated by
- * schema_for_table_key(). tupdesc describes the the format of the tuple (which may or
- * may not include dropped columns). rel is the table from which the tuple has come,
- * and key_index is the primary key/replica identity index we're using. */
-int tuple_to_avro_key(avro_value_t *output_val, TupleDesc tupdesc, HeapTuple tuple,
-        Relation rel, Form_pg_index key_index) {
+/* Allocates an encoding plan with space for num_columns columns, and scratch space
+ * for deforming tuples with the given descriptor. */
+encoding_plan *encoding_plan_new(TupleDesc tupdesc, int num_columns) {
+    encoding_plan *plan = palloc0(sizeof(encoding_plan));
+
+    plan->num_columns = num_columns;
+    plan->columns = palloc0(Max(num_columns, 1) * sizeof(column_plan));
+    plan->rel_natts = tupdesc->natts;
+    plan->tuple_natts = natts_excluding_dropped(tupdesc);
+    plan->values = palloc(Max(tupdesc->natts, 1) * sizeof(Datum));
+    plan->isnull = palloc(Max(tupdesc->natts, 1) * sizeof(bool));
+    plan->old_values = NULL; /* allocated on first use by tuple_changed_columns() */
+    plan->old_isnull = NULL;
+    return plan;
+}
+
+
+/* Returns the number of attributes in the tuple descriptor that are not dropped. */
+int natts_excluding_dropped(TupleDesc tupdesc) {
+    int natts = 0;
+    for (int i = 0; i < tupdesc->natts; i++) {
+        if (!tupdesc->attrs[i]->attisdropped) natts++;
+    }
+    return natts;
+}
+
+
+/* Returns the number of attributes in the tuple descriptor that are neither dropped
+ * nor in the set of excluded columns (which may be NULL). */
+int natts_included(TupleDesc tupdesc, Bitmapset *excluded_columns) {
+    int natts = 0;
+    for (int i = 0; i < tupdesc->natts; i++) {
+        if (column_is_included(tupdesc, i, excluded_columns)) natts++;
+    }
+    return natts;
+}
+
+
+/* Returns true if the attribute at the given index of the tuple descriptor is a column
+ * of the Avro record, i.e. it is neither dropped nor excluded. */
+bool column_is_included(TupleDesc tupdesc, int index, Bitmapset *excluded_columns) {
+    return !tupdesc->attrs[index]->attisdropped && !bms_is_member(index, excluded_columns);
+}
+
+
+/* Frees an encoding plan built by encoding_plan_for_row() or encoding_plan_for_key(). */
+void encoding_plan_free(encoding_plan *plan) {
+    pfree(plan->columns);
+    pfree(plan->values);
+    pfree(plan->isnull);
+    if (plan->old_values) pfree(plan->old_values);
+    if (plan->old_isnull) pfree(plan->old_isnull);
+    pfree(plan);
+}
+
+
+/* Chooses the encoder function for a column based on its type. This is the only place
+ * where we look at the type of a column, and the only place where the catalog is
+ * consulted (to find the output function of types that we encode as strings). */
+void column_plan_init(column_plan *column, Form_pg_attribute attr, encoding_options *options) {
+    Oid output_func;
+
+    column->typid = attr->atttypid;
+    column->own_union = false;
+    column->is_varlena = false;
+    column->toast_marker = column_has_toast_marker(attr, options);
+    column->scale = 0;
+
+    if (column_is_decimal(attr, options)) {
+        column->encode = encode_decimal;
+        column->scale = (attr->atttypmod - VARHDRSZ) & 0xffff;
+        return;
+    }
+
+    switch (attr->atttypid) {
+        case BOOLOID:        column->encode = encode_boolean;  break;
+        case FLOAT4OID:      column->encode = encode_float4;   break;
+        case FLOAT8OID:      column->encode = encode_float8;   break;
+        case INT2OID:        column->encode = encode_int2;     break;
+        case INT4OID:        column->encode = encode_int4;     break;
+        case INT8OID:        column->encode = encode_int8;     break;
+        case CASHOID:        column->encode = encode_cash;     break;
+        case OIDOID:
+        case REGPROCOID:     column->encode = encode_oid;      break;
+        case XIDOID:         column->encode = encode_xid;      break;
+        case CIDOID:         column->encode = encode_cid;      break;
+        case NUMERICOID:     column->encode = encode_numeric;  break;
+        case TIMEOID:        column->encode = encode_time;     break;
+        case TIMETZOID:      column->encode = encode_time_tz;  break;
+        case INTERVALOID:    column->encode = encode_interval; break;
+        case BYTEAOID:       column->encode = encode_bytea;    break;
+        case CHAROID:        column->encode = encode_char;     break;
+        case NAMEOID:        column->encode = encode_name;     break;
+        case TEXTOID:
+        case BPCHAROID:
+        case VARCHAROID:     column->encode = encode_text;     break;
+
+        /* Types that handle nullability themselves, unless they use logical types */
+        case DATEOID:
+            if (options->temporal_encoding == TEMPORAL_ENCODING_LOGICAL) {
+                column->encode = encode_date_days;
+            } else {
+                column->encode = encode_date;
+                column->own_union = true;
+            }
+            break;
+        case TIMESTAMPOID:
+        case TIMESTAMPTZOID:
+            if (options->temporal_encoding == TEMPORAL_ENCODING_LOGICAL) {
+                column->encode = encode_timestamp_micros;
+            } else {
+                column->encode = attr->atttypid == TIMESTAMPOID ?
+                    encode_timestamp : encode_timestamp_tz;
+                column->own_union = true;
+            }
+            break;
+
+        /* Any datatypes that we don't know are converted into their string representation */
+        default:
+            getTypeOutputInfo(attr->atttypid, &output_func, &column->is_varlena);
+            fmgr_info_cxt(output_func, &column->output_func, CurrentMemoryContext);
+            column->encode = encode_with_output_func;
+            break;
+    }
+}
+
+
+/* Translates a Postgres heap tuple into Avro binary encoding, following an encoding
+ * plan built by encoding_plan_for_row() or encoding_plan_for_key(), and appends it
+ * to a buffer.
+ *
+ * tupdesc describes the format of the tuple. During stream replication it is the
+ * table's descriptor, but during snapshot it is taken from the result set, which
+ * has dropped columns omitted; the number of attributes tells us which it is.
+ *
+ * unchanged_toast is true if the tuple is the new row of an update, in which logical
+ * decoding leaves TOASTed values that the update didn't change as pointers to the
+ * on-disk TOAST storage. If the column has a marker for such values in its schema,
+ * the marker is written instead of fetching the value.
+ *
+ * changed is either NULL, or a bitmap computed by tuple_changed_columns(), in which
+ * case only the columns whose bit is set are encoded, and all others are written as
+ * null (the "newRow" of an UpdateDelta message). */
+int tuple_to_avro(StringInfo out, encoding_plan *plan, TupleDesc tupdesc, HeapTuple tuple,
+        bool unchanged_toast, const bits8 *changed) {
     int err = 0;
-    TupleDesc rel_tupdesc = RelationGetDescr(rel);
-    check(err, avro_value_reset(output_val));
-
-    for (int field = 0; field < key_index->indkey.dim1; field++) {
-        Form_pg_attribute attr;
-        avro_value_t field_val;
-        bool isnull;
-        Datum datum;
-
-        int attnum = key_index->indkey.values[field] - 1;
-
-        // rel_tupdesc->attrs[attnum] is the indexed attribute. To figure out which
-        // attribute number in the tuple this corresponds to, we need to see if there
-        // are any columns that are dropped in rel_tupdesc but not in tupdesc.
-        int tup_i = 0;
-        for (int rel_i = 0; rel_i < attnum; rel_i++) {
-            if (!rel_tupdesc->attrs[rel_i]->attisdropped || tupdesc->attrs[tup_i]->attisdropped) tup_i++;
-        }
+    bool omits_dropped;
 
-        if (tup_i >= tupdesc->natts || tupdesc->attrs[tup_i]->attisdropped) {
-            elog(ERROR, "index refers to non-existent attribute number %d", attnum);
-        }
+    if (tupdesc->natts == plan->rel_natts) {
+        omits_dropped = false;
+    } else if (tupdesc->natts == plan->tuple_natts) {
+        omits_dropped = true;
+    } else {
+        elog(ERROR, "tuple has %d attributes, but encoding plan expects %d or %d",
+                tupdesc->natts, plan->rel_natts, plan->tuple_natts);
+    }
+
+    if (plan->num_columns == 0) {
+        /* The "dummy" field of a table without columns (see schema_for_table_row) */
+        write_avro_boolean(out, false);
+        return err;
+    }
 
-        attr = tupdesc->attrs[tup_i];
-        check(err, avro_value_get_by_index(output_val, field, &field_val, NULL));
+    heap_deform_tuple(tuple, tupdesc, plan->values, plan->isnull);
 
-        datum = heap_getattr(tuple, tup_i + 1, tupdesc, &isnull);
+    for (int i = 0; i < plan->num_columns; i++) {
+        column_plan *column = &plan->columns[i];
+        int tup_i = omits_dropped ? column->tuple_index : column->rel_index;
 
-        if (isnull) {
-            check(err, avro_value_set_branch(&field_val, 0, NULL));
+        if (plan->isnull[tup_i] || (changed && !(changed[i / 8] & (1 << (i % 8))))) {
+            write_avro_long(out, 0); /* null branch of the union */
+        } else if (unchanged_toast && column->toast_marker &&
+                VARATT_IS_EXTERNAL_ONDISK(DatumGetPointer(plan->values[tup_i]))) {
+            write_avro_long(out, 2); /* UnchangedToast branch of the union */
+            write_avro_long(out, 0); /* its only symbol, UNCHANGED */
+        } else if (column->own_union) {
+            check(err, column->encode(out, column, plan->values[tup_i]));
         } else {
-            check(err, update_avro_with_datum(&field_val, attr->atttypid, datum));
+            write_avro_long(out, 1); /* value branch of the union */
+            check(err, column->encode(out, column, plan->values[tup_i]));
         }
     }
 
-    return 0;
+    return err;
+}
+
+
+/* Compares the old and new tuples of an update, column by column, and sets bit i of
+ * changed (which must have room for (plan->num_columns + 7) / 8 bytes) if the update
+ * changed the value of the i-th column of the encoding plan. Values are compared by
+ * their binary representation, so a value that was rewritten with an equal but not
+ * identical representation counts as changed. A TOASTed value that logical decoding
+ * left as a pointer to the on-disk TOAST storage is unchanged by definition. Only
+ * used during stream replication, where tupdesc is the table's descriptor. */
+void tuple_changed_columns(encoding_plan *plan, TupleDesc tupdesc, HeapTuple oldtuple,
+        HeapTuple newtuple, bits8 *changed) {
+    if (tupdesc->natts != plan->rel_natts) {
+        elog(ERROR, "tuple has %d attributes, but encoding plan expects %d",
+                tupdesc->natts, plan->rel_natts);
+    }
+
+    if (!plan->old_values) {
+        plan->old_values = MemoryContextAlloc(GetMemoryChunkContext(plan),
+                Max(tupdesc->natts, 1) * sizeof(Datum));
+        plan->old_isnull = MemoryContextAlloc(GetMemoryChunkContext(plan),
+                Max(tupdesc->natts, 1) * sizeof(bool));
+    }
+
+    memset(changed, 0, (plan->num_columns + 7) / 8);
+    heap_deform_tuple(oldtuple, tupdesc, plan->old_values, plan->old_isnull);
+    heap_deform_tuple(newtuple, tupdesc, plan->values, plan->isnull);
+
+    for (int i = 0; i < plan->num_columns; i++) {
+        int tup_i = plan->columns[i].rel_index;
+        Form_pg_attribute attr = tupdesc->attrs[tup_i];
+        bool same;
+
+        if (plan->isnull[tup_i] || plan->old_isnull[tup_i]) {
+            same = plan->isnull[tup_i] && plan->old_isnull[tup_i];
+        } else if (attr->attlen == -1 &&
+                VARATT_IS_EXTERNAL_ONDISK(DatumGetPointer(plan->values[tup_i]))) {
+            same = true;
+        } else {
+            same = datumIsEqual(plan->old_values[tup_i], plan->values[tup_i],
+                    attr->attbyval, attr->attlen);
+        }
+
+        if (!same) changed[i / 8] |= 1 << (i % 8);
+    }
 }
 
 
-/* Generates an Avro schema that can be used to encode a Postgres type
- * with the given OID. */
-avro_schema_t schema_for_oid(predef_schema *predef, Oid typid) {
+/* Generates an Avro schema that can be used to encode values of a column
+ * with the given attributes (most importantly its type OID). */
+avro_schema_t schema_for_oid(predef_schema *predef, encoding_options *options, Form_pg_attribute attr) {
     avro_schema_t value_schema, null_schema, union_schema;
 
-    switch (typid) {
+    switch (attr->atttypid) {
         /* Numeric-like types */
         case BOOLOID:    /* boolean: 'true'/'false' */
             value_schema = avro_schema_boolean();
@@ -289,12 +665,16 @@ avro_schema_t schema_for_oid(predef_schema *predef, Oid typid) {
             value_schema = avro_schema_long();
             break;
         case NUMERICOID: /* numeric(p, s), decimal(p, s): arbitrary precision number */
-            value_schema = schema_for_numeric(predef);
+            value_schema = schema_for_numeric(predef, column_is_decimal(attr, options));
             break;
 
         /* Date/time types. We don't bother with abstime, reltime and tinterval (which are based
          * on Unix timestamps with 1-second resolution), as they are deprecated. */
         case DATEOID:        /* date: 32-bit signed integer, resolution of 1 day */
+            if (options->temporal_encoding == TEMPORAL_ENCODING_LOGICAL) {
+                value_schema = avro_schema_int(); /* date logical type */
+                break;
+            }
             return schema_for_date(predef);
         case TIMEOID:        /* time without time zone: microseconds since start of day */
             value_schema = avro_schema_long();
@@ -303,9 +683,12 @@ avro_schema_t schema_for_oid(predef_schema *predef, Oid typid) {
             value_schema = schema_for_time_tz(predef);
             break;
         case TIMESTAMPOID:   /* timestamp without time zone: datetime, microseconds since epoch */
-            return schema_for_timestamp(predef, false);
         case TIMESTAMPTZOID: /* timestamp with time zone, timestamptz: datetime with time zone */
-            return schema_for_timestamp(predef, true);
+            if (options->temporal_encoding == TEMPORAL_ENCODING_LOGICAL) {
+                value_schema = avro_schema_long(); /* timestamp-micros logical type */
+                break;
+            }
+            return schema_for_timestamp(predef, attr->atttypid == TIMESTAMPTZOID);
         case INTERVALOID:    /* @ <number> <units>, time interval */
             value_schema = schema_for_interval(predef);
             break;
@@ -358,102 +741,489 @@ avro_schema_t schema_for_oid(predef_schema *predef, Oid typid) {
     avro_schema_union_append(union_schema, value_schema);
     avro_schema_decref(null_schema);
     avro_schema_decref(value_schema);
+
+    if (column_has_toast_marker(attr, options)) {
+        value_schema = schema_for_unchanged_toast(predef);
+        avro_schema_union_append(union_schema, value_schema);
+        avro_schema_decref(value_schema);
+    }
     return union_schema;
 }
 
 
-/* Translates a Postgres datum into an Avro value. */
-int update_avro_with_datum(avro_value_t *output_val, Oid typid, Datum pg_datum) {
-    int err = 0;
-    avro_value_t branch_val;
+/* Returns true if values of a column may be TOASTed, and the options say that values
+ * which an update didn't change should be represented by a marker. Such columns have
+ * the UnchangedToast enum as a third branch of their union. */
+bool column_has_toast_marker(Form_pg_attribute attr, encoding_options *options) {
+    return options->unchanged_toast == UNCHANGED_TOAST_MARKER &&
+        attr->attlen == -1 && attr->attstorage != 'p'; /* varlena, storage not plain */
+}
+
+
+static int encode_boolean(StringInfo out, column_plan *column, Datum pg_datum) {
+    write_avro_boolean(out, DatumGetBool(pg_datum));
+    return 0;
+}
+
+static int encode_float4(StringInfo out, column_plan *column, Datum pg_datum) {
+    write_avro_float(out, DatumGetFloat4(pg_datum));
+    return 0;
+}
+
+static int encode_float8(StringInfo out, column_plan *column, Datum pg_datum) {
+    write_avro_double(out, DatumGetFloat8(pg_datum));
+    return 0;
+}
+
+static int encode_int2(StringInfo out, column_plan *column, Datum pg_datum) {
+    write_avro_long(out, DatumGetInt16(pg_datum));
+    return 0;
+}
+
+static int encode_int4(StringInfo out, column_plan *column, Datum pg_datum) {
+    write_avro_long(out, DatumGetInt32(pg_datum));
+    return 0;
+}
+
+static int encode_int8(StringInfo out, column_plan *column, Datum pg_datum) {
+    write_avro_long(out, DatumGetInt64(pg_datum));
+    return 0;
+}
+
+static int encode_cash(StringInfo out, column_plan *column, Datum pg_datum) {
+    write_avro_long(out, DatumGetCash(pg_datum));
+    return 0;
+}
+
+static int encode_oid(StringInfo out, column_plan *column, Datum pg_datum) {
+    write_avro_long(out, DatumGetObjectId(pg_datum));
+    return 0;
+}
+
+static int encode_xid(StringInfo out, column_plan *column, Datum pg_datum) {
+    write_avro_long(out, DatumGetTransactionId(pg_datum));
+    return 0;
+}
+
+static int encode_cid(StringInfo out, column_plan *column, Datum pg_datum) {
+    write_avro_long(out, DatumGetCommandId(pg_datum));
+    return 0;
+}
+
+/* Encodes a NUMERIC value as a double, which is the default (see schema_for_numeric). */
+static int encode_numeric(StringInfo out, column_plan *column, Datum pg_datum) {
+    write_avro_double(out, atof(numeric_normalize(DatumGetNumeric(pg_datum))));
+    return 0;
+}
+
+/* Encodes a NUMERIC value with the Avro decimal logical type, i.e. as the unscaled
+ * value (the value multiplied by 10^scale) in big-endian two's complement. The
+ * unscaled value is computed directly from the base-10000 digits of the internal
+ * representation, in 32-bit limbs (least significant first), so arbitrarily large
+ * values are supported and no intermediate string is needed. */
+static int encode_decimal(StringInfo out, column_plan *column, Datum pg_datum) {
+    Numeric num = DatumGetNumeric(pg_datum);
+    const char *data = VARDATA(num);
+    uint16 header = *((const uint16 *) data);
+    const int16 *digits;
+    int ndigits, weight, exponent, max_limbs, len = 0;
+    uint32 small_limbs[8], *limbs = small_limbs;
+    bool negative;
+
+    if ((header & NUMERIC_HDR_SIGN_MASK) == NUMERIC_HDR_NAN) {
+        avro_set_error("NaN cannot be encoded as an Avro decimal");
+        return EINVAL;
+    }
 
-    /* Types that handle nullability themselves */
-    if (typid == DATEOID || typid == TIMESTAMPOID || typid == TIMESTAMPTZOID) {
-        branch_val = *output_val;
+    if (header & NUMERIC_HDR_SHORT) {
+        negative = (header & NUMERIC_HDR_SHORT_SIGN_MASK) != 0;
+        weight = header & NUMERIC_HDR_SHORT_WEIGHT_MASK;
+        if (header & NUMERIC_HDR_SHORT_WEIGHT_SIGN_MASK) weight |= ~NUMERIC_HDR_SHORT_WEIGHT_MASK;
+        digits = (const int16 *) (data + sizeof(uint16));
     } else {
-        check(err, avro_value_set_branch(output_val, 1, &branch_val));
+        negative = (header & NUMERIC_HDR_SIGN_MASK) == NUMERIC_HDR_NEG;
+        weight = *((const int16 *) (data + sizeof(uint16)));
+        digits = (const int16 *) (data + 2 * sizeof(uint16));
     }
+    ndigits = (VARSIZE(num) - ((const char *) digits - (const char *) num)) / sizeof(int16);
 
-    switch (typid) {
-        case BOOLOID:
-            check(err, avro_value_set_boolean(&branch_val, DatumGetBool(pg_datum)));
-            break;
-        case FLOAT4OID:
-            check(err, avro_value_set_float(&branch_val, DatumGetFloat4(pg_datum)));
-            break;
-        case FLOAT8OID:
-            check(err, avro_value_set_double(&branch_val, DatumGetFloat8(pg_datum)));
-            break;
-        case INT2OID:
-            check(err, avro_value_set_int(&branch_val, DatumGetInt16(pg_datum)));
-            break;
-        case INT4OID:
-            check(err, avro_value_set_int(&branch_val, DatumGetInt32(pg_datum)));
-            break;
-        case INT8OID:
-            check(err, avro_value_set_long(&branch_val, DatumGetInt64(pg_datum)));
-            break;
-        case CASHOID:
-            check(err, avro_value_set_long(&branch_val, DatumGetCash(pg_datum)));
-            break;
-        case OIDOID:
-        case REGPROCOID:
-            check(err, avro_value_set_long(&branch_val, DatumGetObjectId(pg_datum)));
-            break;
-        case XIDOID:
-            check(err, avro_value_set_long(&branch_val, DatumGetTransactionId(pg_datum)));
-            break;
-        case CIDOID:
-            check(err, avro_value_set_long(&branch_val, DatumGetCommandId(pg_datum)));
-            break;
-        case NUMERICOID:
-            /* There is no implementation for Decimal type in apache/avro package for c language.
-             * We use logic for "double" type to avoid "0.0" values.
-             */
-            check(err, avro_value_set_double(&branch_val, atof(numeric_normalize(DatumGetNumeric(pg_datum)))));
-            break;
-        case DATEOID:
-            check(err, update_avro_with_date(output_val, DatumGetDateADT(pg_datum)));
-            break;
-        case TIMEOID:
-            check(err, avro_value_set_long(&branch_val, DatumGetTimeADT(pg_datum)));
-            break;
-        case TIMETZOID:
-            check(err, update_avro_with_time_tz(&branch_val, DatumGetTimeTzADTP(pg_datum)));
-            break;
-        case TIMESTAMPOID:
-            check(err, update_avro_with_timestamp(output_val, false, DatumGetTimestamp(pg_datum)));
-            break;
-        case TIMESTAMPTZOID:
-            check(err, update_avro_with_timestamp(output_val, true, DatumGetTimestampTz(pg_datum)));
-            break;
-        case INTERVALOID:
-            check(err, update_avro_with_interval(&branch_val, DatumGetIntervalP(pg_datum)));
-            break;
-        case BYTEAOID:
-            check(err, update_avro_with_bytes(&branch_val, DatumGetByteaP(pg_datum)));
-            break;
-        case CHAROID:
-            check(err, update_avro_with_char(&branch_val, DatumGetChar(pg_datum)));
-            break;
-        case NAMEOID:
-            check(err, avro_value_set_string(&branch_val, NameStr(*DatumGetName(pg_datum))));
-            break;
-        case TEXTOID:
-        case BPCHAROID:
-        case VARCHAROID:
-            check(err, avro_value_set_string(&branch_val, TextDatumGetCString(pg_datum)));
-            break;
-        default:
-            check(err, update_avro_with_string(&branch_val, typid, pg_datum));
-            break;
+    /* The digits, taken as an integer, need to be multiplied by 10^exponent to get the
+     * unscaled value. exponent is negative if the last digit extends beyond the scale. */
+    exponent = NUMERIC_DIGIT_DEC_DIGITS * (weight - ndigits + 1) + column->scale;
+
+    /* A 32-bit limb holds more than 9 decimal digits; leave space for one extra limb */
+    max_limbs = (NUMERIC_DIGIT_DEC_DIGITS * ndigits + Max(exponent, 0)) / 9 + 2;
+    if (max_limbs > lengthof(small_limbs)) {
+        limbs = palloc(max_limbs * sizeof(uint32));
     }
 
-    return err;
+    for (int i = 0; i < ndigits; i++) {
+        decimal_mul_add(limbs, &len, NUMERIC_DIGIT_BASE, digits[i]);
+    }
+
+    for (; exponent > 0; exponent -= Min(exponent, DECIMAL_MAX_POW10_STEP)) {
+        decimal_mul_add(limbs, &len, decimal_pow10[Min(exponent, DECIMAL_MAX_POW10_STEP)], 0);
+    }
+    for (; exponent < 0; exponent += Min(-exponent, DECIMAL_MAX_POW10_STEP)) {
+        if (decimal_div(limbs, &len, decimal_pow10[Min(-exponent, DECIMAL_MAX_POW10_STEP)]) != 0) {
+            avro_set_error("Numeric value has more than %d digits after the decimal point", column->scale);
+            return EINVAL;
+        }
+    }
+
+    write_decimal_bytes(out, limbs, len, negative);
+    if (limbs != small_limbs) pfree(limbs);
+    return 0;
 }
 
-avro_schema_t schema_for_numeric(predef_schema *predef) {
-    return avro_schema_double(); /* FIXME use decimal logical type: http://avro.apache.org/docs/1.7.7/spec.html#Decimal */
+/* Multiplies a number, given as len limbs (least significant first), by mul and adds
+ * add to it. There must be space for one more limb beyond len. */
+void decimal_mul_add(uint32 *limbs, int *len, uint32 mul, uint32 add) {
+    uint64 carry = add;
+
+    for (int i = 0; i < *len; i++) {
+        uint64 product = (uint64) limbs[i] * mul + carry;
+        limbs[i] = (uint32) product;
+        carry = product >> 32;
+    }
+    if (carry) limbs[(*len)++] = (uint32) carry;
+}
+
+/* Divides a number, given as len limbs (least significant first), by divisor.
+ * Returns the remainder. */
+uint32 decimal_div(uint32 *limbs, int *len, uint32 divisor) {
+    uint64 remainder = 0;
+
+    for (int i = *len - 1; i >= 0; i--) {
+        uint64 dividend = (remainder << 32) | limbs[i];
+        limbs[i] = (uint32) (dividend / divisor);
+        remainder = dividend % divisor;
+    }
+    while (*len > 0 && limbs[*len - 1] == 0) (*len)--;
+    return (uint32) remainder;
+}
+
+/* Writes a number, given as its magnitude in len limbs (least significant first) and
+ * its sign, as an Avro bytes value containing its two's complement representation in
+ * big-endian byte order, using as few bytes as possible. Overwrites the limbs. */
+void write_decimal_bytes(StringInfo out, uint32 *limbs, int len, bool negative) {
+    char small_bytes[33], *bytes = small_bytes;
+    int num_bytes = 0, skip = 0;
+    uint32 carry = 1;
+    char sign_byte;
+
+    if (4 * len + 1 > sizeof(small_bytes)) {
+        bytes = palloc(4 * len + 1);
+    }
+
+    if (len == 0) negative = false;
+    sign_byte = negative ? 0xff : 0x00;
+
+    if (negative) {
+        /* Two's complement: invert and add one */
+        for (int i = 0; i < len; i++) {
+            limbs[i] = ~limbs[i] + carry;
+            carry = carry && limbs[i] == 0;
+        }
+    }
+
+    bytes[num_bytes++] = sign_byte;
+    for (int i = len - 1; i >= 0; i--) {
+        bytes[num_bytes++] = (char) (limbs[i] >> 24);
+        bytes[num_bytes++] = (char) (limbs[i] >> 16);
+        bytes[num_bytes++] = (char) (limbs[i] >> 8);
+        bytes[num_bytes++] = (char) limbs[i];
+    }
+
+    /* Drop leading bytes that only repeat the sign */
+    while (num_bytes - skip > 1 && bytes[skip] == sign_byte &&
+            (bytes[skip + 1] & 0x80) == (sign_byte & 0x80)) {
+        skip++;
+    }
+
+    write_avro_bytes(out, bytes + skip, num_bytes - skip);
+    if (bytes != small_bytes) pfree(bytes);
+}
+
+static int encode_date(StringInfo out, column_plan *column, Datum pg_datum) {
+    DateADT date = DatumGetDateADT(pg_datum);
+    int year, month, day;
+
+    if (DATE_NOT_FINITE(date)) {
+        return write_special_time(out, DATE_IS_NOBEGIN(date));
+    }
+
+    j2date(date + POSTGRES_EPOCH_JDATE, &year, &month, &day);
+    write_avro_long(out, 1); /* Date branch of the union */
+    write_avro_long(out, year);
+    write_avro_long(out, month);
+    write_avro_long(out, day);
+    return 0;
+}
+
+static int encode_time(StringInfo out, column_plan *column, Datum pg_datum) {
+    write_avro_long(out, DatumGetTimeADT(pg_datum));
+    return 0;
+}
+
+static int encode_time_tz(StringInfo out, column_plan *column, Datum pg_datum) {
+    TimeTzADT *time = DatumGetTimeTzADTP(pg_datum);
+    write_avro_long(out, time->time);
+    /* Negate the timezone offset because PG internally uses negative values for locations
+     * east of GMT, but ISO 8601 does it the other way round. */
+    write_avro_long(out, -time->zone);
+    return 0;
+}
+
+static int encode_timestamp(StringInfo out, column_plan *column, Datum pg_datum) {
+    return write_timestamp(out, false, DatumGetTimestamp(pg_datum));
+}
+
+static int encode_timestamp_tz(StringInfo out, column_plan *column, Datum pg_datum) {
+    return write_timestamp(out, true, DatumGetTimestampTz(pg_datum));
+}
+
+/* Encodes a date as the number of days since 1970-01-01 (Avro date logical type). The
+ * infinities are encoded as the smallest and largest int, like Postgres does internally;
+ * finite dates are never that far from the epoch. */
+static int encode_date_days(StringInfo out, column_plan *column, Datum pg_datum) {
+    DateADT date = DatumGetDateADT(pg_datum);
+
+    if (DATE_NOT_FINITE(date)) {
+        write_avro_long(out, date); /* DATEVAL_NOBEGIN or DATEVAL_NOEND */
+    } else {
+        write_avro_long(out, (int64) date + (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE));
+    }
+    return 0;
+}
+
+/* Encodes a timestamp as the number of microseconds since 1970-01-01 00:00:00 UTC (Avro
+ * timestamp-micros logical type), for both timestamp and timestamp with time zone; no
+ * time zone conversion takes place. The infinities are encoded as the smallest and
+ * largest long, like Postgres does internally. */
+static int encode_timestamp_micros(StringInfo out, column_plan *column, Datum pg_datum) {
+    const int64 epoch_offset = (int64) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * USECS_PER_DAY;
+    Timestamp timestamp = DatumGetTimestamp(pg_datum);
+
+    if (TIMESTAMP_NOT_FINITE(timestamp)) {
+        write_avro_long(out, timestamp); /* DT_NOBEGIN or DT_NOEND */
+        return 0;
+    }
+
+    if (timestamp > DT_NOEND - epoch_offset) {
+        ereport(ERROR,
+                (errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+                 errmsg("timestamp out of range")));
+        return 1;
+    }
+
+    write_avro_long(out, timestamp + epoch_offset);
+    return 0;
+}
+
+static int encode_interval(StringInfo out, column_plan *column, Datum pg_datum) {
+    struct pg_tm decoded;
+    fsec_t fsec;
+
+    interval2tm(*DatumGetIntervalP(pg_datum), &decoded, &fsec);
+    write_avro_long(out, decoded.tm_year);
+    write_avro_long(out, decoded.tm_mon);
+    write_avro_long(out, decoded.tm_mday);
+    write_avro_long(out, decoded.tm_hour);
+    write_avro_long(out, decoded.tm_min);
+    write_avro_long(out, decoded.tm_sec);
+    write_avro_long(out, fsec);
+    return 0;
+}
+
+static int encode_bytea(StringInfo out, column_plan *column, Datum pg_datum) {
+    bytea *bytes = DatumGetByteaPP(pg_datum);
+    write_avro_bytes(out, VARDATA_ANY(bytes), VARSIZE_ANY_EXHDR(bytes));
+    return 0;
+}
+
+static int encode_char(StringInfo out, column_plan *column, Datum pg_datum) {
+    char c = DatumGetChar(pg_datum);
+    write_avro_bytes(out, &c, c == '\0' ? 0 : 1);
+    return 0;
+}
+
+static int encode_name(StringInfo out, column_plan *column, Datum pg_datum) {
+    write_avro_string(out, NameStr(*DatumGetName(pg_datum)));
+    return 0;
+}
+
+static int encode_text(StringInfo out, column_plan *column, Datum pg_datum) {
+    text *str = DatumGetTextPP(pg_datum);
+    write_avro_bytes(out, VARDATA_ANY(str), VARSIZE_ANY_EXHDR(str));
+    return 0;
+}
+
+/* For any datatypes that we don't know, this function converts them into a string
+ * representation (which is always required by a datatype), using the output function
+ * that was looked up when the encoding plan was built. */
+static int encode_with_output_func(StringInfo out, column_plan *column, Datum pg_datum) {
+    char *str;
+
+    if (column->is_varlena) {
+        pg_datum = PointerGetDatum(PG_DETOAST_DATUM(pg_datum));
+    }
+
+    str = OutputFunctionCall(&column->output_func, pg_datum);
+    write_avro_string(out, str);
+    pfree(str);
+    return 0;
+}
+
+/* NUMERIC is either encoded as a double, or as bytes with the decimal logical type:
+ * http://avro.apache.org/docs/1.8.0/spec.html#Decimal
+ * avro-c doesn't support logical types, so the logicalType, precision and scale
+ * attributes are added to the JSON of the schema by schema_json_add_logical_types(). */
+avro_schema_t schema_for_numeric(predef_schema *predef, bool as_decimal) {
+    if (as_decimal) {
+        return avro_schema_bytes();
+    } else {
+        return avro_schema_double();
+    }
+}
+
+/* Returns true if values of the given column should be encoded as Avro decimals. This
+ * requires the column type to specify the precision and scale, since a decimal schema
+ * has a fixed scale; plain NUMERIC columns are encoded as doubles. */
+bool column_is_decimal(Form_pg_attribute attr, encoding_options *options) {
+    return attr->atttypid == NUMERICOID &&
+        options->numeric_encoding == NUMERIC_ENCODING_DECIMAL &&
+        attr->atttypmod >= (int32) VARHDRSZ;
+}
+
+/* If values of the given column are encoded with an Avro logical type, returns the name
+ * of the underlying primitive type, and appends the attributes of the logical type (in
+ * JSON) to attributes, unless it is NULL. Returns NULL if there is no logical type. */
+const char *column_logical_type(Form_pg_attribute attr, encoding_options *options,
+        StringInfo attributes) {
+    const char *type_name = NULL, *logical_type = NULL;
+
+    if (column_is_decimal(attr, options)) {
+        if (attributes) {
+            appendStringInfo(attributes,
+                    "\"logicalType\":\"decimal\",\"precision\":%d,\"scale\":%d",
+                    ((attr->atttypmod - VARHDRSZ) >> 16) & 0xffff,
+                    (attr->atttypmod - VARHDRSZ) & 0xffff);
+        }
+        return "bytes";
+    }
+
+    if (options->temporal_encoding == TEMPORAL_ENCODING_LOGICAL) {
+        switch (attr->atttypid) {
+            case DATEOID:
+                type_name = "int";
+                logical_type = "date";
+                break;
+            case TIMEOID:
+                type_name = "long";
+                logical_type = "time-micros";
+                break;
+            case TIMESTAMPOID:
+            case TIMESTAMPTZOID:
+                type_name = "long";
+                logical_type = "timestamp-micros";
+                break;
+        }
+    }
+
+    if (type_name && attributes) {
+        appendStringInfo(attributes, "\"logicalType\":\"%s\"", logical_type);
+    }
+    return type_name;
+}
+
+/* Adds the logical type attributes of columns (see column_logical_type) to the JSON of
+ * a table schema generated by avro-c, which describes them as plain primitive types.
+ * json contains the JSON from offset start onwards, and tupdesc and excluded_columns
+ * are those of the table (or key index) from which the schema was generated.
+ *
+ * The JSON is a record whose fields array contains one object per column (except
+ * dropped and excluded columns), so the fields are found by tracking the nesting depth. In the field
+ * of a column with a logical type, the primitive type name is replaced with a type
+ * object, or extended if it is already in a type object. */
+void schema_json_add_logical_types(StringInfo json, int start, TupleDesc tupdesc,
+        Bitmapset *excluded_columns, encoding_options *options) {
+    StringInfoData annotated, attributes;
+    const char *type_name = NULL;
+    int depth = 0, attnum = -1, pos, token_start, token_len;
+    bool has_logical_type = false;
+
+    for (int i = 0; i < tupdesc->natts; i++) {
+        if (column_is_included(tupdesc, i, excluded_columns) &&
+                column_logical_type(tupdesc->attrs[i], options, NULL)) {
+            has_logical_type = true;
+        }
+    }
+    if (!has_logical_type) return;
+
+    initStringInfo(&annotated);
+    initStringInfo(&attributes);
+
+    for (pos = start; pos < json->len; pos++) {
+        char c = json->data[pos];
+
+        if (c == '{' || c == '[') {
+            depth++;
+            if (depth == 3) {
+                /* Start of a field of the record: find the corresponding column */
+                do {
+                    attnum++;
+                } while (attnum < tupdesc->natts &&
+                        !column_is_included(tupdesc, attnum, excluded_columns));
+
+                resetStringInfo(&attributes);
+                type_name = NULL;
+                if (attnum < tupdesc->natts) {
+                    type_name = column_logical_type(tupdesc->attrs[attnum], options, &attributes);
+                }
+            }
+        } else if (c == '}' || c == ']') {
+            depth--;
+        } else if (c == '"') {
+            token_start = pos;
+            for (pos++; pos < json->len && json->data[pos] != '"'; pos++) {
+                if (json->data[pos] == '\\') pos++;
+            }
+            token_len = pos + 1 - token_start;
+
+            /* A type name is a string value (not an object key), and is not the value
+             * of a "name" attribute (the column might be called "int", for example) */
+            if (type_name && token_len == (int) strlen(type_name) + 2 &&
+                    strncmp(json->data + token_start + 1, type_name, token_len - 2) == 0 &&
+                    json->data[pos + 1] != ':' &&
+                    !string_info_ends_with(&annotated, "\"name\":")) {
+                /* The type name is either on its own, or already inside {"type":...} */
+                bool in_object = string_info_ends_with(&annotated, "{\"type\":");
+
+                appendStringInfo(&annotated, "%s\"%s\",%s%s",
+                        in_object ? "" : "{\"type\":", type_name, attributes.data,
+                        in_object ? "" : "}");
+                type_name = NULL;
+                continue;
+            }
+
+            appendBinaryStringInfo(&annotated, json->data + token_start, token_len);
+            continue;
+        }
+
+        appendStringInfoChar(&annotated, c);
+    }
+
+    json->len = start;
+    appendBinaryStringInfo(json, annotated.data, annotated.len);
+    pfree(annotated.data);
+    pfree(attributes.data);
+}
+
+/* Returns true if the contents of buf end with the given string. */
+bool string_info_ends_with(StringInfo buf, const char *suffix) {
+    int len = strlen(suffix);
+    return buf->len >= len && strncmp(buf->data + buf->len - len, suffix, len) == 0;
 }
 
 avro_schema_t schema_for_special_times(predef_schema *predef, avro_schema_t record_schema) {
@@ -481,6 +1251,16 @@ avro_schema_t schema_for_special_times(predef_schema *predef, avro_schema_t reco
     return union_schema;
 }
 
+avro_schema_t schema_for_unchanged_toast(predef_schema *predef) {
+    if (predef->unchanged_toast_schema) {
+        return avro_schema_link(predef->unchanged_toast_schema);
+    } else {
+        predef->unchanged_toast_schema = avro_schema_enum("UnchangedToast"); // TODO needs namespace
+        avro_schema_enum_symbol_append(predef->unchanged_toast_schema, "UNCHANGED");
+        return predef->unchanged_toast_schema;
+    }
+}
+
 void schema_for_date_fields(avro_schema_t record_schema) {
     avro_schema_t column_schema = avro_schema_int();
     avro_schema_record_field_append(record_schema, "year", column_schema);
@@ -523,30 +1303,12 @@ avro_schema_t schema_for_date(predef_schema *predef) {
     }
 }
 
-int update_avro_with_date(avro_value_t *union_val, DateADT date) {
-    int err = 0;
-    int year, month, day;
-    avro_value_t enum_val, record_val, year_val, month_val, day_val;
-
-    if (DATE_NOT_FINITE(date)) {
-        check(err, avro_value_set_branch(union_val, 2, &enum_val));
-        if (DATE_IS_NOBEGIN(date)) {
-            avro_value_set_enum(&enum_val, 1);
-        } else {
-            avro_value_set_enum(&enum_val, 0);
-        }
-    } else {
-        j2date(date + POSTGRES_EPOCH_JDATE, &year, &month, &day);
-
-        check(err, avro_value_set_branch(union_val, 1, &record_val));
-        check(err, avro_value_get_by_index(&record_val, 0, &year_val,  NULL));
-        check(err, avro_value_get_by_index(&record_val, 1, &month_val, NULL));
-        check(err, avro_value_get_by_index(&record_val, 2, &day_val,   NULL));
-        check(err, avro_value_set_int(&year_val,  year));
-        check(err, avro_value_set_int(&month_val, month));
-        check(err, avro_value_set_int(&day_val,   day));
-    }
-    return err;
+/* Writes the union branch for +infinity or -infinity of a date or timestamp, which
+ * are encoded as the SpecialTime enum (see schema_for_special_times). */
+int write_special_time(StringInfo out, bool is_nobegin) {
+    write_avro_long(out, 2); /* SpecialTime branch of the union */
+    write_avro_long(out, is_nobegin ? 1 : 0); /* NEG_INFINITY : POS_INFINITY */
+    return 0;
 }
 
 avro_schema_t schema_for_time_tz(predef_schema *predef) {
@@ -573,20 +1335,6 @@ avro_schema_t schema_for_time_tz(predef_schema *predef) {
     return record_schema;
 }
 
-int update_avro_with_time_tz(avro_value_t *record_val, TimeTzADT *time) {
-    int err = 0;
-    avro_value_t micro_val, zone_val;
-
-    check(err, avro_value_get_by_index(record_val, 0, &micro_val, NULL));
-    check(err, avro_value_get_by_index(record_val, 1, &zone_val,  NULL));
-    check(err, avro_value_set_long(&micro_val, time->time));
-    /* Negate the timezone offset because PG internally uses negative values for locations
-     * east of GMT, but ISO 8601 does it the other way round. */
-    check(err, avro_value_set_int(&zone_val, -time->zone));
-
-    return err;
-}
-
 /* Should a date/time value be represented using a record (year, month, day, hours, minutes,
  * seconds and microseconds), or a ISO8601 string, or a timestamp (number of microseconds
  * since epoch)? Depends how the data is going to be consumed -- the formats ought to be
@@ -643,21 +1391,13 @@ avro_schema_t schema_for_timestamp(predef_schema *predef, bool with_tz) {
     return schema_for_special_times(predef, record_schema);
 }
 
-int update_avro_with_timestamp(avro_value_t *union_val, bool with_tz, Timestamp timestamp) {
+int write_timestamp(StringInfo out, bool with_tz, Timestamp timestamp) {
     int err = 0, tz_offset;
-    avro_value_t enum_val, record_val, year_val, month_val, day_val, hour_val,
-                 minute_val, second_val, micro_val, zone_val;
     struct pg_tm decoded;
     fsec_t fsec;
 
     if (TIMESTAMP_NOT_FINITE(timestamp)) {
-        check(err, avro_value_set_branch(union_val, 2, &enum_val));
-        if (TIMESTAMP_IS_NOBEGIN(timestamp)) {
-            check(err, avro_value_set_enum(&enum_val, 1));
-        } else {
-            check(err, avro_value_set_enum(&enum_val, 0));
-        }
-        return err;
+        return write_special_time(out, TIMESTAMP_IS_NOBEGIN(timestamp));
     }
 
     // Postgres timestamp is microseconds since 2000-01-01. You can convert it to the
@@ -675,27 +1415,19 @@ int update_avro_with_timestamp(avro_value_t *union_val, bool with_tz, Timestamp
         return 1;
     }
 
-    check(err, avro_value_set_branch(union_val, 1, &record_val));
-    check(err, avro_value_get_by_index(&record_val, 0, &year_val,   NULL));
-    check(err, avro_value_get_by_index(&record_val, 1, &month_val,  NULL));
-    check(err, avro_value_get_by_index(&record_val, 2, &day_val,    NULL));
-    check(err, avro_value_get_by_index(&record_val, 3, &hour_val,   NULL));
-    check(err, avro_value_get_by_index(&record_val, 4, &minute_val, NULL));
-    check(err, avro_value_get_by_index(&record_val, 5, &second_val, NULL));
-    check(err, avro_value_get_by_index(&record_val, 6, &micro_val,  NULL));
-    check(err, avro_value_set_int(&year_val,   decoded.tm_year));
-    check(err, avro_value_set_int(&month_val,  decoded.tm_mon));
-    check(err, avro_value_set_int(&day_val,    decoded.tm_mday));
-    check(err, avro_value_set_int(&hour_val,   decoded.tm_hour));
-    check(err, avro_value_set_int(&minute_val, decoded.tm_min));
-    check(err, avro_value_set_int(&second_val, decoded.tm_sec));
-    check(err, avro_value_set_int(&micro_val,  fsec));
+    write_avro_long(out, 1); /* DateTime or DateTimeTZ branch of the union */
+    write_avro_long(out, decoded.tm_year);
+    write_avro_long(out, decoded.tm_mon);
+    write_avro_long(out, decoded.tm_mday);
+    write_avro_long(out, decoded.tm_hour);
+    write_avro_long(out, decoded.tm_min);
+    write_avro_long(out, decoded.tm_sec);
+    write_avro_long(out, fsec);
 
     if (with_tz) {
-        check(err, avro_value_get_by_index(&record_val, 7, &zone_val, NULL));
         /* Negate the timezone offset because PG internally uses negative values for
          * locations east of GMT, but ISO 8601 does it the other way round. */
-        check(err, avro_value_set_int(&zone_val, -tz_offset));
+        write_avro_long(out, -tz_offset);
     }
     return err;
 }
@@ -711,65 +1443,6 @@ avro_schema_t schema_for_interval(predef_schema *predef) {
     }
 }
 
-int update_avro_with_interval(avro_value_t *record_val, Interval *interval) {
-    int err = 0;
-    avro_value_t year_val, month_val, day_val, hour_val, minute_val, second_val, micro_val;
-    struct pg_tm decoded;
-    fsec_t fsec;
-
-    interval2tm(*interval, &decoded, &fsec);
-    check(err, avro_value_get_by_index(record_val, 0, &year_val,   NULL));
-    check(err, avro_value_get_by_index(record_val, 1, &month_val,  NULL));
-    check(err, avro_value_get_by_index(record_val, 2, &day_val,    NULL));
-    check(err, avro_value_get_by_index(record_val, 3, &hour_val,   NULL));
-    check(err, avro_value_get_by_index(record_val, 4, &minute_val, NULL));
-    check(err, avro_value_get_by_index(record_val, 5, &second_val, NULL));
-    check(err, avro_value_get_by_index(record_val, 6, &micro_val,  NULL));
-    check(err, avro_value_set_int(&year_val,   decoded.tm_year));
-    check(err, avro_value_set_int(&month_val,  decoded.tm_mon));
-    check(err, avro_value_set_int(&day_val,    decoded.tm_mday));
-    check(err, avro_value_set_int(&hour_val,   decoded.tm_hour));
-    check(err, avro_value_set_int(&minute_val, decoded.tm_min));
-    check(err, avro_value_set_int(&second_val, decoded.tm_sec));
-    check(err, avro_value_set_int(&micro_val,  fsec));
-
-    return err;
-}
-
-int update_avro_with_bytes(avro_value_t *output_val, bytea *bytes) {
-    return avro_value_set_bytes(output_val, VARDATA(bytes), VARSIZE(bytes) - VARHDRSZ);
-}
-
-int update_avro_with_char(avro_value_t *output_val, char c) {
-    char str[2];
-    str[0] = c;
-    str[1] = '\0';
-    return avro_value_set_string(output_val, str);
-}
-
-/* For any datatypes that we don't know, this function converts them into a string
- * representation (which is always required by a datatype). */
-int update_avro_with_string(avro_value_t *output_val, Oid typid, Datum pg_datum) {
-    int err = 0;
-    Oid output_func;
-    bool is_varlena;
-    char *str;
-
-    getTypeOutputInfo(typid, &output_func, &is_varlena);
-    if (is_varlena) {
-        pg_datum = PointerGetDatum(PG_DETOAST_DATUM(pg_datum));
-    }
-
-    /* This looks up the output function by OID on every call. Might be a bit faster
-     * to do cache the output function info (like how printtup() does it). */
-    str = OidOutputFunctionCall(output_func, pg_datum);
-    err = avro_value_set_string(output_val, str);
-    pfree(str);
-
-    return err;
-}
-
-
 /* Sanitises the `raw` string to be a valid Avro identifier using an encoding
  * similar to the "percent encoding" used in URLs.  Unsupported characters are
  * replaced by a hexadecimal representation:
@@ -3,17 +3,116 @@
 
 #include "avro.h"
 #include "postgres.h"
+#include "fmgr.h"
 #include "access/htup.h"
+#include "lib/stringinfo.h"
+#include "nodes/bitmapset.h"
 #include "utils/rel.h"
 
 #define GENERATED_SCHEMA_NAMESPACE "com.martinkl.bottledwater.dbschema"
 #define PREDEFINED_SCHEMA_NAMESPACE "com.martinkl.bottledwater.datatypes"
 
+/* How NUMERIC columns are represented in Avro */
+typedef enum {
+    NUMERIC_ENCODING_UNDEFINED = 0,
+    NUMERIC_ENCODING_DOUBLE,   /* as a double (may lose precision) */
+    NUMERIC_ENCODING_DECIMAL   /* as bytes with the decimal logical type */
+} numeric_encoding_t;
+
+/* How date, time and timestamp columns are represented in Avro */
+typedef enum {
+    TEMPORAL_ENCODING_UNDEFINED = 0,
+    TEMPORAL_ENCODING_RECORD,  /* as records of calendar fields */
+    TEMPORAL_ENCODING_LOGICAL  /* as ints or longs with Avro logical types */
+} temporal_encoding_t;
+
+/* How TOASTed values that an update didn't change are represented in the new row */
+typedef enum {
+    UNCHANGED_TOAST_UNDEFINED = 0,
+    UNCHANGED_TOAST_FETCH,     /* by fetching the value from TOAST storage */
+    UNCHANGED_TOAST_MARKER     /* by the UnchangedToast union branch */
+} unchanged_toast_t;
+
+/* How updates are sent when the old row is known */
+typedef enum {
+    UPDATE_FORMAT_UNDEFINED = 0,
+    UPDATE_FORMAT_FULL,        /* as the complete new row */
+    UPDATE_FORMAT_DELTA        /* as the changed columns of the new row */
+} update_format_t;
+
+/* Whether updates and deletes carry the old row */
+typedef enum {
+    OLD_ROW_UNDEFINED = 0,
+    OLD_ROW_INCLUDE,           /* if it is known */
+    OLD_ROW_OMIT               /* never; only the key is sent */
+} old_row_t;
+
+/* Whether table schemas are sent with a fingerprint */
+typedef enum {
+    SCHEMA_FINGERPRINT_UNDEFINED = 0,
+    SCHEMA_FINGERPRINT_OMIT,   /* as TableSchema messages */
+    SCHEMA_FINGERPRINT_INCLUDE /* as FingerprintedSchema messages */
+} schema_fingerprint_t;
+
+/* Options that determine how Postgres values are mapped to Avro. They affect both the
+ * generated schemas and the encoding of rows, so the snapshot and the replication
+ * stream must use the same options. */
+typedef struct {
+    numeric_encoding_t numeric_encoding;
+    temporal_encoding_t temporal_encoding;
+    unchanged_toast_t unchanged_toast;
+    update_format_t update_format; /* Only affects stream replication */
+    old_row_t old_row;             /* Only affects stream replication */
+    schema_fingerprint_t schema_fingerprint;
+} encoding_options;
+
+struct column_plan;
+
+/* Appends a non-null datum of a particular column to a buffer in Avro binary encoding. */
+typedef int (*column_encoder)(StringInfo out, struct column_plan *column, Datum pg_datum);
+
+/* Describes how to encode one column of a table or key. Built once per table schema,
+ * so that encoding a row doesn't need to look anything up in the catalog. */
+typedef struct column_plan {
+    int            rel_index;   /* Index of the column in the table's tuple descriptor */
+    int            tuple_index; /* Index of the column in a tuple with dropped columns omitted */
+    Oid            typid;       /* Postgres type of the column */
+    column_encoder encode;      /* Function that converts a datum of this column into Avro */
+    bool           own_union;   /* True if encode writes the union branch index itself, false
+                                   if the non-null branch is written before calling it */
+    bool           is_varlena;  /* True if datums must be detoasted before calling output_func */
+    bool           toast_marker; /* True if the schema has a union branch for unchanged TOASTed values */
+    int            scale;       /* Number of digits after the decimal point, for decimals */
+    FmgrInfo       output_func; /* Type output function, for types that are encoded as strings */
+} column_plan;
+
+typedef struct {
+    int          num_columns; /* Number of columns to encode (one per Avro record field, in order) */
+    column_plan *columns;     /* Encoding plan for each column */
+    int          rel_natts;   /* Number of attributes in the table, including dropped columns */
+    int          tuple_natts; /* Number of attributes in the table, excluding dropped columns */
+    Datum       *values;      /* Scratch space for deforming a tuple (rel_natts entries) */
+    bool        *isnull;      /* Scratch space for deforming a tuple (rel_natts entries) */
+    Datum       *old_values;  /* Scratch space for deforming the old tuple of an update */
+    bool        *old_isnull;  /* Scratch space for deforming the old tuple of an update */
+} encoding_plan;
+
+void encoding_options_init(encoding_options *options);
+bool encoding_options_parse(encoding_options *options, const char *name, const char *value);
 Relation table_key_index(Relation rel);
-int schema_for_table_key(Relation rel, avro_schema_t *schema_out);
-int schema_for_table_row(Relation rel, avro_schema_t *schema_out);
-int tuple_to_avro_row(avro_value_t *output_val, TupleDesc tupdesc, HeapTuple tuple);
-int tuple_to_avro_key(avro_value_t *output_val, TupleDesc tupdesc, HeapTuple tuple,
-        Relation rel, Form_pg_index key_index);
+int schema_for_table_key(Relation rel, encoding_options *options, avro_schema_t *schema_out);
+int schema_for_table_row(Relation rel, encoding_options *options, Bitmapset *excluded_columns,
+        avro_schema_t *schema_out);
+void schema_json_add_logical_types(StringInfo json, int start, TupleDesc tupdesc,
+        Bitmapset *excluded_columns, encoding_options *options);
+encoding_plan *encoding_plan_for_row(TupleDesc tupdesc, encoding_options *options,
+        Bitmapset *excluded_columns);
+encoding_plan *encoding_plan_for_key(TupleDesc tupdesc, Relation index_rel,
+        encoding_options *options);
+void encoding_plan_free(encoding_plan *plan);
+int tuple_to_avro(StringInfo out, encoding_plan *plan, TupleDesc tupdesc, HeapTuple tuple,
+        bool unchanged_toast, const bits8 *changed);
+void tuple_changed_columns(encoding_plan *plan, TupleDesc tupdesc, HeapTuple oldtuple,
+        HeapTuple newtuple, bits8 *changed);
 
 #endif /* OID2AVRO_H */
@@ -0,0 +1,145 @@
+/* Optional profiling of the output plugin's hot path. When the profile_interval option
+ * is set, the time taken by each phase of converting a change is recorded in a
+ * histogram per table, and the histograms are written to the server log every
+ * profile_interval milliseconds. This shows which phase is responsible when a
+ * walsender is using a lot of CPU, without needing to attach a profiler. */
+
+#include "profile.h"
+#include "lib/stringinfo.h"
+
+static const char *phase_names[PROFILE_NUM_PHASES] = {
+    "schema lookup", "key encoding", "row encoding", "frame writing"
+};
+
+void profile_histogram_add(profile_histogram *hist, uint64 duration_us);
+uint64 profile_histogram_percentile(profile_histogram *hist, double fraction);
+void profile_histogram_report(profile_histogram *hist, const char *slot_name, Oid relid,
+        profile_phase phase);
+
+
+/* Creates an empty profiler, allocated in the given memory context. */
+profiler *profiler_new(MemoryContext context, int report_interval) {
+    HASHCTL hash_ctl;
+    profiler *prof = MemoryContextAllocZero(context, sizeof(profiler));
+
+    prof->report_interval = report_interval;
+    prof->last_report = GetCurrentTimestamp();
+
+    memset(&hash_ctl, 0, sizeof(hash_ctl));
+    hash_ctl.keysize = sizeof(Oid);
+    hash_ctl.entrysize = sizeof(profile_entry);
+    hash_ctl.hcxt = context;
+#ifdef HASH_BLOBS
+    /* Postgres 9.5 */
+    prof->tables = hash_create("Bottled Water profile", 32, &hash_ctl,
+            HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+#else
+    /* Postgres 9.4 */
+    hash_ctl.hash = oid_hash;
+    prof->tables = hash_create("Bottled Water profile", 32, &hash_ctl,
+            HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+#endif
+    return prof;
+}
+
+/* Records the time elapsed since start as one execution of the given phase for the
+ * table with the given relid. Called through PROFILE_END(). */
+void profiler_record(profiler *prof, Oid relid, profile_phase phase, instr_time *start) {
+    instr_time duration;
+    profile_entry *entry;
+    bool found;
+
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, *start);
+
+    entry = (profile_entry *) hash_search(prof->tables, &relid, HASH_ENTER, &found);
+    if (!found) memset(entry->phases, 0, sizeof(entry->phases));
+
+    profile_histogram_add(&entry->phases[phase], INSTR_TIME_GET_MICROSEC(duration));
+}
+
+/* Adds one measurement to a histogram. */
+void profile_histogram_add(profile_histogram *hist, uint64 duration_us) {
+    int bucket = 0;
+
+    while (bucket < PROFILE_NUM_BUCKETS - 1 && duration_us >= (UINT64CONST(1) << bucket)) {
+        bucket++;
+    }
+
+    hist->count++;
+    hist->total_us += duration_us;
+    if (duration_us > hist->max_us) hist->max_us = duration_us;
+    hist->buckets[bucket]++;
+}
+
+/* Writes the histograms to the server log if report_interval has elapsed since they
+ * were last written, and starts new histograms. Called at the end of a transaction. */
+void profiler_maybe_report(profiler *prof, const char *slot_name) {
+    HASH_SEQ_STATUS iterator;
+    profile_entry *entry;
+    TimestampTz now = GetCurrentTimestamp();
+
+    if (!TimestampDifferenceExceeds(prof->last_report, now, prof->report_interval)) return;
+
+    hash_seq_init(&iterator, prof->tables);
+    while ((entry = (profile_entry *) hash_seq_search(&iterator)) != NULL) {
+        for (int phase = 0; phase < PROFILE_NUM_PHASES; phase++) {
+            if (entry->phases[phase].count > 0) {
+                profile_histogram_report(&entry->phases[phase], slot_name, entry->relid, phase);
+            }
+        }
+        /* Removing the current entry doesn't disturb the sequential scan */
+        hash_search(prof->tables, &entry->relid, HASH_REMOVE, NULL);
+    }
+
+    prof->last_report = now;
+}
+
+/* Returns an upper bound, in microseconds, on the duration below which the given
+ * fraction of measurements fall, or the maximum if it lies in the last bucket. */
+uint64 profile_histogram_percentile(profile_histogram *hist, double fraction) {
+    uint64 seen = 0;
+
+    for (int bucket = 0; bucket < PROFILE_NUM_BUCKETS - 1; bucket++) {
+        seen += hist->buckets[bucket];
+        if (seen >= fraction * hist->count) return UINT64CONST(1) << bucket;
+    }
+    return hist->max_us;
+}
+
+/* Logs one line summarising a histogram, followed by its non-empty buckets. */
+void profile_histogram_report(profile_histogram *hist, const char *slot_name, Oid relid,
+        profile_phase phase) {
+    StringInfoData buckets;
+    initStringInfo(&buckets);
+
+    for (int bucket = 0; bucket < PROFILE_NUM_BUCKETS; bucket++) {
+        if (hist->buckets[bucket] == 0) continue;
+
+        if (bucket < PROFILE_NUM_BUCKETS - 1) {
+            appendStringInfo(&buckets, " <" UINT64_FORMAT "us:" UINT64_FORMAT,
+                    UINT64CONST(1) << bucket, hist->buckets[bucket]);
+        } else {
+            appendStringInfo(&buckets, " >=" UINT64_FORMAT "us:" UINT64_FORMAT,
+                    UINT64CONST(1) << (bucket - 1), hist->buckets[bucket]);
+        }
+    }
+
+    if (OidIsValid(relid)) {
+        elog(LOG, "Bottled Water profile for slot %s, table %u, %s: " UINT64_FORMAT " calls, "
+                "%.3f ms total, p50 < " UINT64_FORMAT "us, p99 < " UINT64_FORMAT "us, max "
+                UINT64_FORMAT "us;%s",
+                slot_name, relid, phase_names[phase], hist->count, hist->total_us / 1000.0,
+                profile_histogram_percentile(hist, 0.5), profile_histogram_percentile(hist, 0.99),
+                hist->max_us, buckets.data);
+    } else {
+        elog(LOG, "Bottled Water profile for slot %s, %s: " UINT64_FORMAT " calls, "
+                "%.3f ms total, p50 < " UINT64_FORMAT "us, p99 < " UINT64_FORMAT "us, max "
+                UINT64_FORMAT "us;%s",
+                slot_name, phase_names[phase], hist->count, hist->total_us / 1000.0,
+                profile_histogram_percentile(hist, 0.5), profile_histogram_percentile(hist, 0.99),
+                hist->max_us, buckets.data);
+    }
+
+    pfree(buckets.data);
+}
@@ -0,0 +1,55 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "postgres.h"
+#include "portability/instr_time.h"
+#include "utils/hsearch.h"
+#include "utils/timestamp.h"
+
+/* Stages of the output plugin's work whose duration is measured when profiling */
+typedef enum {
+    PROFILE_SCHEMA_LOOKUP = 0, /* Schema cache lookup, including sending a changed schema */
+    PROFILE_KEY,               /* Extracting and encoding the key columns of a row */
+    PROFILE_ROW,               /* Encoding the columns of a row (or the changed columns) */
+    PROFILE_WRITE_FRAME,       /* Compressing and writing a frame to the client (not per table) */
+    PROFILE_NUM_PHASES
+} profile_phase;
+
+/* Durations are counted in buckets of powers of two microseconds: bucket 0 counts
+ * durations under 1 us, bucket i durations of at least 2^(i-1) and under 2^i us, and
+ * the last bucket everything longer. */
+#define PROFILE_NUM_BUCKETS 16
+
+typedef struct {
+    uint64 count;                         /* Number of measurements */
+    uint64 total_us;                      /* Sum of the durations, in microseconds */
+    uint64 max_us;                        /* Longest duration, in microseconds */
+    uint64 buckets[PROFILE_NUM_BUCKETS];  /* Number of measurements per duration range */
+} profile_histogram;
+
+typedef struct {
+    Oid relid;                    /* Used as key in hash table, so it must be first in struct */
+    profile_histogram phases[PROFILE_NUM_PHASES];
+} profile_entry;
+
+/* Histograms of the time spent in each phase, per table, since they were last
+ * reported. Frames are written for all tables at once, so PROFILE_WRITE_FRAME is
+ * recorded under relid InvalidOid. */
+typedef struct {
+    HTAB *tables;                 /* Hash table mapping Oid to profile_entry */
+    int report_interval;          /* Milliseconds between reports to the server log */
+    TimestampTz last_report;      /* When the histograms were last reported */
+} profiler;
+
+/* Starts and ends the measurement of a phase. prof may be NULL, in which case
+ * profiling is disabled and nothing is measured. */
+#define PROFILE_START(prof, start) \
+    do { if (prof) INSTR_TIME_SET_CURRENT(start); } while (0)
+#define PROFILE_END(prof, relid, phase, start) \
+    do { if (prof) profiler_record((prof), (relid), (phase), &(start)); } while (0)
+
+profiler *profiler_new(MemoryContext context, int report_interval);
+void profiler_record(profiler *prof, Oid relid, profile_phase phase, instr_time *start);
+void profiler_maybe_report(profiler *prof, const char *slot_name);
+
+#endif /* PROFILE_H */
@@ -11,6 +11,9 @@ avro_schema_t schema_for_table_schema(void);
 avro_schema_t schema_for_insert(void);
 avro_schema_t schema_for_update(void);
 avro_schema_t schema_for_delete(void);
+avro_schema_t schema_for_update_delta(void);
+avro_schema_t schema_for_key_change(void);
+avro_schema_t schema_for_fingerprinted_schema(void);
 avro_schema_t nullable_schema(avro_schema_t value_schema);
 
 avro_schema_t schema_for_frame() {
@@ -47,6 +50,21 @@ avro_schema_t schema_for_frame() {
     avro_schema_union_append(union_schema, branch_schema);
     avro_schema_decref(branch_schema);
 
+    assert(avro_schema_union_size(union_schema) == PROTOCOL_MSG_UPDATE_DELTA);
+    branch_schema = schema_for_update_delta();
+    avro_schema_union_append(union_schema, branch_schema);
+    avro_schema_decref(branch_schema);
+
+    assert(avro_schema_union_size(union_schema) == PROTOCOL_MSG_KEY_CHANGE);
+    branch_schema = schema_for_key_change();
+    avro_schema_union_append(union_schema, branch_schema);
+    avro_schema_decref(branch_schema);
+
+    assert(avro_schema_union_size(union_schema) == PROTOCOL_MSG_FINGERPRINTED_SCHEMA);
+    branch_schema = schema_for_fingerprinted_schema();
+    avro_schema_union_append(union_schema, branch_schema);
+    avro_schema_decref(branch_schema);
+
     array_schema = avro_schema_array(union_schema);
     avro_schema_decref(union_schema);
 
@@ -156,6 +174,74 @@ avro_schema_t schema_for_delete() {
     return record_schema;
 }
 
+avro_schema_t schema_for_update_delta() {
+    avro_schema_t record_schema = avro_schema_record("UpdateDelta", PROTOCOL_SCHEMA_NAMESPACE);
+
+    avro_schema_t field_schema = avro_schema_long();
+    avro_schema_record_field_append(record_schema, "relid", field_schema);
+    avro_schema_decref(field_schema);
+
+    field_schema = nullable_schema(avro_schema_bytes());
+    avro_schema_record_field_append(record_schema, "key", field_schema);
+    avro_schema_decref(field_schema);
+
+    field_schema = nullable_schema(avro_schema_bytes());
+    avro_schema_record_field_append(record_schema, "oldRow", field_schema);
+    avro_schema_decref(field_schema);
+
+    field_schema = avro_schema_bytes();
+    avro_schema_record_field_append(record_schema, "changedColumns", field_schema);
+    avro_schema_decref(field_schema);
+
+    field_schema = avro_schema_bytes();
+    avro_schema_record_field_append(record_schema, "newRow", field_schema);
+    avro_schema_decref(field_schema);
+
+    return record_schema;
+}
+
+avro_schema_t schema_for_key_change() {
+    avro_schema_t record_schema = avro_schema_record("KeyChange", PROTOCOL_SCHEMA_NAMESPACE);
+
+    avro_schema_t field_schema = avro_schema_long();
+    avro_schema_record_field_append(record_schema, "relid", field_schema);
+    avro_schema_decref(field_schema);
+
+    field_schema = avro_schema_int();
+    avro_schema_record_field_append(record_schema, "op", field_schema);
+    avro_schema_decref(field_schema);
+
+    field_schema = nullable_schema(avro_schema_bytes());
+    avro_schema_record_field_append(record_schema, "key", field_schema);
+    avro_schema_decref(field_schema);
+
+    return record_schema;
+}
+
+avro_schema_t schema_for_fingerprinted_schema() {
+    avro_schema_t record_schema = avro_schema_record("FingerprintedSchema", PROTOCOL_SCHEMA_NAMESPACE);
+
+    avro_schema_t field_schema = avro_schema_long();
+    avro_schema_record_field_append(record_schema, "relid", field_schema);
+    avro_schema_decref(field_schema);
+
+    field_schema = nullable_schema(avro_schema_string());
+    avro_schema_record_field_append(record_schema, "keySchema", field_schema);
+    avro_schema_decref(field_schema);
+
+    field_schema = avro_schema_string();
+    avro_schema_record_field_append(record_schema, "rowSchema", field_schema);
+    avro_schema_decref(field_schema);
+
+    /* CRC-64-AVRO fingerprint of the keySchema and rowSchema fields, which lets the
+     * client skip parsing schemas it already has */
+    field_schema = avro_schema_long();
+    avro_schema_record_field_append(record_schema, "fingerprint", field_schema);
+    avro_schema_decref(field_schema);
+
+    return record_schema;
+}
+
 avro_schema_t nullable_schema(avro_schema_t value_schema) {
     avro_schema_t null_schema = avro_schema_null();
     avro_schema_t union_schema = avro_schema_union();
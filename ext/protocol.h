@@ -22,6 +22,17 @@
 #define PROTOCOL_MSG_INSERT         3
 #define PROTOCOL_MSG_UPDATE         4
 #define PROTOCOL_MSG_DELETE         5
+#define PROTOCOL_MSG_UPDATE_DELTA   6
+#define PROTOCOL_MSG_KEY_CHANGE     7
+#define PROTOCOL_MSG_FINGERPRINTED_SCHEMA 8
+
+/* Values of the "op" field of a KeyChange message, which is sent instead of an
+ * Insert, Update or Delete message for tables selected by the key_only_tables
+ * option. It contains only the key of the row, which is null if the table is
+ * unkeyed. An update that changes the key is sent as a delete and an insert. */
+#define PROTOCOL_KEY_CHANGE_INSERT  0
+#define PROTOCOL_KEY_CHANGE_UPDATE  1
+#define PROTOCOL_KEY_CHANGE_DELETE  2
 
 
 /* Error policies, determining what the snapshot function and output plugin
@@ -44,6 +55,102 @@
 #define PROTOCOL_ERROR_POLICY_LOG "log"
 
 
+/* Values of the numeric_encoding option, which determines how columns of type
+ * NUMERIC (and DECIMAL) are represented in Avro. */
+/* The default is "double", which is widely supported, but loses precision for
+ * values with more than about 15 significant digits. */
+#define PROTOCOL_NUMERIC_ENCODING_DOUBLE "double"
+/* Under "decimal", values are encoded as bytes with the Avro decimal logical type
+ * (the unscaled value as a big-endian two's complement integer), with the precision
+ * and scale of the column type. Columns declared without a precision and scale
+ * (plain NUMERIC) can hold values of any scale, so they are still encoded as double.
+ */
+#define PROTOCOL_NUMERIC_ENCODING_DECIMAL "decimal"
+
+
+/* Values of the temporal_encoding option, which determines how columns of type
+ * DATE, TIME, TIMESTAMP and TIMESTAMPTZ are represented in Avro. */
+/* The default is "record": dates and timestamps are records of calendar fields
+ * (year, month, day, hour, ...), in a union with an enum for +/- infinity, and
+ * timestamps with time zone are converted to the server's time zone. Times are
+ * microseconds since midnight. */
+#define PROTOCOL_TEMPORAL_ENCODING_RECORD "record"
+/* Under "logical", dates are the number of days since 1970-01-01 (Avro "date"
+ * logical type), times are microseconds since midnight ("time-micros"), and
+ * timestamps, with or without time zone, are microseconds since 1970-01-01
+ * 00:00:00 UTC ("timestamp-micros"). -infinity and +infinity are represented by
+ * the smallest and largest int (for dates) or long (for timestamps).
+ */
+#define PROTOCOL_TEMPORAL_ENCODING_LOGICAL "logical"
+
+
+/* Values of the unchanged_toast option, which determines how the new row of an update
+ * represents large (TOASTed) column values that were not modified by the update.
+ * Logical decoding doesn't include such values in the change. */
+/* The default is "fetch": the values are read back from the table's TOAST storage,
+ * so the new row is complete. This is expensive for large values, and fails if the
+ * stored value has since been removed by vacuum. */
+#define PROTOCOL_UNCHANGED_TOAST_FETCH "fetch"
+/* Under "marker", the union of every column that may be TOASTed has an additional
+ * branch, an enum named UnchangedToast with the single symbol UNCHANGED, which is
+ * used in the new row of an update in place of a value that didn't change. The old
+ * row (with REPLICA IDENTITY FULL) and all other rows always contain the full values.
+ */
+#define PROTOCOL_UNCHANGED_TOAST_MARKER "marker"
+
+
+/* Values of the update_format option, which determines how updates are sent. */
+/* The default is "full": an Update message contains the complete new row. */
+#define PROTOCOL_UPDATE_FORMAT_FULL "full"
+/* Under "delta", updates of tables with REPLICA IDENTITY FULL (for which the old row
+ * is known) are sent as UpdateDelta messages. They contain the old row (unless the
+ * old_row option is "omit"), a bitmap of the fields that the update changed (bit i,
+ * counting from the least significant bit of the first byte, is set if field i of
+ * the row changed), and the new row in which all unchanged fields are null. If the
+ * old row is present, the client reconstructs the new row by copying the unchanged
+ * fields from it; otherwise that requires the consumer's own copy of the previous
+ * row. Updates of other tables are sent in full. */
+#define PROTOCOL_UPDATE_FORMAT_DELTA "delta"
+
+
+/* Values of the old_row option, which determines whether updates and deletes carry
+ * the old row (for tables with REPLICA IDENTITY FULL, or without a primary key). */
+/* The default is "include": the oldRow field contains the old row if it is known. */
+#define PROTOCOL_OLD_ROW_INCLUDE "include"
+/* Under "omit", the oldRow field of Update, UpdateDelta and Delete messages is always
+ * null, and only the key identifies the row. The client requests this when none of
+ * its callbacks use the old row. */
+#define PROTOCOL_OLD_ROW_OMIT "omit"
+
+
+/* Values of the schema_fingerprint option, which determines whether table schemas are
+ * sent with a fingerprint. */
+/* The default is "omit": table schemas are sent as TableSchema messages. */
+#define PROTOCOL_SCHEMA_FINGERPRINT_OMIT "omit"
+/* Under "include", table schemas are sent as FingerprintedSchema messages instead,
+ * which have the same fields as TableSchema followed by the CRC-64-AVRO fingerprint
+ * of the encoded keySchema and rowSchema fields. A client that already has schemas
+ * with that fingerprint for the table can skip parsing them. The client requests
+ * this if it understands FingerprintedSchema messages. */
+#define PROTOCOL_SCHEMA_FINGERPRINT_INCLUDE "include"
+
+
+/* Values of the frame_compression option, which determines whether frames sent by
+ * the output plugin are compressed. It does not apply to the snapshot. */
+/* The default is "none": each replication message is a frame in Avro binary encoding. */
+#define PROTOCOL_FRAME_COMPRESSION_NONE "none"
+/* Under "deflate", each replication message starts with a header byte. If it is
+ * PROTOCOL_FRAME_UNCOMPRESSED, the frame follows as normal. If it is
+ * PROTOCOL_FRAME_DEFLATE, it is followed by the size of the uncompressed frame as a
+ * 4-byte big-endian integer, and the frame compressed with zlib. Frames smaller than
+ * the frame_compression_min_bytes option (default 1024), and frames that don't get
+ * any smaller, are sent uncompressed. */
+#define PROTOCOL_FRAME_COMPRESSION_DEFLATE "deflate"
+
+#define PROTOCOL_FRAME_UNCOMPRESSED 0
+#define PROTOCOL_FRAME_DEFLATE      1
+
+
 avro_schema_t schema_for_frame(void);
 
 #endif /* PROTOCOL_H */
@@ -1,5 +1,12 @@
 /* Conversion of Postgres server-side structures into the wire protocol, which
- * is emitted by the output plugin and consumed by the client. */
+ * is emitted by the output plugin and consumed by the client.
+ *
+ * Frames are encoded directly in Avro binary encoding, following the schema in
+ * protocol.c, without building up an Avro value first. A frame is a record with
+ * a single field: an array of messages, each of which is a union of the message
+ * types. We encode the array as a sequence of blocks containing one message
+ * each, so that messages can be appended without knowing in advance how many
+ * there will be, followed by the empty block that terminates the array. */
 
 #include "protocol_server.h"
 #include "io_util.h"
@@ -9,281 +16,396 @@
 #include <string.h>
 #include "access/heapam.h"
 
-int extract_tuple_key(schema_cache_entry *entry, Relation rel, TupleDesc tupdesc, HeapTuple tuple, bytea **key_out);
-int update_frame_with_table_schema(avro_value_t *frame_val, schema_cache_entry *entry);
-int update_frame_with_insert_raw(avro_value_t *frame_val, Oid relid, bytea *key_bin, bytea *new_bin);
-int update_frame_with_update_raw(avro_value_t *frame_val, Oid relid, bytea *key_bin, bytea *old_bin, bytea *new_bin);
-int update_frame_with_delete_raw(avro_value_t *frame_val, Oid relid, bytea *key_bin, bytea *old_bin);
+void begin_message(frame_buffer *frame, int msg_type);
+int write_tuple_key(StringInfo out, profiler *prof, schema_cache_entry *entry, TupleDesc tupdesc,
+        HeapTuple tuple);
+int write_tuple_row(StringInfo out, profiler *prof, schema_cache_entry *entry, TupleDesc tupdesc,
+        HeapTuple tuple, bool unchanged_toast);
+int write_tuple_delta(StringInfo out, profiler *prof, schema_cache_entry *entry, TupleDesc tupdesc,
+        HeapTuple oldtuple, HeapTuple newtuple);
+int lookup_schema(frame_buffer *frame, schema_cache_t cache, Relation rel, schema_cache_entry **entry_out);
+int write_schema_string(StringInfo out, avro_schema_t schema, TupleDesc tupdesc,
+        Bitmapset *excluded_columns, encoding_options *options);
+int update_frame_with_table_schema(frame_buffer *frame, schema_cache_t cache, schema_cache_entry *entry);
+uint64 schema_fingerprint(const char *data, int len);
+int update_frame_with_key_change(frame_buffer *frame, schema_cache_entry *entry, Relation rel,
+        TupleDesc tupdesc, int op, HeapTuple tuple);
+
+/* Initializes an empty frame, allocated in the current memory context. */
+void frame_buffer_init(frame_buffer *frame) {
+    initStringInfo(&frame->buf);
+    frame->num_messages = 0;
+    frame->profiler = NULL;
+}
 
-/* Populates a wire protocol message for a "begin transaction" event. */
-int update_frame_with_begin_txn(avro_value_t *frame_val, ReorderBufferTXN *txn) {
-    int err = 0;
-    avro_value_t msg_val, union_val, record_val, xid_val;
+/* Removes all messages from a frame, keeping the buffer's memory for reuse. */
+void frame_buffer_reset(frame_buffer *frame) {
+    resetStringInfo(&frame->buf);
+    frame->num_messages = 0;
+}
 
-    check(err, avro_value_get_by_index(frame_val, 0, &msg_val, NULL));
-    check(err, avro_value_append(&msg_val, &union_val, NULL));
-    check(err, avro_value_set_branch(&union_val, PROTOCOL_MSG_BEGIN_TXN, &record_val));
-    check(err, avro_value_get_by_index(&record_val, 0, &xid_val, NULL));
-    check(err, avro_value_set_long(&xid_val, txn->xid));
-    return err;
+/* Discards anything that was appended to the frame after it had the given length
+ * and number of messages. Used to drop a message that could not be encoded. */
+void frame_buffer_truncate(frame_buffer *frame, int len, int num_messages) {
+    frame->buf.len = len;
+    frame->buf.data[len] = '\0';
+    frame->num_messages = num_messages;
 }
 
-/* Populates a wire protocol message for a "commit transaction" event. */
-int update_frame_with_commit_txn(avro_value_t *frame_val, ReorderBufferTXN *txn,
+/* Terminates the array of messages. After this, the buffer contains a complete frame. */
+void frame_buffer_finish(frame_buffer *frame) {
+    write_avro_long(&frame->buf, 0);
+}
+
+void frame_buffer_free(frame_buffer *frame) {
+    pfree(frame->buf.data);
+}
+
+/* Starts a new message of the given type (one of the PROTOCOL_MSG_* constants),
+ * whose fields are then appended by the caller. */
+void begin_message(frame_buffer *frame, int msg_type) {
+    write_avro_long(&frame->buf, 1);        /* array block containing one message */
+    write_avro_long(&frame->buf, msg_type); /* branch of the message union */
+    frame->num_messages++;
+}
+
+/* Appends a wire protocol message for a "begin transaction" event. */
+int update_frame_with_begin_txn(frame_buffer *frame, ReorderBufferTXN *txn) {
+    begin_message(frame, PROTOCOL_MSG_BEGIN_TXN);
+    write_avro_long(&frame->buf, txn->xid);
+    return 0;
+}
+
+/* Appends a wire protocol message for a "commit transaction" event. */
+int update_frame_with_commit_txn(frame_buffer *frame, ReorderBufferTXN *txn,
         XLogRecPtr commit_lsn) {
-    int err = 0;
-    avro_value_t msg_val, union_val, record_val, xid_val, lsn_val;
-
-    check(err, avro_value_get_by_index(frame_val, 0, &msg_val, NULL));
-    check(err, avro_value_append(&msg_val, &union_val, NULL));
-    check(err, avro_value_set_branch(&union_val, PROTOCOL_MSG_COMMIT_TXN, &record_val));
-    check(err, avro_value_get_by_index(&record_val, 0, &xid_val, NULL));
-    check(err, avro_value_get_by_index(&record_val, 1, &lsn_val, NULL));
-    check(err, avro_value_set_long(&xid_val, txn->xid));
-    check(err, avro_value_set_long(&lsn_val, commit_lsn));
-    return err;
+    begin_message(frame, PROTOCOL_MSG_COMMIT_TXN);
+    write_avro_long(&frame->buf, txn->xid);
+    write_avro_long(&frame->buf, commit_lsn);
+    return 0;
 }
 
 /* If we're using a primary key/replica identity index for a given table, this
- * function extracts that index' columns from a row tuple, and encodes the values
- * as an Avro string using the table's key schema. */
-int extract_tuple_key(schema_cache_entry *entry, Relation rel, TupleDesc tupdesc, HeapTuple tuple, bytea **key_out) {
-    int err = 0;
-    Relation index_rel;
+ * function extracts that index' columns from a row tuple, and appends the nullable
+ * key field of a message: the values encoded as Avro binary using the table's key
+ * schema. If the table is unkeyed, the key is null. */
+int write_tuple_key(StringInfo out, profiler *prof, schema_cache_entry *entry, TupleDesc tupdesc,
+        HeapTuple tuple) {
+    int err = 0, start;
+    instr_time start_time;
 
     if (entry->key_schema) {
-        check(err, avro_value_reset(&entry->key_value));
+        PROFILE_START(prof, start_time);
+        write_avro_long(out, 1);
+        start = begin_avro_bytes(out);
+        check(err, tuple_to_avro(out, entry->key_plan, tupdesc, tuple, false, NULL));
+        end_avro_bytes(out, start);
+        PROFILE_END(prof, entry->relid, PROFILE_KEY, start_time);
+    } else {
+        write_avro_long(out, 0);
+    }
+    return err;
+}
 
-        index_rel = table_key_index(rel);
-        err = tuple_to_avro_key(&entry->key_value, tupdesc, tuple, rel, index_rel->rd_index);
-        relation_close(index_rel, AccessShareLock);
+/* Appends a row tuple, encoded as Avro binary using the table's row schema, as a
+ * bytes field of a message. */
+int write_tuple_row(StringInfo out, profiler *prof, schema_cache_entry *entry, TupleDesc tupdesc,
+        HeapTuple tuple, bool unchanged_toast) {
+    int err = 0, start;
+    instr_time start_time;
+
+    PROFILE_START(prof, start_time);
+    start = begin_avro_bytes(out);
+    check(err, tuple_to_avro(out, entry->row_plan, tupdesc, tuple, unchanged_toast, NULL));
+    end_avro_bytes(out, start);
+    PROFILE_END(prof, entry->relid, PROFILE_ROW, start_time);
+    return err;
+}
 
-        if (err) {
-            return err;
-        }
+/* Appends the changedColumns and newRow fields of an UpdateDelta message: a bitmap of
+ * the columns whose value differs between the old and new row, followed by the new
+ * row encoded with the table's row schema, in which all unchanged columns are null. */
+int write_tuple_delta(StringInfo out, profiler *prof, schema_cache_entry *entry, TupleDesc tupdesc,
+        HeapTuple oldtuple, HeapTuple newtuple) {
+    int err = 0, start;
+    int changed_len = (entry->row_plan->num_columns + 7) / 8;
+    bits8 *changed = palloc(Max(changed_len, 1));
+    instr_time start_time;
+
+    PROFILE_START(prof, start_time);
+    tuple_changed_columns(entry->row_plan, tupdesc, oldtuple, newtuple, changed);
+    write_avro_long(out, changed_len);
+    appendBinaryStringInfo(out, (char *) changed, changed_len);
+
+    start = begin_avro_bytes(out);
+    check(err, tuple_to_avro(out, entry->row_plan, tupdesc, newtuple, true, changed));
+    end_avro_bytes(out, start);
+    PROFILE_END(prof, entry->relid, PROFILE_ROW, start_time);
+
+    pfree(changed);
+    return err;
+}
+
+/* Looks up the schema cache entry for a table, and if the table's schema is new or
+ * has changed, appends a message with the new schema to the frame. */
+int lookup_schema(frame_buffer *frame, schema_cache_t cache, Relation rel, schema_cache_entry **entry_out) {
+    int err = 0, changed;
+    instr_time start_time;
 
-        check(err, try_writing(key_out, &write_avro_binary, &entry->key_value));
+    PROFILE_START(frame->profiler, start_time);
+    changed = schema_cache_lookup(cache, rel, entry_out);
+    if (changed < 0) {
+        return EINVAL;
+    } else if (changed) {
+        check(err, update_frame_with_table_schema(frame, cache, *entry_out));
     }
+    PROFILE_END(frame->profiler, RelationGetRelid(rel), PROFILE_SCHEMA_LOOKUP, start_time);
     return err;
 }
 
-/* Updates the given frame value with a tuple inserted into a table. The table
- * schema is automatically included in the frame if it's not in the cache. This
- * function is used both during snapshot and during stream replication.
+/* Appends a message for a tuple inserted into a table. The table schema is
+ * automatically included in the frame if it's not in the cache. This function is
+ * used both during snapshot and during stream replication.
  *
  * The TupleDesc parameter is not redundant. During stream replication, it is just
  * RelationGetDescr(rel), but during snapshot it is taken from the result set.
  * The difference is that the result set tuple has dropped (logically invisible)
  * columns omitted. */
-int update_frame_with_insert(avro_value_t *frame_val, schema_cache_t cache, Relation rel, TupleDesc tupdesc, HeapTuple newtuple) {
+int update_frame_with_insert(frame_buffer *frame, schema_cache_t cache, Relation rel, TupleDesc tupdesc, HeapTuple newtuple) {
     int err = 0;
     schema_cache_entry *entry;
-    bytea *key_bin = NULL, *new_bin = NULL;
 
-    int changed = schema_cache_lookup(cache, rel, &entry);
-    if (changed < 0) {
-        return EINVAL;
-    } else if (changed) {
-        check(err, update_frame_with_table_schema(frame_val, entry));
-    }
+    check(err, lookup_schema(frame, cache, rel, &entry));
 
-    check(err, extract_tuple_key(entry, rel, tupdesc, newtuple, &key_bin));
-    check(err, avro_value_reset(&entry->row_value));
-    check(err, tuple_to_avro_row(&entry->row_value, tupdesc, newtuple));
-    check(err, try_writing(&new_bin, &write_avro_binary, &entry->row_value));
-    check(err, update_frame_with_insert_raw(frame_val, RelationGetRelid(rel), key_bin, new_bin));
+    if (entry->key_only) {
+        return update_frame_with_key_change(frame, entry, rel, tupdesc,
+                PROTOCOL_KEY_CHANGE_INSERT, newtuple);
+    }
 
-    if (key_bin) pfree(key_bin);
-    pfree(new_bin);
+    begin_message(frame, PROTOCOL_MSG_INSERT);
+    write_avro_long(&frame->buf, RelationGetRelid(rel));
+    check(err, write_tuple_key(&frame->buf, frame->profiler, entry, tupdesc, newtuple));
+    check(err, write_tuple_row(&frame->buf, frame->profiler, entry, tupdesc, newtuple, false));
     return err;
 }
 
-/* Updates the given frame with information about a table row that was modified.
- * This is used only during stream replication. */
-int update_frame_with_update(avro_value_t *frame_val, schema_cache_t cache, Relation rel, HeapTuple oldtuple, HeapTuple newtuple) {
+/* Appends a message for a table row that was modified. This is used only during
+ * stream replication. */
+int update_frame_with_update(frame_buffer *frame, schema_cache_t cache, Relation rel, HeapTuple oldtuple, HeapTuple newtuple) {
     int err = 0;
     schema_cache_entry *entry;
-    bytea *old_bin = NULL, *new_bin = NULL, *old_key_bin = NULL, *new_key_bin = NULL;
+    TupleDesc tupdesc = RelationGetDescr(rel);
+    StringInfoData old_key, new_key;
+    bool send_old = (cache->options.old_row != OLD_ROW_OMIT);
 
-    int changed = schema_cache_lookup(cache, rel, &entry);
-    if (changed < 0) {
-        return EINVAL;
-    } else if (changed) {
-        check(err, update_frame_with_table_schema(frame_val, entry));
-    }
+    check(err, lookup_schema(frame, cache, rel, &entry));
 
     /* oldtuple is non-NULL when replident = FULL, or when replident = DEFAULT and there is no
      * primary key, or replident = DEFAULT and the primary key was not modified by the update. */
-    if (oldtuple) {
-        check(err, extract_tuple_key(entry, rel, RelationGetDescr(rel), oldtuple, &old_key_bin));
-        check(err, avro_value_reset(&entry->row_value));
-        check(err, tuple_to_avro_row(&entry->row_value, RelationGetDescr(rel), oldtuple));
-        check(err, try_writing(&old_bin, &write_avro_binary, &entry->row_value));
+    if (!oldtuple && entry->key_only) {
+        return update_frame_with_key_change(frame, entry, rel, tupdesc,
+                PROTOCOL_KEY_CHANGE_UPDATE, newtuple);
+    } else if (!oldtuple) {
+        begin_message(frame, PROTOCOL_MSG_UPDATE);
+        write_avro_long(&frame->buf, RelationGetRelid(rel));
+        check(err, write_tuple_key(&frame->buf, frame->profiler, entry, tupdesc, newtuple));
+        write_avro_long(&frame->buf, 0); /* oldRow is null */
+        check(err, write_tuple_row(&frame->buf, frame->profiler, entry, tupdesc, newtuple, true));
+        return err;
     }
 
-    check(err, extract_tuple_key(entry, rel, RelationGetDescr(rel), newtuple, &new_key_bin));
-    check(err, avro_value_reset(&entry->row_value));
-    check(err, tuple_to_avro_row(&entry->row_value, RelationGetDescr(rel), newtuple));
-    check(err, try_writing(&new_bin, &write_avro_binary, &entry->row_value));
+    /* The keys are small, so we encode them separately to compare them before
+     * deciding which messages to generate. */
+    initStringInfo(&old_key);
+    initStringInfo(&new_key);
+    check(err, write_tuple_key(&old_key, frame->profiler, entry, tupdesc, oldtuple));
+    check(err, write_tuple_key(&new_key, frame->profiler, entry, tupdesc, newtuple));
+
+    if (entry->key_only) {
+        bool key_changed = (old_key.len != new_key.len ||
+                memcmp(old_key.data, new_key.data, new_key.len) != 0);
+
+        /* As below, a change of primary key is a delete and an insert */
+        if (key_changed) {
+            begin_message(frame, PROTOCOL_MSG_KEY_CHANGE);
+            write_avro_long(&frame->buf, RelationGetRelid(rel));
+            write_avro_long(&frame->buf, PROTOCOL_KEY_CHANGE_DELETE);
+            appendBinaryStringInfo(&frame->buf, old_key.data, old_key.len);
+        }
 
-    if (old_key_bin != NULL && (VARSIZE(old_key_bin) != VARSIZE(new_key_bin) ||
-            memcmp(VARDATA(old_key_bin), VARDATA(new_key_bin), VARSIZE(new_key_bin) - VARHDRSZ) != 0)) {
+        begin_message(frame, PROTOCOL_MSG_KEY_CHANGE);
+        write_avro_long(&frame->buf, RelationGetRelid(rel));
+        write_avro_long(&frame->buf,
+                key_changed ? PROTOCOL_KEY_CHANGE_INSERT : PROTOCOL_KEY_CHANGE_UPDATE);
+        appendBinaryStringInfo(&frame->buf, new_key.data, new_key.len);
+
+    } else if (old_key.len != new_key.len || memcmp(old_key.data, new_key.data, new_key.len) != 0) {
         /* If the primary key changed, turn the update into a delete and an insert. */
-        check(err, update_frame_with_delete_raw(frame_val, RelationGetRelid(rel), old_key_bin, old_bin));
-        check(err, update_frame_with_insert_raw(frame_val, RelationGetRelid(rel), new_key_bin, new_bin));
+        begin_message(frame, PROTOCOL_MSG_DELETE);
+        write_avro_long(&frame->buf, RelationGetRelid(rel));
+        appendBinaryStringInfo(&frame->buf, old_key.data, old_key.len);
+        if (send_old) {
+            write_avro_long(&frame->buf, 1);
+            check(err, write_tuple_row(&frame->buf, frame->profiler, entry, tupdesc, oldtuple, false));
+        } else {
+            write_avro_long(&frame->buf, 0); /* oldRow is null */
+        }
+
+        /* No earlier row has the new key, so there is nothing for a consumer to fill in
+         * unchanged TOAST values from: fetch them instead of sending markers */
+        begin_message(frame, PROTOCOL_MSG_INSERT);
+        write_avro_long(&frame->buf, RelationGetRelid(rel));
+        appendBinaryStringInfo(&frame->buf, new_key.data, new_key.len);
+        check(err, write_tuple_row(&frame->buf, frame->profiler, entry, tupdesc, newtuple, false));
+    } else if (cache->options.update_format == UPDATE_FORMAT_DELTA &&
+            rel->rd_rel->relreplident == REPLICA_IDENTITY_FULL) {
+        /* The old row is complete, so the unchanged columns can be filled in from it:
+         * by the client if it is sent, and otherwise from the consumer's previous row. */
+        begin_message(frame, PROTOCOL_MSG_UPDATE_DELTA);
+        write_avro_long(&frame->buf, RelationGetRelid(rel));
+        appendBinaryStringInfo(&frame->buf, new_key.data, new_key.len);
+        if (send_old) {
+            write_avro_long(&frame->buf, 1);
+            check(err, write_tuple_row(&frame->buf, frame->profiler, entry, tupdesc, oldtuple, false));
+        } else {
+            write_avro_long(&frame->buf, 0); /* oldRow is null */
+        }
+        check(err, write_tuple_delta(&frame->buf, frame->profiler, entry, tupdesc, oldtuple, newtuple));
     } else {
-        check(err, update_frame_with_update_raw(frame_val, RelationGetRelid(rel), new_key_bin, old_bin, new_bin));
+        begin_message(frame, PROTOCOL_MSG_UPDATE);
+        write_avro_long(&frame->buf, RelationGetRelid(rel));
+        appendBinaryStringInfo(&frame->buf, new_key.data, new_key.len);
+        if (send_old) {
+            write_avro_long(&frame->buf, 1);
+            check(err, write_tuple_row(&frame->buf, frame->profiler, entry, tupdesc, oldtuple, false));
+        } else {
+            write_avro_long(&frame->buf, 0); /* oldRow is null */
+        }
+        check(err, write_tuple_row(&frame->buf, frame->profiler, entry, tupdesc, newtuple, true));
     }
 
-    if (old_key_bin) pfree(old_key_bin);
-    if (new_key_bin) pfree(new_key_bin);
-    if (old_bin) pfree(old_bin);
-    pfree(new_bin);
+    pfree(old_key.data);
+    pfree(new_key.data);
     return err;
 }
 
-/* Updates the given frame with information about a table row that was deleted.
- * This is used only during stream replication. */
-int update_frame_with_delete(avro_value_t *frame_val, schema_cache_t cache, Relation rel, HeapTuple oldtuple) {
+/* Appends a message for a table row that was deleted. This is used only during
+ * stream replication. */
+int update_frame_with_delete(frame_buffer *frame, schema_cache_t cache, Relation rel, HeapTuple oldtuple) {
     int err = 0;
     schema_cache_entry *entry;
-    bytea *key_bin = NULL, *old_bin = NULL;
 
-    int changed = schema_cache_lookup(cache, rel, &entry);
-    if (changed < 0) {
-        return EINVAL;
-    } else if (changed) {
-        check(err, update_frame_with_table_schema(frame_val, entry));
-    }
+    check(err, lookup_schema(frame, cache, rel, &entry));
 
-    if (oldtuple) {
-        check(err, extract_tuple_key(entry, rel, RelationGetDescr(rel), oldtuple, &key_bin));
-        check(err, avro_value_reset(&entry->row_value));
-        check(err, tuple_to_avro_row(&entry->row_value, RelationGetDescr(rel), oldtuple));
-        check(err, try_writing(&old_bin, &write_avro_binary, &entry->row_value));
+    if (entry->key_only) {
+        return update_frame_with_key_change(frame, entry, rel, RelationGetDescr(rel),
+                PROTOCOL_KEY_CHANGE_DELETE, oldtuple);
     }
 
-    check(err, update_frame_with_delete_raw(frame_val, RelationGetRelid(rel), key_bin, old_bin));
+    begin_message(frame, PROTOCOL_MSG_DELETE);
+    write_avro_long(&frame->buf, RelationGetRelid(rel));
 
-    if (key_bin) pfree(key_bin);
-    if (old_bin) pfree(old_bin);
+    if (oldtuple) {
+        check(err, write_tuple_key(&frame->buf, frame->profiler, entry, RelationGetDescr(rel), oldtuple));
+        if (cache->options.old_row != OLD_ROW_OMIT) {
+            write_avro_long(&frame->buf, 1);
+            check(err, write_tuple_row(&frame->buf, frame->profiler, entry, RelationGetDescr(rel), oldtuple, false));
+        } else {
+            write_avro_long(&frame->buf, 0); /* oldRow is null */
+        }
+    } else {
+        write_avro_long(&frame->buf, 0); /* key is null */
+        write_avro_long(&frame->buf, 0); /* oldRow is null */
+    }
     return err;
 }
 
-/* Sends Avro schemas for a table to the client. This is called the first time we send
- * row-level events for a table, as well as every time the schema changes. All subsequent
- * inserts/updates/deletes are assumed to be encoded with this schema. */
-int update_frame_with_table_schema(avro_value_t *frame_val, schema_cache_entry *entry) {
+/* Appends a KeyChange message, which is sent instead of an Insert, Update or Delete
+ * message for tables selected by the key_only_tables option. Only the key columns are
+ * extracted from the tuple, which may be NULL for a delete on an unkeyed table (the
+ * key is then null, like in the Delete message). */
+int update_frame_with_key_change(frame_buffer *frame, schema_cache_entry *entry, Relation rel,
+        TupleDesc tupdesc, int op, HeapTuple tuple) {
     int err = 0;
-    avro_value_t msg_val, union_val, record_val, relid_val, key_schema_val,
-                 row_schema_val, branch_val;
-    bytea *key_schema_json = NULL, *row_schema_json = NULL;
-
-    check(err, avro_value_get_by_index(frame_val, 0, &msg_val, NULL));
-    check(err, avro_value_append(&msg_val, &union_val, NULL));
-    check(err, avro_value_set_branch(&union_val, PROTOCOL_MSG_TABLE_SCHEMA, &record_val));
-    check(err, avro_value_get_by_index(&record_val, 0, &relid_val,      NULL));
-    check(err, avro_value_get_by_index(&record_val, 1, &key_schema_val, NULL));
-    check(err, avro_value_get_by_index(&record_val, 2, &row_schema_val, NULL));
-    check(err, avro_value_set_long(&relid_val, entry->relid));
 
-    if (entry->key_schema) {
-        check(err, try_writing(&key_schema_json, &write_schema_json, entry->key_schema));
-        check(err, avro_value_set_branch(&key_schema_val, 1, &branch_val));
-        check(err, avro_value_set_string_len(&branch_val, VARDATA(key_schema_json),
-                    VARSIZE(key_schema_json) - VARHDRSZ + 1));
-        pfree(key_schema_json);
+    begin_message(frame, PROTOCOL_MSG_KEY_CHANGE);
+    write_avro_long(&frame->buf, RelationGetRelid(rel));
+    write_avro_long(&frame->buf, op);
+
+    if (tuple) {
+        check(err, write_tuple_key(&frame->buf, frame->profiler, entry, tupdesc, tuple));
     } else {
-        check(err, avro_value_set_branch(&key_schema_val, 0, NULL));
+        write_avro_long(&frame->buf, 0); /* key is null */
     }
-
-    check(err, try_writing(&row_schema_json, &write_schema_json, entry->row_schema));
-    check(err, avro_value_set_string_len(&row_schema_val, VARDATA(row_schema_json),
-                VARSIZE(row_schema_json) - VARHDRSZ + 1));
-    pfree(row_schema_json);
     return err;
 }
 
-/* Populates a wire protocol message for an insert event. */
-int update_frame_with_insert_raw(avro_value_t *frame_val, Oid relid, bytea *key_bin, bytea *new_bin) {
+/* Appends an Avro schema, encoded as JSON, as a string field of a message. The JSON
+ * is written directly into the frame. tupdesc and excluded_columns are those of the
+ * table or key index from which the schema was generated. */
+int write_schema_string(StringInfo out, avro_schema_t schema, TupleDesc tupdesc,
+        Bitmapset *excluded_columns, encoding_options *options) {
     int err = 0;
-    avro_value_t msg_val, union_val, record_val, relid_val, key_val, newrow_val, branch_val;
-
-    check(err, avro_value_get_by_index(frame_val, 0, &msg_val, NULL));
-    check(err, avro_value_append(&msg_val, &union_val, NULL));
-    check(err, avro_value_set_branch(&union_val, PROTOCOL_MSG_INSERT, &record_val));
-    check(err, avro_value_get_by_index(&record_val, 0, &relid_val,  NULL));
-    check(err, avro_value_get_by_index(&record_val, 1, &key_val,    NULL));
-    check(err, avro_value_get_by_index(&record_val, 2, &newrow_val, NULL));
-    check(err, avro_value_set_long(&relid_val, relid));
-    check(err, avro_value_set_bytes(&newrow_val, VARDATA(new_bin), VARSIZE(new_bin) - VARHDRSZ));
-
-    if (key_bin) {
-        check(err, avro_value_set_branch(&key_val, 1, &branch_val));
-        check(err, avro_value_set_bytes(&branch_val, VARDATA(key_bin), VARSIZE(key_bin) - VARHDRSZ));
-    } else {
-        check(err, avro_value_set_branch(&key_val, 0, NULL));
-    }
+    int start = begin_avro_bytes(out);
+    check(err, try_writing(out, &write_schema_json, schema));
+    schema_json_add_logical_types(out, start, tupdesc, excluded_columns, options);
+    end_avro_bytes(out, start);
     return err;
 }
 
-/* Populates a wire protocol message for an update event. */
-int update_frame_with_update_raw(avro_value_t *frame_val, Oid relid, bytea *key_bin,
-        bytea *old_bin, bytea *new_bin) {
-    int err = 0;
-    avro_value_t msg_val, union_val, record_val, relid_val, key_val, oldrow_val, newrow_val, branch_val;
-
-    check(err, avro_value_get_by_index(frame_val, 0, &msg_val, NULL));
-    check(err, avro_value_append(&msg_val, &union_val, NULL));
-    check(err, avro_value_set_branch(&union_val, PROTOCOL_MSG_UPDATE, &record_val));
-    check(err, avro_value_get_by_index(&record_val, 0, &relid_val,  NULL));
-    check(err, avro_value_get_by_index(&record_val, 1, &key_val,    NULL));
-    check(err, avro_value_get_by_index(&record_val, 2, &oldrow_val, NULL));
-    check(err, avro_value_get_by_index(&record_val, 3, &newrow_val, NULL));
-    check(err, avro_value_set_long(&relid_val, relid));
-    check(err, avro_value_set_bytes(&newrow_val, VARDATA(new_bin), VARSIZE(new_bin) - VARHDRSZ));
-
-    if (key_bin) {
-        check(err, avro_value_set_branch(&key_val, 1, &branch_val));
-        check(err, avro_value_set_bytes(&branch_val, VARDATA(key_bin), VARSIZE(key_bin) - VARHDRSZ));
+/* Sends Avro schemas for a table to the client. This is called the first time we send
+ * row-level events for a table, as well as every time the schema changes. All subsequent
+ * inserts/updates/deletes are assumed to be encoded with this schema. If the client
+ * asked for fingerprints, the schemas are sent as a FingerprintedSchema message. */
+int update_frame_with_table_schema(frame_buffer *frame, schema_cache_t cache, schema_cache_entry *entry) {
+    int err = 0, start;
+    bool fingerprint = (cache->options.schema_fingerprint == SCHEMA_FINGERPRINT_INCLUDE);
+
+    begin_message(frame, fingerprint ? PROTOCOL_MSG_FINGERPRINTED_SCHEMA : PROTOCOL_MSG_TABLE_SCHEMA);
+    write_avro_long(&frame->buf, entry->relid);
+    start = frame->buf.len;
+
+    if (entry->key_schema) {
+        write_avro_long(&frame->buf, 1);
+        check(err, write_schema_string(&frame->buf, entry->key_schema,
+                    entry->key_tupdesc, NULL, &cache->options));
     } else {
-        check(err, avro_value_set_branch(&key_val, 0, NULL));
+        write_avro_long(&frame->buf, 0);
     }
 
-    if (old_bin) {
-        check(err, avro_value_set_branch(&oldrow_val, 1, &branch_val));
-        check(err, avro_value_set_bytes(&branch_val, VARDATA(old_bin), VARSIZE(old_bin) - VARHDRSZ));
-    } else {
-        check(err, avro_value_set_branch(&oldrow_val, 0, NULL));
+    check(err, write_schema_string(&frame->buf, entry->row_schema,
+                entry->row_tupdesc, entry->excluded_columns, &cache->options));
+
+    if (fingerprint) {
+        write_avro_long(&frame->buf, (int64) schema_fingerprint(frame->buf.data + start,
+                    frame->buf.len - start));
     }
     return err;
 }
 
-/* Populates a wire protocol message for a delete event. */
-int update_frame_with_delete_raw(avro_value_t *frame_val, Oid relid, bytea *key_bin, bytea *old_bin) {
-    int err = 0;
-    avro_value_t msg_val, union_val, record_val, relid_val, key_val, oldrow_val, branch_val;
-
-    check(err, avro_value_get_by_index(frame_val, 0, &msg_val, NULL));
-    check(err, avro_value_append(&msg_val, &union_val, NULL));
-    check(err, avro_value_set_branch(&union_val, PROTOCOL_MSG_DELETE, &record_val));
-    check(err, avro_value_get_by_index(&record_val, 0, &relid_val,   NULL));
-    check(err, avro_value_get_by_index(&record_val, 1, &key_val,     NULL));
-    check(err, avro_value_get_by_index(&record_val, 2, &oldrow_val,  NULL));
-    check(err, avro_value_set_long(&relid_val, relid));
-
-    if (key_bin) {
-        check(err, avro_value_set_branch(&key_val, 1, &branch_val));
-        check(err, avro_value_set_bytes(&branch_val, VARDATA(key_bin), VARSIZE(key_bin) - VARHDRSZ));
-    } else {
-        check(err, avro_value_set_branch(&key_val, 0, NULL));
+/* Computes the 64-bit Rabin fingerprint (CRC-64-AVRO, as defined by the Avro
+ * specification) of the encoded keySchema and rowSchema fields of a FingerprintedSchema
+ * message. The client compares it with the fingerprint of the schemas it already
+ * has for the table, which is much cheaper than parsing the JSON again. */
+uint64 schema_fingerprint(const char *data, int len) {
+    static const uint64 empty = UINT64CONST(0xc15d213aa4d7a795);
+    static uint64 table[256];
+    static bool table_initialized = false;
+    uint64 fp = empty;
+
+    if (!table_initialized) {
+        for (int i = 0; i < 256; i++) {
+            uint64 entry = i;
+            for (int j = 0; j < 8; j++) {
+                entry = (entry >> 1) ^ (empty & -(entry & 1));
+            }
+            table[i] = entry;
+        }
+        table_initialized = true;
     }
 
-    if (old_bin) {
-        check(err, avro_value_set_branch(&oldrow_val, 1, &branch_val));
-        check(err, avro_value_set_bytes(&branch_val, VARDATA(old_bin), VARSIZE(old_bin) - VARHDRSZ));
-    } else {
-        check(err, avro_value_set_branch(&oldrow_val, 0, NULL));
+    for (int i = 0; i < len; i++) {
+        fp = (fp >> 8) ^ table[(fp ^ (unsigned char) data[i]) & 0xff];
     }
-    return err;
+    return fp;
 }
@@ -1,15 +1,32 @@
 #ifndef PROTOCOL_SERVER_H
 #define PROTOCOL_SERVER_H
 
+#include "profile.h"
 #include "protocol.h"
 #include "schema_cache.h"
 #include "postgres.h"
+#include "lib/stringinfo.h"
 #include "replication/output_plugin.h"
 
-int update_frame_with_begin_txn(avro_value_t *frame_val, ReorderBufferTXN *txn);
-int update_frame_with_commit_txn(avro_value_t *frame_val, ReorderBufferTXN *txn, XLogRecPtr commit_lsn);
-int update_frame_with_insert(avro_value_t *frame_val, schema_cache_t cache, Relation rel, TupleDesc tupdesc, HeapTuple newtuple);
-int update_frame_with_update(avro_value_t *frame_val, schema_cache_t cache, Relation rel, HeapTuple oldtuple, HeapTuple newtuple);
-int update_frame_with_delete(avro_value_t *frame_val, schema_cache_t cache, Relation rel, HeapTuple oldtuple);
+/* A frame of the wire protocol that is being built up. Messages are appended to the
+ * buffer in Avro binary encoding as they are generated, and frame_buffer_finish()
+ * completes the encoding of the frame. */
+typedef struct {
+    StringInfoData buf;   /* Binary encoding of the frame so far */
+    int num_messages;     /* Number of messages that have been appended to the frame */
+    profiler *profiler;   /* Records the time taken to generate messages (NULL = not profiling) */
+} frame_buffer;
+
+void frame_buffer_init(frame_buffer *frame);
+void frame_buffer_reset(frame_buffer *frame);
+void frame_buffer_truncate(frame_buffer *frame, int len, int num_messages);
+void frame_buffer_finish(frame_buffer *frame);
+void frame_buffer_free(frame_buffer *frame);
+
+int update_frame_with_begin_txn(frame_buffer *frame, ReorderBufferTXN *txn);
+int update_frame_with_commit_txn(frame_buffer *frame, ReorderBufferTXN *txn, XLogRecPtr commit_lsn);
+int update_frame_with_insert(frame_buffer *frame, schema_cache_t cache, Relation rel, TupleDesc tupdesc, HeapTuple newtuple);
+int update_frame_with_update(frame_buffer *frame, schema_cache_t cache, Relation rel, HeapTuple oldtuple, HeapTuple newtuple);
+int update_frame_with_delete(frame_buffer *frame, schema_cache_t cache, Relation rel, HeapTuple oldtuple);
 
 #endif /* PROTOCOL_SERVER_H */
@@ -0,0 +1,142 @@
+/* Evaluates row filter predicates (see table_filter.c) on the server, so that rows which
+ * don't match are dropped before they are encoded or sent to the client. A predicate is
+ * parsed and planned like the WHERE clause of a query on the table, once for each table
+ * schema, and is then evaluated on each row with the executor's expression machinery. */
+
+#include "row_filter.h"
+#include "executor/executor.h"
+#include "lib/stringinfo.h"
+#include "optimizer/clauses.h"
+#include "parser/parse_coerce.h"
+#include "parser/parse_collate.h"
+#include "parser/parse_expr.h"
+#include "parser/parse_node.h"
+#include "parser/parse_relation.h"
+#include "parser/parser.h"
+#include "rewrite/rewriteManip.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+
+Node *row_filter_parse(Relation rel, const char *predicate);
+
+/* Compiles a predicate, given as a SQL boolean expression over the columns of the
+ * given table. Raises an error if the predicate is not a valid expression of that
+ * kind. The returned filter and all its state, including what parsing the predicate
+ * allocates, live in a memory context of their own, a child of the current memory
+ * context, which row_filter_free() deletes. The filter must be compiled again if the
+ * table schema changes. */
+row_filter *row_filter_compile(Relation rel, const char *predicate) {
+    MemoryContext context, oldctx;
+    Node *expr;
+    row_filter *filter;
+
+    context = AllocSetContextCreate(CurrentMemoryContext, "row filter",
+            ALLOCSET_SMALL_MINSIZE, ALLOCSET_SMALL_INITSIZE, ALLOCSET_SMALL_MAXSIZE);
+    oldctx = MemoryContextSwitchTo(context);
+
+    expr = row_filter_parse(rel, predicate);
+    filter = palloc0(sizeof(row_filter));
+    filter->context = context;
+
+    filter->estate = CreateExecutorState();
+    filter->expr = ExecPrepareExpr((Expr *) expr, filter->estate);
+    filter->econtext = GetPerTupleExprContext(filter->estate);
+
+    MemoryContextSwitchTo(filter->estate->es_query_cxt);
+    filter->slot = MakeSingleTupleTableSlot(CreateTupleDescCopy(RelationGetDescr(rel)));
+    MemoryContextSwitchTo(oldctx);
+
+    return filter;
+}
+
+/* Parses a predicate and resolves the column references in it against the table,
+ * returning the expression tree (which is not yet planned). */
+Node *row_filter_parse(Relation rel, const char *predicate) {
+    StringInfoData query;
+    List *parsetree;
+    SelectStmt *select;
+    ResTarget *target;
+    ParseState *pstate;
+    RangeTblEntry *rte;
+    Node *expr;
+    char *relname = quote_qualified_identifier(
+            get_namespace_name(RelationGetNamespace(rel)), RelationGetRelationName(rel));
+
+    /* Parse the predicate as the target of a SELECT, and check that it is nothing more
+     * than a single expression (it may also end up in the WHERE clause of the snapshot) */
+    initStringInfo(&query);
+    appendStringInfo(&query, "SELECT %s\n", predicate);
+    parsetree = raw_parser(query.data);
+
+    select = (list_length(parsetree) == 1 && IsA(linitial(parsetree), SelectStmt)) ?
+        (SelectStmt *) linitial(parsetree) : NULL;
+
+    if (!select || select->op != SETOP_NONE || list_length(select->targetList) != 1 ||
+            select->distinctClause || select->intoClause || select->fromClause ||
+            select->whereClause || select->groupClause || select->havingClause ||
+            select->windowClause || select->valuesLists || select->sortClause ||
+            select->limitOffset || select->limitCount || select->lockingClause ||
+            select->withClause || ((ResTarget *) linitial(select->targetList))->name) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("row filter for table %s is not a single expression: %s", relname, predicate)));
+    }
+    target = (ResTarget *) linitial(select->targetList);
+
+    /* Resolve column names as in a WHERE clause of a query on the table */
+    pstate = make_parsestate(NULL);
+    pstate->p_sourcetext = query.data;
+    rte = addRangeTableEntryForRelation(pstate, rel, NULL, false, false);
+    addRTEtoQuery(pstate, rte, false, true, true);
+
+    expr = transformExpr(pstate, target->val, EXPR_KIND_WHERE);
+    expr = coerce_to_boolean(pstate, expr, "row filter");
+    assign_expr_collations(pstate, expr);
+
+    if (checkExprHasSubLink(expr)) {
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("row filter for table %s must not contain subqueries: %s", relname, predicate)));
+    }
+
+    /* The predicate is evaluated in the walsender under a historic catalog snapshot,
+     * where only functions that depend on nothing but their arguments are safe */
+    if (contain_mutable_functions(expr)) {
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("row filter for table %s must only use immutable functions and operators: %s",
+                     relname, predicate)));
+    }
+
+    free_parsestate(pstate);
+    return expr;
+}
+
+/* Evaluates the filter's predicate on a row of the table it was compiled for. Returns
+ * true if the predicate is true, false if it is false, and unknown_result if it is
+ * null (for example because the columns it refers to are not present in the old row
+ * image of a delete). */
+bool row_filter_matches(row_filter *filter, HeapTuple tuple, bool unknown_result) {
+    ExprContext *econtext = filter->econtext;
+    Datum result;
+    bool isnull;
+
+    ResetExprContext(econtext);
+    ExecStoreTuple(tuple, filter->slot, InvalidBuffer, false);
+    econtext->ecxt_scantuple = filter->slot;
+
+    result = ExecEvalExprSwitchContext(filter->expr, econtext, &isnull, NULL);
+    ExecClearTuple(filter->slot);
+
+    return isnull ? unknown_result : DatumGetBool(result);
+}
+
+/* Frees a compiled row filter and all its state, by deleting its memory context. */
+void row_filter_free(row_filter *filter) {
+    MemoryContext context = filter->context;
+
+    ExecDropSingleTupleTableSlot(filter->slot);
+    FreeExecutorState(filter->estate);
+    MemoryContextDelete(context);
+}
@@ -0,0 +1,23 @@
+#ifndef ROW_FILTER_H
+#define ROW_FILTER_H
+
+#include "postgres.h"
+#include "access/htup.h"
+#include "executor/tuptable.h"
+#include "nodes/execnodes.h"
+#include "utils/rel.h"
+
+/* A predicate over the rows of a table, compiled for evaluation by the executor. */
+typedef struct {
+    MemoryContext   context;  /* Holds the filter, its parse tree and everything below */
+    EState         *estate;   /* Executor state, whose memory context is a child of context */
+    ExprState      *expr;     /* The compiled predicate */
+    ExprContext    *econtext; /* Context in which the predicate is evaluated */
+    TupleTableSlot *slot;     /* Slot through which the predicate reads the columns of a row */
+} row_filter;
+
+row_filter *row_filter_compile(Relation rel, const char *predicate);
+bool row_filter_matches(row_filter *filter, HeapTuple tuple, bool unknown_result);
+void row_filter_free(row_filter *filter);
+
+#endif /* ROW_FILTER_H */
@@ -4,63 +4,261 @@
 #include "lib/stringinfo.h"
 #include "access/heapam.h"
 #include "access/tupdesc.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
-
+#include "utils/syscache.h"
+
+/* Relcache and namespace invalidations received by this backend are recorded in a
+ * small ring buffer, and each schema cache applies them to its entries the next time
+ * it is used. The invalidation callbacks can't touch the caches directly: callbacks
+ * can't be unregistered, and a cache may be freed (e.g. when an error aborts a
+ * snapshot) without us getting a chance to remove it from a list of live caches. */
+#define INVAL_LOG_SIZE 64
+
+static Oid inval_log[INVAL_LOG_SIZE]; /* relids of invalidated relations, InvalidOid = all */
+static uint64 inval_count = 0;        /* Total number of invalidations received */
+static bool callbacks_registered = false;
+
+static void schema_cache_relcache_callback(Datum arg, Oid relid);
+static void schema_cache_syscache_callback(Datum arg, int cacheid, uint32 hashvalue);
+HTAB *schema_cache_hash_create(const char *name, Size entrysize, MemoryContext context);
+void schema_cache_apply_invalidations(schema_cache_t cache);
+void schema_cache_invalidate(schema_cache_t cache, Oid relid);
+void schema_cache_entry_set_names(schema_cache_entry *entry, Relation rel);
 int schema_cache_entry_update(schema_cache_t cache, schema_cache_entry *entry, Relation rel);
 bool schema_cache_entry_changed(schema_cache_entry *entry, Relation rel);
 void schema_cache_entry_decrefs(schema_cache_entry *entry);
 void tupdesc_debug_info(StringInfo msg, TupleDesc tupdesc);
 
 /* Creates a new schema cache. All palloc allocations for this cache will be
- * performed in the given memory context. */
-schema_cache_t schema_cache_new(MemoryContext context) {
-    HASHCTL hash_ctl;
+ * performed in the given memory context. The encoding options are copied into
+ * the cache, and determine the schemas and encoding plans of all its entries.
+ * filter (which may be NULL) determines which tables and columns are included,
+ * and must remain valid for the lifetime of the cache. */
+schema_cache_t schema_cache_new(MemoryContext context, encoding_options *options,
+        table_filter_t filter) {
     MemoryContext oldctx = MemoryContextSwitchTo(context);
     schema_cache_t cache = palloc0(sizeof(schema_cache));
     cache->context = context;
+    cache->options = *options;
+    cache->filter = filter;
+
+    cache->entries = schema_cache_hash_create("Bottled Water schema cache",
+            sizeof(schema_cache_entry), context);
+    if (table_filter_has_row_filters(filter)) {
+        cache->row_filters = schema_cache_hash_create("Bottled Water row filters",
+                sizeof(row_filter_entry), context);
+    }
+
+    MemoryContextSwitchTo(oldctx);
+
+    if (!callbacks_registered) {
+        CacheRegisterRelcacheCallback(schema_cache_relcache_callback, (Datum) 0);
+        CacheRegisterSyscacheCallback(NAMESPACEOID, schema_cache_syscache_callback, (Datum) 0);
+        callbacks_registered = true;
+    }
+    cache->inval_seen = inval_count;
+
+    return cache;
+}
 
+/* Creates a hash table whose entries start with an Oid key, allocated in the given
+ * memory context. */
+HTAB *schema_cache_hash_create(const char *name, Size entrysize, MemoryContext context) {
+    HASHCTL hash_ctl;
     memset(&hash_ctl, 0, sizeof(hash_ctl));
     hash_ctl.keysize = sizeof(Oid);
-    hash_ctl.entrysize = sizeof(schema_cache_entry);
+    hash_ctl.entrysize = entrysize;
     hash_ctl.hcxt = context;
 
 #ifdef HASH_BLOBS
     /* Postgres 9.5 */
-    cache->entries = hash_create("Bottled Water schema cache", 32, &hash_ctl,
-            HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    return hash_create(name, 32, &hash_ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
 #else
     /* Postgres 9.4 */
     hash_ctl.hash = oid_hash;
-    cache->entries = hash_create("Bottled Water schema cache", 32, &hash_ctl,
-            HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+    return hash_create(name, 32, &hash_ctl, HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
 #endif
+}
 
-    MemoryContextSwitchTo(oldctx);
-    return cache;
+/* Called by Postgres when a relcache entry is invalidated, for example because a
+ * table was altered or renamed. During logical decoding, this also happens when the
+ * invalidations of a transaction that modified the catalog are replayed. relid is
+ * InvalidOid if all relcache entries are being invalidated. */
+static void schema_cache_relcache_callback(Datum arg, Oid relid) {
+    inval_log[inval_count % INVAL_LOG_SIZE] = relid;
+    inval_count++;
+}
+
+/* Called by Postgres when a namespace is changed (e.g. renamed). The hash value
+ * doesn't tell us which namespace it was, so all tables need to be checked. */
+static void schema_cache_syscache_callback(Datum arg, int cacheid, uint32 hashvalue) {
+    schema_cache_relcache_callback(arg, InvalidOid);
+}
+
+/* Marks the entries affected by any invalidations received since this function was
+ * last called on the cache. If more invalidations arrived than fit in the log, we
+ * no longer know which tables they concerned, so all entries are marked. */
+void schema_cache_apply_invalidations(schema_cache_t cache) {
+    if (inval_count - cache->inval_seen > INVAL_LOG_SIZE) {
+        schema_cache_invalidate(cache, InvalidOid);
+    } else {
+        for (uint64 i = cache->inval_seen; i < inval_count; i++) {
+            schema_cache_invalidate(cache, inval_log[i % INVAL_LOG_SIZE]);
+        }
+    }
+    cache->inval_seen = inval_count;
+}
+
+/* Marks the cache entry for the table with the given relid as dirty, so that its
+ * schema is checked the next time the table is looked up. relid may also be the
+ * key index of a table (renaming an index doesn't invalidate its table), or
+ * InvalidOid to mark all entries. */
+void schema_cache_invalidate(schema_cache_t cache, Oid relid) {
+    HASH_SEQ_STATUS iterator;
+    schema_cache_entry *entry;
+
+    if (cache->row_filters) {
+        row_filter_entry *filter_entry;
+        hash_seq_init(&iterator, cache->row_filters);
+        while ((filter_entry = (row_filter_entry *) hash_seq_search(&iterator)) != NULL) {
+            if (!OidIsValid(relid) || filter_entry->relid == relid) {
+                filter_entry->dirty = true;
+            }
+        }
+    }
+
+    if (OidIsValid(relid)) {
+        entry = (schema_cache_entry *) hash_search(cache->entries, &relid, HASH_FIND, NULL);
+        if (entry) {
+            entry->dirty = true;
+            return;
+        }
+    }
+
+    hash_seq_init(&iterator, cache->entries);
+    while ((entry = (schema_cache_entry *) hash_seq_search(&iterator)) != NULL) {
+        if (!OidIsValid(relid) || entry->key_id == relid) {
+            entry->dirty = true;
+        }
+    }
+}
+
+/* Returns true if changes to the given relation should be replicated, and false if the
+ * table filter excludes it. The decision is remembered in the relation's cache entry,
+ * so for a table that has been seen before this is just a hash table probe. Excluded
+ * tables get an entry without schemas, so that their changes can be skipped without
+ * doing any work; the filter is evaluated again if the table is renamed. Included
+ * tables are added to the cache by the subsequent schema_cache_lookup(). */
+bool schema_cache_table_included(schema_cache_t cache, Relation rel) {
+    Oid relid = RelationGetRelid(rel);
+    bool found_entry;
+    schema_cache_entry *entry;
+
+    if (!table_filter_has_tables(cache->filter)) return true;
+
+    if (cache->inval_seen != inval_count) {
+        schema_cache_apply_invalidations(cache);
+    }
+
+    entry = (schema_cache_entry *) hash_search(cache->entries, &relid, HASH_FIND, NULL);
+    if (entry && !entry->dirty) return !entry->excluded;
+
+    if (table_filter_includes(cache->filter, get_namespace_name(RelationGetNamespace(rel)),
+                RelationGetRelationName(rel))) {
+        return true;
+    }
+
+    /* Remember that the table is excluded, replacing any previous entry for it */
+    entry = (schema_cache_entry *) hash_search(cache->entries, &relid, HASH_ENTER, &found_entry);
+    if (found_entry) {
+        schema_cache_entry_decrefs(entry);
+    } else {
+        memset(entry, 0, sizeof(schema_cache_entry));
+    }
+    schema_cache_entry_set_names(entry, rel);
+    entry->excluded = true;
+    return false;
+}
+
+/* Returns true if the given row of a relation satisfies the row filter predicate for
+ * that relation, or if there is no predicate for it. If the predicate evaluates to
+ * null, unknown_result is returned. tuple must have the relation's tuple descriptor.
+ *
+ * The predicate is compiled the first time a table is seen, and again after a cache
+ * invalidation for the table (the column numbers or types it refers to may have
+ * changed). Tables without a predicate are remembered too, so for them this is just
+ * a hash table probe. */
+bool schema_cache_row_included(schema_cache_t cache, Relation rel, HeapTuple tuple,
+        bool unknown_result) {
+    Oid relid = RelationGetRelid(rel);
+    bool found_entry;
+    row_filter_entry *entry;
+
+    if (!cache->row_filters) return true;
+
+    if (cache->inval_seen != inval_count) {
+        schema_cache_apply_invalidations(cache);
+    }
+
+    entry = (row_filter_entry *) hash_search(cache->row_filters, &relid, HASH_ENTER, &found_entry);
+
+    if (!found_entry || entry->dirty) {
+        char *predicate = table_filter_row_predicate(cache->filter,
+                get_namespace_name(RelationGetNamespace(rel)), RelationGetRelationName(rel));
+
+        if (found_entry && entry->filter) row_filter_free(entry->filter);
+        entry->filter = NULL;
+        entry->dirty = true; /* in case compiling the predicate fails */
+
+        if (predicate) {
+            MemoryContext oldctx = MemoryContextSwitchTo(cache->context);
+            entry->filter = row_filter_compile(rel, predicate);
+            MemoryContextSwitchTo(oldctx);
+        }
+        entry->dirty = false;
+    }
+
+    return !entry->filter || row_filter_matches(entry->filter, tuple, unknown_result);
 }
 
 /* Obtains the schema cache entry for the given relation, creating or updating it if necessary.
  * If the schema hasn't changed since the last invocation, a cached value is used and 0 is returned.
  * If the schema has changed, 1 is returned. If the schema has not been seen before, 2 is returned.
- * If an error occurred creating or updating the entry, returns a negative value. */
+ * If an error occurred creating or updating the entry, returns a negative value.
+ *
+ * An existing entry is only compared against the relation if a cache invalidation has
+ * marked it as dirty since it was last checked; otherwise the lookup is just a hash
+ * table probe. */
 int schema_cache_lookup(schema_cache_t cache, Relation rel, schema_cache_entry **entry_out) {
     Oid relid = RelationGetRelid(rel);
     bool found_entry;
     int err;
-    schema_cache_entry *entry = (schema_cache_entry *)
-        hash_search(cache->entries, &relid, HASH_ENTER, &found_entry);
+    schema_cache_entry *entry;
+
+    if (cache->inval_seen != inval_count) {
+        schema_cache_apply_invalidations(cache);
+    }
+
+    entry = (schema_cache_entry *) hash_search(cache->entries, &relid, HASH_ENTER, &found_entry);
 
     if (found_entry) {
-        if (!schema_cache_entry_changed(entry, rel)) {
+        /* Invalidations are also sent for catalog changes that don't affect the
+         * schema (e.g. creating an index), so a dirty entry may still be valid */
+        if (!entry->dirty || !schema_cache_entry_changed(entry, rel)) {
             /* Schema has not changed */
+            entry->dirty = false;
+            cache->hits++;
             *entry_out = entry;
             return 0;
 
         } else {
             /* Schema has changed since we last saw it -- update the cache */
+            cache->misses++;
             schema_cache_entry_decrefs(entry);
             err = schema_cache_entry_update(cache, entry, rel);
             if (err) {
+                entry->dirty = true; /* try again next time */
                 *entry_out = NULL;
                 return -1;
             }
@@ -69,8 +267,11 @@ int schema_cache_lookup(schema_cache_t cache, Relation rel, schema_cache_entry *
         }
     } else {
         /* Schema not previously seen -- populate a new cache entry */
+        cache->misses++;
+        memset(entry, 0, sizeof(schema_cache_entry));
         err = schema_cache_entry_update(cache, entry, rel);
         if (err) {
+            entry->dirty = true; /* try again next time */
             *entry_out = NULL;
             return -2;
         }
@@ -79,16 +280,22 @@ int schema_cache_lookup(schema_cache_t cache, Relation rel, schema_cache_entry *
     }
 }
 
+/* Sets the identity and names of the table in a schema cache entry. */
+void schema_cache_entry_set_names(schema_cache_entry *entry, Relation rel) {
+    entry->relid = RelationGetRelid(rel);
+    entry->dirty = false;
+    entry->ns_id = RelationGetNamespace(rel);
+    strcpy(NameStr(entry->relname), RelationGetRelationName(rel));
+    strcpy(NameStr(entry->ns_name), get_namespace_name(entry->ns_id));
+}
+
 /* Populates a schema cache entry with the information from a given table. */
 int schema_cache_entry_update(schema_cache_t cache, schema_cache_entry *entry, Relation rel) {
     Relation index_rel;
     MemoryContext oldctx;
     int err;
 
-    entry->relid = RelationGetRelid(rel);
-    entry->ns_id = RelationGetNamespace(rel);
-    strcpy(NameStr(entry->relname), RelationGetRelationName(rel));
-    strcpy(NameStr(entry->ns_name), get_namespace_name(entry->ns_id));
+    schema_cache_entry_set_names(entry, rel);
 
     index_rel = table_key_index(rel);
     if (index_rel) {
@@ -105,39 +312,38 @@ int schema_cache_entry_update(schema_cache_t cache, schema_cache_entry *entry, R
     oldctx = MemoryContextSwitchTo(cache->context);
     if (index_rel) {
         entry->key_tupdesc = CreateTupleDescCopyConstr(RelationGetDescr(index_rel));
+        entry->key_plan = encoding_plan_for_key(RelationGetDescr(rel), index_rel, &cache->options);
         relation_close(index_rel, AccessShareLock);
     } else {
         entry->key_tupdesc = NULL;
+        entry->key_plan = NULL;
     }
     entry->row_tupdesc = CreateTupleDescCopyConstr(RelationGetDescr(rel));
+    entry->excluded_columns = table_filter_excluded_columns(cache->filter,
+            NameStr(entry->ns_name), NameStr(entry->relname), entry->row_tupdesc);
+    entry->row_plan = encoding_plan_for_row(entry->row_tupdesc, &cache->options,
+            entry->excluded_columns);
+    entry->key_only = table_filter_key_only(cache->filter,
+            NameStr(entry->ns_name), NameStr(entry->relname));
     MemoryContextSwitchTo(oldctx);
 
-    err = schema_for_table_key(rel, &entry->key_schema);
+    err = schema_for_table_key(rel, &cache->options, &entry->key_schema);
     if (err) return err;
-    err = schema_for_table_row(rel, &entry->row_schema);
+    err = schema_for_table_row(rel, &cache->options, entry->excluded_columns, &entry->row_schema);
     if (err) return err;
-    entry->row_iface = avro_generic_class_from_schema(entry->row_schema);
-    if (entry->row_iface == NULL) return EINVAL;
-    avro_generic_value_new(entry->row_iface, &entry->row_value);
-
-    if (entry->key_schema) {
-        entry->key_iface = avro_generic_class_from_schema(entry->key_schema);
-        if (entry->key_iface == NULL) return EINVAL;
-        avro_generic_value_new(entry->key_iface, &entry->key_value);
-    }
 
     return 0;
 }
 
 /* Returns false if the schema of the given relation matches the cache entry,
  * and returns true if it has changed. This is detected by keeping a copy of
- * the schema information in the cache entry. An alternative way of implementing
- * this might be to use event triggers:
- * http://www.postgresql.org/docs/9.4/static/event-triggers.html */
+ * the schema information in the cache entry. Only called for entries that have
+ * been marked dirty by a cache invalidation. */
 bool schema_cache_entry_changed(schema_cache_entry *entry, Relation rel) {
     Relation index_rel;
     bool changed = false;
 
+    if (entry->excluded) return true; /* table is no longer excluded, needs schemas */
     if (entry->relid != RelationGetRelid(rel)) return true;
     if (entry->ns_id != RelationGetNamespace(rel)) return true;
     if (strcmp(NameStr(entry->relname), RelationGetRelationName(rel)) != 0) return true;
@@ -164,18 +370,14 @@ bool schema_cache_entry_changed(schema_cache_entry *entry, Relation rel) {
 
 /* Decrements the reference counts for a schema cache entry. */
 void schema_cache_entry_decrefs(schema_cache_entry *entry) {
+    if (entry->key_plan) encoding_plan_free(entry->key_plan);
+    if (entry->row_plan) encoding_plan_free(entry->row_plan);
     if (entry->key_tupdesc) pfree(entry->key_tupdesc);
     if (entry->row_tupdesc) pfree(entry->row_tupdesc);
+    if (entry->excluded_columns) bms_free(entry->excluded_columns);
 
-    avro_value_decref(&entry->row_value);
-    avro_value_iface_decref(entry->row_iface);
-    avro_schema_decref(entry->row_schema);
-
-    if (entry->key_schema) {
-        avro_value_decref(&entry->key_value);
-        avro_value_iface_decref(entry->key_iface);
-        avro_schema_decref(entry->key_schema);
-    }
+    if (entry->row_schema) avro_schema_decref(entry->row_schema);
+    if (entry->key_schema) avro_schema_decref(entry->key_schema);
 
     memset(entry, 0, sizeof(schema_cache_entry));
 }
@@ -191,6 +393,16 @@ void schema_cache_free(schema_cache_t cache) {
     }
 
     hash_destroy(cache->entries);
+
+    if (cache->row_filters) {
+        row_filter_entry *filter_entry;
+        hash_seq_init(&iterator, cache->row_filters);
+        while ((filter_entry = (row_filter_entry *) hash_seq_search(&iterator)) != NULL) {
+            if (filter_entry->filter) row_filter_free(filter_entry->filter);
+        }
+        hash_destroy(cache->row_filters);
+    }
+
     pfree(cache);
 }
 
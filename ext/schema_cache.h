@@ -2,6 +2,8 @@
 #define SCHEMA_CACHE_H
 
 #include "oid2avro.h"
+#include "row_filter.h"
+#include "table_filter.h"
 #include "utils/hsearch.h"
 
 typedef struct {
@@ -17,20 +19,38 @@ typedef struct {
     TupleDesc           row_tupdesc; /* Postgres tuple descriptor for a row of this table */
     avro_schema_t       key_schema;  /* Avro schema for the table's primary key or replica identity */
     avro_schema_t       row_schema;  /* Avro schema for one row of the table */
-    avro_value_iface_t *key_iface;   /* Avro generic interface for creating key values */
-    avro_value_iface_t *row_iface;   /* Avro generic interface for creating row values */
-    avro_value_t        key_value;   /* Avro key value, for encoding one key */
-    avro_value_t        row_value;   /* Avro row value, for encoding one row */
+    encoding_plan      *key_plan;    /* How to extract and encode the key columns of a row (NULL if unkeyed) */
+    encoding_plan      *row_plan;    /* How to encode the columns of a row */
+    Bitmapset          *excluded_columns; /* Columns omitted from rows by the table filter (indexes into row_tupdesc) */
+    bool                excluded;    /* True if the table filter excludes this table. Only the names are set */
+    bool                key_only;    /* True if changes are sent as KeyChange messages, without rows */
+    bool                dirty;       /* Set by cache invalidation; entry must be checked before use */
 } schema_cache_entry;
 
+typedef struct {
+    Oid                 relid;       /* Oid of the table. Used as key in hash table, so it must be first in struct */
+    row_filter         *filter;      /* Compiled row filter predicate (NULL if all rows are included) */
+    bool                dirty;       /* Set by cache invalidation; predicate must be compiled again before use */
+} row_filter_entry;
+
 typedef struct {
     MemoryContext context;         /* Context in which cache entries are allocated */
     HTAB *entries;                 /* Hash table mapping Oid to schema_cache_entry */
+    HTAB *row_filters;             /* Hash table mapping Oid to row_filter_entry (NULL if no row filters) */
+    uint64 inval_seen;             /* Number of invalidations already applied to this cache */
+    uint64 hits;                   /* Lookups that found a valid entry (for statistics) */
+    uint64 misses;                 /* Lookups that had to generate an entry (for statistics) */
+    encoding_options options;      /* How the schemas and encoding plans map values to Avro */
+    table_filter_t filter;         /* Which tables and columns are replicated (NULL = all) */
 } schema_cache;
 
 typedef schema_cache *schema_cache_t;
 
-schema_cache_t schema_cache_new(MemoryContext context);
+schema_cache_t schema_cache_new(MemoryContext context, encoding_options *options,
+        table_filter_t filter);
+bool schema_cache_table_included(schema_cache_t cache, Relation rel);
+bool schema_cache_row_included(schema_cache_t cache, Relation rel, HeapTuple tuple,
+        bool unknown_result);
 int schema_cache_lookup(schema_cache_t cache, Relation rel, schema_cache_entry **entry_out);
 void schema_cache_free(schema_cache_t cache);
 char *schema_debug_info(Relation rel, TupleDesc tupdesc);
@@ -3,6 +3,8 @@
 #include "protocol_server.h"
 #include "error_policy.h"
 
+#include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include "postgres.h"
 #include "fmgr.h"
@@ -13,11 +15,26 @@
 #include "catalog/pg_type.h"
 #include "executor/spi.h"
 #include "lib/stringinfo.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/memutils.h"
 
 PG_MODULE_MAGIC;
 
+/* By default, rows are fetched from each table's cursor 1000 at a time, and packed
+ * into frames of about 1 MB, so that the per-row overhead of the set-returning
+ * function, SPI and libpq is amortised over many rows. */
+#define DEFAULT_SNAPSHOT_BATCH_ROWS 1000
+#define DEFAULT_SNAPSHOT_FRAME_MAX_BYTES (1024 * 1024)
+
+/* One entry of the snapshot_relids option: a table, and optionally a range of values
+ * of its key, which allows a large table to be split between snapshot workers. */
+typedef struct {
+    Oid relid;
+    bool has_min, has_max;     /* Whether the range has a lower and upper bound */
+    int64 min, max;            /* Rows whose key k satisfies min <= k < max are exported */
+} export_chunk;
+
 typedef struct {
     Oid relid;
     Relation rel;
@@ -25,6 +42,7 @@ typedef struct {
     char *rel_name;
     char repl_ident;
     char *index_name;
+    export_chunk *chunk;       /* Key range of the rows to export (NULL = all rows) */
 } export_table;
 
 /* State that we need to remember between calls of bottledwater_export */
@@ -32,19 +50,31 @@ typedef struct {
     MemoryContext memcontext;
     export_table *tables;
     error_policy_t error_policy;
+    encoding_options encoding;
+    table_filter_t table_filter;
     int num_tables, current_table;
-    avro_schema_t frame_schema;
-    avro_value_iface_t *frame_iface;
-    avro_value_t frame_value;
+    frame_buffer frame;
     schema_cache_t schema_cache;
     Portal cursor;
+    int batch_rows;             /* Number of rows to fetch from the cursor at a time */
+    int frame_max_bytes;        /* Return the frame once its encoded size reaches this */
+    SPITupleTable *batch;       /* Rows most recently fetched from the cursor */
+    int batch_size, batch_pos;  /* Number of rows in batch, and index of the next one to encode */
+    bool only_relids;           /* True if only the tables in relids should be exported */
+    List *relids;               /* export_chunk for each entry of the snapshot_relids option */
 } export_state;
 
 void print_tupdesc(char *title, TupleDesc tupdesc);
+void parse_export_options(export_state *state, ArrayType *options);
 void get_table_list(export_state *state, text *table_pattern, bool allow_unkeyed);
 void open_next_table(export_state *state);
 void close_current_table(export_state *state);
-bytea *format_snapshot_row(export_state *state);
+bool fetch_batch(export_state *state);
+void append_snapshot_row(export_state *state, HeapTuple tuple);
+int parse_export_int_option(const char *name, const char *value, int min_value);
+List *parse_relid_list(const char *name, const char *value);
+bool parse_key_bound(const char **pos, int64 *bound);
+char *chunk_key_column(export_table *table);
 bytea *schema_for_relname(char *relname, bool get_key);
 
 
@@ -78,16 +108,20 @@ PG_FUNCTION_INFO_V1(bottledwater_frame_schema);
  * This should be used by clients to decode the data streamed from the log, allowing
  * schema evolution to handle version changes of the plugin. */
 Datum bottledwater_frame_schema(PG_FUNCTION_ARGS) {
-    bytea *json;
+    StringInfoData json;
     avro_schema_t schema = schema_for_frame();
-    int err = try_writing(&json, &write_schema_json, schema);
+    int err;
+
+    initStringInfo(&json);
+    appendStringInfoSpaces(&json, VARHDRSZ);
+    err = try_writing(&json, &write_schema_json, schema);
     avro_schema_decref(schema);
 
     if (err) {
         elog(ERROR, "bottledwater_frame_schema: Could not encode schema as JSON: %s", avro_strerror());
         PG_RETURN_NULL();
     } else {
-        PG_RETURN_TEXT_P(json);
+        PG_RETURN_TEXT_P(string_info_to_bytea(&json));
     }
 }
 
@@ -96,8 +130,10 @@ PG_FUNCTION_INFO_V1(bottledwater_export);
 
 /* Given a search pattern for tables ('%' matches all tables), returns a set of byte array values.
  * Each byte array is a frame of our wire protocol, containing schemas and/or rows of the selected
- * tables. This is a set-returning function (SRF), which means it gets called once for each row of
- * output, allowing us to stream through large datasets without loading everything into memory.
+ * tables. Each frame contains rows until it reaches snapshot_frame_max_bytes. This is a
+ * set-returning function (SRF), which means it gets called once for each row of output (i.e.
+ * each frame), allowing us to stream through large datasets without loading everything into
+ * memory.
  *
  * SRF docs: http://www.postgresql.org/docs/9.4/static/xfunc-c.html#XFUNC-C-RETURN-SET */
 Datum bottledwater_export(PG_FUNCTION_ARGS) {
@@ -133,65 +169,195 @@ Datum bottledwater_export(PG_FUNCTION_ARGS) {
                                                   ALLOCSET_DEFAULT_MAXSIZE);
 
         state->current_table = 0;
-        state->frame_schema = schema_for_frame();
-        state->frame_iface = avro_generic_class_from_schema(state->frame_schema);
-        avro_generic_value_new(state->frame_iface, &state->frame_value);
-        state->schema_cache = schema_cache_new(funcctx->multi_call_memory_ctx);
+        state->batch = NULL;
+        state->batch_size = 0;
+        state->batch_pos = 0;
+        frame_buffer_init(&state->frame);
         funcctx->user_fctx = state;
 
         table_pattern = PG_GETARG_TEXT_P(0);
         allow_unkeyed = PG_GETARG_BOOL(1);
         state->error_policy = parse_error_policy(TextDatumGetCString(PG_GETARG_TEXT_P(2)));
+        /* The options argument is missing if the extension's SQL objects are still those
+         * of version 0.1 (i.e. ALTER EXTENSION bottledwater UPDATE hasn't been run) */
+        parse_export_options(state, PG_NARGS() > 3 ? PG_GETARG_ARRAYTYPE_P(3) : NULL);
+        state->schema_cache = schema_cache_new(funcctx->multi_call_memory_ctx, &state->encoding,
+                state->table_filter);
 
         get_table_list(state, table_pattern, allow_unkeyed);
         if (state->num_tables > 0) open_next_table(state);
     }
 
-    /* On every call of the function, try to fetch one row from the current cursor,
-     * and process it. If the current cursor has no more rows, move on to the next
-     * table. */
+    /* On every call of the function, encode rows from the current batch into a frame,
+     * fetching further batches from the cursor as needed, until the frame is full. If
+     * the current cursor has no more rows, move on to the next table. */
     funcctx = SRF_PERCALL_SETUP();
     state = (export_state *) funcctx->user_fctx;
 
-    while (state->current_table < state->num_tables) {
-        SPI_cursor_fetch(state->cursor, true, 1);
+    /* Leave space for the varlena header, which is filled in by string_info_to_bytea */
+    frame_buffer_reset(&state->frame);
+    appendStringInfoSpaces(&state->frame.buf, VARHDRSZ);
 
-        if (SPI_processed == 0) {
+    /* The byte limit is checked after each row, so a frame contains at least one row,
+     * even if that row is larger than the limit */
+    while (state->current_table < state->num_tables &&
+            (state->frame.num_messages == 0 || state->frame.buf.len < state->frame_max_bytes)) {
+        if (state->batch_pos == state->batch_size && !fetch_batch(state)) {
             close_current_table(state);
             state->current_table++;
             if (state->current_table < state->num_tables) open_next_table(state);
-        } else {
-            /* SPI_cursor_fetch() leaves us in the SPI mem. context */
-            MemoryContextSwitchTo(state->memcontext);
-
-            /* clear any prior tuple result memory */
-            MemoryContextReset(state->memcontext);
+            continue;
+        }
 
-            result = format_snapshot_row(state);
+        /* clear any prior tuple memory */
+        MemoryContextSwitchTo(state->memcontext);
+        MemoryContextReset(state->memcontext);
 
-            MemoryContextSwitchTo(oldcontext);
+        append_snapshot_row(state, state->batch->vals[state->batch_pos++]);
 
-            /* don't forget to clear the SPI temp context */
-            SPI_freetuptable(SPI_tuptable);
+        MemoryContextSwitchTo(oldcontext);
+    }
 
-            if (result != NULL) {
-                SRF_RETURN_NEXT(funcctx, PointerGetDatum(result));
-            }
-        }
+    if (state->frame.num_messages > 0) {
+        frame_buffer_finish(&state->frame);
+        result = string_info_to_bytea(&state->frame.buf);
+        SRF_RETURN_NEXT(funcctx, PointerGetDatum(result));
     }
 
     schema_cache_free(state->schema_cache);
-    avro_value_decref(&state->frame_value);
-    avro_value_iface_decref(state->frame_iface);
-    avro_schema_decref(state->frame_schema);
+    frame_buffer_free(&state->frame);
     SPI_finish();
     SRF_RETURN_DONE(funcctx);
 }
 
+/* Parses the options argument of bottledwater_export, which is an array of alternating
+ * option names and values. These are the same options as are given to the output
+ * plugin, so that the snapshot is encoded in the same way as the replication stream.
+ * Options that only concern the replication stream are ignored. options is NULL if the
+ * function was declared without that argument, in which case the defaults apply. */
+void parse_export_options(export_state *state, ArrayType *options) {
+    Datum *elems;
+    bool *nulls;
+    int num_elems;
+    char *name, *value;
+
+    encoding_options_init(&state->encoding);
+    state->table_filter = table_filter_new();
+    state->batch_rows = DEFAULT_SNAPSHOT_BATCH_ROWS;
+    state->frame_max_bytes = DEFAULT_SNAPSHOT_FRAME_MAX_BYTES;
+    state->only_relids = false;
+    state->relids = NIL;
+    if (!options) return;
+
+    deconstruct_array(options, TEXTOID, -1, false, 'i', &elems, &nulls, &num_elems);
+
+    if (num_elems % 2 != 0) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("bottledwater_export: options must be pairs of names and values")));
+    }
+
+    for (int i = 0; i < num_elems; i += 2) {
+        if (nulls[i]) {
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("bottledwater_export: option name must not be null")));
+        }
+        name = TextDatumGetCString(elems[i]);
+        value = nulls[i + 1] ? NULL : TextDatumGetCString(elems[i + 1]);
+
+        if (strcmp(name, "snapshot_batch_rows") == 0) {
+            state->batch_rows = parse_export_int_option(name, value, 1);
+        } else if (strcmp(name, "snapshot_frame_max_bytes") == 0) {
+            state->frame_max_bytes = parse_export_int_option(name, value, 0);
+        } else if (strcmp(name, "snapshot_relids") == 0) {
+            state->only_relids = true;
+            state->relids = parse_relid_list(name, value);
+        } else if (!encoding_options_parse(&state->encoding, name, value)) {
+            table_filter_parse(state->table_filter, name, value);
+        }
+    }
+}
+
+/* Parses the value of a bottledwater_export option as an integer, and checks that
+ * it is no smaller than min_value. */
+int parse_export_int_option(const char *name, const char *value, int min_value) {
+    char *end;
+    long result;
+
+    errno = 0;
+    result = value ? strtol(value, &end, 10) : 0;
+
+    if (!value || errno != 0 || end == value || *end != '\0' || result < min_value || result > INT_MAX) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("bottledwater_export: invalid value \"%s\" for option \"%s\": expected an integer >= %d",
+                    value ? value : "(null)", name, min_value)));
+    }
+    return (int) result;
+}
+
+/* Parses the value of the snapshot_relids option, which is used to divide the tables
+ * between several parallel snapshot workers. It is a comma-separated list of table
+ * Oids, each optionally followed by a range of key values, as relid:min:max. Either
+ * bound of the range may be empty, for a range that is unbounded on that side. A table
+ * may be listed several times with different ranges. An empty string means that no
+ * tables are exported. */
+List *parse_relid_list(const char *name, const char *value) {
+    List *relids = NIL;
+    const char *pos = value ? value : "";
+    char *end;
+
+    while (*pos != '\0') {
+        export_chunk *chunk = palloc0(sizeof(export_chunk));
+        unsigned long relid;
+        bool valid;
+
+        errno = 0;
+        relid = strtoul(pos, &end, 10);
+        valid = (errno == 0 && end != pos && relid != InvalidOid && relid <= UINT_MAX);
+        pos = end;
+
+        if (valid && *pos == ':') {
+            pos++;
+            chunk->has_min = parse_key_bound(&pos, &chunk->min);
+            valid = (*pos == ':');
+            if (valid) {
+                pos++;
+                chunk->has_max = parse_key_bound(&pos, &chunk->max);
+            }
+        }
+
+        if (!valid || errno != 0 || (*pos != ',' && *pos != '\0')) {
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("bottledwater_export: invalid value \"%s\" for option \"%s\": "
+                        "expected a comma-separated list of table Oids, each optionally "
+                        "followed by :min:max", value, name)));
+        }
+
+        chunk->relid = (Oid) relid;
+        relids = lappend(relids, chunk);
+        if (*pos == ',') pos++;
+    }
+    return relids;
+}
+
+/* Parses an optional integer at *pos, one bound of a key range, and advances *pos past
+ * it. Returns false if the bound is empty. Sets errno if the value is out of range. */
+bool parse_key_bound(const char **pos, int64 *bound) {
+    char *end;
+
+    if (**pos == ':' || **pos == ',' || **pos == '\0') return false;
+
+    *bound = strtoll(*pos, &end, 10);
+    if (end == *pos) errno = EINVAL;
+    *pos = end;
+    return true;
+}
+
 /* Queries the PG catalog to get a list of tables (matching the given table name pattern)
  * that we should export. The pattern is given to the LIKE operator, so "%" means any
  * table. Selects only ordinary tables (no views, foreign tables, etc) and excludes any
- * PG system tables. Updates export_state with the list of tables.
+ * PG system tables, as well as any tables excluded by the table filter option, or
+ * not listed in the snapshot_relids option if it is given.
+ * Updates export_state with the list of tables.
  *
  * Also takes a shared lock on all the tables we're going to export, to make sure they
  * aren't dropped or schema-altered before we get around to reading them. (Ordinary
@@ -232,8 +398,9 @@ void get_table_list(export_state *state, text *table_pattern, bool allow_unkeyed
         elog(ERROR, "Could not fetch table list: SPI_execute_with_args returned %d", ret);
     }
 
-    state->tables = palloc0(SPI_processed * sizeof(export_table));
-    state->num_tables = SPI_processed;
+    /* A table may be exported in several chunks, each of which has its own entry */
+    state->tables = palloc0((SPI_processed + list_length(state->relids)) * sizeof(export_table));
+    state->num_tables = 0;
     initStringInfo(&errors);
 
     for (int i = 0; i < SPI_processed; i++) {
@@ -241,6 +408,8 @@ void get_table_list(export_state *state, text *table_pattern, bool allow_unkeyed
         HeapTuple tuple = SPI_tuptable->vals[i];
         TupleDesc tupdesc = SPI_tuptable->tupdesc;
         export_table *table;
+        ListCell *cell;
+        bool listed = false;
 
         Datum oid_d       = heap_getattr(tuple, 1, tupdesc, &oid_null);
         Datum namespace_d = heap_getattr(tuple, 2, tupdesc, &namespace_null);
@@ -252,7 +421,16 @@ void get_table_list(export_state *state, text *table_pattern, bool allow_unkeyed
             elog(ERROR, "get_table_list: unexpected null value");
         }
 
-        table = &state->tables[i];
+        if (!table_filter_includes(state->table_filter, NameStr(*DatumGetName(namespace_d)),
+                    NameStr(*DatumGetName(relname_d)))) {
+            continue;
+        }
+        foreach(cell, state->relids) {
+            if (((export_chunk *) lfirst(cell))->relid == DatumGetObjectId(oid_d)) listed = true;
+        }
+        if (state->only_relids && !listed) continue;
+
+        table = &state->tables[state->num_tables];
         table->relid      = DatumGetObjectId(oid_d);
         table->rel        = relation_open(table->relid, AccessShareLock);
         table->namespace  = pstrdup(NameStr(*DatumGetName(namespace_d)));
@@ -273,12 +451,30 @@ void get_table_list(export_state *state, text *table_pattern, bool allow_unkeyed
                     quote_qualified_identifier(table->namespace, table->rel_name));
         }
 
-        for (int j = 0; j < i; j++) {
+        for (int j = 0; j < state->num_tables; j++) {
             if (table->relid == state->tables[j].relid) {
                 elog(ERROR, "get_table_list: table %s has ambiguous primary key (%s and %s)",
                         table->rel_name, table->index_name, state->tables[j].index_name);
             }
         }
+
+        /* Add an entry for each chunk of the table, if it was listed with key ranges */
+        listed = false;
+        foreach(cell, state->relids) {
+            export_chunk *chunk = lfirst(cell);
+            if (chunk->relid != table->relid) continue;
+
+            if (listed) {
+                export_table *copy = &state->tables[++state->num_tables];
+                *copy = *table;
+                copy->rel = relation_open(copy->relid, AccessShareLock);
+                table = copy;
+            }
+            table->chunk = (chunk->has_min || chunk->has_max) ? chunk : NULL;
+            listed = true;
+        }
+
+        state->num_tables++;
     }
 
     SPI_freetuptable(SPI_tuptable);
@@ -297,17 +493,41 @@ void get_table_list(export_state *state, text *table_pattern, bool allow_unkeyed
     }
 }
 
-/* Starts a query to dump all the rows from state->tables[state->current_table].
- * Updates the state accordingly. */
+/* Starts a query to dump all the rows from state->tables[state->current_table],
+ * or those that satisfy the table's row filter predicate, if it has one, and are in the
+ * table's key range, if it is being exported in chunks. Updates the state accordingly. */
 void open_next_table(export_state *state) {
     export_table *table = &state->tables[state->current_table];
     SPIPlanPtr plan;
+    char *predicate;
 
     StringInfoData query;
     initStringInfo(&query);
     appendStringInfo(&query, "SELECT * FROM %s",
             quote_qualified_identifier(table->namespace, table->rel_name));
 
+    predicate = table_filter_row_predicate(state->table_filter, table->namespace, table->rel_name);
+    if (predicate) {
+        /* Compiling the predicate checks that it is a single valid expression, so it
+         * can't change the meaning of the rest of the query */
+        row_filter_free(row_filter_compile(table->rel, predicate));
+        appendStringInfo(&query, " WHERE (%s)", predicate);
+    }
+
+    if (table->chunk) {
+        char *key = chunk_key_column(table);
+        appendStringInfoString(&query, predicate ? " AND " : " WHERE ");
+        if (table->chunk->has_min) {
+            appendStringInfo(&query, "%s >= " INT64_FORMAT, key, table->chunk->min);
+        }
+        if (table->chunk->has_min && table->chunk->has_max) {
+            appendStringInfoString(&query, " AND ");
+        }
+        if (table->chunk->has_max) {
+            appendStringInfo(&query, "%s < " INT64_FORMAT, key, table->chunk->max);
+        }
+    }
+
     plan = SPI_prepare_cursor(query.data, 0, NULL, CURSOR_OPT_NO_SCROLL);
     if (!plan) {
         elog(ERROR, "bottledwater_export: SPI_prepare_cursor failed with error %d", SPI_result);
@@ -315,6 +535,26 @@ void open_next_table(export_state *state) {
     state->cursor = SPI_cursor_open(NULL, plan, NULL, NULL, true);
 }
 
+/* Returns the quoted name of the key column of a table that is exported in chunks.
+ * Chunks are ranges of the key, so the key must consist of a single integer column. */
+char *chunk_key_column(export_table *table) {
+    Relation index = table_key_index(table->rel);
+    Form_pg_attribute attr = NULL;
+
+    if (index && index->rd_index->indnatts == 1 && index->rd_index->indkey.values[0] > 0) {
+        attr = RelationGetDescr(table->rel)->attrs[index->rd_index->indkey.values[0] - 1];
+    }
+    if (index) relation_close(index, AccessShareLock);
+
+    if (!attr || (attr->atttypid != INT2OID && attr->atttypid != INT4OID && attr->atttypid != INT8OID)) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("bottledwater_export: table %s can't be exported in chunks, because its "
+                    "key is not a single integer column",
+                    quote_qualified_identifier(table->namespace, table->rel_name))));
+    }
+    return pstrdup(quote_identifier(NameStr(attr->attname)));
+}
+
 /* When the current cursor has no more rows to return, this function closes it,
  * frees the associated resources, and releases the table lock. */
 void close_current_table(export_state *state) {
@@ -322,63 +562,70 @@ void close_current_table(export_state *state) {
     relation_close(table->rel, AccessShareLock);
 
     SPI_cursor_close(state->cursor);
-    SPI_freetuptable(SPI_tuptable);
+    if (state->batch) SPI_freetuptable(state->batch);
+    state->batch = NULL;
+    state->batch_size = 0;
+    state->batch_pos = 0;
 }
 
-/* Call this when SPI_tuptable contains one row of a table, fetched from a cursor.
- * This function encodes that tuple as Avro and returns it as a byte array. */
-bytea *format_snapshot_row(export_state *state) {
-    export_table *table = &state->tables[state->current_table];
-    bytea *output;
+/* Fetches the next batch_rows rows from the current cursor, replacing the previous
+ * batch. Returns false if the cursor has no more rows. */
+bool fetch_batch(export_state *state) {
+    if (state->batch) SPI_freetuptable(state->batch);
 
-    if (SPI_processed != 1) {
-        elog(ERROR, "Expected exactly 1 row from cursor, but got %d rows", SPI_processed);
-    }
-    if (avro_value_reset(&state->frame_value)) {
-        elog(ERROR, "Avro value reset failed: %s", avro_strerror());
-    }
+    SPI_cursor_fetch(state->cursor, true, state->batch_rows);
+    state->batch = SPI_tuptable;
+    state->batch_size = SPI_processed;
+    state->batch_pos = 0;
+    return state->batch_size > 0;
+}
 
-    if (update_frame_with_insert(&state->frame_value, state->schema_cache, table->rel,
-            SPI_tuptable->tupdesc, SPI_tuptable->vals[0])) {
-        elog(INFO, "Failed tuptable: %s", schema_debug_info(table->rel, SPI_tuptable->tupdesc));
+/* Encodes one row of the current table, fetched from its cursor, as an insert message
+ * appended to the frame. If the row can't be encoded and the error policy allows us
+ * to carry on, the row is left out of the frame. */
+void append_snapshot_row(export_state *state, HeapTuple tuple) {
+    export_table *table = &state->tables[state->current_table];
+    frame_buffer *frame = &state->frame;
+    int frame_len = frame->buf.len, frame_messages = frame->num_messages;
+
+    if (update_frame_with_insert(frame, state->schema_cache, table->rel,
+            state->batch->tupdesc, tuple)) {
+        elog(INFO, "Failed tuptable: %s", schema_debug_info(table->rel, state->batch->tupdesc));
         elog(INFO, "Failed relation: %s", schema_debug_info(table->rel, RelationGetDescr(table->rel)));
         error_policy_handle(state->error_policy, "bottledwater_export: Avro conversion failed", avro_strerror());
-        /* if handling the error didn't exit early, it should be safe to fall
-         * through, because we'll just write the frame without the message that
-         * failed (so potentially it'll be an empty frame)
-         */
-    }
-    if (try_writing(&output, &write_avro_binary, &state->frame_value)) {
-        error_policy_handle(state->error_policy, "bottledwater_export: writing Avro binary failed", avro_strerror());
-        /* if we didn't exit early, then output remains uninitialised */
-        return NULL;
+        /* if handling the error didn't exit early, discard whatever was appended to
+         * the frame for the row that failed, and carry on with the next row */
+        frame_buffer_truncate(frame, frame_len, frame_messages);
     }
-    return output;
 }
 
 /* Given the name of a table (relation), generates an Avro schema for either the rows
- * or the key (replica identity) of the table. */
+ * or the key (replica identity) of the table, using the default encoding options. */
 bytea *schema_for_relname(char *relname, bool get_key) {
     int err;
-    bytea *json;
+    StringInfoData json;
     avro_schema_t schema;
+    encoding_options options;
     List *relname_list = stringToQualifiedNameList(relname);
     RangeVar *relvar = makeRangeVarFromNameList(relname_list);
     Relation rel = relation_openrv(relvar, AccessShareLock);
+    Relation schema_rel = get_key ? table_key_index(rel) : rel;
 
-    if (get_key) {
-        err = schema_for_table_key(rel, &schema);
-    } else {
-        err = schema_for_table_row(rel, &schema);
+    if (!schema_rel) {
+        relation_close(rel, AccessShareLock);
+        return NULL;
     }
 
-    relation_close(rel, AccessShareLock);
+    /* The key schema is the row schema of the key index */
+    encoding_options_init(&options);
+    err = schema_for_table_row(schema_rel, &options, NULL, &schema);
     if (err) {
         elog(ERROR, "bottledwater_table_schema: Could not get schema for relname %s: %s",
                 relname, avro_strerror());
     }
-    if (!schema) return NULL;
 
+    initStringInfo(&json);
+    appendStringInfoSpaces(&json, VARHDRSZ);
     err = try_writing(&json, &write_schema_json, schema);
     avro_schema_decref(schema);
 
@@ -386,5 +633,9 @@ bytea *schema_for_relname(char *relname, bool get_key) {
         elog(ERROR, "bottledwater_table_schema: Could not encode schema as JSON: %s",
                 avro_strerror());
     }
-    return json;
+    schema_json_add_logical_types(&json, VARHDRSZ, RelationGetDescr(schema_rel), NULL, &options);
+
+    if (get_key) relation_close(schema_rel, AccessShareLock);
+    relation_close(rel, AccessShareLock);
+    return string_info_to_bytea(&json);
 }
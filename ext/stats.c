@@ -0,0 +1,333 @@
+/* Statistics about the work done by the output plugin, kept in shared memory so that
+ * they can be queried with the bottledwater_stats() function from any session. Each
+ * walsender accumulates counters locally while decoding, and adds them to the shared
+ * counters at the end of each transaction, so the shared lock is only taken once per
+ * transaction.
+ *
+ * Shared memory can only be allocated when the server starts, so statistics are only
+ * collected if the extension is listed in shared_preload_libraries.
+ *
+ * The shared hash table has room for a fixed number of entries. When it is full, the
+ * entries of replication slots that no longer exist are dropped to make room, and
+ * bottledwater_stats_reset() discards the entries of a slot explicitly. */
+
+#include "stats.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "replication/slot.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/tuplestore.h"
+
+/* Maximum number of (slot, table) pairs for which statistics are kept. Tables seen
+ * after the limit is reached (and no dropped slots' entries can be discarded) only
+ * count towards the totals of their slot. */
+#define STATS_MAX_ENTRIES 1024
+
+#define STATS_NUM_COLUMNS 10
+
+typedef struct {
+    NameData slot_name;
+    Oid relid;                    /* InvalidOid for the totals of the slot */
+} plugin_stats_key;
+
+typedef struct {
+    plugin_stats_key key;         /* Used as key in hash table, so it must be first in struct */
+    plugin_stats_counters counters;
+} plugin_stats_shared_entry;
+
+typedef struct {
+    LWLock *lock;                 /* Protects the hash table and all counters in it */
+} plugin_stats_shared;
+
+static plugin_stats_shared *stats_shared = NULL;
+static HTAB *stats_hash = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static void plugin_stats_shmem_startup(void);
+Size plugin_stats_shmem_size(void);
+void plugin_stats_add(plugin_stats_counters *total, plugin_stats_counters *counters, bool with_bytes);
+void plugin_stats_add_shared(const char *slot_name, Oid relid, plugin_stats_counters *counters);
+void plugin_stats_remove_dropped_slots(void);
+bool plugin_stats_slot_exists(const char *slot_name);
+void plugin_stats_check_shared(const char *function_name);
+
+PG_FUNCTION_INFO_V1(bottledwater_stats);
+Datum bottledwater_stats(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(bottledwater_stats_reset);
+Datum bottledwater_stats_reset(PG_FUNCTION_ARGS);
+
+
+/* Requests the shared memory for statistics. Must be called from _PG_init(); does
+ * nothing unless the library is being loaded through shared_preload_libraries. */
+void plugin_stats_shmem_request() {
+    if (!process_shared_preload_libraries_in_progress) return;
+
+    RequestAddinShmemSpace(plugin_stats_shmem_size());
+    RequestAddinLWLocks(1);
+
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = plugin_stats_shmem_startup;
+}
+
+/* Returns the amount of shared memory needed for statistics. */
+Size plugin_stats_shmem_size() {
+    return add_size(MAXALIGN(sizeof(plugin_stats_shared)),
+            hash_estimate_size(STATS_MAX_ENTRIES, sizeof(plugin_stats_shared_entry)));
+}
+
+/* Allocates, or attaches to, the shared statistics when the server starts. */
+static void plugin_stats_shmem_startup() {
+    HASHCTL info;
+    int flags;
+    bool found;
+
+    if (prev_shmem_startup_hook) prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    stats_shared = ShmemInitStruct("Bottled Water stats", sizeof(plugin_stats_shared), &found);
+    if (!found) stats_shared->lock = LWLockAssign();
+
+    memset(&info, 0, sizeof(info));
+    info.keysize = sizeof(plugin_stats_key);
+    info.entrysize = sizeof(plugin_stats_shared_entry);
+#ifdef HASH_BLOBS
+    /* Postgres 9.5 */
+    flags = HASH_ELEM | HASH_BLOBS;
+#else
+    /* Postgres 9.4 */
+    info.hash = tag_hash;
+    flags = HASH_ELEM | HASH_FUNCTION;
+#endif
+    stats_hash = ShmemInitHash("Bottled Water stats hash", STATS_MAX_ENTRIES,
+            STATS_MAX_ENTRIES, &info, flags);
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+
+/* Creates the local counters of an output plugin instance, allocated in the given
+ * memory context. */
+plugin_stats *plugin_stats_new(MemoryContext context, const char *slot_name) {
+    HASHCTL hash_ctl;
+    plugin_stats *stats = MemoryContextAllocZero(context, sizeof(plugin_stats));
+
+    namestrcpy(&stats->slot_name, slot_name);
+
+    memset(&hash_ctl, 0, sizeof(hash_ctl));
+    hash_ctl.keysize = sizeof(Oid);
+    hash_ctl.entrysize = sizeof(plugin_stats_entry);
+    hash_ctl.hcxt = context;
+#ifdef HASH_BLOBS
+    /* Postgres 9.5 */
+    stats->tables = hash_create("Bottled Water table stats", 32, &hash_ctl,
+            HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+#else
+    /* Postgres 9.4 */
+    hash_ctl.hash = oid_hash;
+    stats->tables = hash_create("Bottled Water table stats", 32, &hash_ctl,
+            HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+#endif
+    return stats;
+}
+
+/* Returns the local counters for a table, or for the slot as a whole if relid is
+ * InvalidOid. The caller increments them directly. */
+plugin_stats_counters *plugin_stats_table(plugin_stats *stats, Oid relid) {
+    plugin_stats_entry *entry;
+    bool found;
+
+    stats->dirty = true;
+    if (!OidIsValid(relid)) return &stats->slot;
+
+    entry = (plugin_stats_entry *) hash_search(stats->tables, &relid, HASH_ENTER, &found);
+    if (!found) memset(&entry->counters, 0, sizeof(plugin_stats_counters));
+    return &entry->counters;
+}
+
+/* Adds the local counters to the shared counters, and resets them. The table
+ * counters also count towards the totals of the slot, except for bytes, which for
+ * the slot are counted as frames are written. */
+void plugin_stats_flush(plugin_stats *stats) {
+    HASH_SEQ_STATUS status;
+    plugin_stats_entry *entry;
+
+    if (!stats->dirty) return;
+
+    if (stats_hash) LWLockAcquire(stats_shared->lock, LW_EXCLUSIVE);
+
+    hash_seq_init(&status, stats->tables);
+    while ((entry = (plugin_stats_entry *) hash_seq_search(&status)) != NULL) {
+        plugin_stats_add(&stats->slot, &entry->counters, false);
+        if (stats_hash) plugin_stats_add_shared(NameStr(stats->slot_name), entry->relid, &entry->counters);
+        memset(&entry->counters, 0, sizeof(plugin_stats_counters));
+    }
+
+    if (stats_hash) {
+        plugin_stats_add_shared(NameStr(stats->slot_name), InvalidOid, &stats->slot);
+        LWLockRelease(stats_shared->lock);
+    }
+
+    memset(&stats->slot, 0, sizeof(plugin_stats_counters));
+    stats->dirty = false;
+}
+
+/* Adds one set of counters to another. */
+void plugin_stats_add(plugin_stats_counters *total, plugin_stats_counters *counters, bool with_bytes) {
+    total->inserts             += counters->inserts;
+    total->updates             += counters->updates;
+    total->deletes             += counters->deletes;
+    total->schema_cache_hits   += counters->schema_cache_hits;
+    total->schema_cache_misses += counters->schema_cache_misses;
+    total->errors              += counters->errors;
+    total->encode_time_us      += counters->encode_time_us;
+    if (with_bytes) total->bytes += counters->bytes;
+}
+
+/* Adds counters to the shared entry for the given slot and table, creating it if
+ * necessary. Must be called with the lock held exclusively. */
+void plugin_stats_add_shared(const char *slot_name, Oid relid, plugin_stats_counters *counters) {
+    plugin_stats_key key;
+    plugin_stats_shared_entry *entry;
+    bool found;
+
+    memset(&key, 0, sizeof(key)); /* the key is hashed as a blob, including padding */
+    namestrcpy(&key.slot_name, slot_name);
+    key.relid = relid;
+
+    entry = (plugin_stats_shared_entry *) hash_search(stats_hash, &key, HASH_ENTER_NULL, &found);
+    if (!entry) {
+        plugin_stats_remove_dropped_slots();
+        entry = (plugin_stats_shared_entry *) hash_search(stats_hash, &key, HASH_ENTER_NULL, &found);
+        if (!entry) return; /* out of space */
+    }
+
+    if (!found) memset(&entry->counters, 0, sizeof(plugin_stats_counters));
+    plugin_stats_add(&entry->counters, counters, true);
+}
+
+/* Removes the shared entries of replication slots that no longer exist. Must be called
+ * with the lock held exclusively. */
+void plugin_stats_remove_dropped_slots() {
+    HASH_SEQ_STATUS status;
+    plugin_stats_shared_entry *entry;
+
+    hash_seq_init(&status, stats_hash);
+    while ((entry = (plugin_stats_shared_entry *) hash_seq_search(&status)) != NULL) {
+        if (!plugin_stats_slot_exists(NameStr(entry->key.slot_name))) {
+            hash_search(stats_hash, &entry->key, HASH_REMOVE, NULL);
+        }
+    }
+}
+
+/* Returns true if a replication slot with the given name exists. */
+bool plugin_stats_slot_exists(const char *slot_name) {
+    bool exists = false;
+    int i;
+
+    LWLockAcquire(ReplicationSlotControlLock, LW_SHARED);
+    for (i = 0; i < max_replication_slots && !exists; i++) {
+        ReplicationSlot *slot = &ReplicationSlotCtl->replication_slots[i];
+        exists = slot->in_use && strcmp(NameStr(slot->data.name), slot_name) == 0;
+    }
+    LWLockRelease(ReplicationSlotControlLock);
+
+    return exists;
+}
+
+/* Raises an error if statistics are not being collected. */
+void plugin_stats_check_shared(const char *function_name) {
+    if (!stats_hash) {
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("%s: statistics are not being collected", function_name),
+                 errhint("Add bottledwater to shared_preload_libraries and restart the server.")));
+    }
+}
+
+
+/* Returns the statistics of all slots, one row per slot (with a null relid) and one
+ * row per table that was decoded through that slot. */
+Datum bottledwater_stats(PG_FUNCTION_ARGS) {
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    TupleDesc tupdesc;
+    Tuplestorestate *tupstore;
+    MemoryContext oldctx;
+    HASH_SEQ_STATUS status;
+    plugin_stats_shared_entry *entry;
+
+    if (!rsinfo || !IsA(rsinfo, ReturnSetInfo) || !(rsinfo->allowedModes & SFRM_Materialize)) {
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("bottledwater_stats: set-valued function called in context that cannot accept a set")));
+    }
+
+    plugin_stats_check_shared("bottledwater_stats");
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+        elog(ERROR, "bottledwater_stats: return type must be a row type");
+    }
+
+    oldctx = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+    tupstore = tuplestore_begin_heap(true, false, work_mem);
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupstore;
+    rsinfo->setDesc = tupdesc;
+    MemoryContextSwitchTo(oldctx);
+
+    LWLockAcquire(stats_shared->lock, LW_SHARED);
+
+    hash_seq_init(&status, stats_hash);
+    while ((entry = (plugin_stats_shared_entry *) hash_seq_search(&status)) != NULL) {
+        Datum values[STATS_NUM_COLUMNS];
+        bool nulls[STATS_NUM_COLUMNS];
+        plugin_stats_counters *counters = &entry->counters;
+
+        memset(nulls, 0, sizeof(nulls));
+        values[0] = NameGetDatum(&entry->key.slot_name);
+        values[1] = ObjectIdGetDatum(entry->key.relid);
+        nulls[1]  = !OidIsValid(entry->key.relid);
+        values[2] = Int64GetDatum((int64) counters->inserts);
+        values[3] = Int64GetDatum((int64) counters->updates);
+        values[4] = Int64GetDatum((int64) counters->deletes);
+        values[5] = Int64GetDatum((int64) counters->bytes);
+        values[6] = Int64GetDatum((int64) counters->schema_cache_hits);
+        values[7] = Int64GetDatum((int64) counters->schema_cache_misses);
+        values[8] = Int64GetDatum((int64) counters->errors);
+        values[9] = Float8GetDatum(counters->encode_time_us / 1000.0);
+
+        tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+    }
+
+    LWLockRelease(stats_shared->lock);
+
+    tuplestore_donestoring(tupstore);
+    return (Datum) 0;
+}
+
+/* Discards the statistics of the given replication slot, for the slot and for all of
+ * its tables. If the slot is still being decoded, its counters start again from zero. */
+Datum bottledwater_stats_reset(PG_FUNCTION_ARGS) {
+    Name slot_name = PG_GETARG_NAME(0);
+    HASH_SEQ_STATUS status;
+    plugin_stats_shared_entry *entry;
+
+    plugin_stats_check_shared("bottledwater_stats_reset");
+
+    LWLockAcquire(stats_shared->lock, LW_EXCLUSIVE);
+
+    hash_seq_init(&status, stats_hash);
+    while ((entry = (plugin_stats_shared_entry *) hash_seq_search(&status)) != NULL) {
+        if (strcmp(NameStr(entry->key.slot_name), NameStr(*slot_name)) == 0) {
+            hash_search(stats_hash, &entry->key, HASH_REMOVE, NULL);
+        }
+    }
+
+    LWLockRelease(stats_shared->lock);
+    PG_RETURN_VOID();
+}
@@ -0,0 +1,39 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "postgres.h"
+#include "utils/hsearch.h"
+
+/* Counters of the work done by the output plugin, either for one table, or (with
+ * relid InvalidOid) for a whole replication slot. */
+typedef struct {
+    uint64 inserts;             /* Number of inserted rows decoded */
+    uint64 updates;             /* Number of updated rows decoded */
+    uint64 deletes;             /* Number of deleted rows decoded */
+    uint64 bytes;               /* Bytes of messages generated (for a slot: bytes of frames written) */
+    uint64 schema_cache_hits;   /* Schema cache lookups that found a valid entry */
+    uint64 schema_cache_misses; /* Schema cache lookups that had to generate schemas */
+    uint64 errors;              /* Rows that could not be converted */
+    uint64 encode_time_us;      /* Time spent converting rows to Avro, in microseconds */
+} plugin_stats_counters;
+
+/* Counters accumulated by one output plugin instance since they were last added to
+ * the shared memory counters. */
+typedef struct {
+    NameData slot_name;           /* Replication slot the counters belong to */
+    HTAB *tables;                 /* Hash table mapping Oid to plugin_stats_entry */
+    plugin_stats_counters slot;   /* Counters for the slot as a whole */
+    bool dirty;                   /* True if any counters changed since the last flush */
+} plugin_stats;
+
+typedef struct {
+    Oid relid;                    /* Used as key in hash table, so it must be first in struct */
+    plugin_stats_counters counters;
+} plugin_stats_entry;
+
+void plugin_stats_shmem_request(void);
+plugin_stats *plugin_stats_new(MemoryContext context, const char *slot_name);
+plugin_stats_counters *plugin_stats_table(plugin_stats *stats, Oid relid);
+void plugin_stats_flush(plugin_stats *stats);
+
+#endif /* STATS_H */
@@ -0,0 +1,296 @@
+/* Decides which tables, and which columns of those tables, are replicated. The filter
+ * is configured with the following options, which are given to the output plugin when
+ * replication is started, and passed to bottledwater_export for the snapshot:
+ *
+ *   table_include   Comma-separated patterns of tables to replicate (default: all tables)
+ *   table_exclude   Comma-separated patterns of tables not to replicate
+ *   column_exclude  Comma-separated patterns of the form table.column, naming columns
+ *                   that are omitted from the rows of the tables they belong to
+ *   key_only_tables Comma-separated patterns of tables for which only the key and the
+ *                   type of each change are sent, as KeyChange messages
+ *
+ * A table pattern that contains a dot is matched against the schema-qualified name of
+ * a table (e.g. "public.users"), and otherwise against the unqualified table name. A
+ * table is replicated if it matches one of the include patterns (or none are given),
+ * and it doesn't match any of the exclude patterns. Column exclusions only apply to
+ * the row: the key of a row always contains all primary key/replica identity columns.
+ *
+ * In addition, an option named "row_filter.<table pattern>" gives a SQL boolean
+ * expression over the columns of the matching tables (e.g. "tenant_id IN (1, 2)").
+ * Only rows for which the expression is true are replicated. If several row filters
+ * match a table, a row must satisfy all of them. See row_filter.c.
+ *
+ * None of the filters apply to the extension's bottledwater_watermark table, since the
+ * client relies on seeing every change to it in the replication stream. */
+
+#include <ctype.h>
+
+#include "table_filter.h"
+#include "catalog/dependency.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_class.h"
+#include "commands/extension.h"
+#include "lib/stringinfo.h"
+#include "utils/lsyscache.h"
+
+List *table_filter_parse_patterns(List *patterns, const char *name, const char *value,
+        bool with_column);
+filter_pattern *table_filter_make_pattern(const char *item, const char *name, bool with_column);
+bool pattern_matches(const char *pattern, const char *str);
+bool table_pattern_matches(filter_pattern *pattern, const char *ns_name, const char *rel_name);
+bool table_filter_exempt(const char *ns_name, const char *rel_name);
+
+/* Creates a filter that includes all tables and columns. It is allocated in the
+ * current memory context, as are any patterns subsequently added to it. */
+table_filter_t table_filter_new() {
+    return palloc0(sizeof(table_filter));
+}
+
+/* If name is one of the filter options, adds the patterns in value to the filter and
+ * returns true. Returns false if name is not a filter option. */
+bool table_filter_parse(table_filter_t filter, const char *name, const char *value) {
+    if (strcmp(name, "table_include") == 0) {
+        filter->include = table_filter_parse_patterns(filter->include, name, value, false);
+    } else if (strcmp(name, "table_exclude") == 0) {
+        filter->exclude = table_filter_parse_patterns(filter->exclude, name, value, false);
+    } else if (strcmp(name, "column_exclude") == 0) {
+        filter->column_exclude = table_filter_parse_patterns(filter->column_exclude, name, value, true);
+    } else if (strcmp(name, "key_only_tables") == 0) {
+        filter->key_only = table_filter_parse_patterns(filter->key_only, name, value, false);
+    } else if (strncmp(name, ROW_FILTER_OPTION_PREFIX, strlen(ROW_FILTER_OPTION_PREFIX)) == 0) {
+        filter_pattern *pattern;
+        if (!value || !*value) {
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("option \"%s\" requires a value", name)));
+        }
+        pattern = table_filter_make_pattern(name + strlen(ROW_FILTER_OPTION_PREFIX), name, false);
+        pattern->predicate = pstrdup(value);
+        filter->row_filters = lappend(filter->row_filters, pattern);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* Splits a comma-separated list of patterns, and appends them to a list. */
+List *table_filter_parse_patterns(List *patterns, const char *name, const char *value,
+        bool with_column) {
+    StringInfoData item;
+
+    if (!value) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("option \"%s\" requires a value", name)));
+    }
+
+    initStringInfo(&item);
+
+    for (const char *pos = value; ; pos++) {
+        if (*pos != ',' && *pos != '\0') {
+            if (item.len > 0 || !isspace((unsigned char) *pos)) {
+                appendStringInfoChar(&item, *pos);
+            }
+            continue;
+        }
+
+        while (item.len > 0 && isspace((unsigned char) item.data[item.len - 1])) {
+            item.data[--item.len] = '\0';
+        }
+
+        if (item.len > 0) {
+            patterns = lappend(patterns, table_filter_make_pattern(item.data, name, with_column));
+            resetStringInfo(&item);
+        }
+
+        if (*pos == '\0') break;
+    }
+
+    pfree(item.data);
+    return patterns;
+}
+
+/* Parses a single pattern, given as the item string. Column patterns are split at the
+ * last dot into a table pattern and a column pattern, and table patterns are split at
+ * the first dot into a schema pattern and a name pattern. */
+filter_pattern *table_filter_make_pattern(const char *item, const char *name, bool with_column) {
+    filter_pattern *pattern = palloc0(sizeof(filter_pattern));
+    char *dot;
+    pattern->table = pstrdup(item);
+
+    if (with_column) {
+        dot = strrchr(pattern->table, '.');
+        if (!dot || dot == pattern->table || dot[1] == '\0') {
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("invalid column pattern \"%s\" in option \"%s\"", item, name),
+                     errhint("Column patterns have the form table.column or schema.table.column.")));
+        }
+        *dot = '\0';
+        pattern->column = dot + 1;
+    }
+
+    dot = strchr(pattern->table, '.');
+    if (dot) {
+        *dot = '\0';
+        pattern->schema = pattern->table;
+        pattern->table = dot + 1;
+    }
+
+    if (!*pattern->table) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid table pattern \"%s\" in option \"%s\"", item, name)));
+    }
+    return pattern;
+}
+
+/* Returns true if the filter includes or excludes any tables, or false if it
+ * includes all of them (in which case there is no need to call table_filter_includes). */
+bool table_filter_has_tables(table_filter_t filter) {
+    return filter && (filter->include != NIL || filter->exclude != NIL);
+}
+
+/* Returns true if the table with the given name is selected for replication. */
+bool table_filter_includes(table_filter_t filter, const char *ns_name, const char *rel_name) {
+    ListCell *cell;
+    bool included = (filter->include == NIL);
+
+    if (table_filter_exempt(ns_name, rel_name)) return true;
+
+    foreach(cell, filter->include) {
+        filter_pattern *pattern = (filter_pattern *) lfirst(cell);
+        if (table_pattern_matches(pattern, ns_name, rel_name)) {
+            included = true;
+            break;
+        }
+    }
+
+    if (!included) return false;
+
+    foreach(cell, filter->exclude) {
+        filter_pattern *pattern = (filter_pattern *) lfirst(cell);
+        if (table_pattern_matches(pattern, ns_name, rel_name)) return false;
+    }
+
+    return true;
+}
+
+/* Returns true if only the keys of changed rows should be sent for the given table,
+ * rather than the rows themselves. */
+bool table_filter_key_only(table_filter_t filter, const char *ns_name, const char *rel_name) {
+    ListCell *cell;
+
+    if (!filter || table_filter_exempt(ns_name, rel_name)) return false;
+
+    foreach(cell, filter->key_only) {
+        filter_pattern *pattern = (filter_pattern *) lfirst(cell);
+        if (table_pattern_matches(pattern, ns_name, rel_name)) return true;
+    }
+    return false;
+}
+
+/* Returns true if the filter has any row filter predicates. */
+bool table_filter_has_row_filters(table_filter_t filter) {
+    return filter && filter->row_filters != NIL;
+}
+
+/* Returns the row filter predicate for the given table, combining the predicates of all
+ * matching row filters with AND, or NULL if all rows of the table are included. The
+ * string is allocated in the current memory context. */
+char *table_filter_row_predicate(table_filter_t filter, const char *ns_name, const char *rel_name) {
+    StringInfoData predicate;
+    ListCell *cell;
+
+    if (!filter || table_filter_exempt(ns_name, rel_name)) return NULL;
+    initStringInfo(&predicate);
+
+    foreach(cell, filter->row_filters) {
+        filter_pattern *pattern = (filter_pattern *) lfirst(cell);
+        if (!table_pattern_matches(pattern, ns_name, rel_name)) continue;
+
+        /* Newline in case the predicate ends with a comment */
+        appendStringInfo(&predicate, "%s(%s\n)", predicate.len > 0 ? " AND " : "",
+                pattern->predicate);
+    }
+
+    if (predicate.len == 0) {
+        pfree(predicate.data);
+        return NULL;
+    }
+    return predicate.data;
+}
+
+/* Returns the set of columns of the given table that should be omitted from its rows,
+ * as 0-based indexes into tupdesc, or NULL if there are none. Dropped columns are not
+ * included in the set. The set is allocated in the current memory context. */
+Bitmapset *table_filter_excluded_columns(table_filter_t filter, const char *ns_name,
+        const char *rel_name, TupleDesc tupdesc) {
+    Bitmapset *excluded = NULL;
+    ListCell *cell;
+
+    if (!filter || table_filter_exempt(ns_name, rel_name)) return NULL;
+
+    foreach(cell, filter->column_exclude) {
+        filter_pattern *pattern = (filter_pattern *) lfirst(cell);
+        if (!table_pattern_matches(pattern, ns_name, rel_name)) continue;
+
+        for (int i = 0; i < tupdesc->natts; i++) {
+            Form_pg_attribute attr = tupdesc->attrs[i];
+            if (attr->attisdropped) continue;
+
+            if (pattern_matches(pattern->column, NameStr(attr->attname))) {
+                excluded = bms_add_member(excluded, i);
+            }
+        }
+    }
+
+    return excluded;
+}
+
+/* Returns true if no filter applies to the table with the given name, i.e. if it is
+ * the watermark table that belongs to the extension. A user's table of the same name
+ * in another schema is filtered as usual. */
+bool table_filter_exempt(const char *ns_name, const char *rel_name) {
+    Oid ext_oid, relid;
+
+    if (strcmp(rel_name, WATERMARK_TABLE_NAME) != 0) return false;
+
+    ext_oid = get_extension_oid(EXTENSION_NAME, true);
+    relid = get_relname_relid(rel_name, get_namespace_oid(ns_name, true));
+
+    return ext_oid != InvalidOid && relid != InvalidOid &&
+        getExtensionOfObject(RelationRelationId, relid) == ext_oid;
+}
+
+/* Matches the table part of a pattern against the name of a table. The schema name
+ * is only compared if the pattern is schema-qualified. */
+bool table_pattern_matches(filter_pattern *pattern, const char *ns_name, const char *rel_name) {
+    if (pattern->schema && !pattern_matches(pattern->schema, ns_name)) return false;
+    return pattern_matches(pattern->table, rel_name);
+}
+
+/* Returns true if str matches pattern, in which '*' matches any (possibly empty)
+ * sequence of characters. When a match fails after a '*', the '*' is retried with
+ * one more character of str, so this runs in O(len(pattern) * len(str)) time. */
+bool pattern_matches(const char *pattern, const char *str) {
+    const char *star = NULL, *resume = NULL;
+
+    while (*str) {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = str;
+        } else if (*pattern == *str) {
+            pattern++;
+            str++;
+        } else if (star) {
+            pattern = star + 1;
+            str = ++resume;
+        } else {
+            return false;
+        }
+    }
+
+    while (*pattern == '*') pattern++;
+    return *pattern == '\0';
+}
@@ -0,0 +1,49 @@
+#ifndef TABLE_FILTER_H
+#define TABLE_FILTER_H
+
+#include "postgres.h"
+#include "access/tupdesc.h"
+#include "nodes/bitmapset.h"
+#include "nodes/pg_list.h"
+
+/* Prefix of the names of row filter options; the rest of the name is a table pattern */
+#define ROW_FILTER_OPTION_PREFIX "row_filter."
+
+/* Name of this extension in pg_extension */
+#define EXTENSION_NAME "bottledwater"
+
+/* Table in which the client keeps the watermarks of incremental snapshots, in the
+ * extension's schema. Its changes must always reach the client in full, so no filter
+ * applies to it. */
+#define WATERMARK_TABLE_NAME "bottledwater_watermark"
+
+/* A pattern that selects tables, or columns of tables. In patterns, '*' matches any
+ * sequence of characters, and all other characters match themselves. */
+typedef struct {
+    char *schema;  /* Pattern for the schema name (NULL if the pattern is unqualified) */
+    char *table;   /* Pattern for the table name */
+    char *column;  /* Pattern for the column name (NULL for table patterns) */
+    char *predicate; /* SQL boolean expression that rows must satisfy (row filters only) */
+} filter_pattern;
+
+typedef struct {
+    List *include;         /* If non-empty, only tables matching one of these patterns are replicated */
+    List *exclude;         /* Tables matching any of these patterns are not replicated */
+    List *column_exclude;  /* Columns matching any of these patterns are omitted from rows */
+    List *row_filters;     /* Only rows satisfying the predicates of matching patterns are replicated */
+    List *key_only;        /* Tables matching any of these patterns are replicated as key changes only */
+} table_filter;
+
+typedef table_filter *table_filter_t;
+
+table_filter_t table_filter_new(void);
+bool table_filter_parse(table_filter_t filter, const char *name, const char *value);
+bool table_filter_has_tables(table_filter_t filter);
+bool table_filter_includes(table_filter_t filter, const char *ns_name, const char *rel_name);
+bool table_filter_has_row_filters(table_filter_t filter);
+bool table_filter_key_only(table_filter_t filter, const char *ns_name, const char *rel_name);
+char *table_filter_row_predicate(table_filter_t filter, const char *ns_name, const char *rel_name);
+Bitmapset *table_filter_excluded_columns(table_filter_t filter, const char *ns_name,
+        const char *rel_name, TupleDesc tupdesc);
+
+#endif /* TABLE_FILTER_H */
@@ -24,6 +24,18 @@
 
 #define TABLE_NAME_BUFFER_LENGTH 128
 
+/* Topic to which changes of tables selected with --key-only-tables are written */
+#define DEFAULT_KEY_ONLY_TOPIC "key_changes"
+
+/* Value schema of the messages written to the key-only topic. The symbols of the
+ * enum are in the order of the PROTOCOL_KEY_CHANGE_* values. */
+#define KEY_CHANGE_SCHEMA_JSON \
+    "{\"type\": \"record\", \"name\": \"KeyChange\", " \
+    "\"namespace\": \"com.martinkl.bottledwater\", \"fields\": [" \
+    "{\"name\": \"table\", \"type\": \"string\"}, " \
+    "{\"name\": \"op\", \"type\": {\"type\": \"enum\", \"name\": \"Operation\", " \
+    "\"symbols\": [\"INSERT\", \"UPDATE\", \"DELETE\"]}}]}"
+
 #define check(err, call) { err = call; if (err) return err; }
 
 #define ensure(context, call) { \
@@ -91,6 +103,11 @@ typedef struct {
     table_mapper_t mapper;              /* Remembers topics and schemas for tables we've seen */
     format_t output_format;             /* How to encode messages for writing to Kafka */
     char *topic_prefix;                 /* String to be prepended to all topic names */
+    char *key_only_topic_name;          /* Topic for changes of key-only tables (before prefixing) */
+    rd_kafka_topic_t *key_only_topic;   /* Opened when the first key change is received */
+    avro_schema_t key_change_schema;    /* Value schema of messages in the key-only topic */
+    avro_value_iface_t *key_change_iface; /* Avro generic interface for key_change_schema */
+    int key_change_schema_id;           /* Identifier for key_change_schema, assigned by the registry */
     error_policy_t error_policy;        /* What to do in case of a transient error */
     char error[PRODUCER_CONTEXT_ERROR_LEN];
 } producer_context;
@@ -134,6 +151,7 @@ void set_error_policy(producer_context_t context, char *policy);
 const char* error_policy_name(error_policy_t format);
 void set_kafka_config(producer_context_t context, char *property, char *value);
 void set_topic_config(producer_context_t context, char *property, char *value);
+void set_row_filter(producer_context_t context, char *option);
 char* topic_name_from_avro_schema(avro_schema_t schema);
 
 static int handle_error(producer_context_t context, int err, const char *fmt, ...) __attribute__ ((format (printf, 3, 4)));
@@ -153,11 +171,20 @@ static int on_update_row(void *_context, uint64_t wal_pos, Oid relid,
 static int on_delete_row(void *_context, uint64_t wal_pos, Oid relid,
         const void *key_bin, size_t key_len, avro_value_t *key_val,
         const void *old_bin, size_t old_len, avro_value_t *old_val);
+static int on_key_change(void *_context, uint64_t wal_pos, Oid relid, int op,
+        const void *key_bin, size_t key_len, avro_value_t *key_val);
 static int on_keepalive(void *_context, uint64_t wal_pos);
 static int on_client_error(void *_context, int err, const char *message);
+static int on_snapshot_flush(void *_context);
 int send_kafka_msg(producer_context_t context, uint64_t wal_pos, Oid relid,
         const void *key_bin, size_t key_len,
         const void *val_bin, size_t val_len);
+int send_key_change_msg(producer_context_t context, uint64_t wal_pos, Oid relid, int op,
+        const void *key_bin, size_t key_len);
+int open_key_only_topic(producer_context_t context);
+int produce_kafka_msg(producer_context_t context, uint64_t wal_pos, Oid relid,
+        rd_kafka_topic_t *topic, void *key, size_t key_encoded_len,
+        void *val, size_t val_encoded_len);
 static void on_deliver_msg(rd_kafka_t *kafka, const rd_kafka_message_t *msg, void *envelope);
 void maybe_checkpoint(producer_context_t context);
 void backpressure(producer_context_t context);
@@ -198,11 +225,91 @@ void usage(int exit_status) {
             "                          database contents and just start streaming any new\n"
             "                          updates.  (Ignored if the replication slot already\n"
             "                          exists.)\n"
+            "  --snapshot-workers=N    (default: 1)\n"
+            "                          Number of database connections that take the\n"
+            "                          snapshot in parallel, each reading different tables.\n"
+            "  --snapshot-chunk-bytes=N   (default: 1073741824)\n"
+            "                          With several snapshot workers, tables larger than\n"
+            "                          this are split by key range between workers. 0\n"
+            "                          never splits a table.\n"
+            "  --snapshot-state=FILE   Record the progress of the snapshot in this file, so\n"
+            "                          that if the snapshot fails, it is resumed when\n"
+            "                          Bottled Water is restarted, instead of starting over.\n"
+            "  --incremental-snapshot  When creating the replication slot, start streaming\n"
+            "                          immediately, and read the existing data in small\n"
+            "                          chunks while streaming, instead of taking the\n"
+            "                          snapshot in one long transaction first.\n"
+            "  --incremental-chunk-rows=N   (default: 1000)\n"
+            "                          Number of rows in each chunk of an incremental\n"
+            "                          snapshot.\n"
+            "  --resnapshot=PATTERN    Send the current contents of the tables whose names\n"
+            "                          match this LIKE pattern again, in the same way as an\n"
+            "                          incremental snapshot, while streaming.  (Ignored if\n"
+            "                          the replication slot is created.)\n"
+            "  --snapshot-batch-rows=N (default: 1000)\n"
+            "                          Number of rows the snapshot fetches from a table at\n"
+            "                          a time.\n"
+            "  --snapshot-frame-max-bytes=N   (default: 1048576)\n"
+            "                          Size up to which the snapshot packs rows into one\n"
+            "                          frame. 0 sends one row per frame.\n"
             "  -C, --kafka-config property=value\n"
             "                          Set global configuration property for Kafka producer\n"
             "                          (see --config-help for list of properties).\n"
             "  -T, --topic-config property=value\n"
             "                          Set topic configuration property for Kafka producer.\n"
+            "  --frame-max-messages=N  (default: 1)\n"
+            "                          Maximum number of messages the Postgres extension\n"
+            "                          batches into one frame before sending it. Frames are\n"
+            "                          always sent at the end of a transaction.\n"
+            "  --frame-max-bytes=N     (default: 0, i.e. no limit)\n"
+            "                          Maximum size in bytes of a frame of batched messages.\n"
+            "  --progress-interval=ms  (default: 10000)\n"
+            "                          Transactions that don't change any replicated tables\n"
+            "                          are skipped, but one is sent if nothing else has been\n"
+            "                          sent for this long, so that the replication slot\n"
+            "                          advances. 0 means never.\n"
+            "  --frame-compression=[none|deflate]   (default: none)\n"
+            "                          Compress frames sent by Postgres with zlib, to save\n"
+            "                          bandwidth on the replication connection.\n"
+            "  --frame-compression-min-bytes=N   (default: 1024)\n"
+            "                          Only compress frames of at least this size.\n"
+            "  --profile-interval=ms   (default: 0)\n"
+            "                          Log histograms of the time Postgres spends in each\n"
+            "                          phase of decoding, per table, at this interval.\n"
+            "                          0 disables profiling.\n"
+            "  --numeric-encoding=[double|decimal]   (default: double)\n"
+            "                          How to encode NUMERIC columns. 'decimal' uses the Avro\n"
+            "                          decimal logical type, preserving precision, for\n"
+            "                          columns declared with a precision and scale.\n"
+            "  --temporal-encoding=[record|logical]   (default: record)\n"
+            "                          How to encode date, time and timestamp columns.\n"
+            "                          'logical' uses the Avro date, time-micros and\n"
+            "                          timestamp-micros logical types.\n"
+            "  --unchanged-toast=[fetch|marker]   (default: fetch)\n"
+            "                          How to encode large (TOASTed) values that an update\n"
+            "                          didn't change. 'marker' replaces them in the new row\n"
+            "                          with an UnchangedToast enum value.\n"
+            "  --update-format=[full|delta]   (default: full)\n"
+            "                          How updates of tables with REPLICA IDENTITY FULL are\n"
+            "                          sent by Postgres. 'delta' only sends changed columns;\n"
+            "                          the full new row is reconstructed by the client.\n"
+            "  --key-only-tables=pattern,...\n"
+            "                          For tables matching one of the patterns, only write\n"
+            "                          the key and type of each change to the key-only topic.\n"
+            "  --key-only-topic=name   (default: %s)\n"
+            "                          Topic to which changes of key-only tables are written.\n"
+            "  --include-tables=pattern,...\n"
+            "                          Only replicate tables matching one of the patterns\n"
+            "                          (table or schema.table, where * matches anything).\n"
+            "  --exclude-tables=pattern,...\n"
+            "                          Don't replicate tables matching any of the patterns.\n"
+            "  --exclude-columns=pattern,...\n"
+            "                          Omit columns matching any of the patterns (of the\n"
+            "                          form table.column or schema.table.column) from rows.\n"
+            "  --row-filter=table:expression\n"
+            "                          Only replicate rows of the table (or tables matching\n"
+            "                          the pattern) for which the SQL boolean expression is\n"
+            "                          true. May be given several times.\n"
             "  --config-help           Print the list of configuration properties. See also:\n"
             "            https://github.com/edenhill/librdkafka/blob/master/CONFIGURATION.md\n"
             "  -h, --help\n"
@@ -213,7 +320,8 @@ void usage(int exit_status) {
             DEFAULT_BROKER_LIST,
             DEFAULT_SCHEMA_REGISTRY,
             DEFAULT_OUTPUT_FORMAT_NAME,
-            DEFAULT_ERROR_POLICY_NAME);
+            DEFAULT_ERROR_POLICY_NAME,
+            DEFAULT_KEY_ONLY_TOPIC);
     exit(exit_status);
 }
 
@@ -233,6 +341,30 @@ void parse_options(producer_context_t context, int argc, char **argv) {
         {"kafka-config",    required_argument, NULL, 'C'},
         {"topic-config",    required_argument, NULL, 'T'},
         {"config-help",     no_argument,       NULL,  1 },
+        {"frame-max-messages", required_argument, NULL, 2},
+        {"frame-max-bytes", required_argument, NULL,  3 },
+        {"numeric-encoding", required_argument, NULL, 4 },
+        {"temporal-encoding", required_argument, NULL, 5 },
+        {"include-tables",  required_argument, NULL,  6 },
+        {"exclude-tables",  required_argument, NULL,  7 },
+        {"exclude-columns", required_argument, NULL,  8 },
+        {"row-filter",      required_argument, NULL,  9 },
+        {"unchanged-toast", required_argument, NULL, 10 },
+        {"update-format",   required_argument, NULL, 11 },
+        {"key-only-tables", required_argument, NULL, 12 },
+        {"key-only-topic",  required_argument, NULL, 13 },
+        {"progress-interval", required_argument, NULL, 14 },
+        {"frame-compression", required_argument, NULL, 15 },
+        {"frame-compression-min-bytes", required_argument, NULL, 16 },
+        {"profile-interval", required_argument, NULL, 17 },
+        {"snapshot-batch-rows", required_argument, NULL, 18 },
+        {"snapshot-frame-max-bytes", required_argument, NULL, 19 },
+        {"snapshot-workers", required_argument, NULL, 20 },
+        {"snapshot-chunk-bytes", required_argument, NULL, 21 },
+        {"snapshot-state",  required_argument, NULL, 22 },
+        {"incremental-snapshot", no_argument,  NULL, 23 },
+        {"incremental-chunk-rows", required_argument, NULL, 24 },
+        {"resnapshot",      required_argument, NULL, 25 },
         {"help",            no_argument,       NULL, 'h'},
         {NULL,              0,                 NULL,  0 }
     };
@@ -282,6 +414,90 @@ void parse_options(producer_context_t context, int argc, char **argv) {
                 rd_kafka_conf_properties_show(stderr);
                 exit(0);
                 break;
+            case 2:
+                replication_stream_set_option(&context->client->repl, "frame_max_messages", optarg);
+                break;
+            case 3:
+                replication_stream_set_option(&context->client->repl, "frame_max_bytes", optarg);
+                break;
+            case 4:
+                replication_stream_set_option(&context->client->repl, "numeric_encoding", optarg);
+                break;
+            case 5:
+                replication_stream_set_option(&context->client->repl, "temporal_encoding", optarg);
+                break;
+            case 6:
+                replication_stream_set_option(&context->client->repl, "table_include", optarg);
+                break;
+            case 7:
+                replication_stream_set_option(&context->client->repl, "table_exclude", optarg);
+                break;
+            case 8:
+                replication_stream_set_option(&context->client->repl, "column_exclude", optarg);
+                break;
+            case 9:
+                set_row_filter(context, optarg);
+                break;
+            case 10:
+                replication_stream_set_option(&context->client->repl, "unchanged_toast", optarg);
+                break;
+            case 11:
+                replication_stream_set_option(&context->client->repl, "update_format", optarg);
+                break;
+            case 12:
+                replication_stream_set_option(&context->client->repl, "key_only_tables", optarg);
+                break;
+            case 13:
+                context->key_only_topic_name = strdup(optarg);
+                break;
+            case 14:
+                replication_stream_set_option(&context->client->repl, "progress_interval", optarg);
+                break;
+            case 15:
+                replication_stream_set_option(&context->client->repl, "frame_compression", optarg);
+                break;
+            case 16:
+                replication_stream_set_option(&context->client->repl, "frame_compression_min_bytes", optarg);
+                break;
+            case 17:
+                replication_stream_set_option(&context->client->repl, "profile_interval", optarg);
+                break;
+            case 18:
+                replication_stream_set_option(&context->client->repl, "snapshot_batch_rows", optarg);
+                break;
+            case 19:
+                replication_stream_set_option(&context->client->repl, "snapshot_frame_max_bytes", optarg);
+                break;
+            case 20:
+                context->client->snapshot_workers = strtol(optarg, NULL, 10);
+                if (context->client->snapshot_workers < 1) {
+                    config_error("--snapshot-workers must be at least 1");
+                    usage(1);
+                }
+                break;
+            case 21:
+                context->client->snapshot_chunk_bytes = strtoll(optarg, NULL, 10);
+                if (context->client->snapshot_chunk_bytes < 0) {
+                    config_error("--snapshot-chunk-bytes must not be negative");
+                    usage(1);
+                }
+                break;
+            case 22:
+                context->client->snapshot_state_file = strdup(optarg);
+                break;
+            case 23:
+                context->client->incremental = true;
+                break;
+            case 24:
+                context->client->incremental_chunk_rows = strtol(optarg, NULL, 10);
+                if (context->client->incremental_chunk_rows < 1) {
+                    config_error("--incremental-chunk-rows must be at least 1");
+                    usage(1);
+                }
+                break;
+            case 25:
+                context->client->resnapshot_pattern = strdup(optarg);
+                break;
             case 'h':
                 usage(0);
             default:
@@ -298,6 +514,11 @@ void parse_options(producer_context_t context, int argc, char **argv) {
                      "--output-format=json");
         usage(1);
     }
+
+    if (context->client->incremental && context->client->skip_snapshot) {
+        config_error("--incremental-snapshot and --skip-snapshot can't be used together");
+        usage(1);
+    }
 }
 
 /* Splits an option string by equals sign. Modifies the option argument to be
@@ -316,6 +537,22 @@ char *parse_config_option(char *option) {
     return equals + 1;
 }
 
+/* Parses a row filter of the form table:expression, and passes it to the output plugin
+ * as an option named after the table. */
+void set_row_filter(producer_context_t context, char *option) {
+    char *colon = strchr(option, ':'), *name;
+    if (!colon || colon == option) {
+        log_error("%s: Expected row filter in the form table:expression, not \"%s\"",
+                  progname, option);
+        exit(1);
+    }
+
+    name = malloc(strlen("row_filter.") + (colon - option) + 1);
+    sprintf(name, "row_filter.%.*s", (int) (colon - option), option);
+    replication_stream_set_option(&context->client->repl, name, colon + 1);
+    free(name);
+}
+
 void init_schema_registry(producer_context_t context, char *url) {
     context->registry = schema_registry_new(url);
 
@@ -445,8 +682,13 @@ static int on_begin_txn(void *_context, uint64_t wal_pos, uint32_t xid) {
             fatal_error(context, "Expected snapshot to be the first transaction.");
         }
 
-        log_info("Created replication slot \"%s\", capturing consistent snapshot \"%s\".",
-                 stream->slot_name, stream->snapshot_name);
+        if (context->client->slot_created) {
+            log_info("Created replication slot \"%s\", capturing consistent snapshot \"%s\".",
+                     stream->slot_name, stream->snapshot_name);
+        } else {
+            log_info("Resuming snapshot for replication slot \"%s\" from %s, using snapshot \"%s\".",
+                     stream->slot_name, context->client->snapshot_state_file, stream->snapshot_name);
+        }
     }
 
     // If the circular buffer is full, we have to block and wait for some transactions
@@ -540,6 +782,15 @@ static int on_delete_row(void *_context, uint64_t wal_pos, Oid relid,
         return 0; // delete on unkeyed table --> can't do anything
 }
 
+static int on_key_change(void *_context, uint64_t wal_pos, Oid relid, int op,
+        const void *key_bin, size_t key_len, avro_value_t *key_val) {
+    producer_context_t context = (producer_context_t) _context;
+    if (key_bin)
+        return send_key_change_msg(context, wal_pos, relid, op, key_bin, key_len);
+    else
+        return 0; // change on unkeyed table --> nothing to invalidate
+}
+
 static int on_keepalive(void *_context, uint64_t wal_pos) {
     producer_context_t context = (producer_context_t) _context;
 
@@ -560,17 +811,6 @@ int send_kafka_msg(producer_context_t context, uint64_t wal_pos, Oid relid,
         const void *key_bin, size_t key_len,
         const void *val_bin, size_t val_len) {
 
-    transaction_info *xact = &context->xact_list[context->xact_head];
-    xact->recvd_events++;
-    xact->pending_events++;
-
-    msg_envelope_t envelope = malloc(sizeof(msg_envelope));
-    memset(envelope, 0, sizeof(msg_envelope));
-    envelope->context = context;
-    envelope->wal_pos = wal_pos;
-    envelope->relid = relid;
-    envelope->xact = xact;
-
     void *key = NULL, *val = NULL;
     size_t key_encoded_len, val_encoded_len;
     table_metadata_t table = table_mapper_lookup(context->mapper, relid);
@@ -609,9 +849,153 @@ int send_kafka_msg(producer_context_t context, uint64_t wal_pos, Oid relid,
                     output_format_name(context->output_format));
     }
 
+    return produce_kafka_msg(context, wal_pos, relid, table->topic,
+            key, key_encoded_len, val, val_encoded_len);
+}
+
+
+/* Writes a message for a change of a table selected with --key-only-tables to the
+ * key-only topic. The message key is the row's key, encoded like in the table's own
+ * topic, and the value is a KeyChange record naming the table and type of change. */
+int send_key_change_msg(producer_context_t context, uint64_t wal_pos, Oid relid, int op,
+        const void *key_bin, size_t key_len) {
+
+    void *key = NULL, *val = NULL;
+    size_t key_encoded_len, val_encoded_len;
+    avro_value_t change_val, field_val;
+    int err;
+
+    table_metadata_t table = table_mapper_lookup(context->mapper, relid);
+    if (!table) {
+        log_error("relid %" PRIu32 " has no registered schema", relid);
+        return 1;
+    }
+
+    check(err, open_key_only_topic(context));
+
+    avro_generic_value_new(context->key_change_iface, &change_val);
+    avro_value_get_by_index(&change_val, 0, &field_val, NULL);
+    avro_value_set_string(&field_val, table->table_name);
+    avro_value_get_by_index(&change_val, 1, &field_val, NULL);
+    avro_value_set_enum(&field_val, op);
+
+    switch (context->output_format) {
+    case OUTPUT_FORMAT_JSON:
+        err = avro_bin_to_json(table->key_schema, key_bin, key_len, (char **) &key, &key_encoded_len);
+        if (!err) err = avro_value_to_json(&change_val, 1, (char **) &val);
+        if (!err) val_encoded_len = strlen(val);
+
+        if (err) {
+            log_error("%s: error %s encoding JSON for topic %s",
+                      progname, strerror(err), rd_kafka_topic_name(context->key_only_topic));
+            if (key != NULL) free(key);
+            avro_value_decref(&change_val);
+            return err;
+        }
+        break;
+    case OUTPUT_FORMAT_AVRO: {
+        size_t change_len;
+        avro_value_sizeof(&change_val, &change_len);
+        char *change_bin = malloc(change_len);
+        avro_writer_t writer = avro_writer_memory(change_bin, change_len);
+        err = avro_value_write(writer, &change_val);
+        avro_writer_free(writer);
+
+        if (!err) {
+            err = schema_registry_encode_msg(table->key_schema_id, context->key_change_schema_id,
+                    key_bin, key_len, &key, &key_encoded_len,
+                    change_bin, change_len, &val, &val_encoded_len);
+        }
+        free(change_bin);
+
+        if (err) {
+            log_error("%s: error %s encoding Avro for topic %s",
+                      progname, strerror(err), rd_kafka_topic_name(context->key_only_topic));
+            avro_value_decref(&change_val);
+            return err;
+        }
+        break;
+    }
+    default:
+        fatal_error(context, "invalid output format %s",
+                    output_format_name(context->output_format));
+    }
+
+    avro_value_decref(&change_val);
+    return produce_kafka_msg(context, wal_pos, relid, context->key_only_topic,
+            key, key_encoded_len, val, val_encoded_len);
+}
+
+
+/* Opens the key-only topic, and registers the value schema of its messages, the
+ * first time a key change is sent. Returns 0 on success. */
+int open_key_only_topic(producer_context_t context) {
+    char topic_name[TABLE_MAPPER_MAX_TOPIC_LEN];
+    const char *name = context->key_only_topic_name ?
+        context->key_only_topic_name : DEFAULT_KEY_ONLY_TOPIC;
+
+    if (context->key_only_topic) return 0;
+
+    /* Prefixed in the same way as the topics of tables (see table_mapper.c) */
+    if (context->topic_prefix) {
+        snprintf(topic_name, TABLE_MAPPER_MAX_TOPIC_LEN, "%s%c%s",
+                context->topic_prefix, TABLE_MAPPER_TOPIC_PREFIX_DELIMITER, name);
+    } else {
+        snprintf(topic_name, TABLE_MAPPER_MAX_TOPIC_LEN, "%s", name);
+    }
+
+    if (avro_schema_from_json_length(KEY_CHANGE_SCHEMA_JSON, strlen(KEY_CHANGE_SCHEMA_JSON),
+                &context->key_change_schema)) {
+        log_error("%s: Could not parse key change schema: %s", progname, avro_strerror());
+        return EINVAL;
+    }
+    context->key_change_iface = avro_generic_class_from_schema(context->key_change_schema);
+
+    if (context->registry) {
+        int err = schema_registry_request(context->registry, topic_name, 0,
+                KEY_CHANGE_SCHEMA_JSON, strlen(KEY_CHANGE_SCHEMA_JSON),
+                &context->key_change_schema_id);
+        if (err) {
+            log_error("%s: Failed to register schema for topic %s: %s",
+                      progname, topic_name, context->registry->error);
+            return err;
+        }
+    }
+
+    log_info("Opening Kafka topic \"%s\" for key-only tables", topic_name);
+
+    context->key_only_topic = rd_kafka_topic_new(context->kafka, topic_name,
+            rd_kafka_topic_conf_dup(context->topic_conf));
+    if (!context->key_only_topic) {
+        log_error("%s: Cannot open Kafka topic %s: %s", progname, topic_name,
+                  rd_kafka_err2str(rd_kafka_errno2err(errno)));
+        return EIO;
+    }
+    return 0;
+}
+
+
+/* Hands an encoded message to the Kafka producer, taking ownership of key and val.
+ * The message counts towards the current transaction until its delivery has been
+ * acknowledged (see on_deliver_msg). */
+int produce_kafka_msg(producer_context_t context, uint64_t wal_pos, Oid relid,
+        rd_kafka_topic_t *topic, void *key, size_t key_encoded_len,
+        void *val, size_t val_encoded_len) {
+
+    transaction_info *xact = &context->xact_list[context->xact_head];
+    xact->recvd_events++;
+    xact->pending_events++;
+
+    msg_envelope_t envelope = malloc(sizeof(msg_envelope));
+    memset(envelope, 0, sizeof(msg_envelope));
+    envelope->context = context;
+    envelope->wal_pos = wal_pos;
+    envelope->relid = relid;
+    envelope->xact = xact;
+
     bool enqueued = false;
     while (!enqueued) {
-        int err = rd_kafka_produce(table->topic,
+        int err = rd_kafka_produce(topic,
                 RD_KAFKA_PARTITION_UA, RD_KAFKA_MSG_F_FREE,
                 val, val == NULL ? 0 : val_encoded_len,
                 key, key == NULL ? 0 : key_encoded_len,
@@ -629,7 +1013,7 @@ int send_kafka_msg(producer_context_t context, uint64_t wal_pos, Oid relid,
         } else if (err != 0) {
             log_error("%s: Failed to produce to Kafka (topic %s): %s",
                       progname,
-                      rd_kafka_topic_name(table->topic),
+                      rd_kafka_topic_name(topic),
                       rd_kafka_err2str(rd_kafka_errno2err(errno)));
             if (val != NULL) free(val);
             if (key != NULL) free(key);
@@ -671,6 +1055,19 @@ static void on_deliver_msg(rd_kafka_t *kafka, const rd_kafka_message_t *msg, voi
 }
 
 
+/* Called by the client before it records the progress of a snapshot, in the snapshot
+ * state file or the watermark table. Blocks until Kafka has acknowledged all messages
+ * sent so far, so that chunks recorded as complete are never lost. */
+static int on_snapshot_flush(void *_context) {
+    producer_context_t context = (producer_context_t) _context;
+
+    while (rd_kafka_outq_len(context->kafka) > 0) {
+        backpressure(context);
+    }
+    return 0;
+}
+
+
 /* When a Postgres transaction has been durably written to Kafka (i.e. we've seen the
  * commit event from Postgres, so we know the transaction is complete, and the Kafka
  * broker has acknowledged all messages in the transaction), we checkpoint it. This
@@ -747,8 +1144,10 @@ client_context_t init_client() {
     frame_reader->on_insert_row   = on_insert_row;
     frame_reader->on_update_row   = on_update_row;
     frame_reader->on_delete_row   = on_delete_row;
+    frame_reader->on_key_change   = on_key_change;
     frame_reader->on_keepalive    = on_keepalive;
     frame_reader->on_error        = on_client_error;
+    frame_reader->omit_old_rows   = 1; /* Kafka messages only contain the key and new row */
 
     client_context_t client = db_client_new();
     client->app_name = strdup(APP_NAME);
@@ -757,6 +1156,7 @@ client_context_t init_client() {
     client->repl.slot_name = strdup(DEFAULT_REPLICATION_SLOT);
     client->repl.output_plugin = strdup(OUTPUT_PLUGIN);
     client->repl.frame_reader = frame_reader;
+    client->on_snapshot_flush = on_snapshot_flush;
     return client;
 }
 
@@ -841,14 +1241,24 @@ void start_producer(producer_context_t context) {
 void exit_nicely(producer_context_t context, int status) {
     // If a snapshot was in progress and not yet complete, and an error occurred, try to
     // drop the replication slot, so that the snapshot is retried when the user tries again.
+    // If its progress is being recorded, keep the slot, so that the snapshot can be resumed.
     if (context->client->taking_snapshot && status != 0) {
-        log_info("Dropping replication slot since the snapshot did not complete successfully.");
-        if (replication_slot_drop(&context->client->repl) != 0) {
-            log_error("%s: %s", progname, context->client->repl.error);
+        if (context->client->snapshot_resumable) {
+            log_info("Keeping replication slot since the snapshot can be resumed from %s.",
+                     context->client->snapshot_state_file);
+        } else {
+            log_info("Dropping replication slot since the snapshot did not complete successfully.");
+            if (replication_slot_drop(&context->client->repl) != 0) {
+                log_error("%s: %s", progname, context->client->repl.error);
+            }
         }
     }
 
     if (context->topic_prefix) free(context->topic_prefix);
+    if (context->key_only_topic) rd_kafka_topic_destroy(context->key_only_topic);
+    if (context->key_change_iface) avro_value_iface_decref(context->key_change_iface);
+    if (context->key_change_schema) avro_schema_decref(context->key_change_schema);
+    free(context->key_only_topic_name);
     table_mapper_free(context->mapper);
     if (context->registry) schema_registry_free(context->registry);
     frame_reader_free(context->client->repl.frame_reader);
@@ -876,11 +1286,22 @@ int main(int argc, char **argv) {
 
     replication_stream_t stream = &context->client->repl;
 
-    if (!context->client->slot_created) {
+    if (!context->client->slot_created && !context->client->taking_snapshot) {
         log_info("Replication slot \"%s\" exists, streaming changes from %X/%X.",
                  stream->slot_name,
                  (uint32) (stream->start_lsn >> 32), (uint32) stream->start_lsn);
-    } else if (context->client->skip_snapshot) {
+        if (context->client->incr.state == INCREMENTAL_IDLE) {
+            log_info("Continuing incremental snapshot while streaming.");
+        }
+        if (context->client->resnapshot_pattern) {
+            log_info("Requested re-snapshot of tables matching \"%s\".",
+                     context->client->resnapshot_pattern);
+        }
+    } else if (context->client->slot_created && context->client->incremental) {
+        log_info("Created replication slot \"%s\", taking incremental snapshot while "
+                 "streaming changes from %X/%X.", stream->slot_name,
+                 (uint32) (stream->start_lsn >> 32), (uint32) stream->start_lsn);
+    } else if (context->client->slot_created && context->client->skip_snapshot) {
         log_info("Created replication slot \"%s\", skipping snapshot and streaming changes from %X/%X.",
                  stream->slot_name,
                  (uint32) (stream->start_lsn >> 32), (uint32) stream->start_lsn);
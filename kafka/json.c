@@ -15,10 +15,6 @@
 
 #include <avro.h>
 
-int avro_bin_to_json(avro_schema_t schema,
-        const void *val_bin, size_t val_len,
-        char **val_out, size_t *val_len_out);
-
 
 int json_encode_msg(table_metadata_t table,
         const void *key_bin, size_t key_len,
@@ -10,6 +10,9 @@ int json_encode_msg(table_metadata_t table,
         char **key_out, size_t *key_len_out,
         const void *row_bin, size_t row_len,
         char **row_out, size_t *row_len_out);
+int avro_bin_to_json(avro_schema_t schema,
+        const void *val_bin, size_t val_len,
+        char **val_out, size_t *val_len_out);
 
 
 #endif /* JSON_H */
@@ -0,0 +1,41 @@
+require 'spec_helper'
+require 'format_contexts'
+require 'test_cluster'
+
+describe 'frame compression', functional: true, format: :json do
+  # We only stop the cluster after all examples in the context have run, so
+  # examples need to look at different tables.
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  before(:context) do
+    TEST_CLUSTER.bottledwater_option('frame-compression', 'deflate')
+    TEST_CLUSTER.bottledwater_option('frame-max-messages', 100)
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  example 'rows in compressed frames are published to Kafka in order' do
+    postgres.exec('CREATE TABLE things (id SERIAL PRIMARY KEY, thing TEXT)')
+    postgres.exec(%{INSERT INTO things (thing) SELECT 'thing' || num FROM generate_series(1, 500) AS num})
+
+    messages = kafka_take_messages('things', 500)
+
+    messages.each_with_index do |message, index|
+      expect(fetch_int(decode_key(message.key), 'id')).to eq(index + 1)
+      expect(fetch_string(decode_value(message.value), 'thing')).to eq("thing#{index + 1}")
+    end
+  end
+
+  example 'frames below --frame-compression-min-bytes are published too' do
+    postgres.exec('CREATE TABLE widgets (id SERIAL PRIMARY KEY, widget TEXT)')
+    postgres.exec(%{INSERT INTO widgets (widget) VALUES('small')})
+
+    message = kafka_take_messages('widgets', 1).first
+
+    expect(fetch_string(decode_value(message.value), 'widget')).to eq('small')
+  end
+end
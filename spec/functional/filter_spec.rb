@@ -0,0 +1,70 @@
+require 'spec_helper'
+require 'format_contexts'
+require 'test_cluster'
+
+describe 'table, column and row filters', functional: true, format: :json do
+  # We only stop the cluster after all examples in the context have run, so
+  # examples need to look at different tables.
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+  let(:kazoo) { TEST_CLUSTER.kazoo }
+
+  before(:context) do
+    TEST_CLUSTER.before_service(TEST_CLUSTER.bottledwater_service, 'Prepopulating tables') do |cluster|
+      cluster.postgres.exec('CREATE TABLE users (id SERIAL PRIMARY KEY, username TEXT, password TEXT)')
+      cluster.postgres.exec(%{INSERT INTO users (username, password) VALUES('alice', 'secret')})
+      cluster.postgres.exec('CREATE TABLE audit_log (id SERIAL PRIMARY KEY, entry TEXT)')
+      cluster.postgres.exec(%{INSERT INTO audit_log (entry) VALUES('snapshotted')})
+      cluster.postgres.exec('CREATE TABLE accounts (id SERIAL PRIMARY KEY, name TEXT, active BOOLEAN)')
+      cluster.postgres.exec(%{INSERT INTO accounts (name, active) VALUES('snapshot-active', true), ('snapshot-inactive', false)})
+    end
+
+    TEST_CLUSTER.bottledwater_option('exclude-tables', 'audit_*')
+    TEST_CLUSTER.bottledwater_option('exclude-columns', 'users.password')
+    TEST_CLUSTER.bottledwater_option('row-filter', 'accounts:active')
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  after(:example) { kazoo.reset_metadata }
+
+  example 'excluded tables are neither snapshotted nor streamed' do
+    postgres.exec(%{INSERT INTO audit_log (entry) VALUES('streamed')})
+    postgres.exec('CREATE TABLE things (id SERIAL PRIMARY KEY, thing TEXT)')
+    postgres.exec(%{INSERT INTO things (thing) VALUES('included')})
+
+    # changes are published in commit order, so once the later table has
+    # arrived, the excluded one would have too
+    kafka_take_messages('things', 1)
+    expect(kazoo.topics).to have_key('things')
+    expect(kazoo.topics).not_to have_key('audit_log')
+  end
+
+  example 'excluded columns are left out of rows' do
+    postgres.exec(%{INSERT INTO users (username, password) VALUES('bob', 'hunter2')})
+
+    messages = kafka_take_messages('users', 2)
+
+    messages.each do |message|
+      value = decode_value message.value
+      expect(value).to have_key('username')
+      expect(value).not_to have_key('password')
+    end
+  end
+
+  example 'only rows matching the row filter are snapshotted and streamed' do
+    postgres.exec(%{INSERT INTO accounts (name, active) VALUES('inactive', false)})
+    postgres.exec(%{INSERT INTO accounts (name, active) VALUES('active', true)})
+    # the new row doesn't match, and the old row isn't known to the extension
+    postgres.exec(%{UPDATE accounts SET name = 'deactivated', active = false WHERE name = 'active'})
+    postgres.exec(%{INSERT INTO accounts (name, active) VALUES('active2', true)})
+
+    messages = kafka_take_messages('accounts', 3)
+
+    names = messages.map {|message| fetch_string(decode_value(message.value), 'name') }
+    expect(names).to eq(%w(snapshot-active active active2))
+  end
+end
@@ -0,0 +1,81 @@
+require 'spec_helper'
+require 'format_contexts'
+require 'test_cluster'
+
+describe 'incremental snapshot', functional: true, format: :json do
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  before(:example) do
+    TEST_CLUSTER.before_service(TEST_CLUSTER.bottledwater_service, 'Prepopulating users table') do
+      postgres.exec('CREATE TABLE users (id SERIAL PRIMARY KEY, username TEXT)')
+      postgres.exec(%{INSERT INTO users (username) SELECT 'user' || num FROM generate_series(1, 10) AS num})
+    end
+  end
+
+  after(:example) do
+    TEST_CLUSTER.stop
+  end
+
+  describe 'with --incremental-snapshot' do
+    before(:example) do
+      TEST_CLUSTER.bottledwater_option('incremental-snapshot', true)
+      # several chunks, so that streaming is interleaved with the snapshot
+      TEST_CLUSTER.bottledwater_option('incremental-chunk-rows', 3)
+      TEST_CLUSTER.start
+    end
+
+    example 'publishes the existing database contents into Kafka' do
+      messages = kafka_take_messages('users', 10)
+
+      usernames = messages.map {|message| fetch_string(decode_value(message.value), 'username') }
+      expect(usernames).to match_array((1..10).map {|num| "user#{num}" })
+    end
+
+    example 'publishes ongoing changes as well as the existing contents' do
+      postgres.exec(%{UPDATE users SET username = 'renamed' WHERE id = 5})
+      postgres.exec(%{INSERT INTO users (username) VALUES('user11')})
+
+      # whatever order the snapshot and the changes are interleaved in, the last
+      # message for each key is the current row. A chunk may or may not include
+      # the changed rows as well, so the number of messages isn't known; keep
+      # reading until the changes have arrived (raising if they never do).
+      latest = {}
+      count = 11
+      until latest.size == 11 && latest[5] == 'renamed' && latest.key?(11)
+        count += 1
+        latest = {}
+        kafka_take_messages('users', count).each do |message|
+          key = decode_key message.key
+          latest[fetch_int(key, 'id')] = fetch_string(decode_value(message.value), 'username')
+        end
+      end
+      expect(latest.size).to eq(11)
+      expect(latest[5]).to eq('renamed')
+      expect(latest[11]).to eq('user11')
+    end
+  end
+
+  describe 'bottledwater_resnapshot()' do
+    before(:example) do
+      TEST_CLUSTER.start
+    end
+
+    example 'publishes the contents of matching tables again' do
+      postgres.exec('CREATE TABLE orders (id SERIAL PRIMARY KEY, item TEXT)')
+      postgres.exec(%{INSERT INTO orders (item) VALUES('widget')})
+      kafka_take_messages('users', 10)
+
+      postgres.exec(%{SELECT bottledwater_resnapshot('bottledwater', 'users')})
+      sleep 1
+
+      messages = kafka_take_messages('users', 20)
+      resent = messages.drop(10).map {|message| fetch_string(decode_value(message.value), 'username') }
+      expect(resent).to match_array((1..10).map {|num| "user#{num}" })
+
+      # orders didn't match the pattern, so nothing new was sent for it
+      postgres.exec(%{INSERT INTO orders (item) VALUES('gadget')})
+      messages = kafka_take_messages('orders', 2)
+      expect(fetch_string(decode_value(messages.last.value), 'item')).to eq('gadget')
+    end
+  end
+end
@@ -0,0 +1,40 @@
+require 'spec_helper'
+require 'format_contexts'
+require 'test_cluster'
+
+describe 'key-only tables', functional: true, format: :json do
+  let(:postgres) { TEST_CLUSTER.postgres }
+  let(:kazoo) { TEST_CLUSTER.kazoo }
+
+  before(:context) do
+    TEST_CLUSTER.bottledwater_option('key-only-tables', 'sessions')
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  example 'changes are published as keys and operations to the key-only topic' do
+    postgres.exec('CREATE TABLE sessions (id SERIAL PRIMARY KEY, token TEXT)')
+    postgres.exec(%{INSERT INTO sessions (token) VALUES('abc')})
+    postgres.exec(%{UPDATE sessions SET token = 'def'})
+    postgres.exec('DELETE FROM sessions')
+
+    messages = kafka_take_messages('key_changes', 3)
+
+    messages.each do |message|
+      expect(fetch_int(decode_key(message.key), 'id')).to eq(1)
+    end
+
+    values = messages.map {|message| decode_value message.value }
+    expect(values).to eq([
+      {'table' => 'sessions', 'op' => 'INSERT'},
+      {'table' => 'sessions', 'op' => 'UPDATE'},
+      {'table' => 'sessions', 'op' => 'DELETE'},
+    ])
+
+    kazoo.reset_metadata
+    expect(kazoo.topics).not_to have_key('sessions')
+  end
+end
@@ -0,0 +1,86 @@
+require 'spec_helper'
+require 'format_contexts'
+require 'test_cluster'
+
+describe 'Avro logical types', functional: true, format: :json do
+  # We only stop the cluster after all examples in the context have run, so
+  # examples need to look at different tables.
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  before(:context) do
+    TEST_CLUSTER.bottledwater_option('numeric-encoding', 'decimal')
+    TEST_CLUSTER.bottledwater_option('temporal-encoding', 'logical')
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  # Interprets bytes as a big-endian two's complement integer, as in the Avro
+  # decimal logical type.
+  def unscaled_decimal(bytes)
+    value = bytes.unpack('C*').inject(0) {|acc, byte| (acc << 8) | byte }
+    value -= 1 << (8 * bytes.size) if bytes.getbyte(0) >= 0x80
+    value
+  end
+
+  describe 'with --numeric-encoding=decimal' do
+    example 'NUMERIC columns with a precision and scale are encoded as decimals' do
+      postgres.exec('CREATE TABLE prices (id SERIAL PRIMARY KEY, amount NUMERIC(20, 2))')
+      postgres.exec(%{INSERT INTO prices (amount) VALUES (1234.56), (-1234.56), (0), (123456789012345678.9)})
+
+      messages = kafka_take_messages('prices', 4)
+
+      amounts = messages.map {|message| unscaled_decimal(fetch_bytes(decode_value(message.value), 'amount')) }
+      expect(amounts).to eq([123456, -123456, 0, 12345678901234567890])
+    end
+
+    example 'NUMERIC columns without a scale are still encoded as doubles' do
+      postgres.exec('CREATE TABLE measurements (id SERIAL PRIMARY KEY, reading NUMERIC)')
+      postgres.exec(%{INSERT INTO measurements (reading) VALUES (2.5)})
+
+      message = kafka_take_messages('measurements', 1).first
+
+      expect(decode_value(message.value).fetch('reading')).to eq('double' => 2.5)
+    end
+  end
+
+  describe 'with --temporal-encoding=logical' do
+    example 'dates are encoded as days and timestamps as microseconds since the epoch' do
+      postgres.exec(<<-SQL)
+        CREATE TABLE events (
+          id SERIAL PRIMARY KEY,
+          day DATE,
+          time_of_day TIME,
+          local_time TIMESTAMP,
+          utc_time TIMESTAMP WITH TIME ZONE
+        )
+      SQL
+      postgres.exec(<<-SQL)
+        INSERT INTO events (day, time_of_day, local_time, utc_time) VALUES (
+          '2016-01-02', '03:04:05.123456',
+          '2016-01-02 03:04:05.123456', '2016-01-02 03:04:05.123456+02'
+        )
+      SQL
+
+      message = kafka_take_messages('events', 1).first
+      value = decode_value message.value
+
+      expect(fetch_int(value, 'day')).to eq(16802)
+      expect(fetch_any(value, 'time_of_day')).to eq(11045123456)
+      expect(fetch_any(value, 'local_time')).to eq(1451703845123456)
+      expect(fetch_any(value, 'utc_time')).to eq(1451696645123456)
+    end
+
+    example 'dates before the epoch are negative' do
+      postgres.exec('CREATE TABLE birthdays (id SERIAL PRIMARY KEY, day DATE)')
+      postgres.exec(%{INSERT INTO birthdays (day) VALUES ('1969-12-31')})
+
+      message = kafka_take_messages('birthdays', 1).first
+
+      expect(fetch_int(decode_value(message.value), 'day')).to eq(-1)
+    end
+  end
+end
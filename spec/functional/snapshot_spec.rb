@@ -59,4 +59,116 @@ describe 'initial database snapshot', functional: true, format: :json do
       expect(fetch_string(value, 'username')).to eq('user11')
     end
   end
+
+  describe 'with --snapshot-workers' do
+    before(:example) do
+      TEST_CLUSTER.before_service(TEST_CLUSTER.bottledwater_service, 'Prepopulating more tables') do
+        postgres.exec('CREATE TABLE orders (id SERIAL PRIMARY KEY, item TEXT)')
+        postgres.exec(%{INSERT INTO orders (item) SELECT 'item' || num FROM generate_series(1, 20) AS num})
+        postgres.exec('CREATE TABLE notes (id SERIAL PRIMARY KEY, note TEXT)')
+        postgres.exec(%{INSERT INTO notes (note) SELECT 'note' || num FROM generate_series(1, 30) AS num})
+      end
+
+      TEST_CLUSTER.bottledwater_option('snapshot-workers', 3)
+      TEST_CLUSTER.start
+    end
+
+    example 'publishes the contents of every table into Kafka' do
+      {'users' => 10, 'orders' => 20, 'notes' => 30}.each do |table, rows|
+        messages = kafka_take_messages(table, rows)
+        ids = messages.map {|message| fetch_int(decode_key(message.key), 'id') }
+        expect(ids).to match_array(1..rows)
+      end
+    end
+
+    example 'publishes ongoing inserts into Kafka' do
+      postgres.exec(%{INSERT INTO orders (item) VALUES('item21')})
+
+      messages = kafka_take_messages('orders', 21)
+
+      value = decode_value messages.last.value
+      expect(fetch_string(value, 'item')).to eq('item21')
+    end
+  end
+
+  describe 'with --snapshot-chunk-bytes' do
+    before(:example) do
+      TEST_CLUSTER.before_service(TEST_CLUSTER.bottledwater_service, 'Prepopulating large tables') do
+        postgres.exec('CREATE TABLE events (id BIGSERIAL PRIMARY KEY, payload TEXT)')
+        postgres.exec(%{INSERT INTO events (payload) SELECT repeat('x', 200) || num FROM generate_series(1, 1000) AS num})
+        # a key that can't be split into ranges
+        postgres.exec('CREATE TABLE tags (name TEXT PRIMARY KEY, payload TEXT)')
+        postgres.exec(%{INSERT INTO tags SELECT 'tag' || num, repeat('x', 200) FROM generate_series(1, 100) AS num})
+      end
+
+      TEST_CLUSTER.bottledwater_option('snapshot-workers', 3)
+      TEST_CLUSTER.bottledwater_option('snapshot-chunk-bytes', 16384)
+      TEST_CLUSTER.start
+    end
+
+    example 'publishes every row of a table split into chunks exactly once' do
+      messages = kafka_take_messages('events', 1000)
+
+      ids = messages.map {|message| fetch_any(decode_key(message.key), 'id') }
+      expect(ids).to match_array(1..1000)
+    end
+
+    example 'publishes a table whose key is not an integer in one chunk' do
+      messages = kafka_take_messages('tags', 100)
+
+      names = messages.map {|message| fetch_string(decode_key(message.key), 'name') }
+      expect(names).to match_array((1..100).map {|num| "tag#{num}" })
+    end
+  end
+
+  describe 'with --snapshot-state' do
+    let(:state_file) { '/tmp/bottledwater-snapshot-state' }
+
+    before(:example) do
+      TEST_CLUSTER.before_service(TEST_CLUSTER.bottledwater_service, 'Prepopulating orders table') do
+        postgres.exec('CREATE TABLE orders (id SERIAL PRIMARY KEY, item TEXT)')
+        postgres.exec(%{INSERT INTO orders (item) SELECT 'item' || num FROM generate_series(1, 10) AS num})
+      end
+
+      TEST_CLUSTER.bottledwater_option('snapshot-state', state_file)
+      TEST_CLUSTER.start
+    end
+
+    example 'publishes the existing database contents into Kafka' do
+      messages = kafka_take_messages('users', 10)
+      expect(messages.size).to eq(10)
+
+      messages = kafka_take_messages('orders', 10)
+      expect(messages.size).to eq(10)
+    end
+
+    example 'resumes an interrupted snapshot after a restart' do
+      kafka_take_messages('users', 10)
+      kafka_take_messages('orders', 10)
+
+      # Pretend that Bottled Water was stopped after writing orders, but before
+      # finishing users.
+      relids = Hash[%w(users orders).map {|table|
+        [table, postgres.exec("SELECT '#{table}'::regclass::oid").getvalue(0, 0)]
+      }]
+      state = [
+        'bottledwater snapshot state 1',
+        'slot bottledwater',
+        "chunk 1 8192 #{relids['orders']}",
+        "chunk 0 8192 #{relids['users']}",
+      ].join("\n")
+      TEST_CLUSTER.bottledwater_exec('sh', '-c', %{printf '#{state}\\n' > #{state_file}})
+      TEST_CLUSTER.restart_bottledwater
+      sleep 5
+
+      # only the unfinished table is published again
+      messages = kafka_take_messages('users', 20)
+      resent = messages.drop(10).map {|message| fetch_string(decode_value(message.value), 'username') }
+      expect(resent).to match_array((1..10).map {|num| "user#{num}" })
+
+      postgres.exec(%{INSERT INTO orders (item) VALUES('item11')})
+      messages = kafka_take_messages('orders', 11)
+      expect(fetch_string(decode_value(messages.last.value), 'item')).to eq('item11')
+    end
+  end
 end
@@ -0,0 +1,60 @@
+require 'spec_helper'
+require 'format_contexts'
+require 'test_cluster'
+
+describe 'output plugin statistics', functional: true, format: :json do
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  before(:context) do
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  # The counters are added to the shared statistics at the end of each transaction,
+  # which may be just after its messages have reached Kafka. Returns the row for the
+  # table once the block accepts it, or whatever row there is (if any) after waiting.
+  def table_stats(table, wait: 5)
+    deadline = Time.now + wait
+    loop do
+      row = postgres.exec(%{SELECT * FROM bottledwater_stats() WHERE relid = '#{table}'::regclass}).first
+      return row if (row && yield(row)) || Time.now > deadline
+      sleep 0.1
+    end
+  end
+
+  example 'bottledwater_stats() counts the rows decoded for each table and slot' do
+    postgres.exec('CREATE TABLE counted (id SERIAL PRIMARY KEY, name TEXT)')
+    postgres.exec(%{INSERT INTO counted (name) VALUES('a'), ('b'), ('c')})
+    postgres.exec(%{UPDATE counted SET name = 'd' WHERE id = 1})
+    postgres.exec('DELETE FROM counted WHERE id = 2')
+
+    kafka_take_messages('counted', 5)
+
+    stats = table_stats('counted') {|row| row['deletes'] == '1' }
+    expect(stats['slot_name']).to eq('bottledwater')
+    expect(stats['inserts']).to eq('3')
+    expect(stats['updates']).to eq('1')
+    expect(stats['deletes']).to eq('1')
+    expect(stats['bytes'].to_i).to be > 0
+
+    totals = postgres.exec(%{SELECT * FROM bottledwater_stats()
+                             WHERE slot_name = 'bottledwater' AND relid IS NULL}).to_a
+    expect(totals.size).to eq(1)
+    expect(totals.first['inserts'].to_i).to be >= 3
+  end
+
+  example 'bottledwater_stats_reset() discards the statistics of a slot' do
+    postgres.exec('CREATE TABLE discarded (id SERIAL PRIMARY KEY, name TEXT)')
+    postgres.exec(%{INSERT INTO discarded (name) VALUES('a')})
+    kafka_take_messages('discarded', 1)
+    expect(table_stats('discarded') {|row| row['inserts'] == '1' }).to include('inserts' => '1')
+
+    postgres.exec(%{SELECT bottledwater_stats_reset('bottledwater')})
+
+    rows = postgres.exec(%{SELECT * FROM bottledwater_stats() WHERE slot_name = 'bottledwater'}).to_a
+    expect(rows).to be_empty
+  end
+end
@@ -0,0 +1,87 @@
+require 'spec_helper'
+require 'format_contexts'
+require 'test_cluster'
+
+describe 'encoding of updates', functional: true, format: :json do
+  # We only stop the cluster after all examples in the context have run, so
+  # examples need to look at different tables.
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  # Long enough to be stored out of line (TOASTed) even after compression
+  let(:large_text) { %{(SELECT string_agg(md5(num::text), '') FROM generate_series(1, 1000) AS num)} }
+
+  before(:context) do
+    TEST_CLUSTER.bottledwater_option('unchanged-toast', 'marker')
+    TEST_CLUSTER.bottledwater_option('update-format', 'delta')
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  describe 'with --unchanged-toast=marker' do
+    example 'an update that leaves a TOASTed value unchanged publishes a marker for it' do
+      postgres.exec('CREATE TABLE documents (id SERIAL PRIMARY KEY, title TEXT, body TEXT)')
+      postgres.exec(%{INSERT INTO documents (title, body) VALUES('draft', #{large_text})})
+      postgres.exec(%{UPDATE documents SET title = 'final'})
+
+      messages = kafka_take_messages('documents', 2)
+
+      inserted = decode_value messages[0].value
+      expect(fetch_string(inserted, 'body').size).to eq(32000)
+
+      updated = decode_value messages[1].value
+      expect(fetch_string(updated, 'title')).to eq('final')
+      expect(updated.fetch('body')).to eq('UnchangedToast' => 'UNCHANGED')
+    end
+
+    example 'an update that changes a TOASTed value publishes the new value' do
+      postgres.exec('CREATE TABLE pages (id SERIAL PRIMARY KEY, body TEXT)')
+      postgres.exec(%{INSERT INTO pages (body) VALUES('short')})
+      postgres.exec(%{UPDATE pages SET body = #{large_text}})
+
+      messages = kafka_take_messages('pages', 2)
+
+      updated = decode_value messages[1].value
+      expect(fetch_string(updated, 'body').size).to eq(32000)
+    end
+  end
+
+  describe 'with --update-format=delta' do
+    example 'an update of a table with REPLICA IDENTITY FULL publishes the complete new row' do
+      postgres.exec('CREATE TABLE products (id SERIAL PRIMARY KEY, name TEXT, colour TEXT, price INTEGER, notes TEXT)')
+      postgres.exec('ALTER TABLE products REPLICA IDENTITY FULL')
+      postgres.exec(%{INSERT INTO products (name, colour, price, notes) VALUES('widget', 'red', 100, 'old notes')})
+      postgres.exec(%{UPDATE products SET price = 120})
+      postgres.exec(%{UPDATE products SET colour = NULL, notes = 'new notes'})
+
+      messages = kafka_take_messages('products', 3)
+
+      repriced = decode_value messages[1].value
+      expect(fetch_string(repriced, 'name')).to eq('widget')
+      expect(fetch_string(repriced, 'colour')).to eq('red')
+      expect(fetch_int(repriced, 'price')).to eq(120)
+      expect(fetch_string(repriced, 'notes')).to eq('old notes')
+
+      updated = decode_value messages[2].value
+      expect(fetch_string(updated, 'name')).to eq('widget')
+      expect(updated.fetch('colour')).to be_nil
+      expect(fetch_int(updated, 'price')).to eq(120)
+      expect(fetch_string(updated, 'notes')).to eq('new notes')
+    end
+
+    example 'an update of a table with the default replica identity is published in full' do
+      postgres.exec('CREATE TABLE parts (id SERIAL PRIMARY KEY, name TEXT, price INTEGER)')
+      postgres.exec(%{INSERT INTO parts (name, price) VALUES('bolt', 5)})
+      postgres.exec(%{UPDATE parts SET price = 6})
+
+      messages = kafka_take_messages('parts', 2)
+
+      updated = decode_value messages[1].value
+      expect(fetch_string(updated, 'name')).to eq('bolt')
+      expect(fetch_int(updated, 'price')).to eq(6)
+    end
+  end
+end
@@ -17,6 +17,29 @@ class TestCluster
     hstore
   ).freeze
 
+  # Bottled Water options that examples can set with bottledwater_option.  Each
+  # has to be passed through in the environment of the bottledwater service in
+  # docker-compose.yml, and bottledwater-docker-wrapper.sh turns it back into a
+  # command-line option.
+  BOTTLEDWATER_OPTIONS = %w(
+    exclude-columns
+    exclude-tables
+    frame-compression
+    frame-compression-min-bytes
+    frame-max-messages
+    incremental-chunk-rows
+    incremental-snapshot
+    key-only-tables
+    numeric-encoding
+    row-filter
+    snapshot-chunk-bytes
+    snapshot-state
+    snapshot-workers
+    temporal-encoding
+    unchanged-toast
+    update-format
+  ).freeze
+
   VALGRIND_ERROR_EXITCODE = 123
 
   def initialize
@@ -45,6 +68,7 @@ class TestCluster
     self.bottledwater_on_error = :exit
     self.bottledwater_skip_snapshot = false
     self.bottledwater_topic_prefix = nil
+    BOTTLEDWATER_OPTIONS.each {|option| bottledwater_option(option, nil) }
 
     self.valgrind = false
 
@@ -154,6 +178,13 @@ class TestCluster
     ENV['BOTTLED_WATER_TOPIC_PREFIX'] = prefix.to_s
   end
 
+  # Sets one of BOTTLEDWATER_OPTIONS: true for an option without an argument,
+  # nil to leave the option out.
+  def bottledwater_option(option, value)
+    raise "Unknown Bottled Water option #{option}" unless BOTTLEDWATER_OPTIONS.include?(option)
+    ENV["BOTTLED_WATER_#{option.upcase.tr('-', '_')}"] = value.to_s
+  end
+
   def valgrind=(enabled)
     if enabled
       @valgrind = true
@@ -243,6 +274,21 @@ class TestCluster
     start
   end
 
+  # Restarts just the Bottled Water container, with the same options.  Unlike
+  # restart, this keeps the state of Postgres and Kafka, and the container's
+  # filesystem.
+  def restart_bottledwater
+    @compose.run!(:restart, bottledwater_service)
+    wait_for_container(bottledwater_service)
+  end
+
+  # Runs a command in the Bottled Water container, e.g. to prepare a file for
+  # restart_bottledwater.
+  def bottledwater_exec(*command)
+    container = container_for_service(bottledwater_service)
+    @docker.run!(:exec, container.id, *command)
+  end
+
   private
   def detect_docker_host_ip
     ip_output = @docker.run!(:run, '--rm', 'debian:latest', 'ip', 'route').split("\n")